@@ -0,0 +1,363 @@
+#include "bcache.h"
+#include "io.h"
+#include "memory.h"
+#include "clock.h"
+
+typedef struct bcache_block {
+    storage_device_t* dev;
+    uint32_t sector;
+    uint8_t* data;
+    uint32_t dirtied_at;        // When the block last went from clean to dirty
+    unsigned short hash_next;   // Block index + 1, 0 ends the chain
+    unsigned char valid;
+    unsigned char dirty;
+    unsigned char referenced;   // Second chance for the CLOCK hand
+} bcache_block_t;
+
+#define BCACHE_PER_PAGE   (PAGE_SIZE / BCACHE_BLOCK_SIZE)
+#define BCACHE_STAGING_PAGES (BCACHE_MAX_RUN * BCACHE_BLOCK_SIZE / PAGE_SIZE)
+
+static bcache_block_t blocks[BCACHE_BLOCKS];
+static unsigned short buckets[BCACHE_BUCKETS];  // Block index + 1
+static uint8_t* staging;        // Dirty runs are gathered here for one write
+static int ready = 0;
+static int growing = 0;         // A page request of our own is under way
+static unsigned int pages = 0;  // Buffer pages; blocks past them have none
+static unsigned int hand = 0;
+static unsigned int cached = 0;
+static unsigned int dirty_count = 0;
+static uint32_t flush_deadline = 0;
+
+static unsigned int bcache_hits;
+static unsigned int bcache_misses;
+static unsigned int bcache_read_ops;
+static unsigned int bcache_evictions;
+static unsigned int bcache_blocks_written;
+static unsigned int bcache_write_ops;
+static unsigned int bcache_pages_reclaimed;
+
+// Give the blocks a page of buffers; 0 if the pool has none to spare
+static bcache_block_t* bcache_grow(void) {
+    if (pages == BCACHE_BLOCKS / BCACHE_PER_PAGE ||
+        (pages >= BCACHE_MIN_PAGES && memory_get_free_pages() <= BCACHE_SPARE_PAGES)) {
+        return 0;
+    }
+    growing = 1;
+    uint8_t* page = (uint8_t*)memory_alloc_pages(1);
+    growing = 0;
+    if (!page) return 0;
+
+    bcache_block_t* first = &blocks[pages * BCACHE_PER_PAGE];
+    for (int j = 0; j < BCACHE_PER_PAGE; j++) {
+        first[j].data = page + j * BCACHE_BLOCK_SIZE;
+        first[j].valid = 0;
+    }
+    pages++;
+    return first;
+}
+
+// The staging buffer and the first buffer pages; until they exist I/O
+// goes to the device
+static int bcache_setup(void) {
+    if (ready) return 0;
+
+    staging = (uint8_t*)memory_alloc_pages(BCACHE_STAGING_PAGES);
+    if (!staging) return -1;
+    while (pages < BCACHE_MIN_PAGES) {
+        if (!bcache_grow()) {
+            while (pages > 0) {
+                memory_free_pages(blocks[--pages * BCACHE_PER_PAGE].data, 1);
+            }
+            memory_free_pages(staging, BCACHE_STAGING_PAGES);
+            return -1;
+        }
+    }
+    memory_set_reclaim(bcache_shrink);
+    ready = 1;
+    return 0;
+}
+
+static int bcache_usable(storage_device_t* dev) {
+    return dev->sector_size == BCACHE_BLOCK_SIZE && bcache_setup() == 0;
+}
+
+static unsigned int bcache_bucket(storage_device_t* dev, uint32_t sector) {
+    return (sector ^ ((uint32_t)dev >> 4)) % BCACHE_BUCKETS;
+}
+
+static bcache_block_t* bcache_lookup(storage_device_t* dev, uint32_t sector) {
+    unsigned short index = buckets[bcache_bucket(dev, sector)];
+    while (index) {
+        bcache_block_t* block = &blocks[index - 1];
+        if (block->dev == dev && block->sector == sector) return block;
+        index = block->hash_next;
+    }
+    return 0;
+}
+
+static void bcache_hash(bcache_block_t* block) {
+    unsigned int bucket = bcache_bucket(block->dev, block->sector);
+    block->hash_next = buckets[bucket];
+    buckets[bucket] = (unsigned short)(block - blocks) + 1;
+}
+
+static void bcache_unhash(bcache_block_t* block) {
+    unsigned short* link = &buckets[bcache_bucket(block->dev, block->sector)];
+    unsigned short self = (unsigned short)(block - blocks) + 1;
+    while (*link) {
+        if (*link == self) {
+            *link = block->hash_next;
+            break;
+        }
+        link = &blocks[*link - 1].hash_next;
+    }
+    block->valid = 0;
+    cached--;
+}
+
+// Write back the run of consecutive dirty sectors around block
+static int bcache_flush_run(bcache_block_t* block) {
+    storage_device_t* dev = block->dev;
+    uint32_t first = block->sector;
+    while (first > 0 && block->sector - first < BCACHE_MAX_RUN - 1) {
+        bcache_block_t* prev = bcache_lookup(dev, first - 1);
+        if (!prev || !prev->dirty) break;
+        first--;
+    }
+
+    bcache_block_t* run[BCACHE_MAX_RUN];
+    uint32_t count = 0;
+    while (count < BCACHE_MAX_RUN) {
+        bcache_block_t* next = bcache_lookup(dev, first + count);
+        if (!next || !next->dirty) break;
+        memory_copy(staging + count * BCACHE_BLOCK_SIZE, next->data, BCACHE_BLOCK_SIZE);
+        run[count++] = next;
+    }
+
+    if (storage_write_sectors(dev, first, count, staging) != 0) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        run[i]->dirty = 0;
+    }
+    dirty_count -= count;
+    bcache_blocks_written += count;
+    bcache_write_ops++;
+    return 0;
+}
+
+// Pick a block to reuse with the CLOCK hand. Dirty victims are written
+// back first; 0 if nothing could be freed.
+static bcache_block_t* bcache_evict(void) {
+    unsigned int count = pages * BCACHE_PER_PAGE;
+    for (unsigned int scanned = 0; scanned < 2 * count; scanned++) {
+        if (hand >= count) hand = 0;
+        bcache_block_t* block = &blocks[hand++];
+
+        if (!block->valid) return block;
+        if (block->referenced) {
+            block->referenced = 0;
+            continue;
+        }
+        if (block->dirty && bcache_flush_run(block) != 0) continue;
+
+        bcache_unhash(block);
+        bcache_evictions++;
+        return block;
+    }
+    return 0;
+}
+
+// A block for sector: a free one, a new page's while the cache is full
+// and the pool has room, or else one evicted
+static bcache_block_t* bcache_insert(storage_device_t* dev, uint32_t sector) {
+    bcache_block_t* block = 0;
+    if (cached == pages * BCACHE_PER_PAGE) block = bcache_grow();
+    if (!block) block = bcache_evict();
+    if (!block) return 0;
+    cached++;
+    block->dev = dev;
+    block->sector = sector;
+    block->valid = 1;
+    block->dirty = 0;
+    block->referenced = 1;
+    bcache_hash(block);
+    return block;
+}
+
+int bcache_read(storage_device_t* dev, uint32_t sector, void* buffer) {
+    if (!dev || !buffer || sector >= dev->total_sectors) return -1;
+    if (!bcache_usable(dev)) return dev->read_sector(dev, sector, buffer);
+
+    bcache_block_t* block = bcache_lookup(dev, sector);
+    if (block) {
+        bcache_hits++;
+        block->referenced = 1;
+        memory_copy(buffer, block->data, BCACHE_BLOCK_SIZE);
+        return 0;
+    }
+
+    bcache_misses++;
+    bcache_read_ops++;
+    block = bcache_insert(dev, sector);
+    if (!block) return dev->read_sector(dev, sector, buffer);
+
+    if (dev->read_sector(dev, sector, block->data) != 0) {
+        bcache_unhash(block);
+        return -1;
+    }
+    memory_copy(buffer, block->data, BCACHE_BLOCK_SIZE);
+    return 0;
+}
+
+// Read count consecutive sectors. Each run of sectors missing from the
+// cache is fetched with one device read, then cached.
+int bcache_read_blocks(storage_device_t* dev, uint32_t sector, uint32_t count, void* buffer) {
+    if (!dev || !buffer || sector >= dev->total_sectors || count > dev->total_sectors - sector) return -1;
+    if (!bcache_usable(dev)) return storage_read_sectors(dev, sector, count, buffer);
+
+    uint8_t* out = (uint8_t*)buffer;
+    uint32_t i = 0;
+    while (i < count) {
+        bcache_block_t* block = bcache_lookup(dev, sector + i);
+        if (block) {
+            bcache_hits++;
+            block->referenced = 1;
+            memory_copy(out + i * BCACHE_BLOCK_SIZE, block->data, BCACHE_BLOCK_SIZE);
+            i++;
+            continue;
+        }
+
+        uint32_t run = 1;
+        while (i + run < count && !bcache_lookup(dev, sector + i + run)) run++;
+        if (storage_read_sectors(dev, sector + i, run, out + i * BCACHE_BLOCK_SIZE) != 0) {
+            return -1;
+        }
+        bcache_misses += run;
+        bcache_read_ops++;
+
+        for (uint32_t j = 0; j < run; j++, i++) {
+            block = bcache_insert(dev, sector + i);
+            if (block) {
+                memory_copy(block->data, out + i * BCACHE_BLOCK_SIZE, BCACHE_BLOCK_SIZE);
+            }
+        }
+    }
+    return 0;
+}
+
+// Whole-sector writes never need the old contents read in first
+int bcache_write(storage_device_t* dev, uint32_t sector, const void* buffer) {
+    if (!dev || !buffer || sector >= dev->total_sectors) return -1;
+    if (!bcache_usable(dev)) return dev->write_sector(dev, sector, buffer);
+
+    bcache_block_t* block = bcache_lookup(dev, sector);
+    if (!block) {
+        block = bcache_insert(dev, sector);
+        if (!block) return dev->write_sector(dev, sector, buffer);
+    }
+    block->referenced = 1;
+    memory_copy(block->data, buffer, BCACHE_BLOCK_SIZE);
+
+    if (!block->dirty) {
+        block->dirty = 1;
+        block->dirtied_at = clock_get_ms();
+        if (dirty_count++ == 0) {
+            flush_deadline = block->dirtied_at + BCACHE_FLUSH_MS;
+        }
+    }
+    return 0;
+}
+
+// Write back every dirty block of dev (or of all devices)
+int bcache_sync(storage_device_t* dev) {
+    int result = 0;
+    for (unsigned int i = 0; i < pages * BCACHE_PER_PAGE && dirty_count > 0; i++) {
+        bcache_block_t* block = &blocks[i];
+        if (!block->valid || !block->dirty) continue;
+        if (dev && block->dev != dev) continue;
+        if (bcache_flush_run(block) != 0) result = -1;
+    }
+    return result;
+}
+
+// Write back blocks that have been dirty for BCACHE_FLUSH_MS.
+// Called from the kernel loop.
+void bcache_tick(void) {
+    if (dirty_count == 0) return;
+
+    uint32_t now = clock_get_ms();
+    if ((int)(now - flush_deadline) < 0) return;
+
+    uint32_t next = now + BCACHE_FLUSH_MS;
+    for (unsigned int i = 0; i < pages * BCACHE_PER_PAGE && dirty_count > 0; i++) {
+        bcache_block_t* block = &blocks[i];
+        if (!block->valid || !block->dirty) continue;
+
+        uint32_t expires = block->dirtied_at + BCACHE_FLUSH_MS;
+        if ((int)(now - expires) < 0) {
+            if ((int)(expires - next) < 0) next = expires;
+            continue;
+        }
+        // A failed write stays dirty and is retried at the next deadline
+        bcache_flush_run(block);
+    }
+    flush_deadline = next;
+}
+
+// Give up to count buffer pages back to the pool, the last ones first,
+// writing back what they hold. Never goes below BCACHE_MIN_PAGES.
+unsigned int bcache_shrink(unsigned int count) {
+    unsigned int freed = 0;
+    while (!growing && freed < count && pages > BCACHE_MIN_PAGES) {
+        bcache_block_t* first = &blocks[(pages - 1) * BCACHE_PER_PAGE];
+        for (int j = 0; j < BCACHE_PER_PAGE; j++) {
+            if (first[j].valid && first[j].dirty && bcache_flush_run(&first[j]) != 0) return freed;
+        }
+        for (int j = 0; j < BCACHE_PER_PAGE; j++) {
+            if (first[j].valid) bcache_unhash(&first[j]);
+        }
+        memory_free_pages(first->data, 1);
+        pages--;
+        freed++;
+    }
+    bcache_pages_reclaimed += freed;
+    return freed;
+}
+
+void bcache_stats(void) {
+    vga_puts("Block cache: ");
+    vga_put_uint(cached);
+    vga_puts("/");
+    vga_put_uint(pages * BCACHE_PER_PAGE);
+    vga_puts(" blocks (up to ");
+    vga_put_uint(BCACHE_BLOCKS);
+    vga_puts("), ");
+    vga_put_uint(dirty_count);
+    vga_puts(" dirty\n  memory: ");
+    vga_put_uint(ready ? pages + BCACHE_STAGING_PAGES : 0);
+    vga_puts(" pages (");
+    vga_put_uint(ready ? (pages + BCACHE_STAGING_PAGES) * (PAGE_SIZE / 1024) : 0);
+    vga_puts(" KB), ");
+    vga_put_uint(bcache_pages_reclaimed);
+    vga_puts(" given back under pressure\n  hits: ");
+    vga_put_uint(bcache_hits);
+    vga_puts(", misses: ");
+    vga_put_uint(bcache_misses);
+    vga_puts(" in ");
+    vga_put_uint(bcache_read_ops);
+    vga_puts(" reads");
+    unsigned int lookups = bcache_hits + bcache_misses;
+    if (lookups > 0) {
+        vga_puts(" (");
+        vga_put_uint(bcache_hits * 100 / lookups);
+        vga_puts("% hit)");
+    }
+    vga_puts(", evictions: ");
+    vga_put_uint(bcache_evictions);
+    vga_puts("\n  written back: ");
+    vga_put_uint(bcache_blocks_written);
+    vga_puts(" blocks in ");
+    vga_put_uint(bcache_write_ops);
+    vga_puts(" writes\n");
+}
@@ -0,0 +1,32 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include "storage.h"
+
+// Block cache between the filesystem and the storage drivers.
+// Sectors are cached by (device, sector) and evicted with the CLOCK
+// algorithm. Writes only dirty the cached copy; dirty blocks go to the
+// device when they are evicted, when BCACHE_FLUSH_MS has passed since they
+// were first dirtied, or on bcache_sync(). Runs of consecutive dirty
+// sectors are written back with one multi-sector write.
+//
+// Buffers are user pool pages, taken a page at a time as the cache fills
+// and only while more than BCACHE_SPARE_PAGES stay free. When a page
+// request fails the pool asks the cache to give pages back.
+#define BCACHE_BLOCK_SIZE 512
+#define BCACHE_BLOCKS     512     // Most blocks cached
+#define BCACHE_MIN_PAGES  4       // Buffer pages kept under pressure
+#define BCACHE_SPARE_PAGES 256
+#define BCACHE_BUCKETS    256
+#define BCACHE_MAX_RUN    16      // Sectors merged into one write
+#define BCACHE_FLUSH_MS   5000
+
+int bcache_read(storage_device_t* dev, uint32_t sector, void* buffer);
+int bcache_read_blocks(storage_device_t* dev, uint32_t sector, uint32_t count, void* buffer);
+int bcache_write(storage_device_t* dev, uint32_t sector, const void* buffer);
+int bcache_sync(storage_device_t* dev);     // dev 0 flushes every device
+void bcache_tick(void);
+unsigned int bcache_shrink(unsigned int pages);  // Pages given back to the pool
+void bcache_stats(void);
+
+#endif
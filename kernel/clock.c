@@ -0,0 +1,136 @@
+#include "clock.h"
+#include "io.h"
+#include "memory.h"
+
+// PIT channel 2 is used once at boot to calibrate the TSC
+#define PIT_CHANNEL2     0x42
+#define PIT_COMMAND      0x43
+#define PIT_GATE_PORT    0x61
+#define PIT_FREQUENCY    1193182
+#define PIT_CALIBRATE_MS 10
+
+// The shared page lives at a fixed address below the kernel heap
+static vclock_page_t* vclock = (vclock_page_t*)VCLOCK_PAGE_ADDR;
+
+// Read the time stamp counter
+uint64_t clock_read_tsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// Check CPUID for TSC support
+static int clock_has_tsc(void) {
+    uint32_t eax = 1, ebx, ecx, edx;
+    __asm__ volatile ("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    return (edx & (1 << 4)) != 0;
+}
+
+// 64-by-32 bit division without libgcc helpers
+uint64_t clock_div64(uint64_t dividend, uint32_t divisor) {
+    uint64_t quotient = 0;
+    uint64_t remainder = 0;
+
+    if (divisor == 0) return 0;
+
+    for (int i = 63; i >= 0; i--) {
+        remainder = (remainder << 1) | ((dividend >> i) & 1);
+        if (remainder >= divisor) {
+            remainder -= divisor;
+            quotient |= (uint64_t)1 << i;
+        }
+    }
+    return quotient;
+}
+
+// Measure TSC cycles over a fixed PIT interval
+static uint32_t clock_calibrate_tsc(void) {
+    uint32_t latch = PIT_FREQUENCY / (1000 / PIT_CALIBRATE_MS);
+
+    // Enable channel 2 gate, speaker off
+    outb(PIT_GATE_PORT, (inb(PIT_GATE_PORT) & ~0x02) | 0x01);
+
+    // Channel 2, lobyte/hibyte, mode 0 (interrupt on terminal count)
+    outb(PIT_COMMAND, 0xB0);
+    outb(PIT_CHANNEL2, latch & 0xFF);
+    outb(PIT_CHANNEL2, (latch >> 8) & 0xFF);
+
+    uint64_t start = clock_read_tsc();
+    int timeout = 10000000;
+    while (!(inb(PIT_GATE_PORT) & 0x20) && timeout-- > 0);
+    uint64_t end = clock_read_tsc();
+
+    if (timeout <= 0) {
+        return 0;
+    }
+
+    // Cycles per millisecond == kHz
+    return (uint32_t)(end - start) / PIT_CALIBRATE_MS;
+}
+
+// Initialize the clock and publish the shared page
+void clock_init(void) {
+    memory_set(vclock, 0, PAGE_SIZE);
+
+    if (!clock_has_tsc()) {
+        vga_puts("Clock: no TSC, shared clock page disabled\n");
+        return;
+    }
+
+    uint32_t khz = clock_calibrate_tsc();
+    if (khz == 0) {
+        vga_puts("Clock: TSC calibration failed\n");
+        return;
+    }
+
+    vclock->seq++;
+    __asm__ volatile ("" ::: "memory");
+    vclock->tsc_khz = khz;
+    vclock->shift = VCLOCK_SHIFT;
+    vclock->mult = (uint32_t)clock_div64((uint64_t)1000000 << VCLOCK_SHIFT, khz);
+    vclock->base_tsc = clock_read_tsc();
+    vclock->base_ns = 0;
+    __asm__ volatile ("" ::: "memory");
+    vclock->seq++;
+
+    vga_puts("Clock: shared clock page published\n");
+}
+
+// Advance the base time so user-side deltas stay small
+void clock_update(void) {
+    if (vclock->tsc_khz == 0) return;
+
+    uint64_t now = clock_read_tsc();
+    uint64_t delta = now - vclock->base_tsc;
+    if (delta < VCLOCK_UPDATE_CYCLES) return;
+
+    vclock->seq++;
+    __asm__ volatile ("" ::: "memory");
+    vclock->base_ns += (delta * vclock->mult) >> vclock->shift;
+    vclock->base_tsc = now;
+    __asm__ volatile ("" ::: "memory");
+    vclock->seq++;
+}
+
+// Nanoseconds since boot (kernel side uses the same page)
+uint64_t clock_get_ns(void) {
+    if (vclock->tsc_khz == 0) return 0;
+
+    uint64_t delta = clock_read_tsc() - vclock->base_tsc;
+    return vclock->base_ns + ((delta * vclock->mult) >> vclock->shift);
+}
+
+// Milliseconds since boot
+uint32_t clock_get_ms(void) {
+    return (uint32_t)clock_div64(clock_get_ns(), 1000000);
+}
+
+// Get calibrated TSC frequency
+uint32_t clock_get_tsc_khz(void) {
+    return vclock->tsc_khz;
+}
+
+// Get the shared clock page
+vclock_page_t* clock_get_page(void) {
+    return vclock;
+}
@@ -0,0 +1,40 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+// Define our own integer types for bare-metal environment
+typedef unsigned long long uint64_t;
+typedef unsigned int uint32_t;
+
+// Shared clock page (vDSO-style)
+// The kernel publishes one read-only page at a fixed address that every
+// process can see. User code reads it without a syscall and uses the
+// sequence counter to detect a concurrent update (seqlock):
+//   seq odd  -> kernel is writing, retry
+//   seq changed between start and end of the read -> retry
+// Layout must match struct vclock_page in userlib/userlib.h.
+#define VCLOCK_PAGE_ADDR 0xF000
+#define VCLOCK_SHIFT     22
+
+// Refresh the base once the TSC has moved this far (keeps delta * mult in 64 bits)
+#define VCLOCK_UPDATE_CYCLES 0x40000000
+
+typedef struct vclock_page {
+    volatile uint32_t seq;   // Sequence counter, odd while updating
+    uint32_t tsc_khz;        // Calibrated TSC frequency, 0 if no TSC
+    uint32_t mult;           // ns = base_ns + ((tsc - base_tsc) * mult) >> shift
+    uint32_t shift;
+    uint64_t base_tsc;       // TSC value at base_ns
+    uint64_t base_ns;        // Nanoseconds since boot at base_tsc
+} vclock_page_t;
+
+// Clock functions
+void clock_init(void);
+void clock_update(void);
+uint64_t clock_read_tsc(void);
+uint64_t clock_get_ns(void);
+uint32_t clock_get_ms(void);
+uint32_t clock_get_tsc_khz(void);
+vclock_page_t* clock_get_page(void);
+uint64_t clock_div64(uint64_t dividend, uint32_t divisor);
+
+#endif
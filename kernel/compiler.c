@@ -0,0 +1,1405 @@
+#include "vm.h"
+#include "io.h"
+#include "memory.h"
+#include "string.h"
+
+// Compiler for a small C subset
+// Single pass recursive descent straight to register bytecode:
+//   int, char, void and pointers (every value is one 32-bit cell)
+//   globals, locals, arrays, functions with up to VM_MAX_ARGS parameters
+//   if/else, while, do/while, for, break, continue, return
+//   the C operators except ?:, sizeof and casts
+// Scalar locals live in registers. Loops are compiled with the test at the
+// bottom, and common sequences use the VM's superinstructions.
+
+#define CC_MAX_GLOBALS 64
+#define CC_MAX_LOCALS  64
+#define CC_MAX_LOOPS   16
+#define CC_NAME_LEN    32
+#define CC_MAX_REG     255
+
+// Tokens (single character punctuators use their own value)
+enum {
+    T_EOF = 256, T_NUM, T_STR, T_IDENT,
+    T_INT, T_CHAR, T_VOID, T_IF, T_ELSE, T_WHILE, T_DO, T_FOR,
+    T_RETURN, T_BREAK, T_CONTINUE,
+    T_EQ, T_NE, T_LE, T_GE, T_ANDAND, T_OROR, T_SHL, T_SHR, T_INC, T_DEC,
+    T_ADD_ASSIGN, T_SUB_ASSIGN, T_MUL_ASSIGN, T_DIV_ASSIGN, T_MOD_ASSIGN,
+    T_AND_ASSIGN, T_OR_ASSIGN, T_XOR_ASSIGN, T_SHL_ASSIGN, T_SHR_ASSIGN
+};
+
+typedef struct ctoken {
+    int type;
+    int32_t value;
+    const char* start;
+    int len;
+    int line;
+} ctoken_t;
+
+// Lexer position, saved and restored to emit loop tests after the body
+typedef struct clex {
+    const char* pos;
+    int line;
+    ctoken_t tok;
+} clex_t;
+
+// Expression value kinds
+enum {
+    V_NONE,
+    V_CONST,      // imm
+    V_REG,        // value in reg
+    V_REGOFF,     // value is reg + imm (postfix ++/-- on a register local)
+    V_LOCAL,      // lvalue: register local reg
+    V_GLOBAL,     // lvalue: mem[imm]
+    V_MEM,        // lvalue: mem[reg]
+    V_INDEX,      // lvalue: mem[reg + reg2]
+    V_GINDEX,     // lvalue: mem[imm + reg]
+    V_CMP,        // comparison imm (VM_EQ..VM_GE) of reg and reg2, not yet materialised
+    V_FALSELIST,  // falls through when true, jumps through list imm when false
+    V_TRUELIST    // falls through when false, jumps through list imm when true
+};
+
+typedef struct cvalue {
+    int kind;
+    int reg;
+    int reg2;
+    int32_t imm;
+} cvalue_t;
+
+// Symbols
+enum { SYM_LOCAL, SYM_LOCAL_ARRAY, SYM_GLOBAL, SYM_GLOBAL_ARRAY };
+
+typedef struct csym {
+    char name[CC_NAME_LEN];
+    int kind;
+    int32_t value;           // Register, frame offset or cell address
+} csym_t;
+
+typedef struct cfunc {
+    char name[CC_NAME_LEN];
+    int defined;
+    vm_func_t info;
+} cfunc_t;
+
+typedef struct cloop {
+    int break_list;
+    int continue_list;
+} cloop_t;
+
+typedef struct compiler {
+    clex_t lex;
+    const char* error;
+    int error_line;
+
+    uint32_t code[VM_MAX_CODE];
+    uint32_t code_len;
+    int32_t data[VM_MAX_DATA];
+    uint32_t data_len;
+    uint32_t bss_len;
+
+    csym_t globals[CC_MAX_GLOBALS];
+    int global_count;
+    csym_t locals[CC_MAX_LOCALS];
+    int local_count;
+    cfunc_t funcs[VM_MAX_FUNCS];
+    int func_count;
+    cloop_t loops[CC_MAX_LOOPS];
+    int loop_depth;
+
+    // Current function
+    int locals_top;          // First register above the live locals
+    int next_reg;            // Next free temporary
+    int max_reg;
+    uint32_t frame_cells;
+
+    // Peephole state
+    int last_pc;             // Start of the last instruction emitted
+    int last_write_pc;       // Last instruction whose a operand is a destination
+    int label_pc;            // Last position that is a jump target
+} compiler_t;
+
+static compiler_t cc;
+
+static void expr(cvalue_t* out);
+static void assignment(cvalue_t* out);
+static void statement(void);
+
+// Errors: the first one wins, after that the lexer only returns EOF
+static void error(const char* message) {
+    if (!cc.error) {
+        cc.error = message;
+        cc.error_line = cc.lex.tok.line;
+    }
+    cc.lex.tok.type = T_EOF;
+}
+
+// ---------------------------------------------------------------- lexer
+
+static int is_alpha(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+static int is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static int match_keyword(const char* start, int len, const char* word) {
+    return strlen(word) == len && strncmp(start, word, len) == 0;
+}
+
+static char lex_escape(const char** p) {
+    char c = *(*p)++;
+    switch (c) {
+        case 'n': return '\n';
+        case 't': return '\t';
+        case 'r': return '\r';
+        case '0': return '\0';
+        default:  return c;
+    }
+}
+
+static void next(void) {
+    const char* p = cc.lex.pos;
+    ctoken_t* tok = &cc.lex.tok;
+
+    if (cc.error) {
+        tok->type = T_EOF;
+        return;
+    }
+
+    // Skip whitespace and comments
+    for (;;) {
+        if (*p == '\n') {
+            cc.lex.line++;
+            p++;
+        } else if (*p == ' ' || *p == '\t' || *p == '\r') {
+            p++;
+        } else if (p[0] == '/' && p[1] == '/') {
+            while (*p && *p != '\n') p++;
+        } else if (p[0] == '/' && p[1] == '*') {
+            p += 2;
+            while (*p && !(p[0] == '*' && p[1] == '/')) {
+                if (*p == '\n') cc.lex.line++;
+                p++;
+            }
+            if (*p) p += 2;
+        } else if (*p == '#') {
+            // Preprocessor lines (#include) are ignored
+            while (*p && *p != '\n') p++;
+        } else {
+            break;
+        }
+    }
+
+    tok->start = p;
+    tok->line = cc.lex.line;
+    tok->value = 0;
+
+    if (*p == '\0') {
+        tok->type = T_EOF;
+    } else if (is_digit(*p)) {
+        int32_t value = 0;
+        if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+            p += 2;
+            for (;;) {
+                char c = *p;
+                if (is_digit(c)) value = value * 16 + (c - '0');
+                else if (c >= 'a' && c <= 'f') value = value * 16 + (c - 'a' + 10);
+                else if (c >= 'A' && c <= 'F') value = value * 16 + (c - 'A' + 10);
+                else break;
+                p++;
+            }
+        } else {
+            while (is_digit(*p)) value = value * 10 + (*p++ - '0');
+        }
+        tok->type = T_NUM;
+        tok->value = value;
+    } else if (is_alpha(*p)) {
+        while (is_alpha(*p) || is_digit(*p)) p++;
+        int len = p - tok->start;
+        tok->type = T_IDENT;
+        if (match_keyword(tok->start, len, "int")) tok->type = T_INT;
+        else if (match_keyword(tok->start, len, "char")) tok->type = T_CHAR;
+        else if (match_keyword(tok->start, len, "void")) tok->type = T_VOID;
+        else if (match_keyword(tok->start, len, "if")) tok->type = T_IF;
+        else if (match_keyword(tok->start, len, "else")) tok->type = T_ELSE;
+        else if (match_keyword(tok->start, len, "while")) tok->type = T_WHILE;
+        else if (match_keyword(tok->start, len, "do")) tok->type = T_DO;
+        else if (match_keyword(tok->start, len, "for")) tok->type = T_FOR;
+        else if (match_keyword(tok->start, len, "return")) tok->type = T_RETURN;
+        else if (match_keyword(tok->start, len, "break")) tok->type = T_BREAK;
+        else if (match_keyword(tok->start, len, "continue")) tok->type = T_CONTINUE;
+    } else if (*p == '"') {
+        p++;
+        while (*p && *p != '"' && *p != '\n') {
+            if (*p == '\\' && p[1]) p++;
+            p++;
+        }
+        if (*p != '"') {
+            cc.lex.pos = p;
+            error("unterminated string");
+            return;
+        }
+        p++;
+        tok->type = T_STR;
+    } else if (*p == '\'') {
+        p++;
+        // Stop at the end of the source, as the string branch does
+        if (!*p || (*p == '\\' && !p[1])) {
+            cc.lex.pos = p;
+            error("bad character literal");
+            return;
+        }
+        tok->value = (*p == '\\') ? (p++, lex_escape(&p)) : *p++;
+        if (*p != '\'') {
+            cc.lex.pos = p;
+            error("bad character literal");
+            return;
+        }
+        p++;
+        tok->type = T_NUM;
+    } else {
+        // Operators: longest match first
+        static const struct { const char* text; int type; } ops[] = {
+            { "<<=", T_SHL_ASSIGN }, { ">>=", T_SHR_ASSIGN },
+            { "==", T_EQ }, { "!=", T_NE }, { "<=", T_LE }, { ">=", T_GE },
+            { "&&", T_ANDAND }, { "||", T_OROR }, { "<<", T_SHL }, { ">>", T_SHR },
+            { "++", T_INC }, { "--", T_DEC }, { "+=", T_ADD_ASSIGN },
+            { "-=", T_SUB_ASSIGN }, { "*=", T_MUL_ASSIGN }, { "/=", T_DIV_ASSIGN },
+            { "%=", T_MOD_ASSIGN }, { "&=", T_AND_ASSIGN }, { "|=", T_OR_ASSIGN },
+            { "^=", T_XOR_ASSIGN },
+        };
+        tok->type = *p;
+        for (int i = 0; i < (int)(sizeof(ops) / sizeof(ops[0])); i++) {
+            int len = strlen(ops[i].text);
+            if (strncmp(p, ops[i].text, len) == 0) {
+                tok->type = ops[i].type;
+                p += len - 1;
+                break;
+            }
+        }
+        if (!strchr("+-*/%&|^~!<>=()[]{};,", (char)tok->type) && tok->type < 256) {
+            cc.lex.pos = p;
+            error("unexpected character");
+            return;
+        }
+        p++;
+    }
+
+    tok->len = p - tok->start;
+    cc.lex.pos = p;
+}
+
+static int accept(int type) {
+    if (cc.lex.tok.type == type) {
+        next();
+        return 1;
+    }
+    return 0;
+}
+
+static void expect(int type, const char* message) {
+    if (!accept(type)) error(message);
+}
+
+// Skip tokens up to (not including) an unnested terminator
+static void skip_until(int terminator) {
+    int depth = 0;
+    while (cc.lex.tok.type != T_EOF) {
+        int type = cc.lex.tok.type;
+        if (depth == 0 && type == terminator) return;
+        if (type == '(' || type == '[' || type == '{') depth++;
+        if (type == ')' || type == ']' || type == '}') depth--;
+        next();
+    }
+}
+
+static void token_name(char* name) {
+    int len = cc.lex.tok.len < CC_NAME_LEN - 1 ? cc.lex.tok.len : CC_NAME_LEN - 1;
+    memory_copy(name, cc.lex.tok.start, len);
+    name[len] = '\0';
+}
+
+// ---------------------------------------------------------------- emitter
+
+static int writes_a(int op) {
+    switch (op) {
+        case VM_HALT: case VM_ST: case VM_JMP: case VM_JZ: case VM_JNZ:
+        case VM_RET: case VM_RET0: case VM_STG: case VM_STX: case VM_STGX:
+        case VM_BEQ: case VM_BNE: case VM_BLT: case VM_BLE: case VM_BGT:
+        case VM_BGE: case VM_INCBLT:
+            return 0;
+        default:
+            return 1;
+    }
+}
+
+static int emit(int op, int a, int b, int c) {
+    if (cc.code_len >= VM_MAX_CODE - 1) {
+        error("program too large");
+        return 0;
+    }
+    int pc = cc.code_len;
+    cc.code[cc.code_len++] = VM_INSN(op, a, b, c);
+    cc.last_pc = pc;
+    if (writes_a(op)) cc.last_write_pc = pc;
+    return pc;
+}
+
+static int emit_imm(int op, int a, int b, int c, int32_t imm) {
+    int pc = emit(op, a, b, c);
+    if (!cc.error) cc.code[cc.code_len++] = (uint32_t)imm;
+    return pc;
+}
+
+// Jump lists are chained through the immediate words of pending branches
+static int emit_jump(int op, int a, int b, int* list) {
+    int pc = emit_imm(op, a, b, 0, *list);
+    *list = pc + 1;
+    return pc;
+}
+
+static void patch(int list, int target) {
+    while (list >= 0 && !cc.error) {
+        int next_link = (int32_t)cc.code[list];
+        cc.code[list] = target;
+        list = next_link;
+    }
+}
+
+static int merge(int a, int b) {
+    if (a < 0) return b;
+    if (b < 0) return a;
+    int tail = a;
+    while ((int32_t)cc.code[tail] >= 0) tail = cc.code[tail];
+    cc.code[tail] = b;
+    return a;
+}
+
+// Mark the current position as a jump target
+static int label(void) {
+    cc.label_pc = cc.code_len;
+    return cc.code_len;
+}
+
+static void bind(int list) {
+    patch(list, label());
+}
+
+static int alloc_reg(void) {
+    int reg = cc.next_reg++;
+    if (reg > CC_MAX_REG) {
+        error("expression too complex");
+        return 0;
+    }
+    if (reg > cc.max_reg) cc.max_reg = reg;
+    return reg;
+}
+
+// ---------------------------------------------------------------- values
+
+static void set_value(cvalue_t* v, int kind, int reg, int reg2, int32_t imm) {
+    v->kind = kind;
+    v->reg = reg;
+    v->reg2 = reg2;
+    v->imm = imm;
+}
+
+// Get a value into a register (a local's own register when possible)
+static int load(cvalue_t* v) {
+    int reg;
+    switch (v->kind) {
+        case V_REG:
+        case V_LOCAL:
+            return v->reg;
+        case V_CONST:
+            reg = alloc_reg();
+            emit_imm(VM_LI, reg, 0, 0, v->imm);
+            break;
+        case V_REGOFF:
+            reg = alloc_reg();
+            emit_imm(VM_ADDI, reg, v->reg, 0, v->imm);
+            break;
+        case V_GLOBAL:
+            reg = alloc_reg();
+            emit_imm(VM_LDG, reg, 0, 0, v->imm);
+            break;
+        case V_MEM:
+            reg = alloc_reg();
+            emit(VM_LD, reg, v->reg, 0);
+            break;
+        case V_INDEX:
+            reg = alloc_reg();
+            emit(VM_LDX, reg, v->reg, v->reg2);
+            break;
+        case V_GINDEX:
+            reg = alloc_reg();
+            emit_imm(VM_LDGX, reg, v->reg, 0, v->imm);
+            break;
+        case V_CMP:
+            reg = alloc_reg();
+            emit(v->imm, reg, v->reg, v->reg2);
+            break;
+        case V_FALSELIST:
+        case V_TRUELIST: {
+            int end = -1;
+            reg = alloc_reg();
+            emit_imm(VM_LI, reg, 0, 0, v->kind == V_FALSELIST);
+            emit_jump(VM_JMP, 0, 0, &end);
+            bind(v->imm);
+            emit_imm(VM_LI, reg, 0, 0, v->kind != V_FALSELIST);
+            bind(end);
+            break;
+        }
+        default:
+            error("expression has no value");
+            return 0;
+    }
+    set_value(v, V_REG, reg, 0, 0);
+    return reg;
+}
+
+// Store a register into an lvalue
+static void store(cvalue_t* lv, int reg) {
+    switch (lv->kind) {
+        case V_LOCAL:
+            if (reg == lv->reg) break;
+            // Retarget the instruction that produced a temporary
+            if (reg >= cc.locals_top && cc.last_write_pc == cc.last_pc &&
+                cc.label_pc <= cc.last_pc && (int)((cc.code[cc.last_pc] >> 8) & 0xFF) == reg) {
+                cc.code[cc.last_pc] = (cc.code[cc.last_pc] & ~0xFF00u) | ((uint32_t)lv->reg << 8);
+            } else {
+                emit(VM_MOV, lv->reg, reg, 0);
+            }
+            break;
+        case V_GLOBAL:
+            emit_imm(VM_STG, reg, 0, 0, lv->imm);
+            break;
+        case V_MEM:
+            emit(VM_ST, lv->reg, reg, 0);
+            break;
+        case V_INDEX:
+            emit(VM_STX, lv->reg, lv->reg2, reg);
+            break;
+        case V_GINDEX:
+            emit_imm(VM_STGX, reg, lv->reg, 0, lv->imm);
+            break;
+        default:
+            error("lvalue required");
+    }
+}
+
+static int compare_branch(int cmp_op) {
+    return VM_BEQ + (cmp_op - VM_EQ);
+}
+
+static int invert_compare(int cmp_op) {
+    switch (cmp_op) {
+        case VM_EQ: return VM_NE;
+        case VM_NE: return VM_EQ;
+        case VM_LT: return VM_GE;
+        case VM_LE: return VM_GT;
+        case VM_GT: return VM_LE;
+        default:    return VM_LT;
+    }
+}
+
+// Emit a jump through *list taken when v is false (or true)
+static void branch(cvalue_t* v, int when_true, int* list) {
+    int own = when_true ? V_TRUELIST : V_FALSELIST;
+    int other = when_true ? V_FALSELIST : V_TRUELIST;
+
+    if (v->kind == V_CONST) {
+        if ((v->imm != 0) == when_true) emit_jump(VM_JMP, 0, 0, list);
+    } else if (v->kind == V_CMP) {
+        int op = when_true ? v->imm : invert_compare(v->imm);
+        emit_jump(compare_branch(op), v->reg, v->reg2, list);
+    } else if (v->kind == own) {
+        *list = merge(*list, v->imm);
+    } else if (v->kind == other) {
+        emit_jump(VM_JMP, 0, 0, list);
+        bind(v->imm);
+    } else {
+        int reg = load(v);
+        emit_jump(when_true ? VM_JNZ : VM_JZ, reg, 0, list);
+    }
+}
+
+// ---------------------------------------------------------------- symbols
+
+static csym_t* find_symbol(const char* name) {
+    for (int i = cc.local_count - 1; i >= 0; i--) {
+        if (strcmp(cc.locals[i].name, name) == 0) return &cc.locals[i];
+    }
+    for (int i = 0; i < cc.global_count; i++) {
+        if (strcmp(cc.globals[i].name, name) == 0) return &cc.globals[i];
+    }
+    return 0;
+}
+
+static csym_t* add_symbol(csym_t* table, int* count, int max, const char* name, int kind, int32_t value) {
+    if (*count >= max) {
+        error("too many variables");
+        return 0;
+    }
+    csym_t* sym = &table[(*count)++];
+    strcpy(sym->name, name);
+    sym->kind = kind;
+    sym->value = value;
+    return sym;
+}
+
+static int find_func(const char* name) {
+    for (int i = 0; i < cc.func_count; i++) {
+        if (strcmp(cc.funcs[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+static int declare_func(const char* name) {
+    int index = find_func(name);
+    if (index >= 0) return index;
+    if (cc.func_count >= VM_MAX_FUNCS) {
+        error("too many functions");
+        return 0;
+    }
+    index = cc.func_count++;
+    memory_set(&cc.funcs[index], 0, sizeof(cfunc_t));
+    strcpy(cc.funcs[index].name, name);
+    return index;
+}
+
+static int builtin_index(const char* name) {
+    static const char* names[VM_SYS_COUNT] = {
+        "puts", "putchar", "printf", "strlen", "malloc", "free", "clock",
+        "getchar", "read", "write"
+    };
+    for (int i = 0; i < VM_SYS_COUNT; i++) {
+        if (strcmp(names[i], name) == 0) return i;
+    }
+    return -1;
+}
+
+static int32_t add_data(int32_t value) {
+    if (cc.data_len >= VM_MAX_DATA) {
+        error("too much data");
+        return 0;
+    }
+    cc.data[cc.data_len] = value;
+    return 1 + cc.data_len++;
+}
+
+// Store a string literal, one character per cell; returns its address
+static int32_t string_literal(void) {
+    const char* p = cc.lex.tok.start + 1;
+    const char* end = cc.lex.tok.start + cc.lex.tok.len - 1;
+    int32_t addr = 1 + cc.data_len;
+    while (p < end) {
+        add_data(*p == '\\' ? (p++, lex_escape(&p)) : *p++);
+    }
+    add_data(0);
+    return addr;
+}
+
+// ---------------------------------------------------------------- expressions
+
+// Evaluate call arguments into consecutive registers starting at the mark
+static int arguments(int* first) {
+    int count = 0;
+    *first = cc.next_reg;
+    if (cc.lex.tok.type != ')') {
+        do {
+            int slot = *first + count;
+            cvalue_t arg;
+            cc.next_reg = slot;
+            assignment(&arg);
+            int reg = load(&arg);
+            cc.next_reg = slot;
+            if (reg != alloc_reg()) {
+                emit(VM_MOV, slot, reg, 0);
+            }
+            if (++count > VM_MAX_ARGS) error("too many arguments");
+        } while (accept(','));
+    }
+    expect(')', "expected ')' after arguments");
+    return count;
+}
+
+static void call(const char* name, cvalue_t* out) {
+    int first;
+    int builtin = find_func(name) < 0 ? builtin_index(name) : -1;
+    int func = builtin < 0 ? declare_func(name) : 0;
+    int count = arguments(&first);
+
+    cc.next_reg = first;
+    int dest = alloc_reg();
+    if (builtin >= 0) {
+        emit_imm(VM_SYS, dest, first, count, builtin);
+    } else {
+        emit_imm(VM_CALL, dest, first, count, func);
+    }
+    set_value(out, V_REG, dest, 0, 0);
+}
+
+static void primary(cvalue_t* out) {
+    ctoken_t tok = cc.lex.tok;
+
+    if (accept(T_NUM)) {
+        set_value(out, V_CONST, 0, 0, tok.value);
+    } else if (tok.type == T_STR) {
+        set_value(out, V_CONST, 0, 0, string_literal());
+        next();
+    } else if (accept('(')) {
+        expr(out);
+        expect(')', "expected ')'");
+    } else if (tok.type == T_IDENT) {
+        char name[CC_NAME_LEN];
+        token_name(name);
+        next();
+        if (accept('(')) {
+            call(name, out);
+            return;
+        }
+        csym_t* sym = find_symbol(name);
+        if (!sym) {
+            error("undeclared identifier");
+            set_value(out, V_CONST, 0, 0, 0);
+            return;
+        }
+        switch (sym->kind) {
+            case SYM_LOCAL:
+                set_value(out, V_LOCAL, sym->value, 0, 0);
+                break;
+            case SYM_LOCAL_ARRAY: {
+                int reg = alloc_reg();
+                emit_imm(VM_LEA, reg, 0, 0, sym->value);
+                set_value(out, V_REG, reg, 0, 0);
+                break;
+            }
+            case SYM_GLOBAL:
+                set_value(out, V_GLOBAL, 0, 0, sym->value);
+                break;
+            default:
+                set_value(out, V_CONST, 0, 0, sym->value);
+        }
+    } else {
+        error("expected expression");
+        set_value(out, V_CONST, 0, 0, 0);
+    }
+}
+
+// Increment an lvalue; returns the old value for postfix, new for prefix
+static void increment(cvalue_t* lv, int delta, int postfix) {
+    if (lv->kind == V_LOCAL) {
+        emit_imm(VM_ADDI, lv->reg, lv->reg, 0, delta);
+        if (postfix) set_value(lv, V_REGOFF, lv->reg, 0, -delta);
+        return;
+    }
+    cvalue_t target = *lv;
+    int old = load(lv);
+    int updated = alloc_reg();
+    emit_imm(VM_ADDI, updated, old, 0, delta);
+    store(&target, updated);
+    set_value(lv, V_REG, postfix ? old : updated, 0, 0);
+}
+
+static void postfix(cvalue_t* out) {
+    primary(out);
+    for (;;) {
+        if (accept('[')) {
+            cvalue_t index;
+            if (out->kind == V_CONST) {
+                // Global array: mem[addr + index]
+                int32_t addr = out->imm;
+                expr(&index);
+                expect(']', "expected ']'");
+                if (index.kind == V_CONST) {
+                    set_value(out, V_GLOBAL, 0, 0, addr + index.imm);
+                } else {
+                    set_value(out, V_GINDEX, load(&index), 0, addr);
+                }
+                continue;
+            }
+            int base = load(out);
+            expr(&index);
+            expect(']', "expected ']'");
+            if (index.kind == V_CONST) {
+                if (index.imm == 0) {
+                    set_value(out, V_MEM, base, 0, 0);
+                } else {
+                    int reg = alloc_reg();
+                    emit_imm(VM_ADDI, reg, base, 0, index.imm);
+                    set_value(out, V_MEM, reg, 0, 0);
+                }
+            } else {
+                set_value(out, V_INDEX, base, load(&index), 0);
+            }
+        } else if (cc.lex.tok.type == T_INC || cc.lex.tok.type == T_DEC) {
+            int delta = cc.lex.tok.type == T_INC ? 1 : -1;
+            next();
+            increment(out, delta, 1);
+        } else {
+            return;
+        }
+    }
+}
+
+static void unary(cvalue_t* out) {
+    int type = cc.lex.tok.type;
+
+    if (type == T_INC || type == T_DEC) {
+        next();
+        unary(out);
+        increment(out, type == T_INC ? 1 : -1, 0);
+    } else if (type == '-' || type == '+' || type == '!' || type == '~') {
+        next();
+        unary(out);
+        if (type == '+') return;
+        if (out->kind == V_CONST) {
+            out->imm = type == '-' ? -out->imm : type == '!' ? !out->imm : ~out->imm;
+        } else if (type == '!' && out->kind == V_CMP) {
+            out->imm = invert_compare(out->imm);
+        } else if (type == '!' && (out->kind == V_FALSELIST || out->kind == V_TRUELIST)) {
+            out->kind = out->kind == V_FALSELIST ? V_TRUELIST : V_FALSELIST;
+        } else {
+            int src = load(out);
+            int dest = alloc_reg();
+            emit(type == '-' ? VM_NEG : type == '!' ? VM_NOT : VM_BNOT, dest, src, 0);
+            set_value(out, V_REG, dest, 0, 0);
+        }
+    } else if (type == '*') {
+        next();
+        unary(out);
+        if (out->kind == V_CONST) {
+            set_value(out, V_GLOBAL, 0, 0, out->imm);
+        } else {
+            set_value(out, V_MEM, load(out), 0, 0);
+        }
+    } else if (type == '&') {
+        next();
+        unary(out);
+        if (out->kind == V_GLOBAL) {
+            set_value(out, V_CONST, 0, 0, out->imm);
+        } else if (out->kind == V_MEM) {
+            set_value(out, V_REG, out->reg, 0, 0);
+        } else if (out->kind == V_INDEX || out->kind == V_GINDEX) {
+            int dest = alloc_reg();
+            if (out->kind == V_INDEX) emit(VM_ADD, dest, out->reg, out->reg2);
+            else emit_imm(VM_ADDI, dest, out->reg, 0, out->imm);
+            set_value(out, V_REG, dest, 0, 0);
+        } else if (out->kind == V_LOCAL) {
+            error("cannot take the address of a register variable");
+        }
+    } else {
+        postfix(out);
+    }
+}
+
+// Binary operator precedence, 0 if not a binary operator
+static int precedence(int type) {
+    switch (type) {
+        case T_OROR: return 1;
+        case T_ANDAND: return 2;
+        case '|': return 3;
+        case '^': return 4;
+        case '&': return 5;
+        case T_EQ: case T_NE: return 6;
+        case '<': case '>': case T_LE: case T_GE: return 7;
+        case T_SHL: case T_SHR: return 8;
+        case '+': case '-': return 9;
+        case '*': case '/': case '%': return 10;
+        default: return 0;
+    }
+}
+
+static int binary_opcode(int type) {
+    switch (type) {
+        case '+': case T_ADD_ASSIGN: return VM_ADD;
+        case '-': case T_SUB_ASSIGN: return VM_SUB;
+        case '*': case T_MUL_ASSIGN: return VM_MUL;
+        case '/': case T_DIV_ASSIGN: return VM_DIV;
+        case '%': case T_MOD_ASSIGN: return VM_MOD;
+        case '&': case T_AND_ASSIGN: return VM_AND;
+        case '|': case T_OR_ASSIGN: return VM_OR;
+        case '^': case T_XOR_ASSIGN: return VM_XOR;
+        case T_SHL: case T_SHL_ASSIGN: return VM_SHL;
+        case T_SHR: case T_SHR_ASSIGN: return VM_SHR;
+        case T_EQ: return VM_EQ;
+        case T_NE: return VM_NE;
+        case '<': return VM_LT;
+        case T_LE: return VM_LE;
+        case '>': return VM_GT;
+        case T_GE: return VM_GE;
+        default: return VM_HALT;
+    }
+}
+
+static int32_t fold(int op, int32_t a, int32_t b) {
+    switch (op) {
+        case VM_ADD: return a + b;
+        case VM_SUB: return a - b;
+        case VM_MUL: return a * b;
+        // As the VM does: x / -1 negates with wrap-around rather than
+        // letting idiv trap on INT_MIN / -1
+        case VM_DIV: return b == -1 ? (int32_t)(0u - (uint32_t)a) : b ? a / b : (error("division by zero"), 0);
+        case VM_MOD: return b == -1 ? 0 : b ? a % b : (error("division by zero"), 0);
+        case VM_AND: return a & b;
+        case VM_OR:  return a | b;
+        case VM_XOR: return a ^ b;
+        case VM_SHL: return a << (b & 31);
+        case VM_SHR: return a >> (b & 31);
+        case VM_EQ:  return a == b;
+        case VM_NE:  return a != b;
+        case VM_LT:  return a < b;
+        case VM_LE:  return a <= b;
+        case VM_GT:  return a > b;
+        default:     return a >= b;
+    }
+}
+
+// Combine two values; temporaries from mark upwards are reused for the result
+static void binary_op(int op, cvalue_t* lhs, cvalue_t* rhs, int mark) {
+    if (lhs->kind == V_CONST && rhs->kind == V_CONST) {
+        lhs->imm = fold(op, lhs->imm, rhs->imm);
+        return;
+    }
+
+    // Constant on either side of + or - becomes ADDI
+    if (op == VM_ADD && lhs->kind == V_CONST && rhs->kind != V_CONST) {
+        int src = load(rhs);
+        cc.next_reg = mark;
+        int dest = alloc_reg();
+        emit_imm(VM_ADDI, dest, src, 0, lhs->imm);
+        set_value(lhs, V_REG, dest, 0, 0);
+        return;
+    }
+    if ((op == VM_ADD || op == VM_SUB) && rhs->kind == V_CONST) {
+        int src = load(lhs);
+        cc.next_reg = mark;
+        int dest = alloc_reg();
+        emit_imm(VM_ADDI, dest, src, 0, op == VM_ADD ? rhs->imm : -rhs->imm);
+        set_value(lhs, V_REG, dest, 0, 0);
+        return;
+    }
+
+    int a = load(lhs);
+    int b = load(rhs);
+    if (op >= VM_EQ && op <= VM_GE) {
+        // Left unmaterialised so conditions become compare-and-branch
+        set_value(lhs, V_CMP, a, b, op);
+        return;
+    }
+    cc.next_reg = mark;
+    int dest = alloc_reg();
+    emit(op, dest, a, b);
+    set_value(lhs, V_REG, dest, 0, 0);
+}
+
+static void binary(int min_prec, cvalue_t* out) {
+    int mark = cc.next_reg;
+    unary(out);
+
+    for (;;) {
+        int type = cc.lex.tok.type;
+        int prec = precedence(type);
+        if (prec == 0 || prec < min_prec) return;
+        next();
+
+        if (type == T_ANDAND || type == T_OROR) {
+            int when_true = type == T_OROR;
+            int list = -1;
+            cvalue_t rhs;
+            branch(out, when_true, &list);
+            cc.next_reg = mark;
+            binary(prec + 1, &rhs);
+            branch(&rhs, when_true, &list);
+            cc.next_reg = mark;
+            set_value(out, when_true ? V_TRUELIST : V_FALSELIST, 0, 0, list);
+            continue;
+        }
+
+        cvalue_t rhs;
+        binary(prec + 1, &rhs);
+        binary_op(binary_opcode(type), out, &rhs, mark);
+    }
+}
+
+static int is_assign_op(int type) {
+    return type == '=' || (type >= T_ADD_ASSIGN && type <= T_SHR_ASSIGN);
+}
+
+static void assignment(cvalue_t* out) {
+    binary(1, out);
+
+    int type = cc.lex.tok.type;
+    if (!is_assign_op(type)) return;
+    next();
+
+    cvalue_t lv = *out;
+    cvalue_t rhs;
+    if (lv.kind < V_LOCAL || lv.kind > V_GINDEX) {
+        error("lvalue required");
+        return;
+    }
+
+    if (type == '=') {
+        assignment(&rhs);
+        int reg = load(&rhs);
+        store(&lv, reg);
+        set_value(out, V_REG, lv.kind == V_LOCAL ? lv.reg : reg, 0, 0);
+        return;
+    }
+
+    int op = binary_opcode(type);
+    if (lv.kind == V_LOCAL) {
+        // Operate on the register in place
+        assignment(&rhs);
+        if ((op == VM_ADD || op == VM_SUB) && rhs.kind == V_CONST) {
+            emit_imm(VM_ADDI, lv.reg, lv.reg, 0, op == VM_ADD ? rhs.imm : -rhs.imm);
+        } else {
+            emit(op, lv.reg, lv.reg, load(&rhs));
+        }
+        set_value(out, V_LOCAL, lv.reg, 0, 0);
+        return;
+    }
+
+    cvalue_t value = lv;
+    int inner = cc.next_reg;
+    load(&value);
+    assignment(&rhs);
+    binary_op(op, &value, &rhs, inner);
+    int reg = load(&value);
+    store(&lv, reg);
+    set_value(out, V_REG, reg, 0, 0);
+}
+
+static void expr(cvalue_t* out) {
+    assignment(out);
+    while (accept(',')) {
+        assignment(out);
+    }
+}
+
+// ---------------------------------------------------------------- statements
+
+// Compile a condition, jumping through *list when it is false (or true)
+static void condition(int when_true, int* list) {
+    cvalue_t v;
+    expr(&v);
+    branch(&v, when_true, list);
+    cc.next_reg = cc.locals_top;
+}
+
+// Restore a saved lexer position (after an error the lexer stays at EOF)
+static void restore(const clex_t* state) {
+    if (!cc.error) cc.lex = *state;
+}
+
+static int parse_type(void) {
+    int type = cc.lex.tok.type;
+    if (type != T_INT && type != T_CHAR && type != T_VOID) return 0;
+    next();
+    while (accept('*'));
+    return 1;
+}
+
+static void block(void);
+
+static void local_declaration(void) {
+    do {
+        char name[CC_NAME_LEN];
+        while (accept('*'));
+        if (cc.lex.tok.type != T_IDENT) {
+            error("expected variable name");
+            return;
+        }
+        token_name(name);
+        next();
+
+        if (accept('[')) {
+            int32_t size = cc.lex.tok.value;
+            expect(T_NUM, "expected array size");
+            expect(']', "expected ']'");
+            if (size <= 0 || cc.frame_cells + size > VM_MEM_CELLS / 2) {
+                error("bad array size");
+                return;
+            }
+            add_symbol(cc.locals, &cc.local_count, CC_MAX_LOCALS, name, SYM_LOCAL_ARRAY, cc.frame_cells);
+            cc.frame_cells += size;
+            continue;
+        }
+
+        int reg = cc.locals_top;
+        cc.next_reg = reg;
+        alloc_reg();
+        cc.locals_top = cc.next_reg;
+        if (accept('=')) {
+            cvalue_t lv, init;
+            set_value(&lv, V_LOCAL, reg, 0, 0);
+            assignment(&init);
+            store(&lv, load(&init));
+        }
+        add_symbol(cc.locals, &cc.local_count, CC_MAX_LOCALS, name, SYM_LOCAL, reg);
+        cc.next_reg = cc.locals_top;
+    } while (accept(','));
+    expect(';', "expected ';' after declaration");
+}
+
+static void loop_begin(void) {
+    if (cc.loop_depth >= CC_MAX_LOOPS) {
+        error("loops nested too deeply");
+        return;
+    }
+    cc.loops[cc.loop_depth].break_list = -1;
+    cc.loops[cc.loop_depth].continue_list = -1;
+    cc.loop_depth++;
+}
+
+static void loop_end(void) {
+    if (cc.loop_depth > 0) {
+        cc.loop_depth--;
+        bind(cc.loops[cc.loop_depth].break_list);
+    }
+}
+
+// Fuse "i += 1; if (i < n) goto top" into one INCBLT at the bottom of a loop
+static void fuse_counted_loop(int step_pc, int cond_pc) {
+    if (cc.error || cc.code_len != (uint32_t)cond_pc + 2 || cond_pc != step_pc + 2) return;
+    uint32_t step = cc.code[step_pc];
+    uint32_t test = cc.code[cond_pc];
+    int reg = (step >> 8) & 0xFF;
+    if ((step & 0xFF) != VM_ADDI || ((step >> 16) & 0xFF) != (uint32_t)reg ||
+        cc.code[step_pc + 1] != 1 || (test & 0xFF) != VM_BLT || ((test >> 8) & 0xFF) != (uint32_t)reg) {
+        return;
+    }
+    cc.code[step_pc] = VM_INSN(VM_INCBLT, reg, (test >> 16) & 0xFF, 0);
+    cc.code[step_pc + 1] = cc.code[cond_pc + 1];
+    cc.code_len = step_pc + 2;
+    cc.last_pc = step_pc;
+}
+
+// while (cond) body  =>  if (!cond) goto done; top: body; if (cond) goto top; done:
+static void while_statement(void) {
+    expect('(', "expected '(' after while");
+    clex_t cond = cc.lex;
+    loop_begin();
+    condition(0, &cc.loops[cc.loop_depth - 1].break_list);
+    expect(')', "expected ')'");
+
+    int top = label();
+    statement();
+    bind(cc.loops[cc.loop_depth - 1].continue_list);
+
+    clex_t after = cc.lex;
+    restore(&cond);
+    int list = -1;
+    condition(1, &list);
+    patch(list, top);
+    restore(&after);
+    loop_end();
+}
+
+static void do_statement(void) {
+    loop_begin();
+    int top = label();
+    statement();
+    bind(cc.loops[cc.loop_depth - 1].continue_list);
+    expect(T_WHILE, "expected while");
+    expect('(', "expected '(' after while");
+    int list = -1;
+    condition(1, &list);
+    patch(list, top);
+    expect(')', "expected ')'");
+    expect(';', "expected ';'");
+    loop_end();
+}
+
+// for (init; cond; step) body  =>  init; if (!cond) goto done;
+//   top: body; continue: step; if (cond) goto top; done:
+static void for_statement(void) {
+    cvalue_t v;
+    expect('(', "expected '(' after for");
+    if (cc.lex.tok.type != ';') {
+        expr(&v);
+        cc.next_reg = cc.locals_top;
+    }
+    expect(';', "expected ';'");
+
+    loop_begin();
+    clex_t cond = cc.lex;
+    int has_cond = cc.lex.tok.type != ';';
+    if (has_cond) condition(0, &cc.loops[cc.loop_depth - 1].break_list);
+    expect(';', "expected ';'");
+
+    clex_t step = cc.lex;
+    skip_until(')');
+    expect(')', "expected ')'");
+
+    int top = label();
+    statement();
+    bind(cc.loops[cc.loop_depth - 1].continue_list);
+    clex_t after = cc.lex;
+
+    int step_pc = cc.code_len;
+    restore(&step);
+    if (cc.lex.tok.type != ')') {
+        expr(&v);
+        cc.next_reg = cc.locals_top;
+    }
+
+    int cond_pc = cc.code_len;
+    int list = -1;
+    if (has_cond) {
+        restore(&cond);
+        condition(1, &list);
+    } else {
+        emit_jump(VM_JMP, 0, 0, &list);
+    }
+    patch(list, top);
+    fuse_counted_loop(step_pc, cond_pc);
+
+    restore(&after);
+    loop_end();
+}
+
+static void statement(void) {
+    int type = cc.lex.tok.type;
+    cc.next_reg = cc.locals_top;
+
+    if (type == '{') {
+        block();
+    } else if (type == T_INT || type == T_CHAR) {
+        parse_type();
+        local_declaration();
+    } else if (accept(T_IF)) {
+        int else_list = -1;
+        expect('(', "expected '(' after if");
+        condition(0, &else_list);
+        expect(')', "expected ')'");
+        statement();
+        if (accept(T_ELSE)) {
+            int end = -1;
+            emit_jump(VM_JMP, 0, 0, &end);
+            bind(else_list);
+            statement();
+            bind(end);
+        } else {
+            bind(else_list);
+        }
+    } else if (accept(T_WHILE)) {
+        while_statement();
+    } else if (accept(T_DO)) {
+        do_statement();
+    } else if (accept(T_FOR)) {
+        for_statement();
+    } else if (accept(T_RETURN)) {
+        if (accept(';')) {
+            emit(VM_RET0, 0, 0, 0);
+            return;
+        }
+        cvalue_t v;
+        expr(&v);
+        emit(VM_RET, load(&v), 0, 0);
+        expect(';', "expected ';' after return");
+    } else if (type == T_BREAK || type == T_CONTINUE) {
+        next();
+        if (cc.loop_depth == 0) {
+            error("break or continue outside a loop");
+            return;
+        }
+        cloop_t* loop = &cc.loops[cc.loop_depth - 1];
+        emit_jump(VM_JMP, 0, 0, type == T_BREAK ? &loop->break_list : &loop->continue_list);
+        expect(';', "expected ';'");
+    } else if (accept(';')) {
+        // Empty statement
+    } else {
+        cvalue_t v;
+        expr(&v);
+        expect(';', "expected ';'");
+    }
+}
+
+static void block(void) {
+    int saved_count = cc.local_count;
+    int saved_top = cc.locals_top;
+
+    expect('{', "expected '{'");
+    while (cc.lex.tok.type != '}' && cc.lex.tok.type != T_EOF) {
+        statement();
+    }
+    expect('}', "expected '}'");
+
+    cc.local_count = saved_count;
+    cc.locals_top = saved_top;
+    cc.next_reg = saved_top;
+}
+
+// ---------------------------------------------------------------- top level
+
+static void function(const char* name) {
+    int index = declare_func(name);
+    cfunc_t* func = &cc.funcs[index];
+    int nparams = 0;
+
+    cc.local_count = 0;
+    cc.locals_top = 0;
+    cc.next_reg = 0;
+    cc.max_reg = 0;
+    cc.frame_cells = 0;
+    cc.loop_depth = 0;
+
+    // Parameters arrive in registers 0 .. nparams - 1
+    if (!accept(')')) {
+        clex_t start = cc.lex;
+        if (accept(T_VOID) && cc.lex.tok.type != ')') {
+            restore(&start);
+        }
+        while (cc.lex.tok.type != ')' && cc.lex.tok.type != T_EOF) {
+            char param[CC_NAME_LEN] = "";
+            if (!parse_type()) error("expected parameter type");
+            if (cc.lex.tok.type == T_IDENT) {
+                token_name(param);
+                next();
+            }
+            add_symbol(cc.locals, &cc.local_count, CC_MAX_LOCALS, param, SYM_LOCAL, nparams++);
+            if (!accept(',')) break;
+        }
+        expect(')', "expected ')' after parameters");
+    }
+    if (nparams > VM_MAX_ARGS) error("too many parameters");
+
+    // Prototype
+    if (accept(';')) return;
+
+    if (func->defined) error("function redefined");
+    func->defined = 1;
+    func->info.entry = cc.code_len;
+    func->info.nparams = nparams;
+    cc.locals_top = nparams;
+    cc.next_reg = nparams;
+    cc.max_reg = nparams > 0 ? nparams - 1 : 0;
+    cc.label_pc = cc.code_len;
+
+    block();
+    emit(VM_RET0, 0, 0, 0);
+
+    func->info.nregs = cc.max_reg + 1;
+    func->info.frame_cells = cc.frame_cells;
+}
+
+static void global_declaration(char* name) {
+    for (;;) {
+        if (accept('[')) {
+            int32_t size = cc.lex.tok.value;
+            expect(T_NUM, "expected array size");
+            expect(']', "expected ']'");
+            if (size <= 0 || cc.bss_len + size > VM_MAX_BSS) {
+                error("bad array size");
+                return;
+            }
+            // Arrays are zeroed at load time rather than stored in the image
+            add_symbol(cc.globals, &cc.global_count, CC_MAX_GLOBALS, name, SYM_GLOBAL_ARRAY,
+                       VM_BSS_BASE + cc.bss_len);
+            cc.bss_len += size;
+        } else {
+            int32_t value = 0;
+            if (accept('=')) {
+                int negative = accept('-');
+                value = cc.lex.tok.value;
+                if (cc.lex.tok.type == T_STR) {
+                    value = string_literal();
+                    next();
+                } else {
+                    expect(T_NUM, "expected constant initialiser");
+                }
+                if (negative) value = -value;
+            }
+            add_symbol(cc.globals, &cc.global_count, CC_MAX_GLOBALS, name, SYM_GLOBAL, add_data(value));
+        }
+
+        if (!accept(',')) break;
+        while (accept('*'));
+        token_name(name);
+        expect(T_IDENT, "expected variable name");
+    }
+    expect(';', "expected ';' after declaration");
+}
+
+static void program(void) {
+    while (cc.lex.tok.type != T_EOF) {
+        char name[CC_NAME_LEN];
+        if (!parse_type()) {
+            error("expected declaration");
+            return;
+        }
+        token_name(name);
+        expect(T_IDENT, "expected name");
+        if (accept('(')) {
+            function(name);
+        } else {
+            global_declaration(name);
+        }
+    }
+}
+
+// Compile C source to a bytecode image in out; returns 0 on success
+int vm_compile(const char* source, void* out, uint32_t out_size, uint32_t* out_len) {
+    memory_set(&cc, 0, sizeof(cc));
+    cc.lex.pos = source;
+    cc.lex.line = 1;
+    cc.last_pc = -1;
+    cc.last_write_pc = -1;
+    next();
+
+    program();
+
+    int main_func = find_func("main");
+    if (!cc.error && (main_func < 0 || !cc.funcs[main_func].defined)) {
+        error("no main function");
+    }
+    for (int i = 0; !cc.error && i < cc.func_count; i++) {
+        if (!cc.funcs[i].defined) error("call to undefined function");
+    }
+
+    uint32_t size = sizeof(vm_image_header_t) + cc.func_count * sizeof(vm_func_t) +
+                    (cc.code_len + cc.data_len) * sizeof(uint32_t);
+    if (!cc.error && size > out_size) {
+        error("image too large");
+    }
+
+    if (cc.error) {
+        vga_puts("Compile error (line ");
+        char digits[12];
+        int i = 0;
+        int line = cc.error_line;
+        do {
+            digits[i++] = '0' + line % 10;
+            line /= 10;
+        } while (line > 0);
+        while (i > 0) vga_putchar(digits[--i]);
+        vga_puts("): ");
+        vga_puts(cc.error);
+        vga_puts("\n");
+        return -1;
+    }
+
+    vm_image_header_t* header = (vm_image_header_t*)out;
+    header->magic = VM_MAGIC;
+    header->func_count = cc.func_count;
+    header->code_words = cc.code_len;
+    header->data_cells = cc.data_len;
+    header->bss_cells = cc.bss_len;
+    header->main_func = main_func;
+
+    uint8_t* p = (uint8_t*)(header + 1);
+    for (int i = 0; i < cc.func_count; i++) {
+        memory_copy(p, &cc.funcs[i].info, sizeof(vm_func_t));
+        p += sizeof(vm_func_t);
+    }
+    memory_copy(p, cc.code, cc.code_len * sizeof(uint32_t));
+    p += cc.code_len * sizeof(uint32_t);
+    memory_copy(p, cc.data, cc.data_len * sizeof(int32_t));
+
+    *out_len = size;
+    return 0;
+}
@@ -0,0 +1,73 @@
+#include "crc32c.h"
+
+// crc32c_table[k][b]: the CRC of byte b followed by k zero bytes
+static uint32_t crc32c_table[8][256];
+static int crc32c_ready;
+static int crc32c_hardware;
+
+static void crc32c_init(void) {
+    for (uint32_t b = 0; b < 256; b++) {
+        uint32_t crc = b;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+        }
+        crc32c_table[0][b] = crc;
+    }
+    for (uint32_t b = 0; b < 256; b++) {
+        for (int k = 1; k < 8; k++) {
+            uint32_t prev = crc32c_table[k - 1][b];
+            crc32c_table[k][b] = (prev >> 8) ^ crc32c_table[0][prev & 0xFF];
+        }
+    }
+
+    // CPUID.1:ECX bit 20 is SSE4.2
+    uint32_t eax = 1, ebx, ecx, edx;
+    __asm__ volatile ("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    crc32c_hardware = (ecx & (1 << 20)) != 0;
+    crc32c_ready = 1;
+}
+
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t* p, uint32_t length) {
+    for (; length >= 4; length -= 4, p += 4) {
+        __asm__ ("crc32l %1, %0" : "+r"(crc) : "rm"(*(const uint32_t*)p));
+    }
+    for (; length > 0; length--, p++) {
+        __asm__ ("crc32b %1, %0" : "+r"(crc) : "qm"(*p));
+    }
+    return crc;
+}
+
+static uint32_t crc32c_slice8(uint32_t crc, const uint8_t* p, uint32_t length) {
+    for (; length >= 8; length -= 8, p += 8) {
+        uint32_t lo = *(const uint32_t*)p ^ crc;
+        uint32_t hi = *(const uint32_t*)(p + 4);
+        crc = crc32c_table[7][lo & 0xFF] ^ crc32c_table[6][(lo >> 8) & 0xFF] ^
+              crc32c_table[5][(lo >> 16) & 0xFF] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xFF] ^ crc32c_table[2][(hi >> 8) & 0xFF] ^
+              crc32c_table[1][(hi >> 16) & 0xFF] ^ crc32c_table[0][hi >> 24];
+    }
+    for (; length > 0; length--, p++) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p) & 0xFF];
+    }
+    return crc;
+}
+
+uint32_t crc32c(uint32_t crc, const void* data, uint32_t length) {
+    if (!crc32c_ready) {
+        crc32c_init();
+    }
+    crc = ~crc;
+    if (crc32c_hardware) {
+        crc = crc32c_sse42(crc, (const uint8_t*)data, length);
+    } else {
+        crc = crc32c_slice8(crc, (const uint8_t*)data, length);
+    }
+    return ~crc;
+}
+
+const char* crc32c_method(void) {
+    if (!crc32c_ready) {
+        crc32c_init();
+    }
+    return crc32c_hardware ? "SSE4.2" : "slicing-by-8";
+}
@@ -0,0 +1,19 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+// Define our own integer types for bare-metal environment
+typedef unsigned int uint32_t;
+typedef unsigned char uint8_t;
+
+// CRC32C (Castagnoli polynomial, reflected 0x82F63B78), the checksum of
+// iSCSI, ext4 and btrfs metadata. Computed with the SSE4.2 crc32
+// instruction when CPUID reports it, else eight bytes at a time with
+// slicing-by-8 tables.
+#define CRC32C_POLY 0x82F63B78
+
+// Continue crc (0 to start) over length more bytes; crc32c(crc32c(0, a), b)
+// is the checksum of a followed by b
+uint32_t crc32c(uint32_t crc, const void* data, uint32_t length);
+const char* crc32c_method(void);
+
+#endif
@@ -0,0 +1,375 @@
+#include "event.h"
+#include "pipe.h"
+#include "socket.h"
+#include "thread.h"
+#include "clock.h"
+#include "io.h"
+
+// Event polls (epoll-like readiness notification). Every pollable object
+// has a poll_head; registering it in a poll adds a watcher item there.
+// When the object changes state it notifies its watchers, which puts them
+// on their poll's ready list, so event_wait() only looks at ready items.
+// Level-triggered items stay queued while their object is still ready;
+// edge-triggered items are reported once per notification.
+
+static event_poll_t* polls = 0;
+static event_timer_t* timers = 0;
+
+// Console input has no interrupt handler; event_tick() samples it
+static poll_head_t console_poll;
+static int console_ready = 0;
+
+static poll_head_t* event_source_head(unsigned int type, void* object) {
+    switch (type) {
+        case FD_CONSOLE:    return &console_poll;
+        case FD_PIPE_READ:
+        case FD_PIPE_WRITE: return &((pipe_t*)object)->poll;
+        case FD_EVENT:      return &((event_poll_t*)object)->poll;
+        case FD_TIMER:      return &((event_timer_t*)object)->poll;
+        case FD_SOCKET:     return &((socket_t*)object)->poll;
+    }
+    return 0;
+}
+
+// Current readiness of a watched object
+static unsigned int event_source_state(unsigned int type, void* object) {
+    switch (type) {
+        case FD_CONSOLE:    return event_console_poll();
+        case FD_PIPE_READ:  return pipe_poll((pipe_t*)object, 0);
+        case FD_PIPE_WRITE: return pipe_poll((pipe_t*)object, 1);
+        case FD_EVENT:      return ((event_poll_t*)object)->ready_head ? EVENT_IN : 0;
+        case FD_TIMER:      return ((event_timer_t*)object)->expirations ? EVENT_IN : 0;
+        case FD_SOCKET:     return socket_poll((socket_t*)object);
+    }
+    return 0;
+}
+
+static void event_append(event_item_t* item) {
+    event_poll_t* poll = item->poll;
+
+    item->queued = 1;
+    item->next_ready = 0;
+    if (poll->ready_tail) {
+        poll->ready_tail->next_ready = item;
+    } else {
+        poll->ready_head = item;
+    }
+    poll->ready_tail = item;
+}
+
+// Put an item on its poll's ready list and wake the poll's waiters
+static void event_enqueue(event_item_t* item) {
+    if (item->queued) return;
+
+    event_append(item);
+    wait_queue_wake_all(&item->poll->wait);
+    event_notify(&item->poll->poll, EVENT_IN);
+}
+
+static void event_dequeue(event_item_t* item) {
+    event_poll_t* poll = item->poll;
+    if (!item->queued) return;
+
+    event_item_t* prev = 0;
+    for (event_item_t* it = poll->ready_head; it; prev = it, it = it->next_ready) {
+        if (it != item) continue;
+        if (prev) {
+            prev->next_ready = it->next_ready;
+        } else {
+            poll->ready_head = it->next_ready;
+        }
+        if (poll->ready_tail == it) {
+            poll->ready_tail = prev;
+        }
+        break;
+    }
+    item->queued = 0;
+    item->next_ready = 0;
+}
+
+// An object became ready for some of events; EVENT_HUP reaches every watcher
+void event_notify(poll_head_t* head, unsigned int events) {
+    for (event_item_t* item = head->watchers; item; item = item->next_watcher) {
+        if ((item->events & events) || (events & EVENT_HUP)) {
+            event_enqueue(item);
+        }
+    }
+}
+
+// Unlink an item from its poll and its object, then free it
+static void event_item_free(event_item_t* item) {
+    event_poll_t* poll = item->poll;
+
+    event_dequeue(item);
+
+    event_item_t** link = &poll->items;
+    while (*link && *link != item) {
+        link = &(*link)->next;
+    }
+    if (*link) *link = item->next;
+
+    link = &item->source->watchers;
+    while (*link && *link != item) {
+        link = &(*link)->next_watcher;
+    }
+    if (*link) *link = item->next_watcher;
+
+    memory_free(item);
+}
+
+// An object is going away: drop every registration of it
+void event_detach_source(poll_head_t* head) {
+    while (head->watchers) {
+        event_item_free(head->watchers);
+    }
+}
+
+event_poll_t* event_poll_create(void) {
+    event_poll_t* poll = (event_poll_t*)memory_alloc(sizeof(event_poll_t));
+    if (!poll) return 0;
+    memory_set(poll, 0, sizeof(event_poll_t));
+
+    poll->next = polls;
+    polls = poll;
+    return poll;
+}
+
+static void event_poll_destroy(event_poll_t* poll) {
+    while (poll->items) {
+        event_item_free(poll->items);
+    }
+    event_detach_source(&poll->poll);
+
+    event_poll_t** link = &polls;
+    while (*link && *link != poll) {
+        link = &(*link)->next;
+    }
+    if (*link) *link = poll->next;
+    memory_free(poll);
+}
+
+// Add, change or remove interest in one of the process's descriptors
+int event_control(event_poll_t* poll, process_t* process, int op, int fd, const event_t* event) {
+    fd_entry_t* entry = process_get_fd(process, fd);
+    if (!entry || (entry->type == FD_EVENT && entry->object == poll)) return -1;
+
+    poll_head_t* head = event_source_head(entry->type, entry->object);
+    if (!head) return -1;
+
+    event_item_t* item = poll->items;
+    while (item && !(item->fd == fd && item->object == entry->object)) {
+        item = item->next;
+    }
+
+    if (op == EVENT_DEL) {
+        if (!item) return -1;
+        event_item_free(item);
+        return 0;
+    }
+    if (!event || (op == EVENT_ADD && item) || (op == EVENT_MOD && !item) ||
+        (op != EVENT_ADD && op != EVENT_MOD)) {
+        return -1;
+    }
+
+    if (!item) {
+        item = (event_item_t*)memory_alloc(sizeof(event_item_t));
+        if (!item) return -1;
+        memory_set(item, 0, sizeof(event_item_t));
+        item->poll = poll;
+        item->source = head;
+        item->type = entry->type;
+        item->object = entry->object;
+        item->fd = fd;
+        item->next = poll->items;
+        poll->items = item;
+        item->next_watcher = head->watchers;
+        head->watchers = item;
+    }
+    item->events = event->events;
+    item->data = event->data;
+
+    // Already ready objects are reported by the next wait
+    if (event_source_state(item->type, item->object) & (item->events | EVENT_HUP)) {
+        event_enqueue(item);
+    }
+    return 0;
+}
+
+// Report ready items, visiting each queued item at most once
+static int event_collect(event_poll_t* poll, event_t* events, int max_events) {
+    event_item_t* last = poll->ready_tail;
+    int count = 0;
+
+    while (poll->ready_head && count < max_events) {
+        event_item_t* item = poll->ready_head;
+        poll->ready_head = item->next_ready;
+        if (!poll->ready_head) poll->ready_tail = 0;
+        item->queued = 0;
+        item->next_ready = 0;
+
+        unsigned int state = event_source_state(item->type, item->object) &
+                             (item->events | EVENT_HUP);
+        if (state) {
+            events[count].events = state;
+            events[count].data = item->data;
+            count++;
+            if (!(item->events & EVENT_ET)) {
+                event_append(item);
+            }
+        }
+        if (item == last) break;
+    }
+    return count;
+}
+
+// A wait finished: forget its deadline and, if an earlier try queued the
+// caller, take it off the queue again
+static void event_wait_done(event_poll_t* poll) {
+    thread_t* self = thread_get_current();
+
+    poll->has_deadline = 0;
+    if (self && self->waiting_on == &poll->wait) {
+        wait_queue_remove(self);
+        self->state = PROCESS_RUNNING;
+    }
+}
+
+// Wait for ready descriptors. Returns the number of events, 0 on timeout,
+// or EVENT_WOULD_BLOCK with the caller queued; the caller retries once it
+// is ready again, and the deadline carries over between retries.
+int event_wait(event_poll_t* poll, event_t* events, int max_events, unsigned int timeout_ms) {
+    if (max_events <= 0) return -1;
+
+    event_tick();
+    int count = event_collect(poll, events, max_events);
+    if (count > 0 || timeout_ms == 0) {
+        event_wait_done(poll);
+        return count;
+    }
+
+    if (timeout_ms != EVENT_TIMEOUT_INFINITE) {
+        unsigned int now = clock_get_ms();
+        if (!poll->has_deadline) {
+            poll->deadline = now + timeout_ms;
+            poll->has_deadline = 1;
+        } else if ((int)(now - poll->deadline) >= 0) {
+            event_wait_done(poll);
+            return 0;
+        }
+    }
+
+    wait_queue_sleep(&poll->wait, thread_get_current());
+    return EVENT_WOULD_BLOCK;
+}
+
+// Timer that fires after initial_ms, then every interval_ms (0 = once)
+event_timer_t* event_timer_create(unsigned int initial_ms, unsigned int interval_ms) {
+    event_timer_t* timer = (event_timer_t*)memory_alloc(sizeof(event_timer_t));
+    if (!timer) return 0;
+    memory_set(timer, 0, sizeof(event_timer_t));
+
+    timer->expires = clock_get_ms() + initial_ms;
+    timer->interval = interval_ms;
+    timer->armed = 1;
+    timer->next = timers;
+    timers = timer;
+    return timer;
+}
+
+// Read the number of expirations since the last read (4 bytes)
+int event_timer_read(event_timer_t* timer, void* buffer, unsigned int count) {
+    if (count < sizeof(unsigned int)) return -1;
+
+    if (timer->expirations == 0) {
+        if (!timer->armed) return 0;
+        wait_queue_sleep(&timer->wait, thread_get_current());
+        return EVENT_WOULD_BLOCK;
+    }
+    *(unsigned int*)buffer = timer->expirations;
+    timer->expirations = 0;
+    return sizeof(unsigned int);
+}
+
+static void event_timer_destroy(event_timer_t* timer) {
+    event_detach_source(&timer->poll);
+
+    event_timer_t** link = &timers;
+    while (*link && *link != timer) {
+        link = &(*link)->next;
+    }
+    if (*link) *link = timer->next;
+    memory_free(timer);
+}
+
+unsigned int event_console_poll(void) {
+    return keyboard_available() ? (EVENT_IN | EVENT_OUT) : EVENT_OUT;
+}
+
+// Read the keys already typed; never waits (check EVENT_IN first)
+int event_console_read(void* buffer, unsigned int count) {
+    char* dest = (char*)buffer;
+    unsigned int done = 0;
+
+    while (done < count && keyboard_available()) {
+        char c = keyboard_read();
+        if (c) {
+            dest[done++] = c;
+        }
+    }
+    console_ready = keyboard_available();
+    return done;
+}
+
+void event_retain(unsigned int type, void* object) {
+    if (type == FD_EVENT) {
+        ((event_poll_t*)object)->refs++;
+    } else if (type == FD_TIMER) {
+        ((event_timer_t*)object)->refs++;
+    }
+}
+
+void event_release(unsigned int type, void* object) {
+    if (type == FD_EVENT) {
+        event_poll_t* poll = (event_poll_t*)object;
+        if (--poll->refs == 0) event_poll_destroy(poll);
+    } else if (type == FD_TIMER) {
+        event_timer_t* timer = (event_timer_t*)object;
+        if (--timer->refs == 0) event_timer_destroy(timer);
+    }
+}
+
+// Sample the sources that have no interrupt: timers, console input,
+// network sockets, and wait deadlines. Called from the kernel loop and
+// before every wait.
+void event_tick(void) {
+    unsigned int now = clock_get_ms();
+
+    for (event_timer_t* timer = timers; timer; timer = timer->next) {
+        if (!timer->armed || (int)(now - timer->expires) < 0) continue;
+
+        if (timer->interval) {
+            unsigned int missed = (now - timer->expires) / timer->interval;
+            timer->expirations += missed + 1;
+            timer->expires += (missed + 1) * timer->interval;
+        } else {
+            timer->expirations++;
+            timer->armed = 0;
+        }
+        wait_queue_wake_all(&timer->wait);
+        event_notify(&timer->poll, EVENT_IN);
+    }
+
+    int ready = keyboard_available();
+    if (ready && !console_ready) {
+        event_notify(&console_poll, EVENT_IN);
+    }
+    console_ready = ready;
+
+    socket_poll_network();
+
+    for (event_poll_t* poll = polls; poll; poll = poll->next) {
+        if (poll->has_deadline && poll->wait.head && (int)(now - poll->deadline) >= 0) {
+            wait_queue_wake_all(&poll->wait);
+        }
+    }
+}
@@ -0,0 +1,90 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+#include "process.h"
+
+// Readiness bits
+#define EVENT_IN   0x01         // Data to read (or a timer expired)
+#define EVENT_OUT  0x04         // Room to write
+#define EVENT_HUP  0x10         // Other end closed; always reported
+#define EVENT_ET   0x80000000   // Edge triggered: report once per notification
+
+// event_control() operations
+#define EVENT_ADD  1
+#define EVENT_DEL  2
+#define EVENT_MOD  3
+
+#define EVENT_TIMEOUT_INFINITE 0xFFFFFF   // Largest timeout the syscall can pass
+#define EVENT_WOULD_BLOCK (-2)
+
+struct event_item;
+
+// Embedded in every object that can become ready. Each registration of
+// the object in an event poll is a watcher; notifications go straight to
+// the watchers so waits only look at objects that actually became ready.
+typedef struct poll_head {
+    struct event_item* watchers;
+} poll_head_t;
+
+// What event_wait() reports per ready descriptor
+typedef struct event {
+    unsigned int events;
+    unsigned int data;
+} event_t;
+
+typedef struct event_item {
+    struct event_poll* poll;
+    poll_head_t* source;
+    unsigned int type;              // FD_* of the watched object
+    void* object;
+    int fd;
+    unsigned int events;            // Interest, plus EVENT_ET
+    unsigned int data;
+    int queued;                     // On the poll's ready list
+    struct event_item* next_watcher;
+    struct event_item* next_ready;
+    struct event_item* next;
+} event_item_t;
+
+typedef struct event_poll {
+    event_item_t* items;
+    event_item_t* ready_head;
+    event_item_t* ready_tail;
+    unsigned int refs;
+    unsigned int deadline;          // clock_get_ms() at which a pending wait times out
+    int has_deadline;
+    wait_queue_t wait;
+    poll_head_t poll;               // An event poll is itself pollable
+    struct event_poll* next;
+} event_poll_t;
+
+// Interval timer readable as a count of expirations
+typedef struct event_timer {
+    unsigned int expires;           // clock_get_ms() of the next expiry
+    unsigned int interval;          // 0 for one-shot
+    unsigned int expirations;
+    int armed;
+    unsigned int refs;
+    poll_head_t poll;
+    wait_queue_t wait;
+    struct event_timer* next;
+} event_timer_t;
+
+void event_notify(poll_head_t* head, unsigned int events);
+void event_detach_source(poll_head_t* head);
+
+event_poll_t* event_poll_create(void);
+int event_control(event_poll_t* poll, process_t* process, int op, int fd, const event_t* event);
+int event_wait(event_poll_t* poll, event_t* events, int max_events, unsigned int timeout_ms);
+
+event_timer_t* event_timer_create(unsigned int initial_ms, unsigned int interval_ms);
+int event_timer_read(event_timer_t* timer, void* buffer, unsigned int count);
+
+unsigned int event_console_poll(void);
+int event_console_read(void* buffer, unsigned int count);
+
+void event_retain(unsigned int type, void* object);
+void event_release(unsigned int type, void* object);
+void event_tick(void);
+
+#endif
@@ -0,0 +1,209 @@
+#include "file.h"
+#include "io.h"
+#include "string.h"
+
+static open_file_t open_files[MAX_OPEN_FILES];
+
+static unsigned int readahead_reads;      // Reads of files still on disk
+static unsigned int readahead_hits;       // ... served without waiting on the device
+static unsigned int readahead_requests;
+static unsigned int readahead_sectors;
+static unsigned int readahead_window_sum;
+static unsigned int readahead_window_max;
+
+// The entry behind an open file, or 0 once it has been removed
+static file_entry_t* file_entry_of(open_file_t* file) {
+    if (!file || !file->ino) return 0;
+    file_entry_t* entry = filesystem_entry(file->ino);
+    if (!entry || !entry->used || entry->type != FILE_TYPE_FILE) return 0;
+    return entry;
+}
+
+static int file_readable(open_file_t* file) {
+    return (file->flags & O_ACCMODE) != O_WRONLY;
+}
+
+static int file_writable(open_file_t* file) {
+    return (file->flags & O_ACCMODE) != O_RDONLY;
+}
+
+// Open a regular file. The result has no references yet; installing it as
+// a descriptor (or file_retain()) takes the first one.
+open_file_t* file_open(const char* path, unsigned int flags) {
+    if (!path) return 0;
+
+    // Find a slot first, so a full table does not leave a created file behind
+    open_file_t* file = 0;
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        if (!open_files[i].used) {
+            file = &open_files[i];
+            break;
+        }
+    }
+    if (!file) return 0;
+
+    file_entry_t* entry = filesystem_find_file(path);
+    if (!entry && (flags & O_CREAT)) {
+        entry = filesystem_create(path, FILE_TYPE_FILE);
+    }
+    if (!entry || entry->type != FILE_TYPE_FILE) return 0;
+
+    file->ino = entry->ino;
+    file->offset = 0;
+    file->flags = flags;
+    file->refs = 0;
+    file->ra_next = 0;
+    file->ra_window = 0;
+    file->ra_end = 0;
+    file->used = 1;
+
+    if ((flags & O_TRUNC) && file_writable(file)) {
+        filesystem_truncate(entry, 0);
+    }
+    return file;
+}
+
+void file_retain(open_file_t* file) {
+    file->refs++;
+}
+
+void file_release(open_file_t* file) {
+    if (file->refs > 0 && --file->refs > 0) return;
+    file->used = 0;
+    file->ino = 0;
+}
+
+// Read from the current position and advance it
+int file_read(open_file_t* file, void* buffer, unsigned int count) {
+    int read = file_pread(file, buffer, count, file->offset);
+    if (read > 0) {
+        file->offset += read;
+    }
+    return read;
+}
+
+// Write at the current position (the end in append mode) and advance it
+int file_write(open_file_t* file, const void* data, unsigned int count) {
+    file_entry_t* entry = file_entry_of(file);
+    if (entry && (file->flags & O_APPEND)) {
+        file->offset = entry->size;
+    }
+    int written = file_pwrite(file, data, count, file->offset);
+    if (written > 0) {
+        file->offset += written;
+    }
+    return written;
+}
+
+// Track the access pattern of reads from a file still on disk. A read
+// that starts where the last one ended doubles the window (starting at
+// FILE_READAHEAD_MIN), any other halves it. Once less than half a window
+// of read-ahead data is left past the read, the next window is fetched
+// together with the read itself, so a steady reader finds its data in
+// memory and the device sees a few large requests.
+static void file_read_ahead(open_file_t* file, file_entry_t* entry, unsigned int offset, unsigned int count) {
+    unsigned int end = offset + count;
+    if (offset == file->ra_next) {
+        file->ra_window = file->ra_window ? file->ra_window * 2 : FILE_READAHEAD_MIN;
+        if (file->ra_window > FILE_READAHEAD_MAX) file->ra_window = FILE_READAHEAD_MAX;
+    } else {
+        file->ra_window /= 2;
+        if (file->ra_window < FILE_READAHEAD_MIN) file->ra_window = 0;
+        file->ra_end = 0;
+    }
+    file->ra_next = end;
+
+    readahead_reads++;
+    readahead_window_sum += file->ra_window;
+    if (file->ra_window > readahead_window_max) readahead_window_max = file->ra_window;
+    if (filesystem_cached(entry, offset, end)) readahead_hits++;
+
+    if (file->ra_window == 0 || (file->ra_end > end && file->ra_end - end >= file->ra_window / 2)) return;
+    unsigned int from = file->ra_end > offset ? file->ra_end : offset;
+    int sectors = filesystem_prefetch(entry, from, end + file->ra_window);
+    if (sectors > 0) {
+        readahead_requests++;
+        readahead_sectors += sectors;
+    }
+    file->ra_end = end + file->ra_window;
+}
+
+// Read at an explicit offset without moving the position
+int file_pread(open_file_t* file, void* buffer, unsigned int count, unsigned int offset) {
+    file_entry_t* entry = file_entry_of(file);
+    if (!entry || !file_readable(file)) return -1;
+    if ((entry->flags & FILE_FLAG_ON_DISK) && count > 0 && offset < entry->size) {
+        file_read_ahead(file, entry, offset, count);
+    }
+    return filesystem_read_at(entry, offset, buffer, count);
+}
+
+// Write at an explicit offset without moving the position
+int file_pwrite(open_file_t* file, const void* data, unsigned int count, unsigned int offset) {
+    file_entry_t* entry = file_entry_of(file);
+    if (!entry || !file_writable(file)) return -1;
+    return filesystem_write_at(entry, offset, data, count);
+}
+
+// Move the position; returns the new offset
+int file_seek(open_file_t* file, int offset, int whence) {
+    file_entry_t* entry = file_entry_of(file);
+    if (!entry) return -1;
+
+    int base;
+    if (whence == SEEK_SET) {
+        base = 0;
+    } else if (whence == SEEK_CUR) {
+        base = file->offset;
+    } else if (whence == SEEK_END) {
+        base = entry->size;
+    } else {
+        return -1;
+    }
+
+    if (offset < 0 && base + offset < 0) return -1;
+    file->offset = base + offset;
+    return file->offset;
+}
+
+// The file was removed; its entry may be reused for something else
+void file_forget(unsigned int ino) {
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        if (open_files[i].used && open_files[i].ino == ino) {
+            open_files[i].ino = 0;
+        }
+    }
+}
+
+// The whole tree was dropped (a load replaces it); every entry number may
+// be reused, so no open file may keep one
+void file_forget_all(void) {
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        open_files[i].ino = 0;
+    }
+}
+
+// Show how well read-ahead kept up with readers of files still on disk
+void file_readahead_stats(void) {
+    vga_puts("Read-ahead: ");
+    vga_put_uint(readahead_hits);
+    vga_puts("/");
+    vga_put_uint(readahead_reads);
+    vga_puts(" reads from memory");
+    if (readahead_reads > 0) {
+        vga_puts(" (");
+        vga_put_uint(readahead_hits * 100 / readahead_reads);
+        vga_puts("%)");
+    }
+    vga_puts(", ");
+    vga_put_uint(readahead_sectors);
+    vga_puts(" sectors in ");
+    vga_put_uint(readahead_requests);
+    vga_puts(" prefetches\n  window: ");
+    vga_put_uint(readahead_reads ? readahead_window_sum / readahead_reads : 0);
+    vga_puts(" bytes average, ");
+    vga_put_uint(readahead_window_max);
+    vga_puts(" max (limit ");
+    vga_put_uint(FILE_READAHEAD_MAX);
+    vga_puts(")\n");
+}
@@ -0,0 +1,61 @@
+#ifndef FILE_H
+#define FILE_H
+
+#include "filesystem.h"
+
+// Open flags; the access mode is in the low two bits
+#define O_RDONLY  0x0000
+#define O_WRONLY  0x0001
+#define O_RDWR    0x0002
+#define O_ACCMODE 0x0003
+#define O_CREAT   0x0040
+#define O_TRUNC   0x0200
+#define O_APPEND  0x0400
+
+// lseek() origins
+#define SEEK_SET 0
+#define SEEK_CUR 1
+#define SEEK_END 2
+
+#define MAX_OPEN_FILES 32
+
+// Read-ahead window for files still on disk, in bytes
+#define FILE_READAHEAD_MIN 4096
+#define FILE_READAHEAD_MAX 65536
+
+// Open file: a file entry seen through a position and access flags. It is
+// shared by every descriptor installed for it and dropped with the last
+// one. Removing the file, or loading another tree, detaches it (ino
+// becomes 0) and further I/O fails.
+// Reads that continue where the last one ended grow a read-ahead window;
+// reads elsewhere shrink it.
+typedef struct open_file {
+    unsigned int ino;
+    unsigned int offset;
+    unsigned int flags;
+    unsigned int refs;
+    unsigned int ra_next;        // Where a sequential read would start
+    unsigned int ra_window;      // Bytes to read ahead, 0 when off
+    unsigned int ra_end;         // End of the data read ahead so far
+    int used;
+} open_file_t;
+
+// One buffer of a readv/writev/pread/pwrite request
+typedef struct io_vector {
+    void* base;
+    unsigned int length;
+} io_vector_t;
+
+open_file_t* file_open(const char* path, unsigned int flags);
+void file_retain(open_file_t* file);
+void file_release(open_file_t* file);
+int file_read(open_file_t* file, void* buffer, unsigned int count);
+int file_write(open_file_t* file, const void* data, unsigned int count);
+int file_pread(open_file_t* file, void* buffer, unsigned int count, unsigned int offset);
+int file_pwrite(open_file_t* file, const void* data, unsigned int count, unsigned int offset);
+int file_seek(open_file_t* file, int offset, int whence);
+void file_forget(unsigned int ino);
+void file_forget_all(void);
+void file_readahead_stats(void);
+
+#endif
@@ -1,15 +1,379 @@
-#include "filesystem.h"
+#include "pinefs.h"
 #include "io.h"
 #include "string.h"
-#include "storage.h"
+#include "file.h"
+#include "vfs.h"
 
 // Global filesystem instance
 filesystem_t fs;
 
+// Directory entry cache. Every entry except the root sits in the bucket for
+// (parent, name hash), so resolving a path component costs one bucket walk
+// no matter how many children the directory has. Misses are remembered in a
+// direct-mapped negative cache so repeated lookups of absent names (the
+// existence checks done before every create) skip even that.
+typedef struct dcache_negative {
+    unsigned int parent;
+    unsigned int hash;
+    char name[MAX_FILENAME];
+} dcache_negative_t;
+
+static unsigned int dcache_buckets[DCACHE_BUCKETS];
+static dcache_negative_t dcache_negative[DCACHE_NEGATIVE];
+static unsigned int dcache_hits;
+static unsigned int dcache_misses;
+static unsigned int dcache_negative_hits;
+
+// Interned names. Each distinct name is stored once in the name area behind
+// a small header and shared by every entry that carries it. Freed names go
+// on a free list per rounded size and are reused before the area grows.
+typedef struct fs_name {
+    unsigned int next;           // Next name in the intern bucket or free list
+    unsigned int hash;           // dcache_hash_name() of the name
+    unsigned short refs;
+    unsigned char len;
+    unsigned char size;          // Bytes taken in the area, header included
+} fs_name_t;
+
+#define NAME_BUCKETS 1024
+#define NAME_CLASSES ((sizeof(fs_name_t) + MAX_FILENAME + 3) / 4 + 1)
+
+static unsigned char* name_pages[MAX_NAME_PAGES];
+static unsigned int name_page_count;     // Pages allocated so far
+static unsigned int name_top;            // Next unused offset in the area
+static unsigned int name_buckets[NAME_BUCKETS];
+static unsigned int name_free[NAME_CLASSES];
+static unsigned int names_interned;
+
+// Disk table: records of saved files (see file_disk_t), in slab pages like
+// the inode table and referred to by index; index 0 means none
+static file_disk_t* disk_slabs[MAX_DISK_SLABS];
+static unsigned int disk_slab_count;
+static unsigned int disk_next = 1;      // First index never handed out
+static unsigned int disk_free_list;     // Freed records, linked through extents[0].start
+static unsigned int disk_live;
+static file_disk_t disk_none;           // Read for a file without a record; never written
+
+// Source of content versions, shared by every entry of every mount
+static unsigned int version_clock;
+
+// FNV-1a over at most MAX_FILENAME - 1 characters, matching the stored name
+unsigned int dcache_hash_name(const char* name) {
+    unsigned int hash = 2166136261u;
+    for (int i = 0; name[i] && i < MAX_FILENAME - 1; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static fs_name_t* name_at(unsigned int offset) {
+    return (fs_name_t*)(name_pages[offset / PAGE_SIZE] + offset % PAGE_SIZE);
+}
+
+// Carve size bytes out of the name area; 0 when it is full
+static unsigned int name_alloc(unsigned int size) {
+    unsigned int offset = name_free[size / 4];
+    if (offset) {
+        name_free[size / 4] = name_at(offset)->next;
+        return offset;
+    }
+
+    // Names never straddle a page; offset 0 stays reserved for "no name"
+    unsigned int used = name_top % PAGE_SIZE;
+    if (used == 0 || used + size > PAGE_SIZE) {
+        unsigned int page = (name_top + PAGE_SIZE - 1) / PAGE_SIZE;
+        if (page >= MAX_NAME_PAGES) {
+            return 0;
+        }
+        if (page == name_page_count) {
+            name_pages[page] = memory_alloc_pages(1);
+            if (!name_pages[page]) {
+                return 0;
+            }
+            name_page_count++;
+        }
+        name_top = page * PAGE_SIZE + (page == 0 ? 4 : 0);
+    }
+
+    offset = name_top;
+    name_top += size;
+    return offset;
+}
+
+// Return the offset of an interned copy of name, taking a reference
+static unsigned int name_intern(const char* name, unsigned int hash) {
+    int len = strlen(name);
+    if (len >= MAX_FILENAME) len = MAX_FILENAME - 1;
+
+    unsigned int* bucket = &name_buckets[hash & (NAME_BUCKETS - 1)];
+    for (unsigned int offset = *bucket; offset; offset = name_at(offset)->next) {
+        fs_name_t* n = name_at(offset);
+        if (n->hash == hash && n->len == len && n->refs != 0xFFFF &&
+            memory_compare(n + 1, name, len) == 0) {
+            n->refs++;
+            return offset;
+        }
+    }
+
+    unsigned int size = (sizeof(fs_name_t) + len + 1 + 3) & ~3u;
+    unsigned int offset = name_alloc(size);
+    if (!offset) {
+        return 0;
+    }
+
+    fs_name_t* n = name_at(offset);
+    n->hash = hash;
+    n->refs = 1;
+    n->len = len;
+    n->size = size;
+    memory_copy(n + 1, name, len);
+    ((char*)(n + 1))[len] = '\0';
+    n->next = *bucket;
+    *bucket = offset;
+    names_interned++;
+    return offset;
+}
+
+static void name_release(unsigned int offset) {
+    fs_name_t* n = name_at(offset);
+    if (--n->refs > 0) {
+        return;
+    }
+
+    unsigned int* link = &name_buckets[n->hash & (NAME_BUCKETS - 1)];
+    while (*link && *link != offset) {
+        link = &name_at(*link)->next;
+    }
+    if (*link) {
+        *link = n->next;
+    }
+    n->next = name_free[n->size / 4];
+    name_free[n->size / 4] = offset;
+    names_interned--;
+}
+
+// Look up an entry by index
+file_entry_t* filesystem_entry(unsigned int ino) {
+    if (ino == 0 || ino >= fs.next_entry) {
+        return 0;
+    }
+    return &fs.slabs[ino / INODES_PER_SLAB][ino % INODES_PER_SLAB];
+}
+
+// A version no content of any path has carried since boot. An entry takes
+// a new one when it is created, loaded or changed, so (path, version)
+// names one content even across rm, recreate and load.
+unsigned int filesystem_next_version(void) {
+    return ++version_clock;
+}
+
+const char* filesystem_entry_name(const file_entry_t* entry) {
+    return (const char*)(name_at(entry->name) + 1);
+}
+
+// The name's hash is kept with the interned name, not in every entry
+unsigned int filesystem_entry_hash(const file_entry_t* entry) {
+    return name_at(entry->name)->hash;
+}
+
+// Take an entry off the free list, growing the table by a slab if needed
+file_entry_t* inode_alloc(void) {
+    file_entry_t* entry;
+    if (fs.free_list) {
+        entry = filesystem_entry(fs.free_list);
+        fs.free_list = entry->next;
+    } else {
+        unsigned int ino = fs.next_entry;
+        if (ino / INODES_PER_SLAB >= fs.slab_count) {
+            if (fs.slab_count >= MAX_INODE_SLABS) {
+                return 0;
+            }
+            file_entry_t* slab = memory_alloc_pages(1);
+            if (!slab) {
+                return 0;
+            }
+            fs.slabs[fs.slab_count++] = slab;
+        }
+        fs.next_entry++;
+        entry = filesystem_entry(ino);
+        entry->ino = ino;
+    }
+    fs.live_entries++;
+    return entry;
+}
+
+static file_disk_t* disk_at(unsigned int index) {
+    return &disk_slabs[index / DISKS_PER_SLAB][index % DISKS_PER_SLAB];
+}
+
+// The file's disk record, or an empty one if it has none
+file_disk_t* file_disk(file_entry_t* file) {
+    return file->disk ? disk_at(file->disk) : &disk_none;
+}
+
+// The file's disk record, taken from the table if it has none yet; 0 when
+// out of memory
+file_disk_t* file_disk_claim(file_entry_t* file) {
+    if (file->disk) {
+        return disk_at(file->disk);
+    }
+    unsigned int index;
+    if (disk_free_list) {
+        index = disk_free_list;
+        disk_free_list = disk_at(index)->extents[0].start;
+    } else {
+        index = disk_next;
+        if (index / DISKS_PER_SLAB >= disk_slab_count) {
+            if (disk_slab_count >= MAX_DISK_SLABS) {
+                return 0;
+            }
+            file_disk_t* slab = memory_alloc_pages(1);
+            if (!slab) {
+                return 0;
+            }
+            disk_slabs[disk_slab_count++] = slab;
+        }
+        disk_next++;
+    }
+    file_disk_t* disk = disk_at(index);
+    memory_set(disk, 0, sizeof(file_disk_t));
+    disk_live++;
+    file->disk = index;
+    return disk;
+}
+
+// Give the record back once it holds no runs and no sector maps
+void file_disk_put(file_entry_t* file) {
+    file_disk_t* disk = file_disk(file);
+    if (!file->disk || disk->extent_count || disk->dirty_blocks || disk->loaded_blocks) {
+        return;
+    }
+    disk->extents[0].start = disk_free_list;
+    disk_free_list = file->disk;
+    disk_live--;
+    file->disk = 0;
+}
+
+// Return an entry, its name and its data pages to the free lists
+static void inode_free(file_entry_t* entry) {
+    vfs_type_of(entry)->inode_ops->release(entry);
+    name_release(entry->name);
+    entry->mount = 0;
+    entry->used = 0;
+    entry->type = 0;
+    entry->size = 0;
+    entry->next = fs.free_list;
+    fs.free_list = entry->ino;
+    fs.live_entries--;
+}
+
+static unsigned int dcache_slot(unsigned int parent, unsigned int hash) {
+    unsigned int key = hash ^ (parent * 2654435761u);
+    return key ^ (key >> 16);
+}
+
+void dcache_insert(file_entry_t* entry) {
+    unsigned int hash = filesystem_entry_hash(entry);
+    unsigned int slot = dcache_slot(entry->parent, hash);
+    unsigned int* bucket = &dcache_buckets[slot & (DCACHE_BUCKETS - 1)];
+    entry->hash_next = *bucket;
+    *bucket = entry->ino;
+
+    // The name exists now; drop any remembered miss for it
+    dcache_negative_t* neg = &dcache_negative[slot & (DCACHE_NEGATIVE - 1)];
+    if (neg->parent == entry->parent && neg->hash == hash) {
+        neg->parent = 0;
+    }
+}
+
+static void dcache_remove(file_entry_t* entry) {
+    unsigned int slot = dcache_slot(entry->parent, filesystem_entry_hash(entry));
+    unsigned int* link = &dcache_buckets[slot & (DCACHE_BUCKETS - 1)];
+    while (*link) {
+        if (*link == entry->ino) {
+            *link = entry->hash_next;
+            break;
+        }
+        link = &filesystem_entry(*link)->hash_next;
+    }
+    entry->hash_next = 0;
+}
+
+static file_entry_t* dcache_lookup(file_entry_t* parent, const char* name) {
+    unsigned int hash = dcache_hash_name(name);
+    unsigned int slot = dcache_slot(parent->ino, hash);
+
+    dcache_negative_t* neg = &dcache_negative[slot & (DCACHE_NEGATIVE - 1)];
+    if (neg->parent == parent->ino && neg->hash == hash && strcmp(neg->name, name) == 0) {
+        dcache_negative_hits++;
+        return 0;
+    }
+
+    unsigned int ino = dcache_buckets[slot & (DCACHE_BUCKETS - 1)];
+    while (ino) {
+        file_entry_t* entry = filesystem_entry(ino);
+        if (entry->parent == parent->ino && filesystem_entry_hash(entry) == hash &&
+            strcmp(filesystem_entry_name(entry), name) == 0) {
+            dcache_hits++;
+            return entry;
+        }
+        ino = entry->hash_next;
+    }
+
+    dcache_misses++;
+    int len = strlen(name);
+    if (len < MAX_FILENAME) {
+        neg->parent = parent->ino;
+        neg->hash = hash;
+        memory_copy(neg->name, name, len + 1);
+    }
+    return 0;
+}
+
+// Drop every entry, keeping the slab and name pages for reuse. Open files
+// are detached, since their entry numbers are about to be reused.
+void filesystem_reset(void) {
+    file_forget_all();
+    for (unsigned int ino = 1; ino < fs.next_entry; ino++) {
+        file_entry_t* entry = filesystem_entry(ino);
+        if (entry->used && !vfs_persistent(entry)) {
+            vfs_type_of(entry)->inode_ops->release(entry);
+            entry->mount = 0;
+            continue;
+        }
+        if (entry->used && (entry->flags & FILE_FLAG_EXTENTS)) {
+            file_free_extents(entry);
+        }
+        if (entry->used && entry->disk) {
+            memory_free(file_disk(entry)->dirty_blocks);
+            memory_free(file_disk(entry)->loaded_blocks);
+        }
+    }
+    save_invalidate();
+    disk_next = 1;
+    disk_free_list = 0;
+    disk_live = 0;
+
+    fs.root = 0;
+    fs.current_dir = 0;
+    fs.next_entry = 1;
+    fs.free_list = 0;
+    fs.live_entries = 0;
+
+    name_top = 0;
+    names_interned = 0;
+    memory_set(name_buckets, 0, sizeof(name_buckets));
+    memory_set(name_free, 0, sizeof(name_free));
+    memory_set(dcache_buckets, 0, sizeof(dcache_buckets));
+    memory_set(dcache_negative, 0, sizeof(dcache_negative));
+}
+
 // Initialize filesystem
 void filesystem_init(void) {
     // Initialize filesystem structure
-    fs.next_entry = 0;
+    filesystem_reset();
+    vfs_init();
     
     // Create root directory
     fs.root = filesystem_create_file("/", FILE_TYPE_DIR);
@@ -20,6 +384,7 @@ void filesystem_init(void) {
     filesystem_mkdir("home");
     filesystem_mkdir("etc");
     filesystem_mkdir("tmp");
+    filesystem_mount("/tmp", "tmpfs");
     
     // Create some default files
     filesystem_write_file("/etc/version", "pineOS v1.0\n");
@@ -27,187 +392,782 @@ void filesystem_init(void) {
     filesystem_write_file("/home/readme.txt", "This is your home directory.\n");
 }
 
-// Create a new file entry
-file_entry_t* filesystem_create_file(const char* name, int type) {
-    if (fs.next_entry >= MAX_FILES + MAX_DIRS) {
+// Create a new entry of the filesystem mounted as mount, not yet linked
+// into any directory
+static file_entry_t* filesystem_new_entry(const char* name, int type, unsigned int mount) {
+    file_entry_t* entry = inode_alloc();
+    if (!entry) {
         return 0; // No more space
     }
     
-    file_entry_t* entry = &fs.entries[fs.next_entry++];
-    
     // Initialize entry
-    int name_len = strlen(name);
-    if (name_len >= MAX_FILENAME) name_len = MAX_FILENAME - 1;
-    memory_copy(entry->name, name, name_len);
-    entry->name[name_len] = '\0';
+    entry->name = name_intern(name, dcache_hash_name(name));
+    if (!entry->name) {
+        entry->next = fs.free_list;
+        fs.free_list = entry->ino;
+        fs.live_entries--;
+        return 0;
+    }
     
     entry->type = type;
+    entry->flags = 0;
     entry->size = 0;
-    entry->data = 0;
+    entry->version = filesystem_next_version();
     entry->parent = 0;
     entry->children = 0;
     entry->next = 0;
+    entry->hash_next = 0;
+    entry->disk = 0;
+    entry->mount = mount;
     entry->used = 1;
+    vfs_type_of(entry)->inode_ops->init(entry);
+    
+    return entry;
+}
+
+// Create a new entry of the saved tree
+file_entry_t* filesystem_create_file(const char* name, int type) {
+    return filesystem_new_entry(name, type, 0);
+}
+
+// Locate the byte at offset in an extent-mapped file
+unsigned char* file_address(file_entry_t* file, unsigned int offset) {
+    unsigned int page = offset / PAGE_SIZE;
+    for (unsigned int i = 0; i < file->data.map.extent_count; i++) {
+        file_extent_t* extent = &file->data.map.extents[i];
+        if (page < extent->pages) {
+            return (unsigned char*)(extent->addr + page * PAGE_SIZE) + offset % PAGE_SIZE;
+        }
+        page -= extent->pages;
+    }
+    return 0;
+}
+
+// Pages shared between files by reflink copies, with the number of files
+// mapping each. A page not listed belongs to one file. Open addressing
+// keyed by page number; page_ref_slots is a power of two.
+typedef struct fs_page_ref {
+    unsigned int addr;
+    unsigned int refs;           // 0: empty slot
+} fs_page_ref_t;
+
+static fs_page_ref_t* page_refs;
+static unsigned int page_ref_slots;
+static unsigned int page_ref_count;
+unsigned int pages_unshared;             // Private copies made on write
+
+static unsigned int page_ref_home(unsigned int addr) {
+    return (addr / PAGE_SIZE) & (page_ref_slots - 1);
+}
+
+static fs_page_ref_t* page_ref_find(unsigned int addr) {
+    if (!page_ref_count) {
+        return 0;
+    }
+    for (unsigned int i = page_ref_home(addr); page_refs[i].refs; i = (i + 1) & (page_ref_slots - 1)) {
+        if (page_refs[i].addr == addr) {
+            return &page_refs[i];
+        }
+    }
+    return 0;
+}
+
+// One more file maps the page
+int page_ref_add(unsigned int addr) {
+    fs_page_ref_t* ref = page_ref_find(addr);
+    if (ref) {
+        ref->refs++;
+        return 0;
+    }
+    
+    if ((page_ref_count + 1) * 4 > page_ref_slots * 3) {
+        unsigned int slots = page_ref_slots ? page_ref_slots * 2 : 256;
+        fs_page_ref_t* table = memory_alloc(slots * sizeof(fs_page_ref_t));
+        if (!table) {
+            return -1;
+        }
+        memory_set(table, 0, slots * sizeof(fs_page_ref_t));
+        fs_page_ref_t* old = page_refs;
+        unsigned int old_slots = page_ref_slots;
+        page_refs = table;
+        page_ref_slots = slots;
+        for (unsigned int i = 0; i < old_slots; i++) {
+            if (old[i].refs) {
+                unsigned int j = page_ref_home(old[i].addr);
+                while (table[j].refs) j = (j + 1) & (slots - 1);
+                table[j] = old[i];
+            }
+        }
+        if (old) {
+            memory_free(old);
+        }
+    }
+    
+    unsigned int i = page_ref_home(addr);
+    while (page_refs[i].refs) i = (i + 1) & (page_ref_slots - 1);
+    page_refs[i].addr = addr;
+    page_refs[i].refs = 2;
+    page_ref_count++;
+    return 0;
+}
+
+// One file fewer maps the page; 1 if another still does
+static int page_ref_drop(unsigned int addr) {
+    fs_page_ref_t* ref = page_ref_find(addr);
+    if (!ref) {
+        return 0;
+    }
+    if (--ref->refs > 1) {
+        return 1;
+    }
+    
+    // Down to one owner: unlist it, moving later entries of the probe
+    // sequence back into the hole
+    unsigned int mask = page_ref_slots - 1;
+    unsigned int hole = ref - page_refs;
+    page_refs[hole].refs = 0;
+    page_ref_count--;
+    for (unsigned int i = (hole + 1) & mask; page_refs[i].refs; i = (i + 1) & mask) {
+        unsigned int home = page_ref_home(page_refs[i].addr);
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            page_refs[hole] = page_refs[i];
+            page_refs[i].refs = 0;
+            hole = i;
+        }
+    }
+    return 1;
+}
+
+// Give back count pages from addr, except those another file still maps
+void file_release_pages(unsigned int addr, unsigned int count) {
+    if (!page_ref_count) {
+        memory_free_pages((void*)addr, count);
+        return;
+    }
+    unsigned int run = 0;
+    for (unsigned int i = 0; i <= count; i++) {
+        if (i < count && !page_ref_drop(addr + i * PAGE_SIZE)) {
+            run++;
+            continue;
+        }
+        if (run) {
+            memory_free_pages((void*)(addr + (i - run) * PAGE_SIZE), run);
+        }
+        run = 0;
+    }
+}
+
+void file_free_extents(file_entry_t* file) {
+    for (unsigned int i = 0; i < file->data.map.extent_count; i++) {
+        file_extent_t* extent = &file->data.map.extents[i];
+        file_release_pages(extent->addr, extent->pages);
+    }
+    if (file->data.map.extents) {
+        memory_free(file->data.map.extents);
+    }
+    memory_set(&file->data, 0, sizeof(file->data));
+    file->flags &= ~FILE_FLAG_EXTENTS;
+}
+
+// Make room for extra more extents in the file's list
+static int file_extent_room(file_entry_t* file, unsigned int extra) {
+    unsigned int count = file->data.map.extent_count;
+    if (count + extra <= file->data.map.extent_capacity) {
+        return 0;
+    }
+    unsigned int capacity = count ? count * 2 : 4;
+    if (capacity < count + extra) {
+        capacity = count + extra;
+    }
+    file_extent_t* extents = memory_alloc(capacity * sizeof(file_extent_t));
+    if (!extents) {
+        return -1;
+    }
+    if (count) {
+        memory_copy(extents, file->data.map.extents, count * sizeof(file_extent_t));
+        memory_free(file->data.map.extents);
+    }
+    file->data.map.extents = extents;
+    file->data.map.extent_capacity = capacity;
+    return 0;
+}
+
+// Add a run of pages at the end of the file, merging it into the last
+// extent when it directly follows it
+int file_add_extent(file_entry_t* file, unsigned int addr, unsigned int pages) {
+    unsigned int count = file->data.map.extent_count;
+    file_extent_t* last = count ? &file->data.map.extents[count - 1] : 0;
+    
+    if (last && last->addr + last->pages * PAGE_SIZE == addr) {
+        last->pages += pages;
+    } else {
+        if (file_extent_room(file, 1) != 0) {
+            return -1;
+        }
+        file->data.map.extents[count].addr = addr;
+        file->data.map.extents[count].pages = pages;
+        file->data.map.extent_count++;
+    }
+    
+    file->data.map.pages += pages;
+    return 0;
+}
+
+// Back the first size bytes of an extent-mapped file with pages. The last
+// extent is grown in place while the pages after it are free.
+static int file_reserve(file_entry_t* file, unsigned int size) {
+    unsigned int needed = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    while (file->data.map.pages < needed) {
+        unsigned int count = needed - file->data.map.pages;
+        void* pages = 0;
+        
+        if (file->data.map.extent_count) {
+            file_extent_t* last = &file->data.map.extents[file->data.map.extent_count - 1];
+            pages = memory_alloc_pages_at((void*)(last->addr + last->pages * PAGE_SIZE), count);
+        }
+        if (!pages) {
+            pages = memory_alloc_pages(count);
+        }
+        if (!pages) {
+            // Fragmented pool: settle for one page at a time
+            count = 1;
+            pages = memory_alloc_pages(1);
+        }
+        if (!pages) {
+            return -1;
+        }
+        
+        if (file_add_extent(file, (unsigned int)pages, count) != 0) {
+            memory_free_pages(pages, count);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Copy count bytes into the file at offset (zeros when data is null). The
+// space must already be backed.
+void file_fill(file_entry_t* file, unsigned int offset, const unsigned char* data, unsigned int count) {
+    if (!(file->flags & FILE_FLAG_EXTENTS)) {
+        if (data) {
+            memory_copy(file->data.inline_data + offset, data, count);
+        } else {
+            memory_set(file->data.inline_data + offset, 0, count);
+        }
+        return;
+    }
+    
+    while (count > 0) {
+        unsigned int chunk = PAGE_SIZE - offset % PAGE_SIZE;
+        if (chunk > count) chunk = count;
+        unsigned char* dest = file_address(file, offset);
+        if (data) {
+            memory_copy(dest, data, chunk);
+            data += chunk;
+        } else {
+            memory_set(dest, 0, chunk);
+        }
+        offset += chunk;
+        count -= chunk;
+    }
+}
+
+// Map page number page of the file to the page at addr instead, splitting
+// the extent around it
+static int file_remap_page(file_entry_t* file, unsigned int page, unsigned int addr) {
+    unsigned int i = 0;
+    while (page >= file->data.map.extents[i].pages) {
+        page -= file->data.map.extents[i].pages;
+        i++;
+    }
+    file_extent_t* extent = &file->data.map.extents[i];
+    if (extent->pages == 1) {
+        extent->addr = addr;
+        return 0;
+    }
+    
+    // Head, the new page and tail; head or tail may be empty
+    unsigned int pieces = (page > 0) + 1 + (page + 1 < extent->pages);
+    if (file_extent_room(file, pieces - 1) != 0) {
+        return -1;
+    }
+    file_extent_t* extents = file->data.map.extents;
+    file_extent_t old = extents[i];
+    for (unsigned int j = file->data.map.extent_count; j-- > i + 1; ) {
+        extents[j + pieces - 1] = extents[j];
+    }
+    file->data.map.extent_count += pieces - 1;
+    
+    if (page > 0) {
+        extents[i].addr = old.addr;
+        extents[i].pages = page;
+        i++;
+    }
+    extents[i].addr = addr;
+    extents[i].pages = 1;
+    if (page + 1 < old.pages) {
+        extents[i + 1].addr = old.addr + (page + 1) * PAGE_SIZE;
+        extents[i + 1].pages = old.pages - page - 1;
+    }
+    return 0;
+}
+
+// Copy on write: give the file a private copy of every page in
+// [offset, end) it shares with a reflinked copy
+static int file_unshare(file_entry_t* file, unsigned int offset, unsigned int end) {
+    if (!page_ref_count || !(file->flags & FILE_FLAG_EXTENTS)) {
+        return 0;
+    }
+    for (unsigned int page = offset / PAGE_SIZE; page * PAGE_SIZE < end; page++) {
+        unsigned int addr = (unsigned int)file_address(file, page * PAGE_SIZE);
+        if (!addr || !page_ref_find(addr)) {
+            continue;
+        }
+        void* copy = memory_alloc_pages(1);
+        if (!copy) {
+            return -1;
+        }
+        memory_copy(copy, (void*)addr, PAGE_SIZE);
+        if (file_remap_page(file, page, (unsigned int)copy) != 0) {
+            memory_free_pages(copy, 1);
+            return -1;
+        }
+        page_ref_drop(addr);
+        pages_unshared++;
+    }
+    return 0;
+}
+
+// Make sure the file can hold size bytes, moving inline data out to
+// pages once it outgrows the entry
+int file_grow(file_entry_t* file, unsigned int size) {
+    if (file->flags & FILE_FLAG_EXTENTS) {
+        return file_reserve(file, size);
+    }
+    if (size <= FILE_INLINE_SIZE) {
+        return 0;
+    }
+    
+    char saved[FILE_INLINE_SIZE];
+    memory_copy(saved, file->data.inline_data, file->size);
+    memory_set(&file->data, 0, sizeof(file->data));
+    file->flags |= FILE_FLAG_EXTENTS;
+    
+    if (file_reserve(file, size) != 0) {
+        file_free_extents(file);
+        memory_copy(file->data.inline_data, saved, file->size);
+        return -1;
+    }
+    file_fill(file, 0, (const unsigned char*)saved, file->size);
+    return 0;
+}
+
+// Write count bytes at offset, growing the file as needed; a gap between
+// the old end and offset reads back as zeros. data may be null to write zeros.
+int file_store(file_entry_t* file, unsigned int offset, const void* data, unsigned int count) {
+    unsigned int end = offset + count;
+    if (end < offset || file_fault_in(file) != 0 || file_grow(file, end) != 0 ||
+        file_unshare(file, offset < file->size ? offset : file->size, end) != 0) {
+        return -1;
+    }
+    
+    file_mark_dirty(file, offset < file->size ? offset : file->size, end);
+    if (offset > file->size) {
+        file_fill(file, file->size, 0, offset - file->size);
+    }
+    file_fill(file, offset, (const unsigned char*)data, count);
+    if (end > file->size) {
+        file->size = end;
+    }
+    file->version = filesystem_next_version();
+    return count;
+}
+
+// Read up to count bytes from offset; returns the number of bytes read
+static int pinefs_read(file_entry_t* file, unsigned int offset, void* buffer, unsigned int count) {
+    if (offset >= file->size) {
+        return 0;
+    }
+    if (count > file->size - offset) {
+        count = file->size - offset;
+    }
+    if (file_load_range(file, offset, offset + count) < 0) {
+        return -1;
+    }
+    
+    if (!(file->flags & FILE_FLAG_EXTENTS)) {
+        memory_copy(buffer, file->data.inline_data + offset, count);
+        return count;
+    }
+    
+    unsigned char* dest = (unsigned char*)buffer;
+    unsigned int left = count;
+    while (left > 0) {
+        unsigned int chunk = PAGE_SIZE - offset % PAGE_SIZE;
+        if (chunk > left) chunk = left;
+        memory_copy(dest, file_address(file, offset), chunk);
+        dest += chunk;
+        offset += chunk;
+        left -= chunk;
+    }
+    return count;
+}
+
+// Set the file size, zero-filling when it grows and giving back whole
+// pages when it shrinks
+static int pinefs_truncate(file_entry_t* file, unsigned int size) {
+    if (size > file->size) {
+        return file_store(file, file->size, 0, size - file->size) < 0 ? -1 : 0;
+    }
+    if (size == 0 && (file->flags & FILE_FLAG_ON_DISK)) {
+        // Nothing of a file still on disk is needed
+        file_disk_t* disk = file_disk(file);
+        if (disk->loaded_blocks) {
+            memory_free(disk->loaded_blocks);
+            disk->loaded_blocks = 0;
+        }
+        file->flags &= ~FILE_FLAG_ON_DISK;
+    } else if (file_fault_in(file) != 0) {
+        return -1;
+    }
+    
+    if (file->flags & FILE_FLAG_EXTENTS) {
+        if (size <= FILE_INLINE_SIZE) {
+            // Small enough to move back into the entry
+            char saved[FILE_INLINE_SIZE];
+            pinefs_read(file, 0, saved, size);
+            file_free_extents(file);
+            memory_copy(file->data.inline_data, saved, size);
+        } else {
+            unsigned int keep = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+            while (file->data.map.pages > keep) {
+                file_extent_t* last = &file->data.map.extents[file->data.map.extent_count - 1];
+                unsigned int drop = file->data.map.pages - keep;
+                if (drop > last->pages) drop = last->pages;
+                last->pages -= drop;
+                file_release_pages(last->addr + last->pages * PAGE_SIZE, drop);
+                file->data.map.pages -= drop;
+                if (last->pages == 0) {
+                    file->data.map.extent_count--;
+                }
+            }
+        }
+    }
+    
+    file->size = size;
+    file->version = filesystem_next_version();
+    // A change like any write, so a file that shares its runs is moved
+    // off them instead of having them trimmed under the other sharers
+    file_mark_dirty(file, size, size);
+    return 0;
+}
+
+static void pinefs_init(file_entry_t* entry) {
+    save_mark_record(entry->ino);
+}
+
+static void pinefs_release(file_entry_t* entry) {
+    if (entry->flags & FILE_FLAG_EXTENTS) {
+        file_free_extents(entry);
+    }
+    file_forget_disk(entry);
+}
+
+static unsigned int pinefs_pages(file_entry_t* entry) {
+    return (entry->flags & FILE_FLAG_EXTENTS) ? entry->data.map.pages : 0;
+}
+
+static const vfs_inode_ops_t pinefs_inode_ops = {
+    pinefs_init,
+    pinefs_release,
+    pinefs_pages,
+};
+
+static const vfs_file_ops_t pinefs_file_ops = {
+    pinefs_read,
+    file_store,
+    pinefs_truncate,
+};
+
+// The saved tree: files are read in from the device as they are used and
+// every change is tracked for the next save
+const vfs_type_t pinefs_type = {
+    "pinefs",
+    1,
+    &pinefs_inode_ops,
+    &pinefs_file_ops,
+};
+
+// Read up to count bytes from offset; returns the number of bytes read
+int filesystem_read_at(file_entry_t* file, unsigned int offset, void* buffer, unsigned int count) {
+    if (!file || file->type != FILE_TYPE_FILE) {
+        return -1;
+    }
+    return vfs_type_of(file)->file_ops->read(file, offset, buffer, count);
+}
+
+// Write count bytes at offset; returns count, or -1 when out of space
+int filesystem_write_at(file_entry_t* file, unsigned int offset, const void* data, unsigned int count) {
+    if (!file || file->type != FILE_TYPE_FILE) {
+        return -1;
+    }
+    if (count == 0) {
+        return 0;
+    }
+    return vfs_type_of(file)->file_ops->write(file, offset, data, count);
+}
+
+// Set the file size; the end moves over zeros when it grows
+int filesystem_truncate(file_entry_t* file, unsigned int size) {
+    if (!file || file->type != FILE_TYPE_FILE) {
+        return -1;
+    }
+    return vfs_type_of(file)->file_ops->truncate(file, size);
+}
+
+// Resolve one path component inside dir, crossing into whatever is
+// mounted on the directory it names
+static file_entry_t* filesystem_step(file_entry_t* dir, const char* name) {
+    if (strcmp(name, ".") == 0) {
+        return dir;
+    }
+    if (strcmp(name, "..") == 0) {
+        return dir->parent ? filesystem_entry(dir->parent) : fs.root;
+    }
+    return vfs_follow(dcache_lookup(dir, name));
+}
+
+// Walk every component of path but the last and return the directory that
+// would contain it. The last component is copied to leaf, or left empty when
+// the path names a directory itself ("/", "a/").
+static file_entry_t* filesystem_resolve_parent(const char* path, char* leaf) {
+    file_entry_t* dir = fs.current_dir;
+    if (path[0] == '/') {
+        dir = fs.root;
+        path++; // Skip leading slash
+    }
+    
+    int len = strlen(path);
+    if (len >= MAX_PATH) {
+        return 0;
+    }
+    char path_copy[MAX_PATH];
+    memory_copy(path_copy, path, len + 1);
+    
+    leaf[0] = '\0';
+    char* save;
+    char* component = strtok_r(path_copy, "/", &save);
+    while (component) {
+        char* next = strtok_r(0, "/", &save);
+        if (!next) {
+            int leaf_len = strlen(component);
+            if (leaf_len >= MAX_FILENAME) leaf_len = MAX_FILENAME - 1;
+            memory_copy(leaf, component, leaf_len);
+            leaf[leaf_len] = '\0';
+            break;
+        }
+    
+        dir = filesystem_step(dir, component);
+        if (!dir || dir->type != FILE_TYPE_DIR) {
+            return 0;
+        }
+        component = next;
+    }
     
-    return entry;
+    return dir;
 }
 
 // Find a file by path
 file_entry_t* filesystem_find_file(const char* path) {
-    if (strcmp(path, "/") == 0) {
-        return fs.root;
-    }
-    
-    if (strcmp(path, ".") == 0) {
-        return fs.current_dir;
+    char leaf[MAX_FILENAME];
+    file_entry_t* dir = filesystem_resolve_parent(path, leaf);
+    if (!dir || !leaf[0]) {
+        return dir;
     }
-    
-    if (strcmp(path, "..") == 0) {
-        return fs.current_dir->parent ? fs.current_dir->parent : fs.root;
+    return filesystem_step(dir, leaf);
+}
+
+// The directory gained or lost an entry, so the next save writes its
+// index again
+static void dir_index_changed(file_entry_t* dir) {
+    if (vfs_persistent(dir)) {
+        dir->flags |= FILE_FLAG_DIRTY;
     }
-    
-    // Handle relative paths
-    file_entry_t* search_dir = fs.current_dir;
-    if (path[0] == '/') {
-        search_dir = fs.root;
-        path++; // Skip leading slash
+    save_mark_record(dir->ino);
+}
+
+// Create a new entry named leaf inside parent and link it in
+static file_entry_t* filesystem_add_entry(file_entry_t* parent, const char* leaf, int type) {
+    file_entry_t* entry = filesystem_new_entry(leaf, type, parent->mount);
+    if (!entry) {
+        return 0;
     }
     
-    // Split path into components
-    char path_copy[MAX_PATH];
-    memory_copy(path_copy, path, strlen(path) + 1);
+    // Add to parent's children
+    entry->parent = parent->ino;
+    entry->next = parent->children;
+    parent->children = entry->ino;
+    dir_index_changed(parent);
+    dcache_insert(entry);
     
-    char* component = strtok(path_copy, "/");
-    while (component) {
-        file_entry_t* found = 0;
-        file_entry_t* child = search_dir->children;
-        
-        while (child) {
-            if (strcmp(child->name, component) == 0) {
-                found = child;
-                break;
-            }
-            child = child->next;
+    return entry;
+}
+
+// Unlink an entry from its parent and free it
+static void filesystem_remove_entry(file_entry_t* entry) {
+    file_entry_t* parent = filesystem_entry(entry->parent);
+    dir_index_changed(parent);
+    if (parent->children == entry->ino) {
+        parent->children = entry->next;
+    } else {
+        file_entry_t* sibling = filesystem_entry(parent->children);
+        while (sibling && sibling->next != entry->ino) {
+            sibling = filesystem_entry(sibling->next);
         }
-        
-        if (!found) {
-            return 0; // Not found
+        if (sibling) {
+            sibling->next = entry->next;
+            save_mark_record(sibling->ino);
         }
-        
-        search_dir = found;
-        component = strtok(0, "/");
     }
-    
-    return search_dir;
+
+    dcache_remove(entry);
+    inode_free(entry);
+}
+
+// Create a file or directory by path without printing anything; fails if
+// the parent is missing or the name is taken
+file_entry_t* filesystem_create(const char* path, int type) {
+    char leaf[MAX_FILENAME];
+    file_entry_t* parent = filesystem_resolve_parent(path, leaf);
+    if (!parent || !leaf[0] || filesystem_step(parent, leaf)) {
+        return 0;
+    }
+    return filesystem_add_entry(parent, leaf, type);
 }
 
 // Create a directory
 int filesystem_mkdir(const char* name) {
-    file_entry_t* parent = fs.current_dir;
-    
-    // Check if it's an absolute path
-    if (name[0] == '/') {
-        parent = fs.root;
-        name++; // Skip leading slash
+    char leaf[MAX_FILENAME];
+    file_entry_t* parent = filesystem_resolve_parent(name, leaf);
+    if (!parent || !leaf[0]) {
+        vga_puts("Error: Cannot create directory\n");
+        return -1;
     }
     
     // Check if directory already exists
-    file_entry_t* existing = filesystem_find_file(name);
-    if (existing) {
+    if (filesystem_step(parent, leaf)) {
         vga_puts("Error: Directory already exists\n");
         return -1;
     }
     
     // Create new directory
-    file_entry_t* new_dir = filesystem_create_file(name, FILE_TYPE_DIR);
-    if (!new_dir) {
+    if (!filesystem_add_entry(parent, leaf, FILE_TYPE_DIR)) {
         vga_puts("Error: Cannot create directory\n");
         return -1;
     }
     
-    // Add to parent's children
-    new_dir->parent = parent;
-    new_dir->next = parent->children;
-    parent->children = new_dir;
-    
     vga_puts("Directory created: ");
     vga_puts(name);
     vga_puts("\n");
     return 0;
 }
 
-// Create an empty file
-int filesystem_touch(const char* name) {
-    file_entry_t* parent = fs.current_dir;
-    
-    // Check if it's an absolute path
-    if (name[0] == '/') {
-        parent = fs.root;
-        name++; // Skip leading slash
-    }
-    
-    // Check if file already exists
-    file_entry_t* existing = filesystem_find_file(name);
-    if (existing) {
-        vga_puts("Error: File already exists\n");
-        return -1;
+// Create an empty file in parent (leaf known to be absent)
+static file_entry_t* filesystem_touch_at(file_entry_t* parent, const char* leaf, const char* name) {
+    file_entry_t* new_file = filesystem_add_entry(parent, leaf, FILE_TYPE_FILE);
+    if (!new_file) {
+        vga_puts("Error: Cannot create file\n");
+        return 0;
     }
     
-    // Create new file
-    file_entry_t* new_file = filesystem_create_file(name, FILE_TYPE_FILE);
-    if (!new_file) {
+    vga_puts("File created: ");
+    vga_puts(name);
+    vga_puts("\n");
+    return new_file;
+}
+
+// Create an empty file
+int filesystem_touch(const char* name) {
+    char leaf[MAX_FILENAME];
+    file_entry_t* parent = filesystem_resolve_parent(name, leaf);
+    if (!parent || !leaf[0]) {
         vga_puts("Error: Cannot create file\n");
         return -1;
     }
     
-    // Allocate data buffer
-    new_file->data = memory_alloc(MAX_FILE_SIZE);
-    if (!new_file->data) {
-        vga_puts("Error: Out of memory\n");
+    // Check if file already exists
+    if (filesystem_step(parent, leaf)) {
+        vga_puts("Error: File already exists\n");
         return -1;
     }
     
-    // Add to parent's children
-    new_file->parent = parent;
-    new_file->next = parent->children;
-    parent->children = new_file;
-    
-    vga_puts("File created: ");
-    vga_puts(name);
-    vga_puts("\n");
-    return 0;
+    return filesystem_touch_at(parent, leaf, name) ? 0 : -1;
 }
 
 // Write content to a file
 int filesystem_write_file(const char* name, const char* content) {
-    file_entry_t* file = filesystem_find_file(name);
+    return filesystem_write_file_data(name, content, strlen(content));
+}
+
+// Find a file for writing, creating it if it doesn't exist
+file_entry_t* filesystem_open_for_write(const char* name) {
+    char leaf[MAX_FILENAME];
+    file_entry_t* parent = filesystem_resolve_parent(name, leaf);
+    file_entry_t* file = parent;
+    
+    if (parent && leaf[0]) {
+        file = filesystem_step(parent, leaf);
+        if (!file) {
+            // Create file if it doesn't exist
+            return filesystem_touch_at(parent, leaf, name);
+        }
+    }
     
     if (!file) {
-        // Create file if it doesn't exist
-        if (filesystem_touch(name) != 0) {
-            return -1;
-        }
-        file = filesystem_find_file(name);
+        vga_puts("Error: Directory not found\n");
+        return 0;
     }
     
     if (file->type != FILE_TYPE_FILE) {
         vga_puts("Error: Not a file\n");
+        return 0;
+    }
+    
+    return file;
+}
+
+// Write a buffer of known length (binaries may contain NUL bytes)
+int filesystem_write_file_data(const char* name, const void* data, int size) {
+    file_entry_t* file = filesystem_open_for_write(name);
+    if (!file) {
         return -1;
     }
     
-    int content_len = strlen(content);
-    if (content_len >= MAX_FILE_SIZE) {
-        content_len = MAX_FILE_SIZE - 1;
+    // Overwrite in place, then drop whatever is left of the old contents
+    if (filesystem_write_at(file, 0, data, size) < 0 || filesystem_truncate(file, size) != 0) {
+        vga_puts("Error: Out of space\n");
+        return -1;
+    }
+    
+    return 0;
+}
+
+// Append a buffer to the end of a file
+int filesystem_append(const char* name, const void* data, int size) {
+    file_entry_t* file = filesystem_open_for_write(name);
+    if (!file) {
+        return -1;
     }
     
-    memory_copy(file->data, content, content_len);
-    file->data[content_len] = '\0';
-    file->size = content_len;
+    if (size > 0 && filesystem_write_at(file, file->size, data, size) < 0) {
+        vga_puts("Error: Out of space\n");
+        return -1;
+    }
     
     return 0;
 }
 
-// Read content from a file
+// Read a whole file into a NUL-terminated copy; the caller frees it
 char* filesystem_read_file(const char* name) {
     file_entry_t* file = filesystem_find_file(name);
     
@@ -221,7 +1181,14 @@ char* filesystem_read_file(const char* name) {
         return 0;
     }
     
-    return file->data;
+    char* content = memory_alloc(file->size + 1);
+    if (!content) {
+        vga_puts("Error: Out of memory\n");
+        return 0;
+    }
+    filesystem_read_at(file, 0, content, file->size);
+    content[file->size] = '\0';
+    return content;
 }
 
 // List directory contents
@@ -243,10 +1210,10 @@ int filesystem_ls(const char* path) {
     }
     
     vga_puts("Contents of ");
-    vga_puts(dir->name);
+    vga_puts(filesystem_entry_name(dir));
     vga_puts(":\n");
     
-    file_entry_t* child = dir->children;
+    file_entry_t* child = filesystem_entry(dir->children);
     if (!child) {
         vga_puts("  (empty)\n");
         return 0;
@@ -259,7 +1226,7 @@ int filesystem_ls(const char* path) {
         } else {
             vga_puts("      ");
         }
-        vga_puts(child->name);
+        vga_puts(filesystem_entry_name(child));
         if (child->type == FILE_TYPE_FILE) {
             vga_puts(" (");
             // Convert size to string
@@ -276,7 +1243,7 @@ int filesystem_ls(const char* path) {
             vga_puts(" bytes)");
         }
         vga_puts("\n");
-        child = child->next;
+        child = filesystem_entry(child->next);
     }
     
     return 0;
@@ -305,25 +1272,28 @@ int filesystem_cd(const char* path) {
     return 0;
 }
 
-// Print working directory
-int filesystem_pwd(void) {
-    char path[MAX_PATH] = "";
-    file_entry_t* current = fs.current_dir;
-    
-    // Build path from current directory to root
+// Build the absolute path of an entry from its parents
+static void filesystem_entry_path(file_entry_t* current, char* path) {
+    path[0] = '\0';
     while (current && current != fs.root) {
+        const char* name = filesystem_entry_name(current);
         char temp[MAX_PATH];
         memory_copy(temp, "/", 1);
-        memory_copy(temp + 1, current->name, strlen(current->name));
-        memory_copy(temp + 1 + strlen(current->name), path, strlen(path));
+        memory_copy(temp + 1, name, strlen(name));
+        memory_copy(temp + 1 + strlen(name), path, strlen(path) + 1);
         memory_copy(path, temp, strlen(temp) + 1);
-        current = current->parent;
+        current = filesystem_entry(current->parent);
     }
     
     if (strlen(path) == 0) {
         memory_copy(path, "/", 2);
     }
-    
+}
+
+// Print working directory
+int filesystem_pwd(void) {
+    char path[MAX_PATH];
+    filesystem_entry_path(fs.current_dir, path);
     vga_puts(path);
     vga_puts("\n");
     return 0;
@@ -343,27 +1313,8 @@ int filesystem_rm(const char* name) {
         return -1;
     }
     
-    // Remove from parent's children list
-    file_entry_t* parent = file->parent;
-    if (parent->children == file) {
-        parent->children = file->next;
-    } else {
-        file_entry_t* sibling = parent->children;
-        while (sibling && sibling->next != file) {
-            sibling = sibling->next;
-        }
-        if (sibling) {
-            sibling->next = file->next;
-        }
-    }
-    
-    // Free file data
-    if (file->data) {
-        memory_free(file->data);
-    }
-    
-    // Mark as unused
-    file->used = 0;
+    file_forget(file->ino);
+    filesystem_remove_entry(file);
     
     vga_puts("File removed: ");
     vga_puts(name);
@@ -390,27 +1341,23 @@ int filesystem_rmdir(const char* name) {
         return -1;
     }
     
+    if ((dir->flags & FILE_FLAG_MOUNTED) || vfs_is_mount_root(dir)) {
+        vga_puts("Error: Directory is a mount point\n");
+        return -1;
+    }
+    
     if (dir->children) {
         vga_puts("Error: Directory not empty\n");
         return -1;
     }
     
-    // Remove from parent's children list
-    file_entry_t* parent = dir->parent;
-    if (parent->children == dir) {
-        parent->children = dir->next;
-    } else {
-        file_entry_t* sibling = parent->children;
-        while (sibling && sibling->next != dir) {
-            sibling = sibling->next;
-        }
-        if (sibling) {
-            sibling->next = dir->next;
-        }
+    // Its entry is about to be reused
+    if (dir == fs.current_dir) {
+        vga_puts("Error: Directory is the current directory\n");
+        return -1;
     }
     
-    // Mark as unused
-    dir->used = 0;
+    filesystem_remove_entry(dir);
     
     vga_puts("Directory removed: ");
     vga_puts(name);
@@ -418,409 +1365,265 @@ int filesystem_rmdir(const char* name) {
     return 0;
 }
 
-// Show directory tree
-void filesystem_tree(const char* path, int depth) {
-    file_entry_t* dir = fs.current_dir;
-    
-    if (path && strlen(path) > 0) {
-        dir = filesystem_find_file(path);
-    }
-    
-    if (!dir || dir->type != FILE_TYPE_DIR) {
-        return;
-    }
-    
-    // Print indentation
-    for (int i = 0; i < depth; i++) {
-        vga_puts("  ");
-    }
-    
-    vga_puts(dir->name);
-    vga_puts("/\n");
-    
-    // Print children
-    file_entry_t* child = dir->children;
-    while (child) {
-        for (int i = 0; i < depth + 1; i++) {
-            vga_puts("  ");
-        }
-        
-        if (child->type == FILE_TYPE_DIR) {
-            vga_puts(child->name);
-            vga_puts("/\n");
-            filesystem_tree(child->name, depth + 2);
-        } else {
-            vga_puts(child->name);
-            vga_puts("\n");
-        }
-        
-        child = child->next;
-    }
-} 
-
-// Copy a file from src to dest
-int filesystem_cp(const char* src, const char* dest) {
-    file_entry_t* src_file = filesystem_find_file(src);
-    if (!src_file) {
-        vga_puts("Error: Source file not found\n");
-        return -1;
-    }
-    if (src_file->type != FILE_TYPE_FILE) {
-        vga_puts("Error: Source is not a file\n");
+// Give the mount in slot index a fresh, empty root over dir
+static int filesystem_attach(unsigned int index, file_entry_t* dir) {
+    vfs_mount_t* mount = vfs_mount_get(index);
+    file_entry_t* root = filesystem_new_entry(filesystem_entry_name(dir), FILE_TYPE_DIR, index);
+    if (!root) {
         return -1;
     }
-    // Read source data
-    char* src_data = src_file->data;
-    int src_size = src_file->size;
-    if (!src_data) {
-        vga_puts("Error: Source file is empty\n");
+    root->parent = dir->parent;
+    mount->covered = dir->ino;
+    mount->root = root->ino;
+    dir->flags |= FILE_FLAG_MOUNTED;
+    return 0;
+}
+
+// Mount a new, empty filesystem of a RAM-only type on a directory. What
+// the directory held stays hidden, and saved, until the mount goes away.
+int filesystem_mount(const char* path, const char* type_name) {
+    const vfs_type_t* type = vfs_find_type(type_name);
+    if (!type || type->persistent) {
+        vga_puts("Error: Cannot mount that filesystem type\n");
         return -1;
     }
-    // If dest exists and is a directory, error
-    file_entry_t* dest_file = filesystem_find_file(dest);
-    if (dest_file && dest_file->type == FILE_TYPE_DIR) {
-        vga_puts("Error: Destination is a directory\n");
+    
+    file_entry_t* dir = filesystem_find_file(path);
+    if (!dir || dir->type != FILE_TYPE_DIR) {
+        vga_puts("Error: Directory not found\n");
         return -1;
     }
-    // Write to destination (creates file if needed)
-    int result = filesystem_write_file(dest, src_data);
-    if (result == 0) {
-        vga_puts("File copied: ");
-        vga_puts(src);
-        vga_puts(" -> ");
-        vga_puts(dest);
-        vga_puts("\n");
-    }
-    return result;
-} 
-
-// Simple filesystem format for storage
-// Sector 0: Filesystem header
-// Sector 1+: File entries and data
-
-typedef struct fs_header {
-    char magic[8];           // "PINEFS\0\0"
-    uint32_t version;        // Filesystem version
-    uint32_t total_entries;  // Number of file entries
-    uint32_t data_start;     // First sector for file data
-} fs_header_t;
-
-// Save filesystem to storage device
-int filesystem_save_to_storage(storage_device_t* device) {
-    if (!device) {
-        vga_puts("Error: No storage device specified\n");
+    if (dir == fs.root || vfs_is_mount_root(dir)) {
+        vga_puts("Error: Directory is a mount point\n");
         return -1;
     }
     
-    vga_puts("Saving filesystem to ");
-    vga_puts(device->name);
-    vga_puts("...\n");
-    
-    // Create filesystem header
-    fs_header_t header;
-    memory_copy(header.magic, "PINEFS\0\0", 8);
-    header.version = 1;
-    header.total_entries = fs.next_entry;
-    header.data_start = 2; // Start file data at sector 2
-    
-    // Write header to sector 0
-    if (device->write_sector(device, 0, &header) != 0) {
-        vga_puts("Error: Failed to write filesystem header\n");
+    char absolute[MAX_PATH];
+    filesystem_entry_path(dir, absolute);
+    int index = vfs_add_mount(type, absolute, dir->ino);
+    if (index < 0) {
+        vga_puts("Error: Mount table full\n");
         return -1;
     }
-    
-    // Write file entries to sector 1
-    if (device->write_sector(device, 1, fs.entries) != 0) {
-        vga_puts("Error: Failed to write file entries\n");
+    if (filesystem_attach(index, dir) != 0) {
+        vfs_drop_mount(index);
+        vga_puts("Error: Cannot create mount root\n");
         return -1;
     }
     
-    // Write file data starting from sector 2
-    uint32_t current_sector = header.data_start;
-    for (int i = 0; i < fs.next_entry; i++) {
-        if (fs.entries[i].used && fs.entries[i].type == FILE_TYPE_FILE && fs.entries[i].data) {
-            // Calculate sectors needed for this file
-            uint32_t sectors_needed = (fs.entries[i].size + device->sector_size - 1) / device->sector_size;
-            
-            // Write file data
-            for (uint32_t s = 0; s < sectors_needed; s++) {
-                uint8_t sector_data[512] = {0}; // Clear sector
-                uint32_t bytes_to_copy = device->sector_size;
-                uint32_t offset = s * device->sector_size;
-                
-                if (offset + bytes_to_copy > fs.entries[i].size) {
-                    bytes_to_copy = fs.entries[i].size - offset;
-                }
-                
-                if (bytes_to_copy > 0) {
-                    memory_copy(sector_data, fs.entries[i].data + offset, bytes_to_copy);
-                }
-                
-                if (device->write_sector(device, current_sector + s, sector_data) != 0) {
-                    vga_puts("Error: Failed to write file data\n");
-                    return -1;
-                }
-            }
-            
-            current_sector += sectors_needed;
-        }
-    }
-    
-    vga_puts("Filesystem saved successfully\n");
+    vga_puts("Mounted ");
+    vga_puts(type->name);
+    vga_puts(" on ");
+    vga_puts(absolute);
+    vga_puts("\n");
     return 0;
 }
 
-// Load filesystem from storage device
-int filesystem_load_from_storage(storage_device_t* device) {
-    if (!device) {
-        vga_puts("Error: No storage device specified\n");
-        return -1;
-    }
-    
-    vga_puts("Loading filesystem from ");
-    vga_puts(device->name);
-    vga_puts("...\n");
-    
-    // Read filesystem header with error checking
-    fs_header_t header;
-    memory_set(&header, 0, sizeof(header)); // Initialize header
-    
-    if (device->read_sector(device, 0, &header) != 0) {
-        vga_puts("Error: Failed to read filesystem header\n");
-        return -1;
+// Free a directory of a RAM-only mount and everything below it
+static void filesystem_clear_dir(file_entry_t* dir) {
+    while (dir->children) {
+        file_entry_t* child = filesystem_entry(dir->children);
+        if (child->type == FILE_TYPE_DIR) {
+            filesystem_clear_dir(child);
+        } else {
+            file_forget(child->ino);
+        }
+        filesystem_remove_entry(child);
     }
-    
-    // Verify magic number
-    if (memory_compare(header.magic, "PINEFS\0\0", 8) != 0) {
-        vga_puts("Error: Invalid filesystem format\n");
+}
+
+// Take away the filesystem mounted on a directory, and all of its files,
+// uncovering what the directory held before
+int filesystem_umount(const char* path) {
+    file_entry_t* root = filesystem_find_file(path);
+    if (!root || !vfs_is_mount_root(root)) {
+        vga_puts("Error: Not a mount point\n");
         return -1;
     }
     
-    vga_puts("Valid filesystem found, loading...\n");
-    
-    // Validate entry count to prevent buffer overflow
-    if (header.total_entries > MAX_FILES + MAX_DIRS || header.total_entries == 0) {
-        vga_puts("Error: Invalid entry count in saved filesystem\n");
+    unsigned int index = root->mount;
+    vfs_mount_t* mount = vfs_mount_get(index);
+    if (fs.current_dir->mount == index) {
+        vga_puts("Error: Mount is busy (current directory is inside it)\n");
         return -1;
     }
-    
-    // Clear existing filesystem entries first
-    memory_set(fs.entries, 0, sizeof(fs.entries));
-    
-    // Read saved entries with bounds checking
-    if (device->read_sector(device, 1, fs.entries) != 0) {
-        vga_puts("Error: Failed to read file entries\n");
-        return -1;
+    for (unsigned int i = 1; i < VFS_MAX_MOUNTS; i++) {
+        vfs_mount_t* other = vfs_mount_get(i);
+        if (other && i != index && filesystem_entry(other->covered)->mount == index) {
+            vga_puts("Error: Mount is busy (another filesystem is mounted inside it)\n");
+            return -1;
+        }
     }
     
-    // Set the entry count
-    fs.next_entry = header.total_entries;
+    filesystem_clear_dir(root);
+    inode_free(root);
+    filesystem_entry(mount->covered)->flags &= ~FILE_FLAG_MOUNTED;
     
-    // Clear all pointers and validate entries
-    for (int i = 0; i < fs.next_entry; i++) {
-        fs.entries[i].parent = 0;
-        fs.entries[i].children = 0;
-        fs.entries[i].next = 0;
-        fs.entries[i].data = 0;
-        
-        // Validate entry data to prevent crashes
-        if (fs.entries[i].used) {
-            // Ensure name is null-terminated
-            fs.entries[i].name[MAX_FILENAME - 1] = '\0';
-            
-            // Validate file size
-            if (fs.entries[i].size > MAX_FILE_SIZE) {
-                fs.entries[i].size = MAX_FILE_SIZE;
-            }
-            
-            // Validate file type
-            if (fs.entries[i].type != FILE_TYPE_FILE && fs.entries[i].type != FILE_TYPE_DIR) {
-                fs.entries[i].used = 0; // Mark as unused if invalid
-            }
+    vga_puts("Unmounted ");
+    vga_puts(mount->path);
+    vga_puts("\n");
+    vfs_drop_mount(index);
+    return 0;
+}
+
+// After a load has replaced the tree, mount every RAM-only filesystem
+// again, empty, on its directory; those whose directory is gone are dropped
+void filesystem_remount(void) {
+    for (unsigned int i = 1; i < VFS_MAX_MOUNTS; i++) {
+        vfs_mount_t* mount = vfs_mount_get(i);
+        if (mount) {
+            mount->covered = 0;
+            mount->root = 0;
         }
     }
-    
-    // Find root directory
-    fs.root = 0;
-    for (int i = 0; i < fs.next_entry; i++) {
-        if (fs.entries[i].used && fs.entries[i].type == FILE_TYPE_DIR && 
-            strcmp(fs.entries[i].name, "/") == 0) {
-            fs.root = &fs.entries[i];
-            break;
+    for (unsigned int i = 1; i < VFS_MAX_MOUNTS; i++) {
+        vfs_mount_t* mount = vfs_mount_get(i);
+        if (!mount) {
+            continue;
         }
-    }
-    
-    if (!fs.root) {
-        vga_puts("Warning: No root directory found, reinitializing...\n");
-        filesystem_init();
-        return 0;
-    }
-    
-    fs.current_dir = fs.root;
-    
-    // Rebuild directory structure safely - first pass: clear all pointers
-    for (int i = 0; i < fs.next_entry; i++) {
-        if (fs.entries[i].used) {
-            fs.entries[i].parent = 0;
-            fs.entries[i].children = 0;
-            fs.entries[i].next = 0;
-        }
-    }
-    
-    // Second pass: rebuild structure by putting all entries as children of root
-    // This is a simplified approach that flattens the directory structure
-    file_entry_t* last_child = 0;
-    for (int i = 0; i < fs.next_entry; i++) {
-        if (fs.entries[i].used && &fs.entries[i] != fs.root) {
-            fs.entries[i].parent = fs.root;
-            
-            if (!fs.root->children) {
-                fs.root->children = &fs.entries[i];
-                last_child = &fs.entries[i];
-            } else if (last_child) {
-                last_child->next = &fs.entries[i];
-                last_child = &fs.entries[i];
-            }
+        file_entry_t* dir = filesystem_find_file(mount->path);
+        if (!dir || dir->type != FILE_TYPE_DIR || dir == fs.root || vfs_is_mount_root(dir) ||
+            filesystem_attach(i, dir) != 0) {
+            vfs_drop_mount(i);
         }
     }
-    
-    // Load file data with proper error handling
-    uint32_t current_sector = header.data_start;
-    for (int i = 0; i < fs.next_entry; i++) {
-        if (fs.entries[i].used && fs.entries[i].type == FILE_TYPE_FILE && fs.entries[i].size > 0) {
-            // Validate file size before allocation
-            if (fs.entries[i].size > MAX_FILE_SIZE) {
-                vga_puts("Warning: File too large, truncating\n");
-                fs.entries[i].size = MAX_FILE_SIZE;
-            }
-            
-            // Allocate memory for file data with null check
-            fs.entries[i].data = memory_alloc(MAX_FILE_SIZE);
-            if (!fs.entries[i].data) {
-                vga_puts("Warning: Failed to allocate memory for file: ");
-                vga_puts(fs.entries[i].name);
-                vga_puts("\n");
-                fs.entries[i].size = 0; // Mark as empty if can't allocate
-                continue;
-            }
-            
-            // Initialize allocated memory to prevent garbage data
-            memory_set(fs.entries[i].data, 0, MAX_FILE_SIZE);
-            
-            // Calculate sectors needed with strict bounds checking
-            uint32_t sectors_needed = (fs.entries[i].size + device->sector_size - 1) / device->sector_size;
-            if (sectors_needed > 8) { // Limit to 8 sectors (4KB max)
-                vga_puts("Warning: File too large, limiting to 8 sectors\n");
-                sectors_needed = 8;
-                fs.entries[i].size = 8 * device->sector_size;
-                if (fs.entries[i].size > MAX_FILE_SIZE) {
-                    fs.entries[i].size = MAX_FILE_SIZE;
-                }
-            }
-            
-            // Validate current_sector to prevent reading beyond device
-            if (current_sector + sectors_needed > device->total_sectors) {
-                vga_puts("Warning: File data beyond device capacity, skipping\n");
-                memory_free(fs.entries[i].data);
-                fs.entries[i].data = 0;
-                fs.entries[i].size = 0;
-                continue;
-            }
-            
-            // Read file data with comprehensive error checking
-            int read_success = 1;
-            for (uint32_t s = 0; s < sectors_needed && read_success; s++) {
-                uint8_t sector_data[512];
-                memory_set(sector_data, 0, sizeof(sector_data)); // Initialize sector buffer
-                
-                if (device->read_sector(device, current_sector + s, sector_data) == 0) {
-                    uint32_t bytes_to_copy = device->sector_size;
-                    uint32_t offset = s * device->sector_size;
-                    
-                    // Multiple bounds checks to prevent buffer overflow
-                    if (offset >= MAX_FILE_SIZE) {
-                        vga_puts("Warning: Offset exceeds file buffer\n");
-                        break;
-                    }
-                    if (offset >= fs.entries[i].size) {
-                        break; // Don't read beyond file size
-                    }
-                    if (offset + bytes_to_copy > fs.entries[i].size) {
-                        bytes_to_copy = fs.entries[i].size - offset;
-                    }
-                    if (offset + bytes_to_copy > MAX_FILE_SIZE) {
-                        bytes_to_copy = MAX_FILE_SIZE - offset;
-                    }
-                    
-                    if (bytes_to_copy > 0 && fs.entries[i].data) {
-                        memory_copy(fs.entries[i].data + offset, sector_data, bytes_to_copy);
-                    }
-                } else {
-                    vga_puts("Warning: Failed to read sector ");
-                    // Simple sector number display
-                    uint32_t sector_num = current_sector + s;
-                    char sector_str[16];
-                    int j = 0;
-                    do {
-                        sector_str[j++] = '0' + (sector_num % 10);
-                        sector_num /= 10;
-                    } while (sector_num > 0);
-                    for (int k = j - 1; k >= 0; k--) {
-                        vga_putchar(sector_str[k]);
-                    }
-                    vga_puts("\n");
-                    read_success = 0;
-                }
-            }
-            
-            // If read failed, clean up and mark file as empty
-            if (!read_success) {
-                if (fs.entries[i].data) {
-                    memory_free(fs.entries[i].data);
-                    fs.entries[i].data = 0;
-                }
-                fs.entries[i].size = 0;
+}
+
+// Print a directory and everything below it
+static void filesystem_tree_entry(file_entry_t* dir, int depth) {
+    // Print indentation
+    for (int i = 0; i < depth; i++) {
+        vga_puts("  ");
+    }
+
+    vga_puts(filesystem_entry_name(dir));
+    vga_puts("/\n");
+
+    // Print children
+    file_entry_t* child = filesystem_entry(dir->children);
+    while (child) {
+        if (child->type == FILE_TYPE_DIR) {
+            filesystem_tree_entry(vfs_follow(child), depth + 1);
+        } else {
+            for (int i = 0; i < depth + 1; i++) {
+                vga_puts("  ");
             }
-            
-            current_sector += sectors_needed;
+            vga_puts(filesystem_entry_name(child));
+            vga_puts("\n");
         }
+
+        child = filesystem_entry(child->next);
     }
-    
-    vga_puts("Filesystem loaded successfully\n");
-    return 0;
 }
 
-// Format storage device with empty filesystem
-int filesystem_format_storage(storage_device_t* device) {
-    if (!device) {
-        vga_puts("Error: No storage device specified\n");
-        return -1;
-    }
-    
-    vga_puts("Formatting ");
-    vga_puts(device->name);
-    vga_puts("...\n");
+// Show directory tree
+void filesystem_tree(const char* path, int depth) {
+    file_entry_t* dir = fs.current_dir;
     
-    // Create empty filesystem header
-    fs_header_t header;
-    memory_copy(header.magic, "PINEFS\0\0", 8);
-    header.version = 1;
-    header.total_entries = 0;
-    header.data_start = 2;
+    if (path && strlen(path) > 0) {
+        dir = filesystem_find_file(path);
+    }
     
-    // Write header
-    if (device->write_sector(device, 0, &header) != 0) {
-        vga_puts("Error: Failed to write filesystem header\n");
-        return -1;
+    if (!dir || dir->type != FILE_TYPE_DIR) {
+        return;
     }
     
-    // Clear file entries sector
-    uint8_t empty_sector[512] = {0};
-    if (device->write_sector(device, 1, empty_sector) != 0) {
-        vga_puts("Error: Failed to clear file entries\n");
-        return -1;
+    filesystem_tree_entry(dir, depth);
+}
+
+// Show directory entry cache occupancy and hit rates
+void filesystem_dcache_stats(void) {
+    unsigned int entries = 0;
+    unsigned int used_buckets = 0;
+    unsigned int longest = 0;
+    for (int i = 0; i < DCACHE_BUCKETS; i++) {
+        unsigned int chain = 0;
+        for (unsigned int ino = dcache_buckets[i]; ino; ino = filesystem_entry(ino)->hash_next) {
+            chain++;
+        }
+        if (chain) used_buckets++;
+        if (chain > longest) longest = chain;
+        entries += chain;
+    }
+    
+    vga_puts("Dentry cache: ");
+    vga_put_uint(entries);
+    vga_puts(" entries in ");
+    vga_put_uint(used_buckets);
+    vga_puts("/");
+    vga_put_uint(DCACHE_BUCKETS);
+    vga_puts(" buckets, longest chain ");
+    vga_put_uint(longest);
+    vga_puts("\n  hits: ");
+    vga_put_uint(dcache_hits);
+    vga_puts("  misses: ");
+    vga_put_uint(dcache_misses);
+    vga_puts("  negative hits: ");
+    vga_put_uint(dcache_negative_hits);
+    vga_puts("\n");
+}
+
+// Show inode table and name area usage
+void filesystem_inode_stats(void) {
+    unsigned int free_entries = 0;
+    for (unsigned int ino = fs.free_list; ino; ino = filesystem_entry(ino)->next) {
+        free_entries++;
+    }
+    unsigned int on_disk = 0;
+    unsigned int on_disk_bytes = 0;
+    for (unsigned int ino = 1; ino < fs.next_entry; ino++) {
+        file_entry_t* entry = filesystem_entry(ino);
+        if (entry->used && (entry->flags & FILE_FLAG_ON_DISK)) {
+            on_disk++;
+            on_disk_bytes += entry->size;
+        }
     }
     
-    vga_puts("Storage device formatted successfully\n");
-    return 0;
+    vga_puts("Inodes: ");
+    vga_put_uint(fs.live_entries);
+    vga_puts(" live, ");
+    vga_put_uint(free_entries);
+    vga_puts(" free, ");
+    vga_put_uint(fs.slab_count);
+    vga_puts(" slabs of ");
+    vga_put_uint(INODES_PER_SLAB);
+    vga_puts(" (");
+    vga_put_uint(sizeof(file_entry_t));
+    vga_puts(" bytes each)\n");
+    vga_puts("Disk records: ");
+    vga_put_uint(disk_live);
+    vga_puts(" saved files, ");
+    vga_put_uint(disk_slab_count);
+    vga_puts(" slabs of ");
+    vga_put_uint(DISKS_PER_SLAB);
+    vga_puts(" (");
+    vga_put_uint(sizeof(file_disk_t));
+    vga_puts(" bytes each)\n");
+    vga_puts("Names: ");
+    vga_put_uint(names_interned);
+    vga_puts(" interned, ");
+    vga_put_uint((name_top + PAGE_SIZE - 1) / PAGE_SIZE);
+    vga_puts("/");
+    vga_put_uint(name_page_count);
+    vga_puts(" pages touched\n");
+    vga_puts("Files not fully read in: ");
+    vga_put_uint(on_disk);
+    vga_puts(" (");
+    vga_put_uint(on_disk_bytes);
+    vga_puts(" bytes)\n");
+    
+    // Every file after the first to use a shared page or run saves a copy
+    unsigned int pages_saved = 0;
+    for (unsigned int i = 0; i < page_ref_slots; i++) {
+        if (page_refs[i].refs) {
+            pages_saved += page_refs[i].refs - 1;
+        }
+    }
+    vga_puts("Shared data: ");
+    vga_put_uint(pages_saved * PAGE_SIZE);
+    vga_puts(" bytes of memory saved, ");
+    vga_put_uint(pages_unshared);
+    vga_puts(" pages copied on write, ");
+    vga_put_uint(save_bytes_shared());
+    vga_puts(" bytes saved on disk\n");
 }
\ No newline at end of file
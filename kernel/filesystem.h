@@ -7,49 +7,149 @@
 // File system constants
 #define MAX_FILENAME 32
 #define MAX_PATH 256
-#define MAX_FILES 100
-#define MAX_DIRS 50
-#define MAX_FILE_SIZE 4096
+
+// File data up to this size lives inside the entry itself
+#define FILE_INLINE_SIZE 56
+
+// Directory entry cache: (parent, name hash) -> entry, plus a small
+// direct-mapped cache of recent misses
+#define DCACHE_BUCKETS 1024
+#define DCACHE_NEGATIVE 64
 
 // File types
 #define FILE_TYPE_FILE 1
 #define FILE_TYPE_DIR  2
 
-// File entry structure
+// Run of contiguous data pages
+typedef struct file_extent {
+    unsigned int addr;           // First page
+    unsigned int pages;
+} file_extent_t;
+
+// Run of contiguous sectors on the storage device
+typedef struct disk_extent {
+    unsigned int start;
+    unsigned int sectors;
+} disk_extent_t;
+
+// Saved data runs per file, kept in the on-disk entry
+#define FILE_DISK_EXTENTS 8
+
+// Entry flags
+#define FILE_FLAG_EXTENTS 1      // Data is in extents rather than inline
+#define FILE_FLAG_DIRTY   2      // Data changed since the last save
+#define FILE_FLAG_ALL_DIRTY 4    // Every block changed; dirty_blocks unused
+#define FILE_FLAG_ON_DISK 8      // Some data is still only in the saved runs
+#define FILE_FLAG_COMPRESSED 16  // The saved runs hold a compressed stream
+#define FILE_FLAG_MOUNTED 32     // A filesystem is mounted on this directory
+
+// On-disk state of a saved file. Once saved, a file owns up to
+// FILE_DISK_EXTENTS runs of sectors on the device; dirty_blocks marks the
+// sectors written since, so the next save only rewrites those. A file
+// loaded from storage keeps its data on disk and reads sectors in as they
+// are first accessed. Records live in a side table of their own and only
+// files with runs on the device have one.
+typedef struct file_disk {
+    disk_extent_t extents[FILE_DISK_EXTENTS]; // Data runs, in file order
+    unsigned int extent_count;
+    unsigned int sectors;        // Sectors reserved over all runs
+    unsigned int bytes;          // Compressed file or directory: length of the stream
+    unsigned char* dirty_blocks; // Bit per sector changed since the last save
+    unsigned int dirty_capacity; // Bits in dirty_blocks
+    unsigned char* loaded_blocks; // FILE_FLAG_ON_DISK: bit per sector read in
+} file_disk_t;
+
+// File entry (inode). Entries live in slab pages and refer to each other by
+// index into the inode table; index 0 means none. Names are interned in a
+// separate string area. Small file contents are stored inline; larger ones
+// in an extent list of whole pages that grows as the file does. A saved
+// file refers to its file_disk_t record. A compressed file is rewritten
+// whole, and read in whole on first access. An entry belongs to the
+// filesystem of its mount (see vfs.h); files of a RAM-only one keep their
+// data in data.tmp and never reach the device.
 typedef struct file_entry {
-    char name[MAX_FILENAME];
-    int type;                    // FILE_TYPE_FILE or FILE_TYPE_DIR
-    int size;                    // File size in bytes
-    char* data;                  // File content (for files)
-    struct file_entry* parent;   // Parent directory
-    struct file_entry* children; // First child (for directories)
-    struct file_entry* next;     // Next sibling
-    int used;                    // 1 if entry is used, 0 if free
+    unsigned int ino;            // Index of this entry
+    unsigned int name;           // Offset of the interned name, which carries its hash
+    unsigned int parent;         // Parent directory
+    unsigned int children;       // First child (for directories)
+    unsigned int next;           // Next sibling, or next free entry
+    unsigned int hash_next;      // Next entry in the same dcache bucket
+    unsigned char type;          // FILE_TYPE_FILE or FILE_TYPE_DIR
+    unsigned char used;          // 1 if entry is used, 0 if free
+    unsigned char flags;         // FILE_FLAG_*
+    unsigned char mount;         // Index in the mount table
+    unsigned int size;           // File size in bytes
+    unsigned int version;        // New on every content change, see filesystem_next_version()
+    union {
+        char inline_data[FILE_INLINE_SIZE];
+        struct {
+            file_extent_t* extents;      // In file order
+            unsigned int extent_count;
+            unsigned int extent_capacity;
+            unsigned int pages;          // Total over all extents
+        } map;
+        struct {
+            unsigned int* pages;         // Page of each PAGE_SIZE bytes, 0 if never written
+            unsigned int capacity;
+        } tmp;
+    } data;
+    unsigned int disk;           // Record in the disk table, 0 if none
 } file_entry_t;
 
+// Inode table, disk table and name area growth limits (one page per
+// slab). Slabs come from the user page pool as the tree grows, and the
+// inode table may take all of it: with 96-byte entries that is 42 per page
+// and about 43,000 files in the 4 MB pool, less whatever file data, disk
+// records and names take from the same pages. A tree of hundreds of
+// thousands of files needs a proportionally larger pool.
+#define INODES_PER_SLAB (PAGE_SIZE / sizeof(file_entry_t))
+#define MAX_INODE_SLABS USER_PAGES_COUNT
+#define MAX_INODES (MAX_INODE_SLABS * INODES_PER_SLAB)
+#define DISKS_PER_SLAB (PAGE_SIZE / sizeof(file_disk_t))
+#define MAX_DISK_SLABS (MAX_INODES / DISKS_PER_SLAB + 1)
+#define MAX_NAME_PAGES 1024
+
 // File system state
 typedef struct filesystem {
     file_entry_t* root;
     file_entry_t* current_dir;
-    file_entry_t entries[MAX_FILES + MAX_DIRS];
-    int next_entry;
+    file_entry_t* slabs[MAX_INODE_SLABS];
+    unsigned int slab_count;
+    unsigned int next_entry;     // First index never handed out
+    unsigned int free_list;      // Freed entries, linked through next
+    unsigned int live_entries;
 } filesystem_t;
 
 // File system functions
 void filesystem_init(void);
 file_entry_t* filesystem_create_file(const char* name, int type);
+file_entry_t* filesystem_create(const char* path, int type);
 file_entry_t* filesystem_find_file(const char* path);
+file_entry_t* filesystem_entry(unsigned int ino);
+unsigned int filesystem_next_version(void);
+const char* filesystem_entry_name(const file_entry_t* entry);
 int filesystem_mkdir(const char* name);
 int filesystem_touch(const char* name);
 int filesystem_write_file(const char* name, const char* content);
+int filesystem_write_file_data(const char* name, const void* data, int size);
+int filesystem_append(const char* name, const void* data, int size);
 char* filesystem_read_file(const char* name);
+int filesystem_read_at(file_entry_t* file, unsigned int offset, void* buffer, unsigned int count);
+int filesystem_write_at(file_entry_t* file, unsigned int offset, const void* data, unsigned int count);
+int filesystem_truncate(file_entry_t* file, unsigned int size);
+int filesystem_reflink(file_entry_t* src, const char* dest);
+int filesystem_cached(file_entry_t* file, unsigned int offset, unsigned int end);
+int filesystem_prefetch(file_entry_t* file, unsigned int offset, unsigned int end);
 int filesystem_ls(const char* path);
 int filesystem_cd(const char* path);
 int filesystem_pwd(void);
 int filesystem_rm(const char* name);
 int filesystem_rmdir(const char* name);
-int filesystem_cp(const char* src, const char* dest);
+int filesystem_mount(const char* path, const char* type);
+int filesystem_umount(const char* path);
 void filesystem_tree(const char* path, int depth);
+void filesystem_dcache_stats(void);
+void filesystem_inode_stats(void);
 
 // Path utilities
 char* filesystem_get_absolute_path(const char* relative_path);
@@ -58,9 +158,23 @@ char* filesystem_get_filename(const char* path);
 int filesystem_path_exists(const char* path);
 
 // Persistent storage functions
+#define FS_SAVE_DEDUP 1     // Store files with identical contents once
+#define FS_SAVE_ASYNC 2     // Write in the background from filesystem_tick()
+int filesystem_save(storage_device_t* device, unsigned int flags);
 int filesystem_save_to_storage(storage_device_t* device);
+void filesystem_save_status(void);
+void filesystem_set_compression(int enabled);
+void filesystem_compression_stats(void);
 int filesystem_load_from_storage(storage_device_t* device);
 int filesystem_format_storage(storage_device_t* device);
+int filesystem_fsck(storage_device_t* device);    // Bad sectors and index faults found, or -1
+int filesystem_lookup_saved(storage_device_t* device, const char* path);
+
+// Journal and group commit to the device of the last save or load
+void filesystem_tick(void);
+void filesystem_set_commit_interval(uint32_t interval_ms);
+int filesystem_set_transaction_size(uint32_t blocks);
+void filesystem_journal_stats(void);
 
 // Global filesystem instance
 extern filesystem_t fs;
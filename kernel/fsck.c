@@ -0,0 +1,224 @@
+#include "pinefs.h"
+#include "io.h"
+#include "bcache.h"
+#include "clock.h"
+#include "crc32c.h"
+
+// Offline check of a saved image: every checksummed sector is read back
+// and compared, and every directory index walked.
+
+// Scrub state: the checksum table as read back, and running totals
+static uint32_t* fsck_sums;
+static uint32_t fsck_checked;
+static uint32_t fsck_unverified;
+static uint32_t fsck_bad;
+static uint64_t fsck_crc_bytes;
+static uint64_t fsck_crc_ns;
+
+// Read count sectors from start straight off the device and check each
+// against the table; what names their owner in reports
+static void fsck_scan(storage_device_t* device, uint32_t start, uint32_t count, const char* what) {
+    while (count > 0) {
+        uint32_t batch = count < FS_IO_SECTORS ? count : FS_IO_SECTORS;
+        int failed = storage_read_sectors(device, start, batch, fs_io_buffer) != 0;
+        uint64_t started = clock_get_ns();
+        for (uint32_t i = 0; i < batch; i++) {
+            uint32_t sum = fsck_sums[(start + i) / FS_SUMS_PER_SECTOR * (FS_BLOCK_SIZE / 4) +
+                                     (start + i) % FS_SUMS_PER_SECTOR];
+            if (!failed && !sum) {
+                fsck_unverified++;
+                continue;
+            }
+            fsck_checked++;
+            fsck_crc_bytes += FS_BLOCK_SIZE;
+            if (failed || crc32c(0, fs_io_buffer + i * FS_BLOCK_SIZE, FS_BLOCK_SIZE) != sum) {
+                fsck_bad++;
+                vga_puts("  sector ");
+                vga_put_uint(start + i);
+                vga_puts(failed ? ": read error (" : ": checksum mismatch (");
+                vga_puts(what);
+                vga_puts(")\n");
+            }
+        }
+        fsck_crc_ns += clock_get_ns() - started;
+        start += batch;
+        count -= batch;
+    }
+}
+
+// Look every entry up through its parent's directory index, and check
+// each directory's entry count against the entries naming it as parent.
+// Returns the faults found.
+static uint32_t fsck_check_index(storage_device_t* device, fs_superblock_t* super, uint32_t* entries) {
+    uint32_t* counts = memory_alloc((super->total_entries + 1) * sizeof(uint32_t));
+    if (!counts) {
+        vga_puts("  directory index not checked: out of memory\n");
+        return 0;
+    }
+    memory_set(counts, 0, (super->total_entries + 1) * sizeof(uint32_t));
+    
+    uint32_t faults = 0;
+    fs_disk_inode_t record;
+    fs_disk_inode_t parent;
+    fs_disk_inode_t found;
+    for (uint32_t ino = 2; ino <= super->total_entries; ino++) {
+        if (lookup_record(device, super, ino, &record) != 0 || record.type == 0 ||
+            record.parent == 0 || record.parent > super->total_entries) {
+            continue;
+        }
+        counts[record.parent]++;
+        (*entries)++;
+        if (lookup_record(device, super, record.parent, &parent) != 0 ||
+            lookup_in_dir(device, super, &parent, record.name, &found) != (int)ino) {
+            faults++;
+            vga_puts("  ");
+            vga_puts(record.name);
+            vga_puts(": missing from its directory's index\n");
+        }
+    }
+    for (uint32_t ino = 1; ino <= super->total_entries; ino++) {
+        if (lookup_record(device, super, ino, &record) == 0 && record.type == FILE_TYPE_DIR &&
+            record.size != counts[ino]) {
+            faults++;
+            vga_puts("  ");
+            vga_puts(record.name);
+            vga_puts(": directory index lists ");
+            vga_put_uint(record.size);
+            vga_puts(" entries, ");
+            vga_put_uint(counts[ino]);
+            vga_puts(" expected\n");
+        }
+    }
+    memory_free(counts);
+    return faults;
+}
+
+// Scrub the image on device: every sector the checksum table covers that
+// is in use (bitmap, inode table, each file's data runs and each
+// directory's index) is read from the device itself, bypassing the block
+// cache, and checked. Pending writes are flushed first. Then every entry
+// is looked up through its directory's index. Returns the number of bad
+// sectors and index faults, or -1.
+int filesystem_fsck(storage_device_t* device) {
+    if (!device) {
+        vga_puts("Error: No storage device specified\n");
+        return -1;
+    }
+    
+    snapshot_drain();
+    fs_superblock_t super;
+    if (bcache_sync(device) != 0 || storage_read_sectors(device, 0, 1, &super) != 0) {
+        vga_puts("Error: Failed to read filesystem header\n");
+        return -1;
+    }
+    if (!fs_superblock_current(&super)) {
+        vga_puts("Error: Invalid filesystem format\n");
+        return -1;
+    }
+    if (super.version < FS_FORMAT_V5) {
+        vga_puts("fsck: version ");
+        vga_put_uint(super.version);
+        vga_puts(" image has no checksums; save to upgrade it\n");
+        return -1;
+    }
+    if (!fs_superblock_intact(&super) || !fs_superblock_sane(&super, device)) {
+        vga_puts("fsck: superblock damaged, nothing else can be checked\n");
+        return 1;
+    }
+    
+    fsck_sums = memory_alloc(super.checksum_sectors * FS_BLOCK_SIZE);
+    if (!fsck_sums) {
+        vga_puts("Error: Out of memory\n");
+        return -1;
+    }
+    vga_puts("Checking ");
+    vga_puts(device->name);
+    vga_puts("...\n");
+    fsck_checked = 1;
+    fsck_unverified = 0;
+    fsck_bad = 0;
+    fsck_crc_bytes = 0;
+    fsck_crc_ns = 0;
+    uint64_t started = clock_get_ns();
+    
+    // The checksum table checks itself; a damaged sector leaves the
+    // sectors it covers unverified
+    for (uint32_t sector = 0; sector < super.checksum_sectors; sector++) {
+        uint32_t* sums = fsck_sums + sector * (FS_BLOCK_SIZE / 4);
+        fsck_checked++;
+        if (storage_read_sectors(device, super.checksum_start + sector, 1, sums) != 0 ||
+            sums[FS_SUMS_PER_SECTOR] != crc32c(0, sums, FS_SUMS_PER_SECTOR * 4)) {
+            fsck_bad++;
+            vga_puts("  sector ");
+            vga_put_uint(super.checksum_start + sector);
+            vga_puts(": checksum mismatch (checksum table)\n");
+            memory_set(sums, 0, FS_BLOCK_SIZE);
+        }
+    }
+    fsck_scan(device, super.bitmap_start, super.bitmap_sectors, "bitmap");
+    
+    // The inode table a sector at a time, then the runs of its files and
+    // directories
+    uint32_t table_used = (super.total_entries + DISK_INODES_PER_SECTOR - 1) / DISK_INODES_PER_SECTOR;
+    for (uint32_t sector = 0; sector < table_used; sector++) {
+        fs_disk_sector_t records;
+        fsck_scan(device, super.table_start + sector, 1, "inode table");
+        if (storage_read_sectors(device, super.table_start + sector, 1, &records) != 0) {
+            continue;
+        }
+        for (uint32_t slot = 0; slot < DISK_INODES_PER_SECTOR; slot++) {
+            fs_disk_inode_t* record = &records.inodes[slot];
+            if ((record->type != FILE_TYPE_FILE && record->type != FILE_TYPE_DIR) || !record->extent_count) {
+                continue;
+            }
+            record->name[MAX_FILENAME - 1] = '\0';
+            uint32_t stored = record->stored ? record->stored : record->size;
+            uint32_t remaining = (stored + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+            for (uint32_t i = 0; i < record->extent_count && i < FILE_DISK_EXTENTS && remaining > 0; i++) {
+                disk_extent_t* extent = &record->data.extents[i];
+                uint32_t count = extent->sectors < remaining ? extent->sectors : remaining;
+                if (extent->start < super.data_start || count > super.total_sectors - extent->start) {
+                    fsck_bad++;
+                    vga_puts("  bad data run in ");
+                    vga_puts(record->name);
+                    vga_puts("\n");
+                    break;
+                }
+                fsck_scan(device, extent->start, count, record->name);
+                remaining -= count;
+            }
+        }
+    }
+    uint64_t elapsed = clock_get_ns() - started;
+    memory_free(fsck_sums);
+    fsck_sums = 0;
+    
+    uint32_t entries = 0;
+    uint32_t faults = super.version >= FS_FORMAT_V6 ? fsck_check_index(device, &super, &entries) : 0;
+    
+    vga_put_uint(fsck_checked);
+    vga_puts(" sectors checked, ");
+    vga_put_uint(fsck_unverified);
+    vga_puts(" without a checksum, ");
+    vga_put_uint(fsck_bad);
+    vga_puts(" bad\n");
+    uint32_t crc_us = (uint32_t)clock_div64(fsck_crc_ns, 1000);
+    vga_puts("  ");
+    vga_put_uint((uint32_t)clock_div64(elapsed, 1000000));
+    vga_puts(" ms, CRC32C (");
+    vga_puts(crc32c_method());
+    vga_puts(") at ");
+    vga_put_uint(crc_us ? (uint32_t)clock_div64(fsck_crc_bytes, crc_us) : 0);
+    vga_puts(" MB/s\n");
+    vga_puts("  Checksum errors on read since boot: ");
+    vga_put_uint(save_sums_failed);
+    vga_puts("\n");
+    if (super.version >= FS_FORMAT_V6) {
+        vga_puts("  Directory index: ");
+        vga_put_uint(entries);
+        vga_puts(" entries looked up, ");
+        vga_put_uint(faults);
+        vga_puts(" faults\n");
+    }
+    return fsck_bad + faults;
+}
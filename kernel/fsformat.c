@@ -0,0 +1,171 @@
+#include "pinefs.h"
+#include "io.h"
+#include "string.h"
+#include "bcache.h"
+#include "crc32c.h"
+#include "vfs.h"
+
+// Layout of the saved image (see pinefs.h): sizing its regions, checking
+// a superblock, and formatting a device.
+
+// Checksum table size for a device of total_sectors
+static uint32_t fs_sums_sectors(uint32_t total_sectors) {
+    return (total_sectors + FS_SUMS_PER_SECTOR - 1) / FS_SUMS_PER_SECTOR;
+}
+
+// Journal size for an image: two halves, each with room for every
+// metadata block, a descriptor per FS_JOURNAL_TAGS of them and a commit
+// block. Version 6 kept at most FS_JOURNAL_TAGS blocks a half.
+static uint32_t fs_journal_sectors(uint32_t version, uint32_t bitmap_sectors, uint32_t sums_sectors,
+                                   uint32_t table_sectors) {
+    uint32_t blocks = 1 + bitmap_sectors + sums_sectors + table_sectors;
+    if (version < FS_FORMAT_VERSION) {
+        return 2 * ((blocks < FS_JOURNAL_TAGS ? blocks : FS_JOURNAL_TAGS) + 2);
+    }
+    return 2 * (blocks + (blocks + FS_JOURNAL_TAGS - 1) / FS_JOURNAL_TAGS + 1);
+}
+
+// Lay the image out afresh: a journal, an inode table with room to grow,
+// and no data runs yet so every file is placed and written in full. Both
+// journal descriptors are cleared and the layout renumbered, so nothing
+// logged under the old layout is replayed over the new one.
+int save_layout(storage_device_t* device, uint32_t table_needed) {
+    uint32_t table = table_needed + table_needed / 2 + 1;
+    if (table > SAVE_MAX_TABLE_SECTORS) {
+        table = SAVE_MAX_TABLE_SECTORS;
+    }
+    
+    if (filesystem_fault_all() != 0) {
+        return -1;
+    }
+    save_invalidate();
+    for (unsigned int ino = 1; ino < fs.next_entry; ino++) {
+        file_entry_t* entry = filesystem_entry(ino);
+        if (!entry->used || !vfs_persistent(entry)) {
+            continue;
+        }
+        file_release_disk(entry);
+        file_clean(entry);
+        entry->flags |= FILE_FLAG_DIRTY | (entry->type == FILE_TYPE_FILE ? FILE_FLAG_ALL_DIRTY : 0);
+    }
+    
+    uint32_t bitmap_sectors = (device->total_sectors + FS_BITMAP_BITS - 1) / FS_BITMAP_BITS;
+    uint32_t sums = fs_sums_sectors(device->total_sectors);
+    uint32_t journal = fs_journal_sectors(FS_FORMAT_VERSION, bitmap_sectors, sums, table);
+    if (table < table_needed || 1 + bitmap_sectors + sums + journal + table >= device->total_sectors) {
+        vga_puts("Error: Device too small for the inode table\n");
+        return -1;
+    }
+    if (save_map_init(device->total_sectors, sums, table, journal) != 0) {
+        vga_puts("Error: Out of memory\n");
+        return -1;
+    }
+    save_super.layout = save_generation + 1;
+    uint8_t empty[FS_BLOCK_SIZE];
+    memory_set(empty, 0, sizeof(empty));
+    if (bcache_write(device, save_super.journal_start, empty) != 0 ||
+        bcache_write(device, save_super.journal_start + journal / 2, empty) != 0) {
+        return -1;
+    }
+    memory_set(save_dirty_records, 0xFF, sizeof(save_dirty_records));
+    save_dirty_record_count = table;
+    memory_set(save_sums_dirty, 0xFF, sums / 8 + 1);
+    save_sums_dirty_count = sums;
+    save_device = device;
+    return 0;
+}
+
+int fs_superblock_valid(fs_superblock_t* super, uint32_t version) {
+    return memory_compare(super->magic, "PINEFS\0\0", 8) == 0 && super->version == version;
+}
+
+// A version 3 to 7 image, which this tree can load
+int fs_superblock_current(fs_superblock_t* super) {
+    return fs_superblock_valid(super, FS_FORMAT_VERSION) || fs_superblock_valid(super, FS_FORMAT_V6) ||
+           fs_superblock_valid(super, FS_FORMAT_V5) ||
+           fs_superblock_valid(super, FS_FORMAT_V4) || fs_superblock_valid(super, FS_FORMAT_V3);
+}
+
+uint32_t fs_superblock_checksum(fs_superblock_t* super) {
+    uint32_t stored = super->checksum;
+    super->checksum = 0;
+    uint32_t sum = crc32c(0, super, sizeof(fs_superblock_t));
+    super->checksum = stored;
+    return sum;
+}
+
+// 1 unless a superblock that carries a checksum fails it
+int fs_superblock_intact(fs_superblock_t* super) {
+    return super->version < FS_FORMAT_V5 || super->checksum == fs_superblock_checksum(super);
+}
+
+// Check a version 3 to 7 superblock's regions against each other and the
+// device
+int fs_superblock_sane(fs_superblock_t* super, storage_device_t* device) {
+    uint32_t bitmap_sectors = (super->total_sectors + FS_BITMAP_BITS - 1) / FS_BITMAP_BITS;
+    uint32_t sums = super->version >= FS_FORMAT_V5 ? fs_sums_sectors(super->total_sectors) : 0;
+    return super->total_entries > 0 && super->total_entries <= MAX_INODES &&
+           super->total_sectors <= device->total_sectors &&
+           super->bitmap_start == 1 && super->bitmap_sectors == bitmap_sectors &&
+           (!sums || (super->checksum_start == 1 + bitmap_sectors && super->checksum_sectors == sums)) &&
+           super->journal_start == 1 + bitmap_sectors + sums &&
+           (super->journal_sectors == 0 ||
+            super->journal_sectors == fs_journal_sectors(super->version, bitmap_sectors, sums, super->table_sectors)) &&
+           super->table_start == super->journal_start + super->journal_sectors &&
+           super->table_sectors <= SAVE_MAX_TABLE_SECTORS &&
+           super->table_sectors * DISK_INODES_PER_SECTOR >= super->total_entries &&
+           super->data_start == super->table_start + super->table_sectors &&
+           super->data_start < super->total_sectors;
+}
+
+// Format storage device with empty filesystem
+int filesystem_format_storage(storage_device_t* device) {
+    if (!device) {
+        vga_puts("Error: No storage device specified\n");
+        return -1;
+    }
+    
+    vga_puts("Formatting ");
+    vga_puts(device->name);
+    vga_puts("...\n");
+    snapshot_drain();
+    
+    // Create empty superblock. The generation carries on from the image
+    // it replaces, so the next save's commits are newer than any left in
+    // the journal.
+    fs_superblock_t super;
+    memory_set(&super, 0, sizeof(super));
+    uint32_t generation = 0;
+    if (bcache_read(device, 0, &super) == 0 && memory_compare(super.magic, "PINEFS\0\0", 8) == 0) {
+        generation = super.generation;
+    }
+    memory_set(&super, 0, sizeof(super));
+    memory_copy(super.magic, "PINEFS\0\0", 8);
+    super.version = FS_FORMAT_VERSION;
+    super.total_entries = 0;
+    super.generation = generation;
+    super.checksum = fs_superblock_checksum(&super);
+    if (load_device == device && filesystem_fault_all() != 0) {
+        vga_puts("Error: Files loaded from this device could not be read in\n");
+        return -1;
+    }
+    if (save_device == device) {
+        save_invalidate();
+    }
+    
+    // Write superblock
+    if (bcache_write(device, 0, &super) != 0) {
+        vga_puts("Error: Failed to write filesystem header\n");
+        return -1;
+    }
+    
+    // Clear the sector after it
+    uint8_t empty_sector[512] = {0};
+    if (bcache_write(device, 1, empty_sector) != 0) {
+        vga_puts("Error: Failed to clear file entries\n");
+        return -1;
+    }
+    
+    vga_puts("Storage device formatted successfully\n");
+    return 0;
+}
@@ -0,0 +1,339 @@
+#include "pinefs.h"
+#include "io.h"
+#include "string.h"
+#include "bcache.h"
+
+// Directory index (see pinefs.h): built when a directory is saved, and
+// searched to find one name on the image without loading the tree.
+
+int index_pair_less(const fs_index_pair_t* a, const fs_index_pair_t* b) {
+    return a->hash < b->hash || (a->hash == b->hash && a->ref < b->ref);
+}
+
+static void index_sift(fs_index_pair_t* pairs, uint32_t root, uint32_t end) {
+    while (root * 2 + 1 < end) {
+        uint32_t child = root * 2 + 1;
+        if (child + 1 < end && index_pair_less(&pairs[child], &pairs[child + 1])) {
+            child++;
+        }
+        if (!index_pair_less(&pairs[root], &pairs[child])) {
+            return;
+        }
+        fs_index_pair_t swap = pairs[root];
+        pairs[root] = pairs[child];
+        pairs[child] = swap;
+        root = child;
+    }
+}
+
+// Heapsort, as a directory can hold a great many entries
+void index_sort(fs_index_pair_t* pairs, uint32_t count) {
+    for (uint32_t i = count / 2; i-- > 0; ) {
+        index_sift(pairs, i, count);
+    }
+    for (uint32_t end = count; end-- > 1; ) {
+        fs_index_pair_t top = pairs[0];
+        pairs[0] = pairs[end];
+        pairs[end] = top;
+        index_sift(pairs, 0, end);
+    }
+}
+
+// The directory's entries as (hash, inode), in index order; count is set
+// to how many. Returns 0 when out of memory.
+static fs_index_pair_t* index_gather(file_entry_t* dir, uint32_t* count) {
+    *count = 0;
+    for (uint32_t child = dir->children; child; child = filesystem_entry(child)->next) {
+        (*count)++;
+    }
+    fs_index_pair_t* pairs = memory_alloc((*count ? *count : 1) * sizeof(fs_index_pair_t));
+    if (!pairs) {
+        return 0;
+    }
+    uint32_t i = 0;
+    for (uint32_t child = dir->children; child; child = filesystem_entry(child)->next) {
+        pairs[i].hash = filesystem_entry_hash(filesystem_entry(child));
+        pairs[i].ref = child;
+        i++;
+    }
+    index_sort(pairs, *count);
+    return pairs;
+}
+
+// Build the B+tree of a directory too big to index inline into new
+// pages, bottom up: full leaves, then each level of links over the one
+// below until a single root. Returns the blocks it takes, 0 for an
+// inline directory, or -1.
+static int save_build_index(file_entry_t* dir, uint8_t** blocks, uint32_t* pages) {
+    uint32_t count;
+    fs_index_pair_t* pairs = index_gather(dir, &count);
+    if (!pairs) {
+        return -1;
+    }
+    if (count <= FS_DIR_INLINE) {
+        memory_free(pairs);
+        return 0;
+    }
+    
+    uint32_t leaves = (count + FS_INDEX_LEAF_ENTRIES - 1) / FS_INDEX_LEAF_ENTRIES;
+    uint32_t total = leaves;
+    for (uint32_t level = leaves; level > 1; ) {
+        level = (level + FS_INDEX_LINKS - 1) / FS_INDEX_LINKS;
+        total += level;
+    }
+    *pages = (total * FS_BLOCK_SIZE + PAGE_SIZE - 1) / PAGE_SIZE;
+    *blocks = memory_alloc_pages(*pages);
+    if (!*blocks) {
+        memory_free(pairs);
+        return -1;
+    }
+    memory_set(*blocks, 0, *pages * PAGE_SIZE);
+    
+    fs_index_block_t* tree = (fs_index_block_t*)*blocks;
+    for (uint32_t i = 0; i < count; i++) {
+        fs_index_block_t* leaf = &tree[i / FS_INDEX_LEAF_ENTRIES];
+        fs_index_leaf_t* slot = &leaf->u.leaves[leaf->count++];
+        const char* name = filesystem_entry_name(filesystem_entry(pairs[i].ref));
+        slot->hash = pairs[i].hash;
+        slot->ino = pairs[i].ref;
+        memory_copy(slot->name, name, strlen(name) + 1);
+    }
+    for (uint32_t i = 0; i < leaves; i++) {
+        tree[i].next = i + 1 < leaves ? i + 1 : FS_INDEX_NONE;
+    }
+    memory_free(pairs);
+    
+    uint32_t first = 0;
+    uint32_t width = leaves;
+    for (uint16_t level = 1; width > 1; level++) {
+        uint32_t base = first + width;
+        for (uint32_t i = 0; i < width; i++) {
+            fs_index_block_t* node = &tree[base + i / FS_INDEX_LINKS];
+            fs_index_block_t* child = &tree[first + i];
+            node->level = level;
+            node->next = FS_INDEX_NONE;
+            node->u.links[node->count].hash = child->level ? child->u.links[0].hash : child->u.leaves[0].hash;
+            node->u.links[node->count].ref = first + i;
+            node->count++;
+        }
+        first = base;
+        width = (width + FS_INDEX_LINKS - 1) / FS_INDEX_LINKS;
+    }
+    return total;
+}
+
+// Write a changed directory's index over runs fitted to it, or give the
+// runs back when it now fits in the record; returns blocks written
+int save_dir_index(storage_device_t* device, file_entry_t* dir, int async) {
+    uint8_t* blocks = 0;
+    uint32_t pages = 0;
+    int count = save_build_index(dir, &blocks, &pages);
+    if (count < 0) {
+        return -1;
+    }
+    
+    save_mark_record(dir->ino);
+    int result = save_fit(dir, count);
+    for (int block = 0; block < count && result == 0; block++) {
+        result = save_put_block(device, file_disk_sector(dir, block), blocks + block * FS_BLOCK_SIZE, async, 0);
+    }
+    if (async && count > 0 && result == 0) {
+        result = snapshot_hold((unsigned int)blocks, pages, 0);
+    }
+    if (blocks && (!async || result != 0)) {
+        memory_free_pages(blocks, pages);
+    }
+    if (dir->disk) {
+        file_disk(dir)->bytes = count * FS_BLOCK_SIZE;
+    }
+    file_clean(dir);
+    return result == 0 ? count : -1;
+}
+
+// Lookups straight from the image, one directory index at a time, through
+// the block cache. lookup_reads counts the blocks they read.
+static uint32_t lookup_reads;
+
+static int lookup_read(storage_device_t* device, uint32_t sector, void* buffer) {
+    lookup_reads++;
+    return bcache_read(device, sector, buffer);
+}
+
+// Read inode ino's record off the image
+int lookup_record(storage_device_t* device, fs_superblock_t* super, uint32_t ino, fs_disk_inode_t* record) {
+    fs_disk_sector_t records;
+    if (ino == 0 || ino > super->total_entries ||
+        lookup_read(device, super->table_start + (ino - 1) / DISK_INODES_PER_SECTOR, &records) != 0) {
+        return -1;
+    }
+    memory_copy(record, &records.inodes[(ino - 1) % DISK_INODES_PER_SECTOR], sizeof(fs_disk_inode_t));
+    record->name[MAX_FILENAME - 1] = '\0';
+    return 0;
+}
+
+// Read block of a directory's index; -1 if it is past the tree or unreadable
+static int lookup_index_block(storage_device_t* device, fs_disk_inode_t* dir, uint32_t block, fs_index_block_t* node) {
+    if (block >= dir->stored / FS_BLOCK_SIZE) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < dir->extent_count && i < FILE_DISK_EXTENTS; i++) {
+        disk_extent_t* extent = &dir->data.extents[i];
+        if (block < extent->sectors) {
+            return lookup_read(device, extent->start + block, node);
+        }
+        block -= extent->sectors;
+    }
+    return -1;
+}
+
+// Find name in the directory whose record is dir, and read its record
+// into found. Returns its inode, 0 if it is not there, or -1 if the image
+// cannot be read or the index is bad.
+int lookup_in_dir(storage_device_t* device, fs_superblock_t* super, fs_disk_inode_t* dir, const char* name,
+                         fs_disk_inode_t* found) {
+    uint32_t hash = dcache_hash_name(name);
+    if (dir->type != FILE_TYPE_DIR) {
+        return 0;
+    }
+    if (dir->extent_count == 0) {
+        fs_index_pair_t* pairs = (fs_index_pair_t*)dir->data.inline_data;
+        for (uint32_t i = 0; i < dir->size && i < FS_DIR_INLINE && pairs[i].hash <= hash; i++) {
+            if (pairs[i].hash != hash) {
+                continue;
+            }
+            if (lookup_record(device, super, pairs[i].ref, found) != 0) {
+                return -1;
+            }
+            if (strncmp(found->name, name, MAX_FILENAME - 1) == 0) {
+                return pairs[i].ref;
+            }
+        }
+        return 0;
+    }
+    
+    // Down the interior levels: the last child whose lowest hash is below
+    // the one sought, as equal hashes may begin at the end of that child
+    fs_index_block_t node;
+    uint32_t blocks = dir->stored / FS_BLOCK_SIZE;
+    uint32_t block = blocks - 1;
+    for (uint32_t depth = 0; ; depth++) {
+        if (depth > FS_INDEX_DEPTH || lookup_index_block(device, dir, block, &node) != 0) {
+            return -1;
+        }
+        if (node.level == 0) {
+            break;
+        }
+        if (node.count == 0 || node.count > FS_INDEX_LINKS) {
+            return -1;
+        }
+        uint32_t low = 0;
+        uint32_t high = node.count;
+        while (low < high) {
+            uint32_t middle = (low + high) / 2;
+            if (node.u.links[middle].hash < hash) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        block = node.u.links[low ? low - 1 : 0].ref;
+    }
+    
+    // Along the leaves until the hashes pass the one sought
+    for (uint32_t steps = 0; steps < blocks; steps++) {
+        if (node.level != 0 || node.count > FS_INDEX_LEAF_ENTRIES) {
+            return -1;
+        }
+        for (uint32_t i = 0; i < node.count; i++) {
+            fs_index_leaf_t* leaf = &node.u.leaves[i];
+            if (leaf->hash > hash) {
+                return 0;
+            }
+            if (leaf->hash == hash && strncmp(leaf->name, name, MAX_FILENAME - 1) == 0) {
+                return lookup_record(device, super, leaf->ino, found) == 0 ? (int)leaf->ino : -1;
+            }
+        }
+        if (node.next == FS_INDEX_NONE) {
+            return 0;
+        }
+        if (lookup_index_block(device, dir, node.next, &node) != 0) {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+// Find path, taken from the root, on the image on device without loading
+// it. Prints what it found and the blocks read on the way. Returns the
+// inode, 0 if the path is not on the image, or -1.
+int filesystem_lookup_saved(storage_device_t* device, const char* path) {
+    if (!device) {
+        vga_puts("Error: No storage device specified\n");
+        return -1;
+    }
+    
+    snapshot_drain();
+    fs_superblock_t super;
+    if (bcache_read(device, 0, &super) != 0 || !fs_superblock_current(&super)) {
+        vga_puts("Error: Invalid filesystem format\n");
+        return -1;
+    }
+    if (super.version < FS_FORMAT_V6) {
+        vga_puts("lookup: version ");
+        vga_put_uint(super.version);
+        vga_puts(" image has no directory index; save to upgrade it\n");
+        return -1;
+    }
+    if (!fs_superblock_intact(&super) || !fs_superblock_sane(&super, device)) {
+        vga_puts("Error: Superblock damaged\n");
+        return -1;
+    }
+    int len = strlen(path);
+    if (len >= MAX_PATH) {
+        vga_puts("Error: Path too long\n");
+        return -1;
+    }
+    
+    char path_copy[MAX_PATH];
+    memory_copy(path_copy, path, len + 1);
+    lookup_reads = 0;
+    fs_disk_inode_t record;
+    int ino = 1;
+    if (lookup_record(device, &super, 1, &record) != 0) {
+        ino = -1;
+    }
+    char* save;
+    for (char* component = strtok_r(path_copy, "/", &save); component && ino > 0;
+         component = strtok_r(0, "/", &save)) {
+        if (strcmp(component, ".") == 0) {
+            continue;
+        }
+        if (strcmp(component, "..") == 0) {
+            ino = record.parent ? record.parent : 1;
+            if (lookup_record(device, &super, ino, &record) != 0) {
+                ino = -1;
+            }
+        } else {
+            fs_disk_inode_t found;
+            ino = lookup_in_dir(device, &super, &record, component, &found);
+            memory_copy(&record, &found, sizeof(record));
+        }
+    }
+    
+    vga_puts(path);
+    if (ino < 0) {
+        vga_puts(": directory index damaged or unreadable");
+    } else if (ino == 0) {
+        vga_puts(": not in the saved image");
+    } else {
+        vga_puts(record.type == FILE_TYPE_DIR ? ": directory, inode " : ": file, inode ");
+        vga_put_uint(ino);
+        vga_puts(", ");
+        vga_put_uint(record.size);
+        vga_puts(record.type == FILE_TYPE_DIR ? " entries" : " bytes");
+    }
+    vga_puts(" (");
+    vga_put_uint(lookup_reads);
+    vga_puts(" blocks read)\n");
+    return ino;
+}
@@ -0,0 +1,292 @@
+#include "pinefs.h"
+#include "io.h"
+#include "bcache.h"
+#include "clock.h"
+#include "crc32c.h"
+
+// Journal. The metadata blocks of a commit are logged in one half of the
+// journal before they are written home, and a committed transaction is
+// replayed on load.
+
+// Group commit settings and statistics
+uint32_t journal_interval_ms = FS_COMMIT_INTERVAL_MS;
+uint32_t journal_transaction_blocks = FS_TRANSACTION_BLOCKS;
+uint32_t journal_last_commit;
+uint32_t journal_first_commit;
+uint32_t journal_commits;
+static uint32_t journal_blocks_logged;
+static uint32_t journal_replayed;
+static uint32_t journal_flushes;
+
+// Running checksum (FNV-1a) over the journaled blocks of images before
+// version 5
+#define FS_CHECKSUM_SEED 2166136261u
+
+static uint32_t fs_checksum(uint32_t sum, const void* data, uint32_t length) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    for (uint32_t i = 0; i < length; i++) {
+        sum = (sum ^ bytes[i]) * 16777619u;
+    }
+    return sum;
+}
+
+// Write back the block cache and have the device put it on the media, so
+// nothing written after this reaches the disk first
+static int save_barrier(storage_device_t* device) {
+    if (bcache_sync(device) != 0) {
+        return -1;
+    }
+    if (!device->flush) {
+        return 0;
+    }
+    journal_flushes++;
+    return device->flush(device);
+}
+
+// Blocks one journal half of sectors can log in a transaction
+static uint32_t journal_capacity(uint32_t sectors) {
+    uint32_t room = sectors - 1;
+    return room - (room + FS_JOURNAL_TAGS) / (FS_JOURNAL_TAGS + 1);
+}
+
+// Write the metadata sectors in targets (the superblock last) through the
+// journal half of this generation: log them behind as many descriptors as
+// they need and flush, which also pushes out file data and the home writes
+// of the previous commit, then write the commit block and flush again.
+// The home writes follow through the block cache. The journal of an image
+// this tree laid out holds every metadata block, so a commit that does not
+// fit is refused rather than written home unprotected.
+// filled, if not 0, holds the blocks already.
+int save_write_metadata(storage_device_t* device, uint32_t* targets, uint32_t count, uint8_t* filled) {
+    uint8_t block[FS_BLOCK_SIZE];
+    if (count > journal_capacity(save_super.journal_sectors / 2)) {
+        vga_puts("Error: Commit too big for the journal\n");
+        return -1;
+    }
+    
+    uint32_t position = save_super.journal_start + (save_super.generation % 2) * (save_super.journal_sectors / 2);
+    fs_journal_block_t header;
+    memory_set(&header, 0, sizeof(header));
+    header.magic = FS_JOURNAL_MAGIC;
+    header.sequence = save_super.generation;
+    header.layout = save_super.layout;
+    header.total = count;
+    uint32_t checksum = 0;
+    for (uint32_t first = 0; first < count; first += FS_JOURNAL_TAGS) {
+        header.type = FS_JOURNAL_DESCRIPTOR;
+        header.count = count - first < FS_JOURNAL_TAGS ? count - first : FS_JOURNAL_TAGS;
+        memory_copy(header.targets, targets + first, header.count * sizeof(uint32_t));
+        if (bcache_write(device, position++, &header) != 0) {
+            return -1;
+        }
+        checksum = crc32c(checksum, header.targets, header.count * sizeof(uint32_t));
+        for (uint32_t i = first; i < first + header.count; i++) {
+            save_metadata_block(targets, filled, i, block);
+            checksum = crc32c(checksum, block, FS_BLOCK_SIZE);
+            if (bcache_write(device, position++, block) != 0) {
+                return -1;
+            }
+        }
+        journal_blocks_logged += 1 + header.count;
+    }
+    if (save_barrier(device) != 0) {
+        return -1;
+    }
+    
+    header.type = FS_JOURNAL_COMMIT;
+    header.count = count;
+    header.total = 0;
+    header.checksum = checksum;
+    memory_set(header.targets, 0, sizeof(header.targets));
+    if (bcache_write(device, position, &header) != 0 || save_barrier(device) != 0) {
+        return -1;
+    }
+    journal_blocks_logged++;
+    
+    // Committed; a crash from here on is repaired by replay
+    for (uint32_t i = 0; i < count; i++) {
+        save_metadata_block(targets, filled, i, block);
+        if (bcache_write(device, targets[i], block) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// 0 turns group commit off; changes then reach the device only on save
+void filesystem_set_commit_interval(uint32_t interval_ms) {
+    journal_interval_ms = interval_ms;
+}
+
+int filesystem_set_transaction_size(uint32_t blocks) {
+    if (blocks == 0 || blocks > FS_JOURNAL_TAGS) {
+        return -1;
+    }
+    journal_transaction_blocks = blocks;
+    return 0;
+}
+
+// Show journal settings and commit statistics
+void filesystem_journal_stats(void) {
+    vga_puts("Journal: ");
+    if (!save_device) {
+        vga_puts("no device bound, save or load first\n");
+    } else if (!save_super.journal_sectors) {
+        vga_puts("none on ");
+        vga_puts(save_device->name);
+        vga_puts(", the next full save adds one\n");
+    } else {
+        vga_put_uint(save_super.journal_sectors);
+        vga_puts(" sectors on ");
+        vga_puts(save_device->name);
+        vga_puts(", up to ");
+        vga_put_uint(journal_capacity(save_super.journal_sectors / 2));
+        vga_puts(" blocks per transaction\n");
+    }
+    
+    vga_puts("  commit interval: ");
+    if (journal_interval_ms) {
+        vga_put_uint(journal_interval_ms);
+        vga_puts(" ms");
+    } else {
+        vga_puts("off");
+    }
+    vga_puts(", transaction size: ");
+    vga_put_uint(journal_transaction_blocks);
+    vga_puts(" blocks, pending: ");
+    vga_put_uint(save_device ? save_pending_blocks() : 0);
+    vga_puts("\n");
+    
+    // Rate over the time since the first commit, in hundredths
+    uint32_t elapsed = clock_get_ms() - journal_first_commit;
+    uint32_t rate = journal_commits && elapsed ? (uint32_t)clock_div64((uint64_t)journal_commits * 100000, elapsed) : 0;
+    vga_puts("  commits: ");
+    vga_put_uint(journal_commits);
+    vga_puts(" (");
+    vga_put_uint(rate / 100);
+    vga_puts(".");
+    vga_putchar('0' + rate / 10 % 10);
+    vga_putchar('0' + rate % 10);
+    vga_puts(" per second), replayed: ");
+    vga_put_uint(journal_replayed);
+    vga_puts("\n  journaled: ");
+    vga_put_uint(journal_blocks_logged * FS_BLOCK_SIZE);
+    vga_puts(" bytes in ");
+    vga_put_uint(journal_blocks_logged);
+    vga_puts(" blocks, cache flushes: ");
+    vga_put_uint(journal_flushes);
+    vga_puts("\n");
+}
+
+// Check one journal half for a committed transaction newer than the
+// superblock, walking each descriptor and the blocks behind it; returns
+// its block count, 0 if there is none. With home set the blocks are also
+// copied to their home sectors, which only a walk already found valid
+// may do.
+static uint32_t filesystem_journal_walk(storage_device_t* device, fs_superblock_t* super, uint32_t half,
+                                        uint32_t* sequence, int home) {
+    fs_journal_block_t descriptor;
+    fs_journal_block_t commit;
+    uint32_t end = half + super->journal_sectors / 2;
+    uint32_t position = half;
+    uint32_t logged = 0;
+    uint32_t total = 0;
+    int crc = super->version >= FS_FORMAT_V5;
+    uint32_t checksum = crc ? 0 : FS_CHECKSUM_SEED;
+    do {
+        if (bcache_read(device, position, &descriptor) != 0 || descriptor.magic != FS_JOURNAL_MAGIC ||
+            descriptor.type != FS_JOURNAL_DESCRIPTOR || descriptor.layout != super->layout ||
+            descriptor.count == 0 || descriptor.count > FS_JOURNAL_TAGS || descriptor.count >= end - position - 1) {
+            return 0;
+        }
+        if (position == half) {
+            *sequence = descriptor.sequence;
+            total = descriptor.total ? descriptor.total : descriptor.count;
+            if ((int)(descriptor.sequence - super->generation) <= 0) {
+                return 0;
+            }
+        } else if (descriptor.sequence != *sequence || descriptor.total != total) {
+            return 0;
+        }
+        if (descriptor.count > total - logged) {
+            return 0;
+        }
+        for (uint32_t i = 0; i < descriptor.count; i++) {
+            if (descriptor.targets[i] >= super->data_start ||
+                (descriptor.targets[i] >= super->journal_start && descriptor.targets[i] < super->table_start)) {
+                return 0;
+            }
+        }
+        
+        if (crc) {
+            checksum = crc32c(checksum, descriptor.targets, descriptor.count * sizeof(uint32_t));
+        }
+        position++;
+        for (uint32_t i = 0; i < descriptor.count; i += FS_IO_SECTORS) {
+            uint32_t count = descriptor.count - i;
+            if (count > FS_IO_SECTORS) {
+                count = FS_IO_SECTORS;
+            }
+            if (bcache_read_blocks(device, position + i, count, fs_io_buffer) != 0) {
+                return 0;
+            }
+            checksum = crc ? crc32c(checksum, fs_io_buffer, count * FS_BLOCK_SIZE)
+                           : fs_checksum(checksum, fs_io_buffer, count * FS_BLOCK_SIZE);
+            for (uint32_t j = 0; home && j < count; j++) {
+                if (bcache_write(device, descriptor.targets[i + j], fs_io_buffer + j * FS_BLOCK_SIZE) != 0) {
+                    return 0;
+                }
+            }
+        }
+        position += descriptor.count;
+        logged += descriptor.count;
+    } while (logged < total);
+    
+    if (bcache_read(device, position, &commit) != 0 || commit.magic != FS_JOURNAL_MAGIC ||
+        commit.type != FS_JOURNAL_COMMIT || commit.sequence != *sequence ||
+        commit.count != total || commit.layout != super->layout) {
+        return 0;
+    }
+    return checksum == commit.checksum ? total : 0;
+}
+
+// Copy committed transactions newer than the superblock home, oldest
+// first, and reread the superblock. Returns -1 if that fails.
+int filesystem_replay_journal(storage_device_t* device, fs_superblock_t* super) {
+    if (!super->journal_sectors) {
+        return 0;
+    }
+    
+    for (int pass = 0; pass < 2; pass++) {
+        // The older of two valid halves goes first
+        uint32_t half = 0;
+        uint32_t sequence = 0;
+        for (uint32_t h = 0; h < 2; h++) {
+            uint32_t start = super->journal_start + h * (super->journal_sectors / 2);
+            uint32_t found;
+            if (filesystem_journal_walk(device, super, start, &found, 0) &&
+                (!half || (int)(found - sequence) < 0)) {
+                half = start;
+                sequence = found;
+            }
+        }
+        if (!half) {
+            break;
+        }
+        
+        if (!filesystem_journal_walk(device, super, half, &sequence, 1)) {
+            return -1;
+        }
+        if (save_barrier(device) != 0 || bcache_read(device, 0, super) != 0) {
+            return -1;
+        }
+        journal_replayed++;
+        vga_puts("Journal: replayed transaction ");
+        vga_put_uint(sequence);
+        vga_puts("\n");
+        if (!fs_superblock_current(super) || !fs_superblock_intact(super) || super->generation != sequence) {
+            return -1;
+        }
+    }
+    return 0;
+}
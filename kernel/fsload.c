@@ -0,0 +1,671 @@
+#include "pinefs.h"
+#include "io.h"
+#include "string.h"
+#include "bcache.h"
+#include "lz.h"
+#include "crc32c.h"
+
+// Reading the saved image. filesystem_load_from_storage() rebuilds the
+// tree from the inode table (or imports a version 1 image); file data
+// stays on the device and is read in on first access.
+
+#define FS_WALK_DEPTH (MAX_PATH / 2)
+
+// Read in a compressed file whole: its stream, in reads of up to
+// FS_IO_SECTORS, then each chunk decoded straight into its page.
+// Returns the number of sectors read, or -1.
+static int file_load_stream(file_entry_t* file) {
+    uint32_t stored = file_disk(file)->bytes;
+    uint32_t sectors = (stored + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+    uint32_t pages = (sectors * FS_BLOCK_SIZE + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint8_t* stream = load_device ? memory_alloc_pages(pages) : 0;
+    uint32_t size = file->size;
+    file->size = 0;
+    int result = stream ? file_grow(file, size) : -1;
+    file->size = size;
+    
+    for (uint32_t block = 0; result == 0 && block < sectors; ) {
+        uint32_t sector = file_disk_sector(file, block);
+        uint32_t count = 1;
+        while (block + count < sectors && count < FS_IO_SECTORS && file_disk_sector(file, block + count) == sector + count) {
+            count++;
+        }
+        result = bcache_read_blocks(load_device, sector, count, stream + block * FS_BLOCK_SIZE);
+        if (result == 0) {
+            result = save_check_sums(sector, count, stream + block * FS_BLOCK_SIZE);
+        }
+        block += count;
+    }
+    
+    uint32_t position = 0;
+    for (uint32_t offset = 0; result == 0 && offset < size; offset += FS_CHUNK_SIZE) {
+        fs_chunk_header_t header;
+        uint32_t raw = size - offset < FS_CHUNK_SIZE ? size - offset : FS_CHUNK_SIZE;
+        memory_copy(&header, stream + position, sizeof(header));
+        position += sizeof(header);
+        if (header.raw != raw || header.stored > raw || position + header.stored > stored) {
+            result = -1;
+        } else if (header.stored == raw) {
+            file_fill(file, offset, stream + position, raw);
+        } else if (lz_decompress(stream + position, header.stored, file_address(file, offset), raw) != (int)raw) {
+            result = -1;
+        }
+        position += header.stored;
+    }
+    
+    if (stream) {
+        memory_free_pages(stream, pages);
+    }
+    if (result != 0) {
+        vga_puts("Error: Cannot read in file: ");
+        vga_puts(filesystem_entry_name(file));
+        vga_puts("\n");
+        return -1;
+    }
+    file->flags &= ~FILE_FLAG_ON_DISK;
+    return sectors;
+}
+
+static int file_block_loaded(file_entry_t* file, uint32_t block) {
+    return file_disk(file)->loaded_blocks[block / 8] & (1 << (block % 8));
+}
+
+// Bring the sectors covering [offset, end) of a file still on disk into
+// memory. Missing sectors that follow each other on the device are read
+// with one request of up to FS_IO_SECTORS, straight into the file's pages,
+// which are all set aside on first access. Once every sector is in, the
+// file is an ordinary resident one. Nothing is marked dirty, since the
+// data matches the image. Returns the number of sectors read, or -1.
+int file_load_range(file_entry_t* file, uint32_t offset, uint32_t end) {
+    if (!(file->flags & FILE_FLAG_ON_DISK)) {
+        return 0;
+    }
+    if (file->flags & FILE_FLAG_COMPRESSED) {
+        return file_load_stream(file);
+    }
+    
+    file_disk_t* disk = file_disk(file);
+    uint32_t blocks = (file->size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+    if (!disk->loaded_blocks) {
+        uint32_t size = file->size;
+        file->size = 0;
+        int grown = load_device && file->disk ? file_grow(file, size) : -1;
+        file->size = size;
+        disk->loaded_blocks = grown == 0 ? memory_alloc(blocks / 8 + 1) : 0;
+        if (!disk->loaded_blocks) {
+            vga_puts("Error: Cannot read in file: ");
+            vga_puts(filesystem_entry_name(file));
+            vga_puts("\n");
+            return -1;
+        }
+        memory_set(disk->loaded_blocks, 0, blocks / 8 + 1);
+    }
+    
+    if (end > file->size) {
+        end = file->size;
+    }
+    uint32_t last = (end + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+    int sectors = 0;
+    for (uint32_t block = offset / FS_BLOCK_SIZE; block < last; ) {
+        if (file_block_loaded(file, block)) {
+            block++;
+            continue;
+        }
+        uint32_t sector = file_disk_sector(file, block);
+        uint32_t count = 1;
+        while (block + count < last && count < FS_IO_SECTORS && !file_block_loaded(file, block + count) &&
+               file_disk_sector(file, block + count) == sector + count) {
+            count++;
+        }
+        
+        if (bcache_read_blocks(load_device, sector, count, fs_io_buffer) != 0) {
+            vga_puts("Error: Failed to read sector ");
+            vga_put_uint(sector);
+            vga_puts("\n");
+            return -1;
+        }
+        if (save_check_sums(sector, count, fs_io_buffer) != 0) {
+            vga_puts("Error: Cannot read in file: ");
+            vga_puts(filesystem_entry_name(file));
+            vga_puts("\n");
+            return -1;
+        }
+        uint32_t bytes = count * FS_BLOCK_SIZE;
+        if (bytes > file->size - block * FS_BLOCK_SIZE) {
+            bytes = file->size - block * FS_BLOCK_SIZE;
+        }
+        file_fill(file, block * FS_BLOCK_SIZE, fs_io_buffer, bytes);
+        for (uint32_t i = 0; i < count; i++, block++) {
+            disk->loaded_blocks[block / 8] |= 1 << (block % 8);
+        }
+        sectors += count;
+    }
+    
+    for (uint32_t block = 0; block < blocks; block++) {
+        if (!file_block_loaded(file, block)) {
+            return sectors;
+        }
+    }
+    memory_free(disk->loaded_blocks);
+    disk->loaded_blocks = 0;
+    file->flags &= ~FILE_FLAG_ON_DISK;
+    return sectors;
+}
+
+// Read in all of a file still on disk
+int file_fault_in(file_entry_t* file) {
+    return file_load_range(file, 0, file->size) < 0 ? -1 : 0;
+}
+
+// 1 if reading [offset, end) of the file needs no device access
+int filesystem_cached(file_entry_t* file, unsigned int offset, unsigned int end) {
+    if (!(file->flags & FILE_FLAG_ON_DISK)) {
+        return 1;
+    }
+    if (!file_disk(file)->loaded_blocks) {
+        return 0;
+    }
+    if (end > file->size) {
+        end = file->size;
+    }
+    for (uint32_t block = offset / FS_BLOCK_SIZE; block * FS_BLOCK_SIZE < end; block++) {
+        if (!file_block_loaded(file, block)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Read [offset, end) of a file in ahead of use; returns sectors read
+int filesystem_prefetch(file_entry_t* file, unsigned int offset, unsigned int end) {
+    if (!file || file->type != FILE_TYPE_FILE) {
+        return -1;
+    }
+    return file_load_range(file, offset, end);
+}
+
+// Read in every file still on disk, before its runs may be reused
+int filesystem_fault_all(void) {
+    for (unsigned int ino = 1; ino < fs.next_entry; ino++) {
+        file_entry_t* entry = filesystem_entry(ino);
+        if (entry->used && file_fault_in(entry) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// 1 if a file loaded before entry holds exactly this run
+static int filesystem_run_claimed(disk_extent_t* extent, file_entry_t* entry) {
+    for (unsigned int ino = 1; ino < entry->ino; ino++) {
+        file_entry_t* other = filesystem_entry(ino);
+        file_disk_t* disk = file_disk(other);
+        for (uint32_t i = 0; other->used && i < disk->extent_count; i++) {
+            if (disk->extents[i].start == extent->start && disk->extents[i].sectors == extent->sectors) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Check a record's runs against the image, claim them in the rebuilt
+// bitmap and give them to the entry, if they cover at least needed
+// sectors. A run may only overlap one claimed before if it is the very
+// same run, shared by a reflink copy or a dedup pass.
+static int filesystem_claim_runs(fs_disk_inode_t* record, file_entry_t* entry, uint32_t needed) {
+    uint32_t total = 0;
+    for (uint32_t i = 0; i < record->extent_count; i++) {
+        disk_extent_t* extent = &record->data.extents[i];
+        if (extent->sectors == 0 || extent->start < save_super.data_start ||
+            extent->start >= save_super.total_sectors ||
+            extent->sectors > save_super.total_sectors - extent->start) {
+            return -1;
+        }
+        if (save_map_used(extent->start, extent->sectors)) {
+            if (!filesystem_run_claimed(extent, entry) || save_run_share(extent) != 0) {
+                return -1;
+            }
+        }
+        save_map_set(extent->start, extent->sectors, 1);
+        total += extent->sectors;
+    }
+    if (total < needed) {
+        return -1;
+    }
+    
+    file_disk_t* disk = file_disk_claim(entry);
+    if (!disk) {
+        return -1;
+    }
+    memory_copy(disk->extents, record->data.extents, record->extent_count * sizeof(disk_extent_t));
+    disk->extent_count = record->extent_count;
+    disk->sectors = total;
+    disk->bytes = record->stored;
+    return 0;
+}
+
+// Take over a file's saved data: its runs, left on disk to be read in as
+// needed, or the data held inline
+static int filesystem_load_extents(fs_disk_inode_t* record, file_entry_t* entry) {
+    uint32_t stored = record->stored ? record->stored : record->size;
+    uint32_t needed = (stored + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+    if (record->extent_count > FILE_DISK_EXTENTS ||
+        (record->extent_count == 0 && record->size > FS_DISK_INLINE) ||
+        (record->stored && (record->extent_count == 0 || record->size <= FS_DISK_INLINE))) {
+        return -1;
+    }
+    
+    if (record->extent_count) {
+        if (filesystem_claim_runs(record, entry, needed) != 0) {
+            return -1;
+        }
+        entry->size = record->size;
+        entry->flags |= FILE_FLAG_ON_DISK;
+        if (record->stored) {
+            entry->flags |= FILE_FLAG_COMPRESSED;
+        }
+    } else if (record->size > 0) {
+        entry->flags |= FILE_FLAG_ALL_DIRTY;
+        if (filesystem_write_at(entry, 0, record->data.inline_data, record->size) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Take over the runs of a directory's index, so the next save can write
+// it in place. The index itself is only read by lookups on the image and
+// fsck; loading links the tree from the records.
+static int filesystem_load_index(fs_disk_inode_t* record, file_entry_t* entry) {
+    if (record->extent_count == 0) {
+        return record->stored || record->size > FS_DIR_INLINE ? -1 : 0;
+    }
+    if (record->extent_count > FILE_DISK_EXTENTS || record->stored == 0 || record->stored % FS_BLOCK_SIZE ||
+        filesystem_claim_runs(record, entry, record->stored / FS_BLOCK_SIZE) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Rebuild the tree from the inode table. Slots are taken in order, so
+// after a reset slot i becomes inode i + 1 again; free slots go back on
+// the free list once every slot exists. The table is read in runs of
+// FS_IO_SECTORS sectors.
+static int filesystem_load_table(storage_device_t* device, fs_superblock_t* super) {
+    fs_disk_sector_t* records = (fs_disk_sector_t*)fs_io_buffer;
+    uint32_t per_read = FS_IO_SECTORS * DISK_INODES_PER_SECTOR;
+    
+    filesystem_reset();
+    for (uint32_t i = 0; i < super->total_entries; i++) {
+        if (i % per_read == 0) {
+            uint32_t sector = i / DISK_INODES_PER_SECTOR;
+            uint32_t count = (super->total_entries - i + DISK_INODES_PER_SECTOR - 1) / DISK_INODES_PER_SECTOR;
+            if (count > FS_IO_SECTORS) {
+                count = FS_IO_SECTORS;
+            }
+            if (bcache_read_blocks(device, super->table_start + sector, count, records) != 0) {
+                vga_puts("Error: Failed to read inode table\n");
+                return -1;
+            }
+            if (save_check_sums(super->table_start + sector, count, fs_io_buffer) != 0) {
+                return -1;
+            }
+        }
+        
+        fs_disk_inode_t* record = &records[(i % per_read) / DISK_INODES_PER_SECTOR].inodes[i % DISK_INODES_PER_SECTOR];
+        record->name[MAX_FILENAME - 1] = '\0';
+        
+        if (record->type == 0 && i > 0) {
+            file_entry_t* entry = inode_alloc();
+            if (!entry) {
+                vga_puts("Error: Out of inodes\n");
+                return -1;
+            }
+            entry->used = 0;
+            entry->type = 0;
+            entry->flags = 0;
+            entry->size = 0;
+            entry->disk = 0;
+            continue;
+        }
+        
+        if (record->type != FILE_TYPE_FILE && record->type != FILE_TYPE_DIR) {
+            vga_puts("Error: Invalid entry type in saved filesystem\n");
+            return -1;
+        }
+        if (i == 0 && (record->type != FILE_TYPE_DIR || strcmp(record->name, "/") != 0)) {
+            vga_puts("Error: Saved filesystem has no root directory\n");
+            return -1;
+        }
+        if ((i > 0 && (record->parent == 0 || !record->name[0])) ||
+            record->parent > super->total_entries || record->next > super->total_entries ||
+            record->children > super->total_entries) {
+            vga_puts("Error: Invalid entry link in saved filesystem\n");
+            return -1;
+        }
+        
+        file_entry_t* entry = filesystem_create_file(record->name, record->type);
+        if (!entry) {
+            vga_puts("Error: Out of inodes\n");
+            return -1;
+        }
+        entry->parent = record->parent;
+        entry->next = record->next;
+        entry->children = record->type == FILE_TYPE_DIR ? record->children : 0;
+        if (record->type == FILE_TYPE_FILE && filesystem_load_extents(record, entry) != 0) {
+            vga_puts("Error: Invalid data run in saved filesystem\n");
+            return -1;
+        }
+        if (record->type == FILE_TYPE_DIR && super->version >= FS_FORMAT_V6 &&
+            filesystem_load_index(record, entry) != 0) {
+            vga_puts("Error: Invalid directory index in saved filesystem\n");
+            return -1;
+        }
+        entry->version = filesystem_next_version();
+    }
+    
+    // Free slots, lowest first on the free list
+    for (uint32_t ino = super->total_entries; ino > 1; ino--) {
+        file_entry_t* entry = filesystem_entry(ino);
+        if (!entry->used) {
+            entry->next = fs.free_list;
+            fs.free_list = ino;
+            fs.live_entries--;
+        }
+    }
+    
+    // Walk every directory's children in their saved order. Each entry must
+    // be listed exactly once, under its own parent, and reach the root.
+    uint8_t* seen = memory_alloc(super->total_entries / 8 + 1);
+    if (!seen) {
+        vga_puts("Error: Out of memory\n");
+        return -1;
+    }
+    memory_set(seen, 0, super->total_entries / 8 + 1);
+    uint32_t linked = 1;
+    int result = 0;
+    for (uint32_t ino = 1; ino <= super->total_entries && result == 0; ino++) {
+        file_entry_t* dir = filesystem_entry(ino);
+        if (!dir->used || dir->type != FILE_TYPE_DIR) {
+            continue;
+        }
+        for (uint32_t child = dir->children; child && result == 0; child = filesystem_entry(child)->next) {
+            file_entry_t* entry = filesystem_entry(child);
+            if (child == 1 || !entry->used || entry->parent != ino || (seen[child / 8] & (1 << (child % 8)))) {
+                result = -1;
+                break;
+            }
+            seen[child / 8] |= 1 << (child % 8);
+            dcache_insert(entry);
+            linked++;
+        }
+    }
+    memory_free(seen);
+    
+    fs.root = filesystem_entry(1);
+    for (uint32_t ino = 2; ino <= super->total_entries && result == 0; ino++) {
+        file_entry_t* entry = filesystem_entry(ino);
+        uint32_t depth = 0;
+        while (entry->used && entry != fs.root && depth++ < FS_WALK_DEPTH) {
+            entry = filesystem_entry(entry->parent);
+        }
+        if (entry->used && entry != fs.root) {
+            result = -1;
+        }
+    }
+    if (result != 0 || linked != fs.live_entries) {
+        vga_puts("Error: Invalid entry link in saved filesystem\n");
+        return -1;
+    }
+    
+    fs.current_dir = fs.root;
+    return 0;
+}
+
+// Rebuild the tree from the version 1 entry records. Records arrive
+// parents first, and after a reset they get inode numbers 1, 2, ... in
+// order, so record i is inode i + 1.
+static int filesystem_load_entries_v1(storage_device_t* device, fs_superblock_t* header) {
+    fs_disk_sector_t records;
+    
+    filesystem_reset();
+    for (uint32_t i = 0; i < header->total_entries; i++) {
+        uint32_t slot = i % DISK_V1_ENTRIES_PER_SECTOR;
+        if (slot == 0) {
+            memory_set(&records, 0, sizeof(records));
+            if (bcache_read(device, 1 + i / DISK_V1_ENTRIES_PER_SECTOR, &records) != 0) {
+                vga_puts("Error: Failed to read file entries\n");
+                return -1;
+            }
+        }
+        
+        fs_disk_entry_v1_t* record = &records.v1_entries[slot];
+        record->name[MAX_FILENAME - 1] = '\0';
+        
+        // Validate entry data to prevent crashes
+        if (record->type != FILE_TYPE_FILE && record->type != FILE_TYPE_DIR) {
+            vga_puts("Error: Invalid entry type in saved filesystem\n");
+            return -1;
+        }
+        if (i == 0 && (record->type != FILE_TYPE_DIR || strcmp(record->name, "/") != 0)) {
+            vga_puts("Error: Saved filesystem has no root directory\n");
+            return -1;
+        }
+        
+        file_entry_t* parent = 0;
+        if (i > 0) {
+            parent = filesystem_entry(record->parent + 1);
+            if (record->parent >= i || parent->type != FILE_TYPE_DIR || !record->name[0]) {
+                vga_puts("Error: Invalid entry link in saved filesystem\n");
+                return -1;
+            }
+        }
+        
+        file_entry_t* entry = filesystem_create_file(record->name, record->type);
+        if (!entry) {
+            vga_puts("Error: Out of inodes\n");
+            return -1;
+        }
+        entry->size = record->type == FILE_TYPE_FILE ? record->size : 0;
+        
+        if (parent) {
+            entry->parent = parent->ino;
+            entry->next = parent->children;
+            parent->children = entry->ino;
+            dcache_insert(entry);
+        } else {
+            fs.root = entry;
+        }
+    }
+    
+    fs.current_dir = fs.root;
+    return 0;
+}
+
+// Version 1 file data is packed back to back in record order
+static void filesystem_load_data_v1(storage_device_t* device, fs_superblock_t* header) {
+    uint32_t current_sector = header->data_start;
+    for (uint32_t ino = 1; ino < fs.next_entry; ino++) {
+        file_entry_t* entry = filesystem_entry(ino);
+        if (entry->type != FILE_TYPE_FILE || entry->size == 0) {
+            continue;
+        }
+        
+        // The record gave the size; the file fills up as sectors are read
+        uint32_t size = entry->size;
+        uint32_t sectors_needed = (size + device->sector_size - 1) / device->sector_size;
+        entry->size = 0;
+        
+        // Validate current_sector to prevent reading beyond device
+        if (current_sector + sectors_needed > device->total_sectors) {
+            vga_puts("Warning: File data beyond device capacity, skipping\n");
+            break;
+        }
+        
+        // Read file data with comprehensive error checking
+        for (uint32_t s = 0; s < sectors_needed; s++) {
+            uint8_t sector_data[512];
+            memory_set(sector_data, 0, sizeof(sector_data)); // Initialize sector buffer
+            
+            if (bcache_read(device, current_sector + s, sector_data) != 0) {
+                vga_puts("Warning: Failed to read sector ");
+                vga_put_uint(current_sector + s);
+                vga_puts("\n");
+                break;
+            }
+            
+            uint32_t bytes_to_copy = device->sector_size;
+            if (bytes_to_copy > size - entry->size) {
+                bytes_to_copy = size - entry->size;
+            }
+            if (filesystem_write_at(entry, entry->size, sector_data, bytes_to_copy) < 0) {
+                vga_puts("Warning: Out of space for file: ");
+                vga_puts(filesystem_entry_name(entry));
+                vga_puts("\n");
+                break;
+            }
+        }
+        
+        current_sector += sectors_needed;
+    }
+}
+
+// Read the checksum table. A sector that fails its own check is dropped:
+// the sectors it covered go unverified until written again.
+static int filesystem_load_sums(storage_device_t* device) {
+    for (uint32_t sector = 0; sector < save_super.checksum_sectors; sector += FS_IO_SECTORS) {
+        uint32_t count = save_super.checksum_sectors - sector;
+        if (count > FS_IO_SECTORS) {
+            count = FS_IO_SECTORS;
+        }
+        uint32_t* sums = save_sums + sector * (FS_BLOCK_SIZE / 4);
+        if (bcache_read_blocks(device, save_super.checksum_start + sector, count, sums) != 0) {
+            vga_puts("Error: Failed to read checksum table\n");
+            return -1;
+        }
+        for (uint32_t i = 0; i < count; i++, sums += FS_BLOCK_SIZE / 4) {
+            if (sums[FS_SUMS_PER_SECTOR] == crc32c(0, sums, FS_SUMS_PER_SECTOR * 4)) {
+                continue;
+            }
+            vga_puts("Warning: Checksum table sector ");
+            vga_put_uint(save_super.checksum_start + sector + i);
+            vga_puts(" is damaged, its blocks go unverified\n");
+            memory_set(sums, 0, FS_BLOCK_SIZE);
+            save_sums_dirty[(sector + i) / 8] |= 1 << ((sector + i) % 8);
+            save_sums_dirty_count++;
+            save_sums_failed++;
+        }
+    }
+    return 0;
+}
+
+// The bitmap was rebuilt from the data runs; a saved one that disagrees
+// is rewritten by the next save
+static void filesystem_check_bitmap(storage_device_t* device) {
+    save_bitmap_dirty_lo = save_bitmap_dirty_hi = 0;
+    for (uint32_t sector = 0; sector < save_super.bitmap_sectors; sector += FS_IO_SECTORS) {
+        uint32_t count = save_super.bitmap_sectors - sector;
+        if (count > FS_IO_SECTORS) {
+            count = FS_IO_SECTORS;
+        }
+        if (bcache_read_blocks(device, save_super.bitmap_start + sector, count, fs_io_buffer) != 0 ||
+            memory_compare(fs_io_buffer, save_disk_map + sector * FS_BLOCK_SIZE, count * FS_BLOCK_SIZE) != 0) {
+            vga_puts("Warning: Free-space bitmap did not match the inode table, rebuilt\n");
+            save_bitmap_dirty_hi = save_super.bitmap_sectors;
+            return;
+        }
+    }
+}
+
+// Load filesystem from storage device
+int filesystem_load_from_storage(storage_device_t* device) {
+    if (!device) {
+        vga_puts("Error: No storage device specified\n");
+        return -1;
+    }
+    
+    vga_puts("Loading filesystem from ");
+    vga_puts(device->name);
+    vga_puts("...\n");
+    snapshot_drain();
+    
+    // Read superblock with error checking
+    fs_superblock_t super;
+    memory_set(&super, 0, sizeof(super)); // Initialize superblock
+    
+    if (bcache_read(device, 0, &super) != 0) {
+        vga_puts("Error: Failed to read filesystem header\n");
+        return -1;
+    }
+    
+    // Verify magic number, version and checksum
+    int v1 = fs_superblock_valid(&super, FS_FORMAT_V1);
+    if (!v1 && !fs_superblock_current(&super)) {
+        vga_puts("Error: Invalid filesystem format\n");
+        return -1;
+    }
+    if (!v1 && !fs_superblock_intact(&super)) {
+        vga_puts("Error: Superblock checksum mismatch\n");
+        return -1;
+    }
+    
+    vga_puts("Valid filesystem found, loading...\n");
+    
+    // Validate entry count to prevent buffer overflow
+    uint32_t v1_table_sectors = (super.total_entries + DISK_V1_ENTRIES_PER_SECTOR - 1) / DISK_V1_ENTRIES_PER_SECTOR;
+    if (!v1 && fs_superblock_sane(&super, device) && filesystem_replay_journal(device, &super) != 0) {
+        vga_puts("Error: Failed to replay the journal\n");
+        return -1;
+    }
+    if (v1 ? (super.total_entries > MAX_INODES || super.total_entries == 0 ||
+              super.data_start < 1 + v1_table_sectors || super.data_start >= device->total_sectors)
+           : !fs_superblock_sane(&super, device)) {
+        vga_puts("Error: Invalid entry count in saved filesystem\n");
+        return -1;
+    }
+    
+    int result;
+    if (v1) {
+        result = filesystem_load_entries_v1(device, &super);
+    } else if (save_map_init(super.total_sectors, super.version >= FS_FORMAT_V5 ? super.checksum_sectors : 0,
+                             super.table_sectors, super.journal_sectors) != 0) {
+        vga_puts("Error: Out of memory\n");
+        return -1;
+    } else {
+        result = filesystem_load_sums(device);
+        if (result == 0) {
+            result = filesystem_load_table(device, &super);
+        }
+    }
+    if (result != 0) {
+        vga_puts("Warning: Reinitializing filesystem\n");
+        filesystem_init();
+        return -1;
+    }
+    
+    if (v1) {
+        // Imported; the first save writes a current image
+        filesystem_load_data_v1(device, &super);
+    } else {
+        // The tree now matches the image on the device
+        filesystem_check_bitmap(device);
+        for (unsigned int ino = 1; ino < fs.next_entry; ino++) {
+            file_entry_t* entry = filesystem_entry(ino);
+            if (entry->used) {
+                file_clean(entry);
+            }
+        }
+        save_clear_records();
+        save_device = device;
+        load_device = device;
+        save_generation = super.generation;
+        save_super.generation = super.generation;
+        save_super.layout = super.layout;
+        save_compress = (super.flags & FS_SUPER_COMPRESS) != 0;
+    }
+    filesystem_remount();
+    
+    vga_puts("Filesystem loaded successfully\n");
+    return 0;
+}
@@ -0,0 +1,1407 @@
+#include "pinefs.h"
+#include "io.h"
+#include "string.h"
+#include "bcache.h"
+#include "clock.h"
+#include "lz.h"
+#include "crc32c.h"
+#include "vfs.h"
+
+// Writing the tree to storage. A save writes the changed files and then
+// the changed metadata as one commit, at once or in the background.
+
+// Save state. After a save or a load, save_device holds an image of the
+// tree laid out as save_super says. Changes since are tracked per inode
+// table sector and bitmap sector here and per data block in the entries,
+// so the next save writes only those.
+
+storage_device_t* save_device;
+storage_device_t* load_device;          // Where files not yet read in live
+uint32_t save_generation;
+fs_superblock_t save_super;
+uint8_t* save_disk_map;                 // The free-space bitmap
+uint32_t save_bitmap_dirty_lo;          // Bitmap sectors changed, [lo, hi)
+uint32_t save_bitmap_dirty_hi;
+uint8_t save_dirty_records[SAVE_MAX_TABLE_SECTORS / 8 + 1];
+uint32_t save_dirty_record_count;
+uint8_t fs_io_buffer[FS_IO_SECTORS * FS_BLOCK_SIZE];
+static uint8_t fs_chunk_buffer[FS_CHUNK_SIZE];
+int save_compress;                      // Volume setting, kept in the superblock
+uint32_t* save_sums;                    // The checksum table, as on disk
+uint8_t* save_sums_dirty;               // Checksum table sectors changed
+uint32_t save_sums_dirty_count;
+uint32_t save_sums_failed;              // Sectors that did not match on read
+
+// Data runs used by more than one file, after a reflink copy or a dedup
+// pass. Sharers always hold the run whole, and a changed file is moved
+// off its shared runs before its blocks are written.
+typedef struct save_shared_run {
+    uint32_t start;
+    uint32_t sectors;
+    uint32_t refs;
+} save_shared_run_t;
+
+static save_shared_run_t* save_shared;
+static uint32_t save_shared_count;
+static uint32_t save_shared_capacity;
+
+// Background save (FS_SAVE_ASYNC). When it starts, a commit is gathered
+// without writing anything: its generation is taken, each changed data
+// block is noted along with where its bytes are, and the metadata blocks
+// are filled in. File pages holding those bytes are marked shared, so a
+// later write copies the page instead of changing what the save will
+// write. filesystem_tick() then writes FS_SNAPSHOT_BLOCKS blocks a time
+// and finally commits the metadata through the journal.
+#define FS_SNAPSHOT_BLOCKS 32
+
+typedef struct save_block {
+    uint32_t sector;
+    uint8_t* data;
+    uint32_t copied;         // data is a private copy, freed once written
+} save_block_t;
+
+typedef struct save_held {
+    unsigned int addr;       // Pages kept for the save: pinned file pages
+    unsigned int pages;      // and compressed streams
+} save_held_t;
+
+static storage_device_t* snapshot_device;   // Set while a background save runs
+static save_block_t* snapshot_blocks;
+static uint32_t snapshot_block_count;
+static uint32_t snapshot_block_capacity;
+static uint32_t snapshot_next;              // Data blocks written so far
+static save_held_t* snapshot_held;
+static uint32_t snapshot_held_count;
+static uint32_t snapshot_held_capacity;
+static uint32_t* snapshot_targets;          // Metadata sectors, superblock last
+static uint8_t* snapshot_metadata;          // Their contents at the start
+static uint32_t snapshot_target_count;
+static uint32_t snapshot_started;
+static uint32_t snapshot_unshared;          // pages_unshared at the start
+static uint32_t snapshot_last_generation;   // Outcome of the last one
+static uint32_t snapshot_last_blocks;
+static uint32_t snapshot_last_ms;
+static uint32_t snapshot_last_copies;
+static int snapshot_last_result;
+static uint32_t snapshot_runs;
+
+static void snapshot_release(void);
+
+void save_mark_record(unsigned int ino) {
+    file_entry_t* entry = filesystem_entry(ino);
+    if (entry && !vfs_persistent(entry)) {
+        return;     // RAM-only entries have no record
+    }
+    uint32_t sector = (ino - 1) / DISK_INODES_PER_SECTOR;
+    if (sector < SAVE_MAX_TABLE_SECTORS && !(save_dirty_records[sector / 8] & (1 << (sector % 8)))) {
+        save_dirty_records[sector / 8] |= 1 << (sector % 8);
+        save_dirty_record_count++;
+    }
+}
+
+void save_clear_records(void) {
+    memory_set(save_dirty_records, 0, sizeof(save_dirty_records));
+    save_dirty_record_count = 0;
+}
+
+// Metadata blocks the next commit would write, superblock included
+uint32_t save_pending_blocks(void) {
+    uint32_t bitmap = save_bitmap_dirty_hi > save_bitmap_dirty_lo ? save_bitmap_dirty_hi - save_bitmap_dirty_lo : 0;
+    if (save_dirty_record_count == 0 && bitmap == 0 && save_sums_dirty_count == 0) {
+        return 0;
+    }
+    return save_dirty_record_count + bitmap + save_sums_dirty_count + 1;
+}
+
+// Checksum table slot of a device sector; 0 if the image has no table
+static uint32_t* save_sum_slot(uint32_t sector) {
+    if (!save_sums || sector >= save_super.total_sectors) {
+        return 0;
+    }
+    return &save_sums[sector / FS_SUMS_PER_SECTOR * (FS_BLOCK_SIZE / 4) + sector % FS_SUMS_PER_SECTOR];
+}
+
+// The checksum table sector covering sector will change
+static void save_mark_sum(uint32_t sector) {
+    uint32_t table_sector = sector / FS_SUMS_PER_SECTOR;
+    if (save_sums && !(save_sums_dirty[table_sector / 8] & (1 << (table_sector % 8)))) {
+        save_sums_dirty[table_sector / 8] |= 1 << (table_sector % 8);
+        save_sums_dirty_count++;
+    }
+}
+
+// Record the checksum of a sector about to be written
+static void save_set_sum(uint32_t sector, const void* data) {
+    uint32_t* slot = save_sum_slot(sector);
+    uint32_t sum = crc32c(0, data, FS_BLOCK_SIZE);
+    if (!slot || *slot == sum) {
+        return;
+    }
+    *slot = sum;
+    save_mark_sum(sector);
+}
+
+// Check count sectors just read from start against the table; reports and
+// returns -1 on a mismatch
+int save_check_sums(uint32_t start, uint32_t count, const uint8_t* data) {
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t* slot = save_sum_slot(start + i);
+        if (slot && *slot && *slot != crc32c(0, data + i * FS_BLOCK_SIZE, FS_BLOCK_SIZE)) {
+            save_sums_failed++;
+            vga_puts("Error: Checksum mismatch in sector ");
+            vga_put_uint(start + i);
+            vga_puts("\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Forget the image; the next save lays everything out again
+void save_invalidate(void) {
+    save_device = 0;
+    save_shared_count = 0;
+    snapshot_release();
+}
+
+static save_shared_run_t* save_run_find(disk_extent_t* extent) {
+    for (uint32_t i = 0; i < save_shared_count; i++) {
+        if (save_shared[i].start == extent->start && save_shared[i].sectors == extent->sectors) {
+            return &save_shared[i];
+        }
+    }
+    return 0;
+}
+
+// One more file uses the run
+int save_run_share(disk_extent_t* extent) {
+    save_shared_run_t* run = save_run_find(extent);
+    if (run) {
+        run->refs++;
+        return 0;
+    }
+    if (save_shared_count == save_shared_capacity) {
+        uint32_t capacity = save_shared_capacity ? save_shared_capacity * 2 : 16;
+        save_shared_run_t* runs = memory_alloc(capacity * sizeof(save_shared_run_t));
+        if (!runs) {
+            return -1;
+        }
+        if (save_shared) {
+            memory_copy(runs, save_shared, save_shared_count * sizeof(save_shared_run_t));
+            memory_free(save_shared);
+        }
+        save_shared = runs;
+        save_shared_capacity = capacity;
+    }
+    save_shared[save_shared_count].start = extent->start;
+    save_shared[save_shared_count].sectors = extent->sectors;
+    save_shared[save_shared_count].refs = 2;
+    save_shared_count++;
+    return 0;
+}
+
+// One file fewer uses the run; 1 if another still does
+static int save_run_drop(disk_extent_t* extent) {
+    save_shared_run_t* run = save_run_find(extent);
+    if (!run) {
+        return 0;
+    }
+    if (--run->refs == 1) {
+        *run = save_shared[--save_shared_count];
+    }
+    return 1;
+}
+
+// Bytes that would be stored again if every sharer had its own runs
+uint32_t save_bytes_shared(void) {
+    uint32_t sectors = 0;
+    for (uint32_t i = 0; i < save_shared_count; i++) {
+        sectors += (save_shared[i].refs - 1) * save_shared[i].sectors;
+    }
+    return sectors * FS_BLOCK_SIZE;
+}
+
+static int file_disk_shared(file_entry_t* file) {
+    file_disk_t* disk = file_disk(file);
+    for (uint32_t i = 0; save_shared_count && i < disk->extent_count; i++) {
+        if (save_run_find(&disk->extents[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int save_map_test(uint32_t sector) {
+    return save_disk_map[sector / 8] & (1 << (sector % 8));
+}
+
+void save_map_set(uint32_t start, uint32_t count, int used) {
+    for (uint32_t s = start; s < start + count && s < save_super.total_sectors; s++) {
+        if (!save_map_test(s) == !used) {
+            continue;
+        }
+        save_disk_map[s / 8] ^= 1 << (s % 8);
+        save_super.free_sectors += used ? -1 : 1;
+        
+        uint32_t sector = s / FS_BITMAP_BITS;
+        if (save_bitmap_dirty_lo >= save_bitmap_dirty_hi) {
+            save_bitmap_dirty_lo = sector;
+            save_bitmap_dirty_hi = sector + 1;
+        } else if (sector < save_bitmap_dirty_lo) {
+            save_bitmap_dirty_lo = sector;
+        } else if (sector >= save_bitmap_dirty_hi) {
+            save_bitmap_dirty_hi = sector + 1;
+        }
+    }
+}
+
+int save_map_used(uint32_t start, uint32_t count) {
+    for (uint32_t s = start; s < start + count; s++) {
+        if (save_map_test(s)) return 1;
+    }
+    return 0;
+}
+
+// First free run of count data sectors. Failing that, the first free run
+// of any length, shortened in *count; 0 if the device is full.
+static uint32_t save_map_find(uint32_t* count) {
+    uint32_t first = 0;
+    uint32_t first_length = 0;
+    uint32_t run = 0;
+    for (uint32_t s = save_super.data_start; s < save_super.total_sectors; s++) {
+        if (save_map_test(s)) {
+            run = 0;
+            continue;
+        }
+        if (++run == *count) {
+            return s + 1 - run;
+        }
+        if (run == 1 && !first) {
+            first = s;
+        }
+        if (s + 1 - run == first) {
+            first_length = run;
+        }
+    }
+    *count = first_length;
+    return first;
+}
+
+// Start an empty bitmap and checksum table for device: superblock,
+// bitmap, checksum table (none for an older image), journal and inode
+// table in front, everything after free
+int save_map_init(uint32_t total_sectors, uint32_t sums_sectors, uint32_t table_sectors,
+                         uint32_t journal_sectors) {
+    uint32_t bitmap_sectors = (total_sectors + FS_BITMAP_BITS - 1) / FS_BITMAP_BITS;
+    if (save_disk_map) {
+        memory_free(save_disk_map);
+    }
+    memory_free(save_sums);
+    memory_free(save_sums_dirty);
+    save_sums = 0;
+    save_sums_dirty = 0;
+    save_disk_map = memory_alloc(bitmap_sectors * FS_BLOCK_SIZE);
+    if (!save_disk_map) {
+        return -1;
+    }
+    memory_set(save_disk_map, 0, bitmap_sectors * FS_BLOCK_SIZE);
+    if (sums_sectors) {
+        save_sums = memory_alloc(sums_sectors * FS_BLOCK_SIZE);
+        save_sums_dirty = memory_alloc(sums_sectors / 8 + 1);
+        if (!save_sums || !save_sums_dirty) {
+            memory_free(save_sums);
+            save_sums = 0;
+            return -1;
+        }
+        memory_set(save_sums, 0, sums_sectors * FS_BLOCK_SIZE);
+        memory_set(save_sums_dirty, 0, sums_sectors / 8 + 1);
+    }
+    save_sums_dirty_count = 0;
+    save_shared_count = 0;
+    
+    memory_set(&save_super, 0, sizeof(save_super));
+    memory_copy(save_super.magic, "PINEFS\0\0", 8);
+    save_super.version = FS_FORMAT_VERSION;
+    save_super.total_sectors = total_sectors;
+    save_super.free_sectors = total_sectors;
+    save_super.bitmap_start = 1;
+    save_super.bitmap_sectors = bitmap_sectors;
+    save_super.checksum_start = 1 + bitmap_sectors;
+    save_super.checksum_sectors = sums_sectors;
+    save_super.journal_start = save_super.checksum_start + sums_sectors;
+    save_super.journal_sectors = journal_sectors;
+    save_super.table_start = save_super.journal_start + journal_sectors;
+    save_super.table_sectors = table_sectors;
+    save_super.data_start = save_super.table_start + table_sectors;
+    save_map_set(0, save_super.data_start, 1);
+    save_bitmap_dirty_lo = 0;
+    save_bitmap_dirty_hi = bitmap_sectors;
+    return 0;
+}
+
+// Mark the blocks covering [offset, end) as changed since the last save.
+// A file without data runs yet is written whole anyway.
+void file_mark_dirty(file_entry_t* file, unsigned int offset, unsigned int end) {
+    file_disk_t* disk = file_disk(file);
+    file->flags |= FILE_FLAG_DIRTY;
+    save_mark_record(file->ino);
+    if (!disk->sectors) {
+        file->flags |= FILE_FLAG_ALL_DIRTY;
+    }
+    if ((file->flags & FILE_FLAG_ALL_DIRTY) || end <= offset) {
+        return;
+    }
+    
+    unsigned int last = (end - 1) / FS_BLOCK_SIZE;
+    if (last >= disk->dirty_capacity) {
+        // Grow the map; without one every block counts as dirty
+        unsigned int capacity = (last + 64) & ~63u;
+        unsigned char* map = memory_alloc(capacity / 8);
+        if (!map) {
+            file->flags |= FILE_FLAG_ALL_DIRTY;
+            return;
+        }
+        memory_set(map, 0, capacity / 8);
+        if (disk->dirty_blocks) {
+            memory_copy(map, disk->dirty_blocks, disk->dirty_capacity / 8);
+            memory_free(disk->dirty_blocks);
+        }
+        disk->dirty_blocks = map;
+        disk->dirty_capacity = capacity;
+    }
+    for (unsigned int block = offset / FS_BLOCK_SIZE; block <= last; block++) {
+        disk->dirty_blocks[block / 8] |= 1 << (block % 8);
+    }
+}
+
+static int file_block_dirty(file_entry_t* file, unsigned int block) {
+    if (file->flags & FILE_FLAG_ALL_DIRTY) {
+        return 1;
+    }
+    file_disk_t* disk = file_disk(file);
+    return block < disk->dirty_capacity && (disk->dirty_blocks[block / 8] & (1 << (block % 8)));
+}
+
+// The file matches its saved image again
+void file_clean(file_entry_t* file) {
+    file_disk_t* disk = file_disk(file);
+    if (disk->dirty_blocks) {
+        memory_free(disk->dirty_blocks);
+        disk->dirty_blocks = 0;
+        disk->dirty_capacity = 0;
+    }
+    file->flags &= ~(FILE_FLAG_DIRTY | FILE_FLAG_ALL_DIRTY);
+    file_disk_put(file);
+}
+
+// Device sector holding a block of the file
+uint32_t file_disk_sector(file_entry_t* file, uint32_t block) {
+    file_disk_t* disk = file_disk(file);
+    for (uint32_t i = 0; i < disk->extent_count; i++) {
+        disk_extent_t* extent = &disk->extents[i];
+        if (block < extent->sectors) {
+            return extent->start + block;
+        }
+        block -= extent->sectors;
+    }
+    return 0;
+}
+
+// Drop the file's data runs, freeing those no other file uses in the
+// bitmap of the image
+void file_release_disk(file_entry_t* file) {
+    file_disk_t* disk = file_disk(file);
+    for (uint32_t i = 0; i < disk->extent_count; i++) {
+        if (!save_run_drop(&disk->extents[i]) && save_device) {
+            save_map_set(disk->extents[i].start, disk->extents[i].sectors, 0);
+        }
+    }
+    if (file->disk) {
+        disk->extent_count = 0;
+        disk->sectors = 0;
+        file_disk_put(file);
+    }
+}
+
+// The entry is going away: give back its data runs and sector maps
+void file_forget_disk(file_entry_t* file) {
+    file_disk_t* disk = file_disk(file);
+    if (disk->loaded_blocks) {
+        memory_free(disk->loaded_blocks);
+        disk->loaded_blocks = 0;
+    }
+    file->flags &= ~FILE_FLAG_ON_DISK;
+    file_release_disk(file);
+    file_clean(file);
+    save_mark_record(file->ino);
+}
+
+// Bytes the file takes in its data runs
+static uint32_t file_stored_size(file_entry_t* file) {
+    return (file->flags & FILE_FLAG_COMPRESSED) ? file_disk(file)->bytes : file->size;
+}
+
+// Copy src to the file at path dest without copying its data. Resident
+// pages are mapped by both files until either writes to one, and saved
+// data runs are shared on the device until either file changes. Returns
+// the number of pages shared, or -1 with dest left empty. Only files of
+// the saved tree share data.
+int filesystem_reflink(file_entry_t* src, const char* dest) {
+    if (!src || src->type != FILE_TYPE_FILE || !vfs_persistent(src)) {
+        return -1;
+    }
+    // Only an untouched or a fully resident file can be shared as a whole
+    if (file_disk(src)->loaded_blocks && file_fault_in(src) != 0) {
+        return -1;
+    }
+    file_entry_t* file = filesystem_open_for_write(dest);
+    if (!file || file == src || !vfs_persistent(file) || filesystem_truncate(file, 0) != 0) {
+        return -1;
+    }
+    file_release_disk(file);
+    file_clean(file);
+    file->flags &= ~FILE_FLAG_COMPRESSED;
+    
+    if (!(src->flags & (FILE_FLAG_EXTENTS | FILE_FLAG_ON_DISK))) {
+        return file_store(file, 0, src->data.inline_data, src->size) < 0 ? -1 : 0;
+    }
+    
+    int shared = 0;
+    if (src->flags & FILE_FLAG_EXTENTS) {
+        memory_set(&file->data, 0, sizeof(file->data));
+        file->flags |= FILE_FLAG_EXTENTS;
+        for (unsigned int i = 0; i < src->data.map.extent_count; i++) {
+            file_extent_t* extent = &src->data.map.extents[i];
+            unsigned int pages = 0;
+            while (pages < extent->pages && page_ref_add(extent->addr + pages * PAGE_SIZE) == 0) {
+                pages++;
+            }
+            if (pages && file_add_extent(file, extent->addr, pages) != 0) {
+                file_release_pages(extent->addr, pages);
+                pages = 0;
+            }
+            if (pages < extent->pages) {
+                file_free_extents(file);
+                return -1;
+            }
+            shared += pages;
+        }
+    }
+    
+    // Runs match the data only while src has no unsaved changes
+    file_disk_t* from = file_disk(src);
+    if (from->extent_count && !(src->flags & FILE_FLAG_DIRTY)) {
+        file_disk_t* disk = file_disk_claim(file);
+        for (uint32_t i = 0; disk && i < from->extent_count; i++) {
+            if (save_run_share(&from->extents[i]) != 0) {
+                break;
+            }
+            disk->extents[i] = from->extents[i];
+            disk->extent_count++;
+        }
+        if (!disk || disk->extent_count < from->extent_count) {
+            file_release_disk(file);
+            if (file->flags & FILE_FLAG_EXTENTS) {
+                file_free_extents(file);
+            }
+            return -1;
+        }
+        disk->sectors = from->sectors;
+        disk->bytes = from->bytes;
+        file->flags |= src->flags & FILE_FLAG_COMPRESSED;
+    }
+    
+    file->size = src->size;
+    file->flags |= src->flags & FILE_FLAG_ON_DISK;
+    if (file_disk(file)->extent_count) {
+        save_mark_record(file->ino);
+    } else {
+        file_mark_dirty(file, 0, file->size);
+    }
+    return shared;
+}
+
+// Add count sectors after the file's last run: grow that run in place
+// while the sectors after it are free, otherwise start a new run
+static int save_extend(file_entry_t* file, uint32_t count) {
+    file_disk_t* disk = file_disk_claim(file);
+    if (!disk) {
+        return -1;
+    }
+    
+    while (count > 0) {
+        disk_extent_t* last = disk->extent_count ? &disk->extents[disk->extent_count - 1] : 0;
+        uint32_t start;
+        uint32_t length = 0;
+        if (last) {
+            start = last->start + last->sectors;
+            while (length < count && start + length < save_super.total_sectors &&
+                   !save_map_test(start + length)) {
+                length++;
+            }
+        }
+        if (length > 0) {
+            last->sectors += length;
+        } else {
+            if (disk->extent_count == FILE_DISK_EXTENTS) {
+                return -1;
+            }
+            length = count;
+            start = save_map_find(&length);
+            if (!start) {
+                return -1;
+            }
+            disk->extents[disk->extent_count].start = start;
+            disk->extents[disk->extent_count].sectors = length;
+            disk->extent_count++;
+        }
+        save_map_set(start, length, 1);
+        disk->sectors += length;
+        count -= length;
+    }
+    return 0;
+}
+
+// Give back sectors past the first keep
+static void save_trim(file_entry_t* file, uint32_t keep) {
+    file_disk_t* disk = file_disk(file);
+    while (disk->sectors > keep) {
+        disk_extent_t* last = &disk->extents[disk->extent_count - 1];
+        uint32_t drop = disk->sectors - keep;
+        if (drop > last->sectors) {
+            drop = last->sectors;
+        }
+        last->sectors -= drop;
+        save_map_set(last->start + last->sectors, drop, 0);
+        disk->sectors -= drop;
+        if (last->sectors == 0) {
+            disk->extent_count--;
+        }
+    }
+    if (disk->extent_count == 0) {
+        file_release_disk(file);
+    }
+}
+
+// Fit the entry's runs to needed sectors, with room to grow to the next
+// page. One that cannot grow within FILE_DISK_EXTENTS runs is moved and
+// written whole.
+int save_fit(file_entry_t* entry, uint32_t needed) {
+    uint32_t reserve = (needed + 7) & ~7u;
+    uint32_t sectors = file_disk(entry)->sectors;
+    if (sectors >= needed) {
+        if (sectors > reserve) {
+            save_trim(entry, reserve);
+            save_mark_record(entry->ino);
+        }
+        return 0;
+    }
+    
+    save_mark_record(entry->ino);
+    if (save_extend(entry, reserve - sectors) == 0) {
+        return 0;
+    }
+    file_release_disk(entry);
+    entry->flags |= FILE_FLAG_DIRTY | FILE_FLAG_ALL_DIRTY;
+    if (save_extend(entry, reserve) == 0) {
+        return 0;
+    }
+    file_release_disk(entry);
+    return save_extend(entry, needed);
+}
+
+// Fit the file's data runs to its size. Small files live in the inode and
+// need none. A changed file whose runs other files share is moved,
+// never trimmed: a shrink marks the file changed (see pinefs_truncate).
+static int save_place(file_entry_t* file) {
+    if ((file->flags & FILE_FLAG_DIRTY) && file_disk_shared(file)) {
+        file_release_disk(file);
+        file->flags |= FILE_FLAG_ALL_DIRTY;
+    }
+    return save_fit(file, file->size <= FS_DISK_INLINE ? 0 : (file_stored_size(file) + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE);
+}
+
+// Compress a file into a stream in new pages: per chunk of FS_CHUNK_SIZE
+// a header, then the chunk compressed, or as is when compressing does
+// not make it smaller. Returns the stream length, or 0 when the stream
+// would not save at least one sector over the raw data.
+static uint32_t save_build_stream(file_entry_t* file, uint8_t** stream, uint32_t* pages) {
+    uint32_t raw_sectors = (file->size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+    uint32_t limit = (raw_sectors - 1) * FS_BLOCK_SIZE;
+    *pages = (limit + PAGE_SIZE - 1) / PAGE_SIZE;
+    *stream = raw_sectors > 1 ? memory_alloc_pages(*pages) : 0;
+    if (!*stream) {
+        return 0;
+    }
+    
+    uint32_t length = 0;
+    for (uint32_t offset = 0; offset < file->size; offset += FS_CHUNK_SIZE) {
+        fs_chunk_header_t header;
+        header.raw = file->size - offset < FS_CHUNK_SIZE ? file->size - offset : FS_CHUNK_SIZE;
+        if (length + sizeof(header) >= limit) {
+            length = 0;
+            break;
+        }
+        uint32_t room = limit - length - sizeof(header);
+        uint8_t* out = *stream + length + sizeof(header);
+        filesystem_read_at(file, offset, fs_chunk_buffer, header.raw);
+        header.stored = lz_compress(fs_chunk_buffer, header.raw, out, room < header.raw ? room : header.raw - 1u);
+        if (!header.stored) {
+            if (header.raw > room) {
+                length = 0;
+                break;
+            }
+            memory_copy(out, fs_chunk_buffer, header.raw);
+            header.stored = header.raw;
+        }
+        memory_copy(*stream + length, &header, sizeof(header));
+        length += sizeof(header) + header.stored;
+    }
+    
+    if (!length) {
+        memory_free_pages(*stream, *pages);
+        *stream = 0;
+    }
+    return length;
+}
+
+// Pick how a changed file is saved. With compression on, a file whose
+// stream saves space is stored compressed and the stream returned for
+// writing; otherwise it is stored as is, in full if its runs held a stream.
+static uint8_t* save_choose_format(file_entry_t* file, uint32_t* pages) {
+    uint8_t* stream = 0;
+    uint32_t length = 0;
+    if (save_compress && file->size > FS_DISK_INLINE) {
+        length = save_build_stream(file, &stream, pages);
+    }
+    file_disk_t* disk = length ? file_disk_claim(file) : 0;
+    if (length && !disk) {
+        memory_free_pages(stream, *pages);
+        stream = 0;
+        length = 0;
+    }
+    if (length) {
+        file->flags |= FILE_FLAG_COMPRESSED;
+        disk->bytes = length;
+    } else if (file->flags & FILE_FLAG_COMPRESSED) {
+        file->flags = (file->flags & ~FILE_FLAG_COMPRESSED) | FILE_FLAG_ALL_DIRTY;
+        if (file->disk) {
+            file_disk(file)->bytes = 0;
+        }
+    }
+    return stream;
+}
+
+// Keep pages for the background save until it is done. File pages (pin)
+// gain a reference, so a write to them copies the page first.
+int snapshot_hold(unsigned int addr, unsigned int pages, int pin) {
+    if (snapshot_held_count == snapshot_held_capacity) {
+        uint32_t capacity = snapshot_held_capacity ? snapshot_held_capacity * 2 : 64;
+        save_held_t* held = memory_alloc(capacity * sizeof(save_held_t));
+        if (!held) {
+            return -1;
+        }
+        if (snapshot_held) {
+            memory_copy(held, snapshot_held, snapshot_held_count * sizeof(save_held_t));
+            memory_free(snapshot_held);
+        }
+        snapshot_held = held;
+        snapshot_held_capacity = capacity;
+    }
+    if (pin && page_ref_add(addr) != 0) {
+        return -1;
+    }
+    snapshot_held[snapshot_held_count].addr = addr;
+    snapshot_held[snapshot_held_count].pages = pages;
+    snapshot_held_count++;
+    return 0;
+}
+
+// Write a data block of a commit, or, for a background save, note it to
+// be written later. copy: data will not stay put and is copied; otherwise
+// it lies in pages held for the save.
+int save_put_block(storage_device_t* device, uint32_t sector, uint8_t* data, int async, int copy) {
+    if (!async) {
+        save_set_sum(sector, data);
+        return bcache_write(device, sector, data);
+    }
+    
+    if (snapshot_block_count == snapshot_block_capacity) {
+        uint32_t capacity = snapshot_block_capacity ? snapshot_block_capacity * 2 : 256;
+        save_block_t* blocks = memory_alloc(capacity * sizeof(save_block_t));
+        if (!blocks) {
+            return -1;
+        }
+        if (snapshot_blocks) {
+            memory_copy(blocks, snapshot_blocks, snapshot_block_count * sizeof(save_block_t));
+            memory_free(snapshot_blocks);
+        }
+        snapshot_blocks = blocks;
+        snapshot_block_capacity = capacity;
+    }
+    if (copy) {
+        uint8_t* saved = memory_alloc(FS_BLOCK_SIZE);
+        if (!saved) {
+            return -1;
+        }
+        memory_copy(saved, data, FS_BLOCK_SIZE);
+        data = saved;
+    }
+    snapshot_blocks[snapshot_block_count].sector = sector;
+    snapshot_blocks[snapshot_block_count].data = data;
+    snapshot_blocks[snapshot_block_count].copied = copy;
+    snapshot_block_count++;
+    save_mark_sum(sector);
+    return 0;
+}
+
+// Drop whatever a background save still holds
+static void snapshot_release(void) {
+    for (uint32_t i = 0; i < snapshot_block_count; i++) {
+        if (snapshot_blocks[i].copied) {
+            memory_free(snapshot_blocks[i].data);
+        }
+    }
+    for (uint32_t i = 0; i < snapshot_held_count; i++) {
+        file_release_pages(snapshot_held[i].addr, snapshot_held[i].pages);
+    }
+    memory_free(snapshot_blocks);
+    memory_free(snapshot_held);
+    memory_free(snapshot_targets);
+    memory_free(snapshot_metadata);
+    snapshot_blocks = 0;
+    snapshot_held = 0;
+    snapshot_targets = 0;
+    snapshot_metadata = 0;
+    snapshot_block_count = snapshot_block_capacity = 0;
+    snapshot_held_count = snapshot_held_capacity = 0;
+    snapshot_target_count = 0;
+    snapshot_device = 0;
+}
+
+// Write a compressed file's stream over its runs; returns sectors written
+static int save_write_stream(storage_device_t* device, file_entry_t* file, uint8_t* stream, int async) {
+    uint32_t stored = file_disk(file)->bytes;
+    uint32_t sectors = (stored + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+    memory_set(stream + stored, 0, sectors * FS_BLOCK_SIZE - stored);
+    for (uint32_t block = 0; block < sectors; block++) {
+        if (save_put_block(device, file_disk_sector(file, block), stream + block * FS_BLOCK_SIZE, async, 0) != 0) {
+            return -1;
+        }
+    }
+    return sectors;
+}
+
+// A directory's record: its entry count and either the runs of its index
+// or, for a small directory, the index itself
+static void save_fill_dir(fs_disk_inode_t* record, file_entry_t* dir) {
+    file_disk_t* disk = file_disk(dir);
+    fs_index_pair_t* pairs = (fs_index_pair_t*)record->data.inline_data;
+    uint32_t count = 0;
+    for (uint32_t child = dir->children; child; child = filesystem_entry(child)->next) {
+        fs_index_pair_t pair = { filesystem_entry_hash(filesystem_entry(child)), child };
+        uint32_t i = count++;
+        if (disk->extent_count || i >= FS_DIR_INLINE) {
+            continue;
+        }
+        while (i > 0 && index_pair_less(&pair, &pairs[i - 1])) {
+            pairs[i] = pairs[i - 1];
+            i--;
+        }
+        pairs[i] = pair;
+    }
+    record->size = count;
+    if (disk->extent_count) {
+        memory_copy(record->data.extents, disk->extents, disk->extent_count * sizeof(disk_extent_t));
+        record->stored = disk->bytes;
+    }
+}
+
+static void save_fill_record(fs_disk_inode_t* record, file_entry_t* entry) {
+    file_disk_t* disk = file_disk(entry);
+    const char* name = filesystem_entry_name(entry);
+    memory_copy(record->name, name, strlen(name) + 1);
+    record->type = entry->type;
+    record->size = entry->size;
+    record->version = entry->version;
+    record->parent = entry->parent;
+    record->next = entry->next;
+    record->children = entry->children;
+    record->extent_count = disk->extent_count;
+    if (entry->type == FILE_TYPE_DIR) {
+        save_fill_dir(record, entry);
+    } else if (disk->extent_count) {
+        memory_copy(record->data.extents, disk->extents, disk->extent_count * sizeof(disk_extent_t));
+        record->stored = (entry->flags & FILE_FLAG_COMPRESSED) ? disk->bytes : 0;
+    } else if (entry->type == FILE_TYPE_FILE) {
+        filesystem_read_at(entry, 0, record->data.inline_data, FS_DISK_INLINE);
+    }
+}
+
+// Hash of the bytes in a file's data runs, as saved
+static int save_hash_runs(storage_device_t* device, file_entry_t* file, uint32_t* hash) {
+    uint8_t block[FS_BLOCK_SIZE];
+    uint32_t stored = file_stored_size(file);
+    *hash = 0;
+    for (uint32_t offset = 0; offset < stored; offset += FS_BLOCK_SIZE) {
+        uint32_t bytes = stored - offset < FS_BLOCK_SIZE ? stored - offset : FS_BLOCK_SIZE;
+        if (bcache_read(device, file_disk_sector(file, offset / FS_BLOCK_SIZE), block) != 0) {
+            return -1;
+        }
+        *hash = crc32c(*hash, block, bytes);
+    }
+    return 0;
+}
+
+// 1 if two files stored the same way hold the same saved bytes
+static int save_same_runs(storage_device_t* device, file_entry_t* a, file_entry_t* b) {
+    uint8_t block_a[FS_BLOCK_SIZE];
+    uint8_t block_b[FS_BLOCK_SIZE];
+    uint32_t stored = file_stored_size(a);
+    if (a->size != b->size || (a->flags & FILE_FLAG_COMPRESSED) != (b->flags & FILE_FLAG_COMPRESSED) ||
+        stored != file_stored_size(b)) {
+        return 0;
+    }
+    for (uint32_t offset = 0; offset < stored; offset += FS_BLOCK_SIZE) {
+        uint32_t bytes = stored - offset < FS_BLOCK_SIZE ? stored - offset : FS_BLOCK_SIZE;
+        if (bcache_read(device, file_disk_sector(a, offset / FS_BLOCK_SIZE), block_a) != 0 ||
+            bcache_read(device, file_disk_sector(b, offset / FS_BLOCK_SIZE), block_b) != 0 ||
+            memory_compare(block_a, block_b, bytes) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Dedup pass, run once every changed block is written. Files are sorted
+// by block hash, and only those with the same size and hash are compared
+// in full; a duplicate gives up its runs to share those of the lowest
+// numbered copy. A file holds at most FILE_DISK_EXTENTS runs, so blocks
+// are shared a whole file at a time. Returns the sectors given back.
+static uint32_t save_dedup(storage_device_t* device) {
+    fs_index_pair_t* pairs = memory_alloc(fs.next_entry * sizeof(fs_index_pair_t));
+    if (!pairs) {
+        return 0;
+    }
+    uint32_t free_before = save_super.free_sectors;
+    uint32_t count = 0;
+    for (unsigned int ino = 1; ino < fs.next_entry; ino++) {
+        file_entry_t* entry = filesystem_entry(ino);
+        if (entry->used && entry->type == FILE_TYPE_FILE && file_disk(entry)->extent_count &&
+            save_hash_runs(device, entry, &pairs[count].hash) == 0 && pairs[count].hash) {
+            pairs[count++].ref = ino;
+        }
+    }
+    index_sort(pairs, count);
+    
+    for (uint32_t group = 0; group < count; ) {
+        uint32_t end = group + 1;
+        while (end < count && pairs[end].hash == pairs[group].hash) {
+            end++;
+        }
+        for (uint32_t i = group + 1; i < end; i++) {
+            file_entry_t* dup = filesystem_entry(pairs[i].ref);
+            file_disk_t* to = file_disk(dup);
+            for (uint32_t j = group; j < i; j++) {
+                file_entry_t* entry = filesystem_entry(pairs[j].ref);
+                file_disk_t* from = file_disk(entry);
+                if (from->extents[0].start == to->extents[0].start || !save_same_runs(device, entry, dup)) {
+                    continue;
+                }
+                
+                uint32_t shared = 0;
+                while (shared < from->extent_count && save_run_share(&from->extents[shared]) == 0) {
+                    shared++;
+                }
+                if (shared < from->extent_count) {
+                    while (shared > 0) {
+                        save_run_drop(&from->extents[--shared]);
+                    }
+                    break;
+                }
+                
+                // Release the old runs in place: the record keeps its
+                // sector maps, which still fit the same bytes
+                for (uint32_t k = 0; k < to->extent_count; k++) {
+                    if (!save_run_drop(&to->extents[k])) {
+                        save_map_set(to->extents[k].start, to->extents[k].sectors, 0);
+                    }
+                }
+                memory_copy(to->extents, from->extents, shared * sizeof(disk_extent_t));
+                to->extent_count = shared;
+                to->sectors = from->sectors;
+                save_mark_record(pairs[i].ref);
+                break;
+            }
+        }
+        group = end;
+    }
+    memory_free(pairs);
+    return save_super.free_sectors - free_before;
+}
+
+// Contents of a metadata sector of the image: the superblock, a bitmap
+// sector, a checksum table sector or an inode table sector
+static void save_fill_block(uint32_t sector, void* buffer) {
+    memory_set(buffer, 0, FS_BLOCK_SIZE);
+    if (sector == 0) {
+        fs_superblock_t* super = (fs_superblock_t*)buffer;
+        memory_copy(super, &save_super, sizeof(save_super));
+        super->checksum = fs_superblock_checksum(super);
+    } else if (sector < save_super.bitmap_start + save_super.bitmap_sectors) {
+        memory_copy(buffer, save_disk_map + (sector - save_super.bitmap_start) * FS_BLOCK_SIZE, FS_BLOCK_SIZE);
+    } else if (sector < save_super.checksum_start + save_super.checksum_sectors) {
+        uint32_t* sums = (uint32_t*)buffer;
+        memory_copy(sums, save_sums + (sector - save_super.checksum_start) * (FS_BLOCK_SIZE / 4), FS_BLOCK_SIZE);
+        sums[FS_SUMS_PER_SECTOR] = crc32c(0, sums, FS_SUMS_PER_SECTOR * 4);
+    } else {
+        fs_disk_sector_t* records = (fs_disk_sector_t*)buffer;
+        uint32_t first = (sector - save_super.table_start) * DISK_INODES_PER_SECTOR + 1;
+        for (uint32_t slot = 0; slot < DISK_INODES_PER_SECTOR; slot++) {
+            file_entry_t* entry = filesystem_entry(first + slot);
+            if (entry && entry->used && vfs_persistent(entry)) {
+                save_fill_record(&records->inodes[slot], entry);
+            }
+        }
+    }
+}
+
+// Contents of metadata block i of a commit: filled in now, or earlier
+// into filled
+void save_metadata_block(uint32_t* targets, uint8_t* filled, uint32_t i, uint8_t* block) {
+    if (filled) {
+        memory_copy(block, filled + i * FS_BLOCK_SIZE, FS_BLOCK_SIZE);
+    } else {
+        save_fill_block(targets[i], block);
+    }
+}
+
+// Advance the background save by up to count data blocks; once they are
+// all out, commit its metadata. The checksum table sectors are filled in
+// only then, as the sums of the data blocks are taken as they are written.
+static void snapshot_step(uint32_t count) {
+    storage_device_t* device = snapshot_device;
+    for (; count > 0 && snapshot_next < snapshot_block_count; count--, snapshot_next++) {
+        save_block_t* block = &snapshot_blocks[snapshot_next];
+        save_set_sum(block->sector, block->data);
+        if (bcache_write(device, block->sector, block->data) != 0) {
+            vga_puts("Error: Background save failed to write file data\n");
+            snapshot_last_result = -1;
+            save_invalidate();
+            return;
+        }
+        if (block->copied) {
+            memory_free(block->data);
+            block->copied = 0;
+        }
+    }
+    if (snapshot_next < snapshot_block_count) {
+        return;
+    }
+    
+    for (uint32_t i = 0; i < snapshot_target_count; i++) {
+        uint32_t sector = snapshot_targets[i];
+        if (sector >= save_super.checksum_start && sector < save_super.checksum_start + save_super.checksum_sectors) {
+            save_fill_block(sector, snapshot_metadata + i * FS_BLOCK_SIZE);
+        }
+    }
+    if (save_write_metadata(device, snapshot_targets, snapshot_target_count, snapshot_metadata) != 0) {
+        vga_puts("Error: Background save failed to write filesystem metadata\n");
+        snapshot_last_result = -1;
+        save_invalidate();
+        return;
+    }
+    save_generation = save_super.generation;
+    if (save_sums_dirty) {
+        memory_set(save_sums_dirty, 0, save_super.checksum_sectors / 8 + 1);
+    }
+    save_sums_dirty_count = 0;
+    journal_last_commit = clock_get_ms();
+    if (journal_commits++ == 0) {
+        journal_first_commit = journal_last_commit;
+    }
+    
+    snapshot_last_result = 0;
+    snapshot_last_generation = save_generation;
+    snapshot_last_blocks = snapshot_block_count + snapshot_target_count;
+    snapshot_last_ms = journal_last_commit - snapshot_started;
+    snapshot_last_copies = pages_unshared - snapshot_unshared;
+    snapshot_runs++;
+    snapshot_release();
+}
+
+// Finish a background save before anything else touches the device
+void snapshot_drain(void) {
+    while (snapshot_device) {
+        snapshot_step(snapshot_block_count);
+    }
+}
+
+// Commit every change since the last commit to device as one transaction:
+// changed file blocks in place, then the changed bitmap and inode table
+// sectors and the superblock through the journal. After a failure the
+// next commit lays the image out afresh. With FS_SAVE_ASYNC nothing is
+// written yet: the commit is handed to the background save.
+static int filesystem_commit(storage_device_t* device, unsigned int flags, uint32_t* written,
+                             uint32_t* in_use, uint32_t* freed) {
+    uint32_t slots = fs.next_entry - 1;
+    uint32_t table_needed = (slots + DISK_INODES_PER_SECTOR - 1) / DISK_INODES_PER_SECTOR;
+    int async = (flags & FS_SAVE_ASYNC) != 0;
+    snapshot_drain();
+    
+    // Build on the image only if it is still the one this tree last wrote,
+    // in the current format
+    fs_superblock_t super;
+    memory_set(&super, 0, sizeof(super));
+    int valid = bcache_read(device, 0, &super) == 0 && fs_superblock_current(&super);
+    if (!valid || !fs_superblock_valid(&super, FS_FORMAT_VERSION) || !fs_superblock_intact(&super) ||
+        save_device != device || super.generation != save_generation || table_needed > save_super.table_sectors) {
+        save_generation = valid ? super.generation : 0;
+        if (save_layout(device, table_needed) != 0) {
+            save_invalidate();
+            return -1;
+        }
+    }
+    
+    // Fit data runs to file sizes before anything else is written.
+    // Changed compressed files go out whole right away.
+    *written = 0;
+    *in_use = 1 + save_super.bitmap_sectors + table_needed;
+    for (unsigned int ino = 1; ino < fs.next_entry; ino++) {
+        file_entry_t* entry = filesystem_entry(ino);
+        if (!entry->used || entry->type != FILE_TYPE_FILE || !vfs_persistent(entry)) {
+            continue;
+        }
+        uint32_t pages = 0;
+        uint8_t* stream = (entry->flags & FILE_FLAG_DIRTY) ? save_choose_format(entry, &pages) : 0;
+        if (save_place(entry) != 0) {
+            if (stream) {
+                memory_free_pages(stream, pages);
+            }
+            vga_puts("Error: Device full\n");
+            save_invalidate();
+            return -1;
+        }
+        if (stream) {
+            int sectors = save_write_stream(device, entry, stream, async);
+            if (async && sectors >= 0 && snapshot_hold((unsigned int)stream, pages, 0) != 0) {
+                sectors = -1;
+            }
+            if (!async || sectors < 0) {
+                memory_free_pages(stream, pages);
+            }
+            if (sectors < 0) {
+                vga_puts("Error: Failed to write file data\n");
+                save_invalidate();
+                return -1;
+            }
+            *written += sectors;
+            file_clean(entry);
+        }
+        if (file_disk(entry)->extent_count) {
+            *in_use += (file_stored_size(entry) + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+        }
+    }
+    
+    // Changed directories' indexes, written whole
+    for (unsigned int ino = 1; ino < fs.next_entry; ino++) {
+        file_entry_t* entry = filesystem_entry(ino);
+        if (!entry->used || entry->type != FILE_TYPE_DIR || !vfs_persistent(entry)) {
+            continue;
+        }
+        if (entry->flags & FILE_FLAG_DIRTY) {
+            int blocks = save_dir_index(device, entry, async);
+            if (blocks < 0) {
+                vga_puts("Error: Failed to write directory index\n");
+                save_invalidate();
+                return -1;
+            }
+            *written += blocks;
+        }
+        *in_use += file_disk(entry)->bytes / FS_BLOCK_SIZE;
+    }
+    
+    // Changed file blocks
+    for (unsigned int ino = 1; ino < fs.next_entry; ino++) {
+        file_entry_t* entry = filesystem_entry(ino);
+        if (!entry->used || !(entry->flags & FILE_FLAG_DIRTY)) {
+            continue;
+        }
+        uint32_t blocks = file_disk(entry)->extent_count ? (entry->size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE : 0;
+        for (uint32_t block = 0; block < blocks; block++) {
+            if (!file_block_dirty(entry, block)) {
+                continue;
+            }
+            // A background save writes whole blocks straight from the
+            // file's pages, held until then
+            int result;
+            if (async && (entry->flags & FILE_FLAG_EXTENTS) && (block + 1) * FS_BLOCK_SIZE <= entry->size) {
+                uint8_t* data = file_address(entry, block * FS_BLOCK_SIZE);
+                unsigned int page = (unsigned int)data & ~(PAGE_SIZE - 1);
+                int held = snapshot_held_count && snapshot_held[snapshot_held_count - 1].addr == page;
+                result = -1;
+                if (held || snapshot_hold(page, 1, 1) == 0) {
+                    result = save_put_block(device, file_disk_sector(entry, block), data, 1, 0);
+                }
+            } else {
+                uint8_t sector_data[FS_BLOCK_SIZE] = {0};
+                filesystem_read_at(entry, block * FS_BLOCK_SIZE, sector_data, FS_BLOCK_SIZE);
+                result = save_put_block(device, file_disk_sector(entry, block), sector_data, async, 1);
+            }
+            if (result != 0) {
+                vga_puts("Error: Failed to write file data\n");
+                save_invalidate();
+                return -1;
+            }
+            (*written)++;
+        }
+        file_clean(entry);
+    }
+    *freed = (flags & FS_SAVE_DEDUP) ? save_dedup(device) : 0;
+    
+    // Changed bitmap and inode table sectors, the checksum table sectors
+    // that cover them and the data, then the superblock
+    uint32_t* targets = memory_alloc((save_pending_blocks() + table_needed + save_super.checksum_sectors + 1) *
+                                     sizeof(uint32_t));
+    if (!targets) {
+        vga_puts("Error: Out of memory\n");
+        save_invalidate();
+        return -1;
+    }
+    uint32_t count = 0;
+    for (uint32_t sector = save_bitmap_dirty_lo; sector < save_bitmap_dirty_hi; sector++) {
+        targets[count++] = save_super.bitmap_start + sector;
+    }
+    for (uint32_t sector = 0; sector < table_needed; sector++) {
+        if (save_dirty_records[sector / 8] & (1 << (sector % 8))) {
+            targets[count++] = save_super.table_start + sector;
+        }
+    }
+    uint32_t capacity = save_pending_blocks() + table_needed + save_super.checksum_sectors + 1;
+    uint8_t* filled = async ? memory_alloc(capacity * FS_BLOCK_SIZE) : 0;
+    if (async && !filled) {
+        memory_free(targets);
+        vga_puts("Error: Out of memory\n");
+        save_invalidate();
+        return -1;
+    }
+    uint8_t block[FS_BLOCK_SIZE];
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t* contents = filled ? filled + i * FS_BLOCK_SIZE : block;
+        save_fill_block(targets[i], contents);
+        save_set_sum(targets[i], contents);
+    }
+    for (uint32_t sector = 0; sector < save_super.checksum_sectors; sector++) {
+        if (save_sums_dirty[sector / 8] & (1 << (sector % 8))) {
+            targets[count++] = save_super.checksum_start + sector;
+        }
+    }
+    targets[count++] = 0;
+    
+    save_super.total_entries = slots;
+    save_super.generation = save_generation + 1;
+    save_super.flags = save_compress ? FS_SUPER_COMPRESS : 0;
+    if (async) {
+        // The checksum table sectors are filled in as the background
+        // save finishes
+        save_fill_block(0, filled + (count - 1) * FS_BLOCK_SIZE);
+        snapshot_targets = targets;
+        snapshot_metadata = filled;
+        snapshot_target_count = count;
+        snapshot_next = 0;
+        snapshot_started = clock_get_ms();
+        snapshot_unshared = pages_unshared;
+        snapshot_device = device;
+        save_bitmap_dirty_lo = save_bitmap_dirty_hi = 0;
+        save_clear_records();
+        *written += count;
+        return 0;
+    }
+    int result = save_write_metadata(device, targets, count, 0);
+    memory_free(targets);
+    if (result != 0) {
+        vga_puts("Error: Failed to write filesystem metadata\n");
+        save_invalidate();
+        return -1;
+    }
+    save_generation = save_super.generation;
+    save_bitmap_dirty_lo = save_bitmap_dirty_hi = 0;
+    save_clear_records();
+    if (save_sums_dirty) {
+        memory_set(save_sums_dirty, 0, save_super.checksum_sectors / 8 + 1);
+    }
+    save_sums_dirty_count = 0;
+    *written += count;
+    
+    journal_last_commit = clock_get_ms();
+    if (journal_commits++ == 0) {
+        journal_first_commit = journal_last_commit;
+    }
+    return 0;
+}
+
+// Save filesystem to storage device. Only blocks changed since the image
+// on the device was written go out again: dirty file blocks, changed
+// bitmap and inode table sectors, and the superblock. FS_SAVE_DEDUP adds
+// a pass that stores files with identical contents once. FS_SAVE_ASYNC
+// returns once the changes are gathered and leaves the writing to
+// filesystem_tick().
+int filesystem_save(storage_device_t* device, unsigned int flags) {
+    if (!device) {
+        vga_puts("Error: No storage device specified\n");
+        return -1;
+    }
+    if ((flags & FS_SAVE_DEDUP) && (flags & FS_SAVE_ASYNC)) {
+        vga_puts("Error: Dedup needs a foreground save\n");
+        return -1;
+    }
+    
+    vga_puts("Saving filesystem to ");
+    vga_puts(device->name);
+    vga_puts("...\n");
+    
+    uint32_t written;
+    uint32_t in_use;
+    uint32_t freed;
+    if (filesystem_commit(device, flags, &written, &in_use, &freed) != 0) {
+        return -1;
+    }
+    
+    if (flags & FS_SAVE_ASYNC) {
+        vga_puts("Background save started: ");
+        vga_put_uint(written);
+        vga_puts(" blocks to write (generation ");
+        vga_put_uint(save_super.generation);
+        vga_puts("), see save --status\n");
+        return 0;
+    }
+    vga_puts("Filesystem saved: ");
+    vga_put_uint(written);
+    vga_puts(" blocks written, ");
+    vga_put_uint(in_use > written ? in_use - written : 0);
+    vga_puts(" unchanged blocks skipped (generation ");
+    vga_put_uint(save_generation);
+    vga_puts(")\n");
+    if (flags & FS_SAVE_DEDUP) {
+        vga_puts("Dedup: ");
+        vga_put_uint(freed);
+        vga_puts(" sectors (");
+        vga_put_uint(freed * FS_BLOCK_SIZE);
+        vga_puts(" bytes) given back\n");
+    }
+    return 0;
+}
+
+int filesystem_save_to_storage(storage_device_t* device) {
+    return filesystem_save(device, 0);
+}
+
+// Show how far a background save has got, or how the last one ended
+void filesystem_save_status(void) {
+    if (snapshot_device) {
+        uint32_t total = snapshot_block_count + snapshot_target_count;
+        vga_puts("Background save to ");
+        vga_puts(snapshot_device->name);
+        vga_puts(" (generation ");
+        vga_put_uint(save_super.generation);
+        vga_puts("): ");
+        vga_put_uint(snapshot_next);
+        vga_puts(" of ");
+        vga_put_uint(total);
+        vga_puts(" blocks written (");
+        vga_put_uint(total ? snapshot_next * 100 / total : 0);
+        vga_puts("%), ");
+        vga_put_uint(clock_get_ms() - snapshot_started);
+        vga_puts(" ms so far, ");
+        vga_put_uint(pages_unshared - snapshot_unshared);
+        vga_puts(" pages copied on write\n");
+        return;
+    }
+    
+    if (snapshot_runs == 0 && snapshot_last_result == 0) {
+        vga_puts("No background save has run\n");
+    } else if (snapshot_last_result != 0) {
+        vga_puts("Last background save failed\n");
+    } else {
+        vga_puts("Last background save: generation ");
+        vga_put_uint(snapshot_last_generation);
+        vga_puts(", ");
+        vga_put_uint(snapshot_last_blocks);
+        vga_puts(" blocks in ");
+        vga_put_uint(snapshot_last_ms);
+        vga_puts(" ms, ");
+        vga_put_uint(snapshot_last_copies);
+        vga_puts(" pages copied on write\n");
+    }
+    if (snapshot_runs) {
+        vga_put_uint(snapshot_runs);
+        vga_puts(" background saves completed\n");
+    }
+}
+
+// Compression applies to files as they are next saved after a change. The
+// setting goes into the superblock with the next commit.
+void filesystem_set_compression(int enabled) {
+    save_compress = enabled != 0;
+}
+
+// Show the compression setting and how much the compressed files save
+void filesystem_compression_stats(void) {
+    uint32_t files = 0;
+    uint32_t raw = 0;
+    uint32_t stored = 0;
+    for (unsigned int ino = 1; ino < fs.next_entry; ino++) {
+        file_entry_t* entry = filesystem_entry(ino);
+        if (entry->used && (entry->flags & FILE_FLAG_COMPRESSED)) {
+            files++;
+            raw += entry->size;
+            stored += file_disk(entry)->bytes;
+        }
+    }
+    
+    vga_puts("Compression: ");
+    vga_puts(save_compress ? "on" : "off");
+    vga_puts(", ");
+    vga_put_uint(files);
+    vga_puts(" files saved compressed, ");
+    vga_put_uint(raw);
+    vga_puts(" bytes in ");
+    vga_put_uint(stored);
+    vga_puts("\n");
+    lz_stats();
+}
+
+// Group commit, called from the kernel loop, which also drives a
+// background save. Once the tree is bound to a
+// device by a save or load, changes pile up in memory and go out in one
+// transaction when the commit interval has passed since the first of them,
+// or sooner once they fill the transaction size.
+void filesystem_tick(void) {
+    static uint32_t pending_since;
+    if (snapshot_device) {
+        snapshot_step(FS_SNAPSHOT_BLOCKS);
+        return;
+    }
+    if (!save_device || journal_interval_ms == 0) {
+        return;
+    }
+    
+    uint32_t pending = save_pending_blocks();
+    if (pending == 0) {
+        pending_since = 0;
+        return;
+    }
+    uint32_t now = clock_get_ms();
+    if (pending_since == 0) {
+        pending_since = now;
+    }
+    if (pending < journal_transaction_blocks && now - pending_since < journal_interval_ms) {
+        return;
+    }
+    
+    uint32_t written;
+    uint32_t in_use;
+    uint32_t freed;
+    filesystem_commit(save_device, 0, &written, &in_use, &freed);
+    pending_since = 0;
+}
@@ -124,6 +124,19 @@ void vga_puts(const char* str) {
     }
 }
 
+// Print an unsigned decimal number
+void vga_put_uint(unsigned int value) {
+    char digits[16];
+    int i = 0;
+    do {
+        digits[i++] = '0' + (value % 10);
+        value /= 10;
+    } while (value > 0);
+    while (i > 0) {
+        vga_putchar(digits[--i]);
+    }
+}
+
 void vga_set_color(unsigned char color) {
     vga_color = color;
 }
@@ -6,6 +6,7 @@ void vga_init(void);
 void vga_clear(void);
 void vga_putchar(char c);
 void vga_puts(const char* str);
+void vga_put_uint(unsigned int value);
 void vga_set_color(unsigned char color);
 void vga_set_cursor(int x, int y);
 void vga_scroll(void);
@@ -1,10 +1,19 @@
 #include "kernel.h"
 #include "string.h"
 #include "storage.h"
+#include "bcache.h"
 #include "user.h"
 #include "network.h"
 #include "netstack.h"
 #include "pci.h"
+#include "clock.h"
+#include "vm.h"
+#include "pipe.h"
+#include "shm.h"
+#include "thread.h"
+#include "event.h"
+#include "file.h"
+#include "vfs.h"
 
 // Multiboot header (provided by multiboot_header.asm)
 extern void multiboot_header(void);
@@ -12,6 +21,9 @@ extern void multiboot_header(void);
 // Function declarations
 void execute_command(const char* command);
 void kernel_loop(void);
+static int parse_uint(const char* text, uint32_t* value);
+static void cat_file(const char* name);
+static int copy_file(const char* src, const char* dest);
 
 // Global variables
 static int cursor_x = 0;
@@ -33,6 +45,7 @@ void kernel_init(void) {
     vga_init();
     keyboard_init();
     memory_init();
+    clock_init();
     process_init();
     filesystem_init();
     storage_init();
@@ -102,11 +115,122 @@ void kernel_loop(void) {
             }
         }
         
+        // Keep the shared clock page fresh
+        clock_update();
+        
+        // Timers, console input and sockets for event polls
+        event_tick();
+        
+        // Write back blocks past their flush deadline
+        bcache_tick();
+        
+        // Group commit of filesystem changes
+        filesystem_tick();
+        
         // Simple process scheduling
         process_schedule();
     }
 }
 
+// Parse an unsigned decimal number; -1 unless text is all digits
+static int parse_uint(const char* text, uint32_t* value) {
+    if (*text < '0' || *text > '9') return -1;
+    *value = 0;
+    while (*text >= '0' && *text <= '9') {
+        *value = *value * 10 + (*text++ - '0');
+    }
+    return *text ? -1 : 0;
+}
+
+// Print a file through a small buffer, whatever its size
+static void cat_file(const char* name) {
+    open_file_t* file = file_open(name, O_RDONLY);
+    if (!file) {
+        vga_puts("Error: File not found\n");
+        return;
+    }
+    file_retain(file);
+    
+    char buffer[256];
+    int count;
+    while ((count = file_read(file, buffer, sizeof(buffer))) > 0) {
+        for (int i = 0; i < count; i++) {
+            vga_putchar(buffer[i]);
+        }
+    }
+    
+    file_release(file);
+}
+
+// Copy a file from src to dest, sharing its data where possible and
+// otherwise going through a small buffer
+static int copy_file(const char* src, const char* dest) {
+    file_entry_t* src_entry = filesystem_find_file(src);
+    if (!src_entry || src_entry->type != FILE_TYPE_FILE) {
+        vga_puts("Error: Source file not found\n");
+        return -1;
+    }
+    // If dest exists and is a directory, error
+    file_entry_t* dest_entry = filesystem_find_file(dest);
+    if (dest_entry && dest_entry->type == FILE_TYPE_DIR) {
+        vga_puts("Error: Destination is a directory\n");
+        return -1;
+    }
+    if (dest_entry == src_entry) {
+        vga_puts("Error: Source and destination are the same file\n");
+        return -1;
+    }
+    
+    // Share the data; copy it only if that runs out of memory
+    int shared = filesystem_reflink(src_entry, dest);
+    if (shared >= 0) {
+        vga_puts("File copied: ");
+        vga_puts(src);
+        vga_puts(" -> ");
+        vga_puts(dest);
+        vga_puts(" (");
+        vga_put_uint(shared);
+        vga_puts(" pages shared)\n");
+        return 0;
+    }
+    
+    open_file_t* in = file_open(src, O_RDONLY);
+    if (!in) {
+        vga_puts("Error: Too many open files\n");
+        return -1;
+    }
+    file_retain(in);
+    open_file_t* out = file_open(dest, O_WRONLY | O_CREAT | O_TRUNC);
+    if (!out) {
+        file_release(in);
+        vga_puts("Error: Cannot create destination\n");
+        return -1;
+    }
+    file_retain(out);
+    
+    int result = 0;
+    char buffer[512];
+    int count;
+    while ((count = file_read(in, buffer, sizeof(buffer))) > 0) {
+        if (file_write(out, buffer, count) != count) {
+            vga_puts("Error: Out of space\n");
+            result = -1;
+            break;
+        }
+    }
+    
+    file_release(out);
+    file_release(in);
+    if (result == 0) {
+        vga_puts("File copied: ");
+        vga_puts(src);
+        vga_puts(" -> ");
+        vga_puts(dest);
+        vga_puts("\n");
+    }
+    return result;
+}
+
 // Command execution
 void execute_command(const char* command) {
     vga_puts("\n");
@@ -124,25 +248,39 @@ void execute_command(const char* command) {
         vga_puts("  process  - Show process status\n");
         vga_puts("  test     - Run memory test\n");
         vga_puts("  reboot   - Reboot system\n");
+        vga_puts("  uptime   - Show time since boot\n");
         vga_puts("  ls       - List directory contents\n");
         vga_puts("  cd       - Change directory\n");
         vga_puts("  pwd      - Print working directory\n");
         vga_puts("  mkdir    - Create directory\n");
         vga_puts("  touch    - Create empty file\n");
         vga_puts("  cat      - Display file contents\n");
-        vga_puts("  echo     - Write text to file\n");
+        vga_puts("  echo     - Write text to file (-a appends a line)\n");
         vga_puts("  rm       - Remove file\n");
         vga_puts("  rmdir    - Remove directory\n");
         vga_puts("  tree     - Show directory tree\n");
-        vga_puts("  cp       - Copy file\n");
-        vga_puts("  storage  - List storage devices\n");
-        vga_puts("  save     - Save filesystem to USB\n");
+        vga_puts("  cp       - Copy file (shares data until either copy changes)\n");
+        vga_puts("  dcache   - Show directory entry cache stats\n");
+        vga_puts("  inodes   - Show inode table and name area usage\n");
+        vga_puts("  storage  - List storage devices, block cache, read-ahead and compression stats\n");
+        vga_puts("  compress - Compress file data on save (compress on|off)\n");
+        vga_puts("  sync     - Write dirty cached blocks to storage\n");
+        vga_puts("  save     - Save filesystem to USB (--dedup stores duplicates once, --async | --status)\n");
         vga_puts("  load     - Load filesystem from USB\n");
         vga_puts("  format   - Format USB device\n");
+        vga_puts("  fsck     - Check every saved block against its checksum, and the directory indexes\n");
+        vga_puts("  lookup   - Find a path in the saved image through the directory indexes\n");
+        vga_puts("  mount    - List mounts (mount tmpfs <dir> adds a RAM-only one)\n");
+        vga_puts("  umount   - Remove a mount and the files in it\n");
+        vga_puts("  journal  - Journal stats (journal interval <ms> | size <blocks>)\n");
         vga_puts("  programs - List user programs\n");
-        vga_puts("  run      - Run user program\n");
+        vga_puts("  run      - Run user program (run a | b pipes programs)\n");
         vga_puts("  compile  - Compile C program from file\n");
         vga_puts("  unload   - Remove user program\n");
+        vga_puts("  sysstat  - Show system call statistics\n");
+        vga_puts("  ipcs     - Show shared memory segments and futex stats\n");
+        vga_puts("  vmbench  - Benchmark the bytecode interpreter\n");
+        vga_puts("  pipebench - Benchmark pipe copy vs page flipping\n");
         vga_puts("  ifconfig - Show/configure network interfaces\n");
         vga_puts("  dhcp     - Start DHCP client on interface\n");
         vga_puts("  wifi     - WiFi management (scan/connect/status)\n");
@@ -156,23 +294,19 @@ void execute_command(const char* command) {
     } else if (strcmp(command, "memory") == 0) {
         unsigned int free_mem = memory_get_free();
         vga_puts("Memory status:\n");
-        vga_puts("  Total: 1MB\n");
-        vga_puts("  Used: ");
-        // Print memory usage (simplified)
-        vga_puts("Unknown\n");
-        vga_puts("  Free: ");
-        // Print free memory (simplified)
-        vga_puts("Unknown\n");
+        vga_puts("  Kernel heap: ");
+        vga_put_uint(memory_used / 1024);
+        vga_puts(" KB used, ");
+        vga_put_uint(free_mem / 1024);
+        vga_puts(" KB free\n");
+        vga_puts("  User pages: ");
+        vga_put_uint(USER_PAGES_COUNT - memory_get_free_pages());
+        vga_puts(" granted, ");
+        vga_put_uint(memory_get_free_pages());
+        vga_puts(" free\n");
     } else if (strcmp(command, "process") == 0) {
         vga_puts("Process status:\n");
-        process_t* current = process_get_current();
-        if (current) {
-            vga_puts("  Current PID: ");
-            // Print PID (simplified)
-            vga_puts("1\n");
-        } else {
-            vga_puts("  No processes running\n");
-        }
+        thread_list_all();
     } else if (strcmp(command, "test") == 0) {
         vga_puts("Running memory test...\n");
         
@@ -188,6 +322,22 @@ void execute_command(const char* command) {
         } else {
             vga_puts("  Memory test: FAILED\n");
         }
+    } else if (strcmp(command, "uptime") == 0) {
+        uint32_t khz = clock_get_tsc_khz();
+        if (khz == 0) {
+            vga_puts("Clock not available (no TSC)\n");
+        } else {
+            uint32_t ms = clock_get_ms();
+            vga_puts("Up ");
+            vga_put_uint(ms / 1000);
+            vga_putchar('.');
+            vga_putchar('0' + (ms / 100) % 10);
+            vga_putchar('0' + (ms / 10) % 10);
+            vga_putchar('0' + ms % 10);
+            vga_puts(" s, TSC ");
+            vga_put_uint(khz / 1000);
+            vga_puts(" MHz\n");
+        }
     } else if (strcmp(command, "reboot") == 0) {
         vga_puts("Rebooting...\n");
         // In a real OS, this would trigger a reboot
@@ -221,15 +371,20 @@ void execute_command(const char* command) {
         // Handle cat command
         const char* name = command + 3;
         while (*name == ' ') name++; // Skip spaces
-        char* content = filesystem_read_file(name);
-        if (content) {
-            vga_puts(content);
-        }
+        cat_file(name);
     } else if (strncmp(command, "echo", 4) == 0) {
         // Handle echo command
         const char* args = command + 4;
         while (*args == ' ') args++; // Skip spaces
         
+        // "echo -a file text" appends a line instead of rewriting the file
+        int append = 0;
+        if (strncmp(args, "-a ", 3) == 0) {
+            append = 1;
+            args += 3;
+            while (*args == ' ') args++;
+        }
+        
         // Find the first space (separating filename from content)
         const char* filename = args;
         while (*args && *args != ' ') args++;
@@ -244,9 +399,14 @@ void execute_command(const char* command) {
             args++;
             
             // Write content to file
-            filesystem_write_file(temp, args);
+            if (append) {
+                filesystem_append(temp, args, strlen(args));
+                filesystem_append(temp, "\n", 1);
+            } else {
+                filesystem_write_file(temp, args);
+            }
         } else {
-            vga_puts("Usage: echo filename content\n");
+            vga_puts("Usage: echo [-a] filename content\n");
         }
     } else if (strncmp(command, "rm", 2) == 0) {
         // Handle rm command
@@ -284,7 +444,7 @@ void execute_command(const char* command) {
             // Now args points to dest
             while (*args == ' ') args++;
             if (*args) {
-                filesystem_cp(src_buf, args);
+                copy_file(src_buf, args);
             } else {
                 vga_puts("Usage: cp <src> <dest>\n");
             }
@@ -319,7 +479,39 @@ void execute_command(const char* command) {
                 }
             }
         }
-    } else if (strcmp(command, "save") == 0) {
+        bcache_stats();
+        file_readahead_stats();
+        filesystem_compression_stats();
+    } else if (strcmp(command, "compress on") == 0 || strcmp(command, "compress off") == 0) {
+        // Volume setting, used for files as they are next saved
+        filesystem_set_compression(command[10] == 'n');
+        vga_puts(command[10] == 'n' ? "Compression on\n" : "Compression off\n");
+    } else if (strcmp(command, "sync") == 0) {
+        if (bcache_sync(0) == 0) {
+            vga_puts("Cached blocks written to storage\n");
+        } else {
+            vga_puts("Error: Some blocks could not be written\n");
+        }
+    } else if (strncmp(command, "journal", 7) == 0 && (command[7] == ' ' || command[7] == '\0')) {
+        // Show or change the group commit settings
+        const char* args = command + 7;
+        while (*args == ' ') args++;
+        uint32_t value;
+        if (*args == '\0') {
+            filesystem_journal_stats();
+        } else if (strncmp(args, "interval ", 9) == 0 && parse_uint(args + 9, &value) == 0) {
+            filesystem_set_commit_interval(value);
+            vga_puts("Commit interval set\n");
+        } else if (strncmp(args, "size ", 5) == 0 && parse_uint(args + 5, &value) == 0 &&
+                   filesystem_set_transaction_size(value) == 0) {
+            vga_puts("Transaction size set\n");
+        } else {
+            vga_puts("Usage: journal [interval <ms> | size <blocks 1-120>]\n");
+        }
+    } else if (strcmp(command, "save --status") == 0) {
+        filesystem_save_status();
+    } else if (strcmp(command, "save") == 0 || strcmp(command, "save --dedup") == 0 ||
+               strcmp(command, "save --async") == 0) {
         // Save filesystem to first available storage device
         storage_device_t* storage_dev = 0;
         int device_count = storage_get_device_count();
@@ -332,7 +524,13 @@ void execute_command(const char* command) {
         }
         
         if (storage_dev) {
-            filesystem_save_to_storage(storage_dev);
+            unsigned int flags = 0;
+            if (strcmp(command, "save --dedup") == 0) {
+                flags = FS_SAVE_DEDUP;
+            } else if (strcmp(command, "save --async") == 0) {
+                flags = FS_SAVE_ASYNC;
+            }
+            filesystem_save(storage_dev, flags);
         } else {
             vga_puts("Error: No storage device found\n");
         }
@@ -374,6 +572,66 @@ void execute_command(const char* command) {
         } else {
             vga_puts("Error: No storage device found\n");
         }
+    } else if (strcmp(command, "fsck") == 0) {
+        // Scrub the first available storage device
+        storage_device_t* storage_dev = 0;
+        int device_count = storage_get_device_count();
+        for (int i = 0; i < device_count; i++) {
+            storage_device_t* dev = storage_get_device(i);
+            if (dev && (dev->type == STORAGE_TYPE_HDD || dev->type == STORAGE_TYPE_USB)) {
+                storage_dev = dev;
+                break;
+            }
+        }
+        
+        if (storage_dev) {
+            filesystem_fsck(storage_dev);
+        } else {
+            vga_puts("Error: No storage device found\n");
+        }
+    } else if (strncmp(command, "lookup", 6) == 0) {
+        // Find a path on the first available storage device
+        const char* path = command + 6;
+        while (*path == ' ') path++; // Skip spaces
+        storage_device_t* storage_dev = 0;
+        int device_count = storage_get_device_count();
+        for (int i = 0; i < device_count; i++) {
+            storage_device_t* dev = storage_get_device(i);
+            if (dev && (dev->type == STORAGE_TYPE_HDD || dev->type == STORAGE_TYPE_USB)) {
+                storage_dev = dev;
+                break;
+            }
+        }
+        
+        if (!*path) {
+            vga_puts("Usage: lookup <path>\n");
+        } else if (storage_dev) {
+            filesystem_lookup_saved(storage_dev, path);
+        } else {
+            vga_puts("Error: No storage device found\n");
+        }
+    } else if (strncmp(command, "mount", 5) == 0) {
+        // "mount" lists mounts, "mount <type> <dir>" adds one
+        const char* args = command + 5;
+        while (*args == ' ') args++; // Skip spaces
+        const char* dir = args;
+        while (*dir && *dir != ' ') dir++;
+        if (!*args) {
+            vfs_list_mounts();
+        } else if (*dir == ' ' && dir - args < 16) {
+            char type[16];
+            memory_copy(type, args, dir - args);
+            type[dir - args] = '\0';
+            while (*dir == ' ') dir++;
+            filesystem_mount(dir, type);
+        } else {
+            vga_puts("Usage: mount [tmpfs <dir>]\n");
+        }
+    } else if (strncmp(command, "umount", 6) == 0) {
+        // Handle umount command
+        const char* dir = command + 6;
+        while (*dir == ' ') dir++; // Skip spaces
+        filesystem_umount(dir);
     } else if (strcmp(command, "programs") == 0) {
         // List user programs
         user_list_programs();
@@ -381,7 +639,29 @@ void execute_command(const char* command) {
         // Run user program
         const char* prog_name = command + 3;
         while (*prog_name == ' ') prog_name++; // Skip spaces
-        if (strlen(prog_name) > 0) {
+        if (strchr(prog_name, '|')) {
+            // Split "a | b | c" into program names
+            char line[128];
+            char* names[USER_MAX_PIPELINE + 1];
+            int count = 0;
+            if (strlen(prog_name) >= (int)sizeof(line)) {
+                vga_puts("Error: Command too long\n");
+                return;
+            }
+            strcpy(line, prog_name);
+            char* start = line;
+            while (count <= USER_MAX_PIPELINE) {
+                char* bar = strchr(start, '|');
+                if (bar) *bar = '\0';
+                while (*start == ' ') start++;
+                char* end = start + strlen(start);
+                while (end > start && end[-1] == ' ') *--end = '\0';
+                names[count++] = start;
+                if (!bar) break;
+                start = bar + 1;
+            }
+            user_run_pipeline(names, count);
+        } else if (strlen(prog_name) > 0) {
             user_run_program(prog_name);
         } else {
             vga_puts("Usage: run <program_name>\n");
@@ -395,6 +675,18 @@ void execute_command(const char* command) {
         } else {
             vga_puts("Usage: compile <filename.c>\n");
         }
+    } else if (strcmp(command, "sysstat") == 0) {
+        user_show_syscall_stats();
+    } else if (strcmp(command, "dcache") == 0) {
+        filesystem_dcache_stats();
+    } else if (strcmp(command, "inodes") == 0) {
+        filesystem_inode_stats();
+    } else if (strcmp(command, "ipcs") == 0) {
+        shm_list();
+    } else if (strcmp(command, "vmbench") == 0) {
+        vm_benchmark();
+    } else if (strcmp(command, "pipebench") == 0) {
+        pipe_benchmark();
     } else if (strncmp(command, "unload", 6) == 0) {
         // Remove user program
         const char* prog_name = command + 6;
@@ -0,0 +1,244 @@
+#include "lz.h"
+#include "io.h"
+#include "memory.h"
+#include "clock.h"
+
+#define LZ_LAST_LITERALS 5      // The input always ends with literals
+#define LZ_MATCH_MARGIN  12     // No match starts this close to the end
+
+// Positions by hash of the four bytes there, as lz_base + offset. Entries
+// below lz_base are left over from earlier inputs, so the table never
+// needs clearing between calls.
+static uint32_t lz_table[1 << LZ_HASH_BITS];
+static uint32_t lz_base = 1;
+
+static uint32_t lz_calls;
+static uint32_t lz_incompressible;
+static uint64_t lz_bytes_in;
+static uint64_t lz_bytes_out;
+static uint64_t lz_compress_ns;
+static uint64_t lz_bytes_decoded;
+static uint64_t lz_decompress_ns;
+
+static uint32_t lz_read32(const uint8_t* p) {
+    return *(const uint32_t*)p;
+}
+
+static uint32_t lz_hash(uint32_t word) {
+    return (word * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Bytes a and b have in common before limit, compared a word at a time
+static uint32_t lz_match_length(const uint8_t* a, const uint8_t* b, const uint8_t* limit) {
+    const uint8_t* start = a;
+    while (a + 4 <= limit) {
+        uint32_t diff = lz_read32(a) ^ lz_read32(b);
+        if (diff) {
+            return a - start + (__builtin_ctz(diff) >> 3);
+        }
+        a += 4;
+        b += 4;
+    }
+    while (a < limit && *a == *b) {
+        a++;
+        b++;
+    }
+    return a - start;
+}
+
+static uint8_t* lz_put_length(uint8_t* out, uint32_t length) {
+    while (length >= 255) {
+        *out++ = 255;
+        length -= 255;
+    }
+    *out++ = length;
+    return out;
+}
+
+// Emit one sequence; match 0 ends the block. Returns 0 when out of room.
+static uint8_t* lz_sequence(uint8_t* out, uint8_t* out_end, const uint8_t* literals, uint32_t literal_count,
+                            uint32_t offset, uint32_t match) {
+    uint32_t worst = 1 + literal_count / 255 + 1 + literal_count + (match ? 2 + match / 255 + 1 : 0);
+    if (worst > (uint32_t)(out_end - out)) {
+        return 0;
+    }
+
+    uint8_t* token = out++;
+    *token = (literal_count < 15 ? literal_count : 15) << 4;
+    if (literal_count >= 15) {
+        out = lz_put_length(out, literal_count - 15);
+    }
+    memory_copy(out, literals, literal_count);
+    out += literal_count;
+
+    if (match) {
+        *out++ = offset & 0xFF;
+        *out++ = offset >> 8;
+        match -= LZ_MIN_MATCH;
+        *token |= match < 15 ? match : 15;
+        if (match >= 15) {
+            out = lz_put_length(out, match - 15);
+        }
+    }
+    return out;
+}
+
+uint32_t lz_compress(const void* src, uint32_t length, void* dst, uint32_t capacity) {
+    if (length > LZ_MAX_INPUT) {
+        return 0;
+    }
+    uint64_t started = clock_get_ns();
+    if (lz_base > 0xFFFFFFFFu - LZ_MAX_INPUT - 1) {
+        memory_set(lz_table, 0, sizeof(lz_table));
+        lz_base = 1;
+    }
+
+    const uint8_t* in = (const uint8_t*)src;
+    const uint8_t* end = in + length;
+    const uint8_t* match_limit = end - LZ_LAST_LITERALS;
+    const uint8_t* scan_end = length > LZ_MATCH_MARGIN ? end - LZ_MATCH_MARGIN : in;
+    const uint8_t* anchor = in;
+    uint8_t* out = (uint8_t*)dst;
+    uint8_t* out_end = out + capacity;
+
+    const uint8_t* p = in;
+    while (out && p < scan_end) {
+        uint32_t word = lz_read32(p);
+        uint32_t* slot = &lz_table[lz_hash(word)];
+        const uint8_t* ref = *slot >= lz_base ? in + (*slot - lz_base) : 0;
+        *slot = lz_base + (p - in);
+        if (!ref || lz_read32(ref) != word) {
+            p++;
+            continue;
+        }
+
+        uint32_t match = LZ_MIN_MATCH + lz_match_length(p + LZ_MIN_MATCH, ref + LZ_MIN_MATCH, match_limit);
+        out = lz_sequence(out, out_end, anchor, p - anchor, p - ref, match);
+        p += match;
+        anchor = p;
+    }
+    if (out) {
+        out = lz_sequence(out, out_end, anchor, end - anchor, 0, 0);
+    }
+    lz_base += length + 1;
+
+    lz_calls++;
+    lz_bytes_in += length;
+    lz_compress_ns += clock_get_ns() - started;
+    if (!out) {
+        lz_incompressible++;
+        lz_bytes_out += length;
+        return 0;
+    }
+    lz_bytes_out += out - (uint8_t*)dst;
+    return out - (uint8_t*)dst;
+}
+
+// Read an extended length; 0 past the end of the input
+static const uint8_t* lz_get_length(const uint8_t* in, const uint8_t* in_end, uint32_t* length) {
+    uint8_t byte;
+    do {
+        if (in >= in_end) {
+            return 0;
+        }
+        byte = *in++;
+        *length += byte;
+    } while (byte == 255);
+    return in;
+}
+
+int lz_decompress(const void* src, uint32_t length, void* dst, uint32_t capacity) {
+    uint64_t started = clock_get_ns();
+    const uint8_t* in = (const uint8_t*)src;
+    const uint8_t* in_end = in + length;
+    uint8_t* out = (uint8_t*)dst;
+    uint8_t* out_end = out + capacity;
+
+    while (in < in_end) {
+        uint8_t token = *in++;
+        uint32_t literals = token >> 4;
+        if (literals == 15 && !(in = lz_get_length(in, in_end, &literals))) {
+            return -1;
+        }
+        if (literals > (uint32_t)(in_end - in) || literals > (uint32_t)(out_end - out)) {
+            return -1;
+        }
+        memory_copy(out, in, literals);
+        in += literals;
+        out += literals;
+        if (in == in_end) {
+            break;
+        }
+
+        if (in_end - in < 2) {
+            return -1;
+        }
+        uint32_t offset = in[0] | (in[1] << 8);
+        in += 2;
+        uint32_t match = token & 15;
+        if (match == 15 && !(in = lz_get_length(in, in_end, &match))) {
+            return -1;
+        }
+        match += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (uint32_t)(out - (uint8_t*)dst) || match > (uint32_t)(out_end - out)) {
+            return -1;
+        }
+
+        // Matches may overlap their own output; whole words only once
+        // the source is at least a word behind
+        const uint8_t* ref = out - offset;
+        if (offset >= 4) {
+            for (; match >= 4; match -= 4, out += 4, ref += 4) {
+                *(uint32_t*)out = lz_read32(ref);
+            }
+        }
+        while (match-- > 0) {
+            *out++ = *ref++;
+        }
+    }
+
+    lz_bytes_decoded += out - (uint8_t*)dst;
+    lz_decompress_ns += clock_get_ns() - started;
+    return out - (uint8_t*)dst;
+}
+
+// MB/s for bytes processed in ns
+static uint32_t lz_rate(uint64_t bytes, uint64_t ns) {
+    uint64_t us = clock_div64(ns, 1000);
+    if (us == 0) {
+        return 0;
+    }
+    while (us > 0xFFFFFFFFu) {
+        us >>= 1;
+        bytes >>= 1;
+    }
+    return (uint32_t)clock_div64(bytes, (uint32_t)us);
+}
+
+void lz_stats(void) {
+    vga_puts("LZ codec: ");
+    if (lz_calls == 0) {
+        vga_puts("nothing compressed yet\n");
+    } else {
+        // Ratio in hundredths
+        uint32_t ratio = lz_bytes_out ? (uint32_t)clock_div64(lz_bytes_in * 100, (uint32_t)lz_bytes_out) : 0;
+        vga_put_uint((uint32_t)lz_bytes_in);
+        vga_puts(" -> ");
+        vga_put_uint((uint32_t)lz_bytes_out);
+        vga_puts(" bytes (");
+        vga_put_uint(ratio / 100);
+        vga_puts(".");
+        vga_putchar('0' + ratio / 10 % 10);
+        vga_putchar('0' + ratio % 10);
+        vga_puts(":1), ");
+        vga_put_uint(lz_incompressible);
+        vga_puts(" of ");
+        vga_put_uint(lz_calls);
+        vga_puts(" blocks stored as is\n");
+    }
+    vga_puts("  compress: ");
+    vga_put_uint(lz_rate(lz_bytes_in, lz_compress_ns));
+    vga_puts(" MB/s, decompress: ");
+    vga_put_uint(lz_rate(lz_bytes_decoded, lz_decompress_ns));
+    vga_puts(" MB/s\n");
+}
@@ -0,0 +1,30 @@
+#ifndef LZ_H
+#define LZ_H
+
+// Define our own integer types for bare-metal environment
+typedef unsigned int uint32_t;
+typedef unsigned short uint16_t;
+typedef unsigned char uint8_t;
+
+// LZ77 codec in the LZ4 block format: each sequence is a token (literal
+// count in the high nibble, match length - LZ_MIN_MATCH in the low one),
+// extra length bytes when a nibble is 15, the literals, then a 16-bit
+// little-endian match offset and extra match length bytes. The last
+// sequence has literals only. Matches are found through a hash of the next
+// four bytes and extended a word at a time.
+#define LZ_MIN_MATCH  4
+#define LZ_HASH_BITS  12
+#define LZ_MAX_INPUT  65535     // Offsets are 16 bits
+
+// Compress length bytes into at most capacity bytes; returns the
+// compressed size, or 0 if it does not fit (the data does not shrink
+// enough and is better stored as is)
+uint32_t lz_compress(const void* src, uint32_t length, void* dst, uint32_t capacity);
+
+// Decompress into at most capacity bytes; returns the size, or -1 if the
+// input is damaged
+int lz_decompress(const void* src, uint32_t length, void* dst, uint32_t capacity);
+
+void lz_stats(void);
+
+#endif
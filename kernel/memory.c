@@ -5,6 +5,11 @@ memory_block_t* memory_head = 0;
 unsigned int memory_total = 0;
 unsigned int memory_used = 0;
 
+// One bit per user page, set when granted
+static unsigned int user_page_bitmap[USER_PAGES_COUNT / 32];
+static unsigned int user_pages_free = USER_PAGES_COUNT;
+static unsigned int (*user_pages_reclaim)(unsigned int pages);
+
 // Memory initialization
 void memory_init(void) {
     // Initialize memory management
@@ -16,6 +21,10 @@ void memory_init(void) {
     memory_head->size = memory_total - sizeof(memory_block_t);
     memory_head->used = 0;
     memory_head->next = 0;
+    
+    // All user pages start out free
+    memory_set(user_page_bitmap, 0, sizeof(user_page_bitmap));
+    user_pages_free = USER_PAGES_COUNT;
 }
 
 // Memory allocation using first-fit algorithm
@@ -88,6 +97,97 @@ void memory_free(void* ptr) {
     }
 }
 
+// Page bitmap helpers
+static int page_is_used(unsigned int page) {
+    return (user_page_bitmap[page / 32] >> (page % 32)) & 1;
+}
+
+static void page_mark(unsigned int first, unsigned int count, int used) {
+    for (unsigned int page = first; page < first + count; page++) {
+        if (page_is_used(page) == used) continue;
+        if (used) {
+            user_page_bitmap[page / 32] |= 1u << (page % 32);
+            user_pages_free--;
+        } else {
+            user_page_bitmap[page / 32] &= ~(1u << (page % 32));
+            user_pages_free++;
+        }
+    }
+}
+
+// First fit search for a run of free user pages
+static void* page_find(unsigned int count) {
+    if (count > user_pages_free) return 0;
+    
+    unsigned int run = 0;
+    for (unsigned int page = 0; page < USER_PAGES_COUNT; page++) {
+        // Skip fully used words quickly
+        if (run == 0 && page % 32 == 0 && user_page_bitmap[page / 32] == 0xFFFFFFFF) {
+            page += 31;
+            continue;
+        }
+        
+        if (page_is_used(page)) {
+            run = 0;
+            continue;
+        }
+        
+        if (++run == count) {
+            unsigned int first = page + 1 - count;
+            page_mark(first, count, 1);
+            return (void*)(USER_PAGES_START + first * PAGE_SIZE);
+        }
+    }
+    return 0;
+}
+
+// Allocate a run of contiguous user pages, asking the cache to give some
+// back if none is free
+void* memory_alloc_pages(unsigned int count) {
+    if (count == 0) return 0;
+    
+    void* pages = page_find(count);
+    if (!pages && user_pages_reclaim && user_pages_reclaim(count) > 0) {
+        pages = page_find(count);
+    }
+    return pages;
+}
+
+void memory_set_reclaim(unsigned int (*reclaim)(unsigned int pages)) {
+    user_pages_reclaim = reclaim;
+}
+
+// Allocate user pages at a fixed address (used to grow a program break in place)
+void* memory_alloc_pages_at(void* addr, unsigned int count) {
+    unsigned int base = (unsigned int)addr;
+    if (count == 0 || base < USER_PAGES_START || (base & (PAGE_SIZE - 1))) return 0;
+    
+    unsigned int first = (base - USER_PAGES_START) / PAGE_SIZE;
+    if (first + count > USER_PAGES_COUNT) return 0;
+    
+    for (unsigned int page = first; page < first + count; page++) {
+        if (page_is_used(page)) return 0;
+    }
+    page_mark(first, count, 1);
+    return addr;
+}
+
+// Return user pages to the pool
+void memory_free_pages(void* addr, unsigned int count) {
+    unsigned int base = (unsigned int)addr;
+    if (count == 0 || base < USER_PAGES_START || (base & (PAGE_SIZE - 1))) return;
+    
+    unsigned int first = (base - USER_PAGES_START) / PAGE_SIZE;
+    if (first + count > USER_PAGES_COUNT) return;
+    
+    page_mark(first, count, 0);
+}
+
+// Get number of free user pages
+unsigned int memory_get_free_pages(void) {
+    return user_pages_free;
+}
+
 // Memory copy function
 void memory_copy(void* dest, const void* src, unsigned int size) {
     unsigned char* d = (unsigned char*)dest;
@@ -9,12 +9,25 @@ void memory_copy(void* dest, const void* src, unsigned int size);
 void memory_set(void* dest, unsigned char value, unsigned int size);
 unsigned int memory_get_free(void);
 
+// Page allocator for memory granted to user programs
+void* memory_alloc_pages(unsigned int count);
+void* memory_alloc_pages_at(void* addr, unsigned int count);
+void memory_free_pages(void* addr, unsigned int count);
+unsigned int memory_get_free_pages(void);
+// Called when a page request fails, to have a cache give pages back
+void memory_set_reclaim(unsigned int (*reclaim)(unsigned int pages));
+
 // Memory layout constants
 #define MEMORY_START 0x10000
 #define MEMORY_END   0x100000
 #define PAGE_SIZE    4096
 #define MAX_PAGES    64
 
+// User pages come from their own region so they never touch the kernel heap
+#define USER_PAGES_START 0x400000
+#define USER_PAGES_COUNT 1024
+#define USER_PAGES_END   (USER_PAGES_START + USER_PAGES_COUNT * PAGE_SIZE)
+
 // Memory block structure
 typedef struct memory_block {
     unsigned int size;
@@ -0,0 +1,266 @@
+#ifndef PINEFS_H
+#define PINEFS_H
+
+#include "filesystem.h"
+
+// Internals of the saved filesystem, shared by filesystem.c and the
+// modules that keep its tree on storage: fsformat.c, fsload.c, fssave.c,
+// fsjournal.c, fsindex.c and fsck.c.
+
+// Filesystem format for storage (version 7)
+// Sector 0: Superblock, naming the regions below, with its own CRC32C
+// Then: free-space bitmap, one bit per device sector
+// Then: checksum table, the CRC32C of every bitmap, inode table and data
+//       sector as last written, FS_SUMS_PER_SECTOR to a sector whose last
+//       word checks the sector itself. 0 means not known yet.
+// Then: journal, two halves that take turns logging the metadata blocks
+//       of a commit before they are written home. Each half has room for
+//       every metadata block of the image, so any commit is journaled.
+// Then: inode table, one record slot per inode (record i is inode i + 1)
+//       holding its parent, sibling and child links, and either up to
+//       FILE_DISK_EXTENTS data runs or, for small files, the data itself.
+//       A directory's record holds its index instead, see below.
+// Then: file data and directory index runs, in any order. A compressed
+//       file's runs hold a stream of chunks, each a header and up to
+//       FS_CHUNK_SIZE bytes of data compressed with the LZ codec, or as is
+//       if it did not shrink.
+//
+// Versions 3 and 4 have no checksums (and 3 no compressed files or
+// superblock flags), 5 no directory index, and 6 a journal of at most
+// FS_JOURNAL_TAGS blocks a half; they load as is, and the first save lays
+// the image out again. Version 1 stored records in tree
+// order with all file data packed after them; such images can still be
+// imported.
+
+#define FS_FORMAT_V1      1
+#define FS_FORMAT_V3      3
+#define FS_FORMAT_V4      4
+#define FS_FORMAT_V5      5
+#define FS_FORMAT_V6      6
+#define FS_FORMAT_VERSION 7
+#define FS_BLOCK_SIZE     512
+#define FS_BITMAP_BITS    (FS_BLOCK_SIZE * 8)
+#define FS_IO_SECTORS     16        // Sectors per sequential read on load
+#define FS_COMMIT_INTERVAL_MS 5000  // Default group commit interval
+#define FS_TRANSACTION_BLOCKS 64    // Default pending blocks that force a commit
+#define FS_CHUNK_SIZE     PAGE_SIZE // Raw bytes per compressed chunk
+#define FS_SUPER_COMPRESS 1         // Superblock flag: compress changed files
+#define FS_SUMS_PER_SECTOR (FS_BLOCK_SIZE / 4 - 1)
+
+typedef struct fs_superblock {
+    char magic[8];           // "PINEFS\0\0"
+    uint32_t version;        // Filesystem version
+    uint32_t total_entries;  // Entry records (v1) or inode slots in use
+    uint32_t data_start;     // First sector for file data
+    uint32_t generation;     // Bumped by every save
+    uint32_t total_sectors;  // Sectors covered by the bitmap
+    uint32_t free_sectors;
+    uint32_t bitmap_start;
+    uint32_t bitmap_sectors;
+    uint32_t table_start;
+    uint32_t table_sectors;  // Room for the inode table to grow into
+    uint32_t journal_start;
+    uint32_t journal_sectors;  // 0 if the image has no journal
+    uint32_t flags;          // FS_SUPER_*
+    uint32_t checksum_start;
+    uint32_t checksum_sectors;  // 0 before version 5
+    uint32_t checksum;       // CRC32C of the superblock with this field 0
+    uint32_t layout;         // Generation of the save that laid the image out
+    uint8_t reserved[436];   // Pad to a whole sector
+} fs_superblock_t;
+
+#define FS_DISK_INLINE (FILE_DISK_EXTENTS * sizeof(disk_extent_t))
+
+// One inode on disk; a slot of type 0 is free
+typedef struct fs_disk_inode {
+    char name[MAX_FILENAME];
+    uint32_t type;
+    uint32_t size;
+    uint32_t version;
+    uint32_t parent;         // Links by inode number, 0 for none
+    uint32_t next;
+    uint32_t children;
+    uint32_t extent_count;   // 0: the data (at most FS_DISK_INLINE) is inline
+    union {
+        disk_extent_t extents[FILE_DISK_EXTENTS];
+        uint8_t inline_data[FS_DISK_INLINE];
+    } data;
+    uint32_t stored;         // Length of the compressed stream, 0 if not compressed;
+                             // for a directory, of its index
+} fs_disk_inode_t;
+
+// Directory index, so one name can be found on the image without reading
+// the whole inode table. Entries are ordered by name hash (FNV-1a, as the
+// directory entry cache uses), then inode. A directory of up to
+// FS_DIR_INLINE entries keeps (hash, inode) pairs in its record's data
+// area; the names are in the records they point to. A bigger one has a
+// B+tree in data runs of its own: leaf blocks hold (hash, inode, name)
+// and link to the next leaf, interior blocks the lowest hash and block
+// number of each child. Blocks are numbered within the runs, leaves
+// first and the root last. The record's size is the entry count, and
+// stored the bytes the tree takes. The tree is rebuilt whole when the
+// directory changes.
+typedef struct fs_index_pair {
+    uint32_t hash;
+    uint32_t ref;            // Inode (inline), or child block (interior)
+} fs_index_pair_t;
+
+typedef struct fs_index_leaf {
+    uint32_t hash;
+    uint32_t ino;
+    char name[MAX_FILENAME];
+} fs_index_leaf_t;
+
+#define FS_DIR_INLINE         (FS_DISK_INLINE / sizeof(fs_index_pair_t))
+#define FS_INDEX_LEAF_ENTRIES ((FS_BLOCK_SIZE - 8) / sizeof(fs_index_leaf_t))
+#define FS_INDEX_LINKS        ((FS_BLOCK_SIZE - 8) / sizeof(fs_index_pair_t))
+#define FS_INDEX_NONE         0xFFFFFFFF
+#define FS_INDEX_DEPTH        8         // Levels a lookup follows at most
+
+typedef struct fs_index_block {
+    uint16_t level;          // 0 for a leaf
+    uint16_t count;
+    uint32_t next;           // Leaf: the next leaf, FS_INDEX_NONE after the last
+    union {
+        fs_index_leaf_t leaves[FS_INDEX_LEAF_ENTRIES];
+        fs_index_pair_t links[FS_INDEX_LINKS];
+    } u;
+} fs_index_block_t;
+
+typedef struct fs_chunk_header {
+    uint16_t raw;            // Bytes of file data
+    uint16_t stored;         // Bytes that follow; raw when kept as is
+} fs_chunk_header_t;
+
+// Version 1 entry; parent is the index of the parent's record
+typedef struct fs_disk_entry_v1 {
+    char name[MAX_FILENAME];
+    uint32_t type;
+    uint32_t size;
+    uint32_t version;
+    uint32_t parent;
+} fs_disk_entry_v1_t;
+
+#define DISK_INODES_PER_SECTOR (512 / sizeof(fs_disk_inode_t))
+#define DISK_V1_ENTRIES_PER_SECTOR (512 / sizeof(fs_disk_entry_v1_t))
+
+// Journal transaction: a descriptor naming the home sector of each of up
+// to FS_JOURNAL_TAGS logged blocks, those blocks, then the next descriptor
+// and its blocks until all are logged, and a commit block that makes it
+// count. One is replayed on load if its sequence is newer than the
+// superblock and it was written under the superblock's layout.
+#define FS_JOURNAL_MAGIC      0x4C4E524A  // "JRNL"
+#define FS_JOURNAL_DESCRIPTOR 1
+#define FS_JOURNAL_COMMIT     2
+#define FS_JOURNAL_TAGS       120         // Most blocks behind one descriptor
+
+typedef struct fs_journal_block {
+    uint32_t magic;
+    uint32_t type;
+    uint32_t sequence;       // Generation the transaction writes
+    uint32_t count;          // Blocks logged behind this descriptor; commit: in all
+    uint32_t checksum;       // Commit: CRC32C of each descriptor's targets and blocks
+    uint32_t targets[FS_JOURNAL_TAGS];
+    uint32_t layout;         // The superblock's layout when written
+    uint32_t total;          // Descriptor: blocks in the transaction, 0 before version 7
+    uint8_t reserved[4];     // Pad to a whole sector
+} fs_journal_block_t;
+
+typedef union fs_disk_sector {
+    uint8_t bytes[512];
+    fs_disk_inode_t inodes[DISK_INODES_PER_SECTOR];
+    fs_disk_entry_v1_t v1_entries[DISK_V1_ENTRIES_PER_SECTOR];
+} fs_disk_sector_t;
+
+#define SAVE_MAX_TABLE_SECTORS (MAX_INODES / DISK_INODES_PER_SECTOR)
+
+// filesystem.c
+extern unsigned int pages_unshared;      // Private copies made on write
+unsigned int dcache_hash_name(const char* name);
+unsigned int filesystem_entry_hash(const file_entry_t* entry);
+file_entry_t* inode_alloc(void);
+file_disk_t* file_disk(file_entry_t* file);
+file_disk_t* file_disk_claim(file_entry_t* file);
+void file_disk_put(file_entry_t* file);
+void dcache_insert(file_entry_t* entry);
+void filesystem_reset(void);
+void file_free_extents(file_entry_t* file);
+unsigned char* file_address(file_entry_t* file, unsigned int offset);
+int page_ref_add(unsigned int addr);
+void file_release_pages(unsigned int addr, unsigned int count);
+int file_add_extent(file_entry_t* file, unsigned int addr, unsigned int pages);
+void file_fill(file_entry_t* file, unsigned int offset, const unsigned char* data, unsigned int count);
+int file_grow(file_entry_t* file, unsigned int size);
+int file_store(file_entry_t* file, unsigned int offset, const void* data, unsigned int count);
+file_entry_t* filesystem_open_for_write(const char* name);
+void filesystem_remount(void);
+
+// fsformat.c
+int save_layout(storage_device_t* device, uint32_t table_needed);
+int fs_superblock_valid(fs_superblock_t* super, uint32_t version);
+int fs_superblock_current(fs_superblock_t* super);
+uint32_t fs_superblock_checksum(fs_superblock_t* super);
+int fs_superblock_intact(fs_superblock_t* super);
+int fs_superblock_sane(fs_superblock_t* super, storage_device_t* device);
+
+// fsload.c
+int file_load_range(file_entry_t* file, uint32_t offset, uint32_t end);
+int file_fault_in(file_entry_t* file);
+int filesystem_fault_all(void);
+
+// fssave.c
+extern storage_device_t* save_device;
+extern storage_device_t* load_device;   // Where files not yet read in live
+extern uint32_t save_generation;
+extern fs_superblock_t save_super;
+extern uint8_t* save_disk_map;          // The free-space bitmap
+extern uint32_t save_bitmap_dirty_lo;   // Bitmap sectors changed, [lo, hi)
+extern uint32_t save_bitmap_dirty_hi;
+extern uint8_t save_dirty_records[SAVE_MAX_TABLE_SECTORS / 8 + 1];
+extern uint32_t save_dirty_record_count;
+extern uint8_t fs_io_buffer[FS_IO_SECTORS * FS_BLOCK_SIZE];
+extern int save_compress;               // Volume setting, kept in the superblock
+extern uint32_t* save_sums;             // The checksum table, as on disk
+extern uint8_t* save_sums_dirty;        // Checksum table sectors changed
+extern uint32_t save_sums_dirty_count;
+extern uint32_t save_sums_failed;       // Sectors that did not match on read
+void save_mark_record(unsigned int ino);
+void save_clear_records(void);
+uint32_t save_pending_blocks(void);
+int save_check_sums(uint32_t start, uint32_t count, const uint8_t* data);
+void save_invalidate(void);
+int save_run_share(disk_extent_t* extent);
+uint32_t save_bytes_shared(void);
+void save_map_set(uint32_t start, uint32_t count, int used);
+int save_map_used(uint32_t start, uint32_t count);
+int save_map_init(uint32_t total_sectors, uint32_t sums_sectors, uint32_t table_sectors,
+                  uint32_t journal_sectors);
+void file_mark_dirty(file_entry_t* file, unsigned int offset, unsigned int end);
+void file_clean(file_entry_t* file);
+uint32_t file_disk_sector(file_entry_t* file, uint32_t block);
+void file_release_disk(file_entry_t* file);
+void file_forget_disk(file_entry_t* file);
+int save_fit(file_entry_t* entry, uint32_t needed);
+int snapshot_hold(unsigned int addr, unsigned int pages, int pin);
+int save_put_block(storage_device_t* device, uint32_t sector, uint8_t* data, int async, int copy);
+void save_metadata_block(uint32_t* targets, uint8_t* filled, uint32_t i, uint8_t* block);
+void snapshot_drain(void);
+
+// fsjournal.c
+extern uint32_t journal_interval_ms;
+extern uint32_t journal_transaction_blocks;
+extern uint32_t journal_last_commit;
+extern uint32_t journal_first_commit;
+extern uint32_t journal_commits;
+int save_write_metadata(storage_device_t* device, uint32_t* targets, uint32_t count, uint8_t* filled);
+int filesystem_replay_journal(storage_device_t* device, fs_superblock_t* super);
+
+// fsindex.c
+int index_pair_less(const fs_index_pair_t* a, const fs_index_pair_t* b);
+void index_sort(fs_index_pair_t* pairs, uint32_t count);
+int save_dir_index(storage_device_t* device, file_entry_t* dir, int async);
+int lookup_record(storage_device_t* device, fs_superblock_t* super, uint32_t ino, fs_disk_inode_t* record);
+int lookup_in_dir(storage_device_t* device, fs_superblock_t* super, fs_disk_inode_t* dir, const char* name,
+                  fs_disk_inode_t* found);
+
+#endif
@@ -0,0 +1,361 @@
+#include "pipe.h"
+#include "io.h"
+#include "user.h"
+#include "clock.h"
+#include "thread.h"
+
+#define PIPE_BENCH_BYTES (8 * 1024 * 1024)
+
+// Publish ring contents before moving head/tail
+#define pipe_barrier() __asm__ volatile ("" ::: "memory")
+
+// Create an empty pipe; ring pages are allocated on first write
+pipe_t* pipe_create(void) {
+    pipe_t* pipe = (pipe_t*)memory_alloc(sizeof(pipe_t));
+    if (!pipe) return 0;
+    memory_set(pipe, 0, sizeof(pipe_t));
+    return pipe;
+}
+
+static void pipe_destroy(pipe_t* pipe) {
+    event_detach_source(&pipe->poll);
+    for (int i = 0; i < PIPE_RING_PAGES; i++) {
+        if (pipe->pages[i]) {
+            memory_free_pages(pipe->pages[i], 1);
+        }
+    }
+    for (unsigned int i = 0; i < pipe->spare_count; i++) {
+        memory_free_pages(pipe->spare[i], 1);
+    }
+    memory_free(pipe);
+}
+
+// Take a reference to one end
+void pipe_retain(pipe_t* pipe, int write_end) {
+    if (write_end) {
+        pipe->writers++;
+    } else {
+        pipe->readers++;
+    }
+}
+
+// Drop a reference to one end; the other side sees EOF or a broken pipe
+void pipe_release(pipe_t* pipe, int write_end) {
+    if (write_end) {
+        pipe->writers--;
+        wait_queue_wake_all(&pipe->read_wait);
+    } else {
+        pipe->readers--;
+        wait_queue_wake_all(&pipe->write_wait);
+    }
+    if (pipe->readers == 0 || pipe->writers == 0) {
+        event_notify(&pipe->poll, EVENT_HUP);
+    }
+
+    if (pipe->readers == 0 && pipe->writers == 0) {
+        pipe_destroy(pipe);
+    }
+}
+
+// Ring page for the writer (reader may have taken the old one)
+static unsigned char* pipe_writer_page(pipe_t* pipe, unsigned int slot) {
+    if (!pipe->pages[slot]) {
+        if (pipe->spare_count > 0) {
+            pipe->pages[slot] = pipe->spare[--pipe->spare_count];
+        } else {
+            pipe->pages[slot] = memory_alloc_pages(1);
+        }
+    }
+    return pipe->pages[slot];
+}
+
+// Copy bytes into the ring. Returns bytes written, -1 if there are no
+// readers, or PIPE_WOULD_BLOCK with the caller queued when the ring is full.
+int pipe_write(pipe_t* pipe, const void* data, unsigned int count) {
+    const unsigned char* src = (const unsigned char*)data;
+    unsigned int written = 0;
+
+    if (pipe->readers == 0) {
+        return -1;
+    }
+
+    while (written < count) {
+        unsigned int space = PIPE_CAPACITY - (pipe->head - pipe->tail);
+        if (space == 0) break;
+
+        unsigned int pos = pipe->head % PIPE_CAPACITY;
+        unsigned int offset = pos % PAGE_SIZE;
+        unsigned char* page = pipe_writer_page(pipe, pos / PAGE_SIZE);
+        if (!page) break;
+
+        unsigned int chunk = PAGE_SIZE - offset;
+        if (chunk > space) chunk = space;
+        if (chunk > count - written) chunk = count - written;
+
+        memory_copy(page + offset, src + written, chunk);
+        pipe_barrier();
+        pipe->head += chunk;
+        written += chunk;
+    }
+
+    if (written == 0 && count > 0) {
+        wait_queue_sleep(&pipe->write_wait, thread_get_current());
+        return PIPE_WOULD_BLOCK;
+    }
+
+    pipe->bytes_copied += written;
+    wait_queue_wake_all(&pipe->read_wait);
+    event_notify(&pipe->poll, EVENT_IN);
+    return written;
+}
+
+// Copy bytes out of the ring. Returns bytes read, 0 at end of file, or
+// PIPE_WOULD_BLOCK with the caller queued when the ring is empty.
+int pipe_read(pipe_t* pipe, void* buffer, unsigned int count) {
+    unsigned char* dest = (unsigned char*)buffer;
+    unsigned int done = 0;
+
+    while (done < count) {
+        unsigned int avail = pipe->head - pipe->tail;
+        if (avail == 0) break;
+
+        unsigned int pos = pipe->tail % PIPE_CAPACITY;
+        unsigned int offset = pos % PAGE_SIZE;
+        unsigned int chunk = PAGE_SIZE - offset;
+        if (chunk > avail) chunk = avail;
+        if (chunk > count - done) chunk = count - done;
+
+        memory_copy(dest + done, pipe->pages[pos / PAGE_SIZE] + offset, chunk);
+        pipe_barrier();
+        pipe->tail += chunk;
+        done += chunk;
+    }
+
+    if (done == 0 && count > 0) {
+        if (pipe->writers == 0) {
+            return 0;
+        }
+        wait_queue_sleep(&pipe->read_wait, thread_get_current());
+        return PIPE_WOULD_BLOCK;
+    }
+
+    wait_queue_wake_all(&pipe->write_wait);
+    event_notify(&pipe->poll, EVENT_OUT);
+    return done;
+}
+
+// Move whole pages from the writer into the ring without copying. The
+// pages must be one complete grant of the process; otherwise, or when the
+// stream is not page aligned, the data is copied instead.
+int pipe_gift(pipe_t* pipe, process_t* process, void* addr, unsigned int count) {
+    unsigned int bytes = count * PAGE_SIZE;
+
+    if (pipe->readers == 0) {
+        return -1;
+    }
+    if (count == 0 || count > PIPE_RING_PAGES || ((unsigned int)addr & (PAGE_SIZE - 1)) ||
+        (pipe->head & (PAGE_SIZE - 1))) {
+        return pipe_write(pipe, addr, bytes);
+    }
+
+    if (PIPE_CAPACITY - (pipe->head - pipe->tail) < bytes) {
+        wait_queue_sleep(&pipe->write_wait, thread_get_current());
+        return PIPE_WOULD_BLOCK;
+    }
+
+    if (process_detach_pages(process, addr, count) != 0) {
+        return pipe_write(pipe, addr, bytes);
+    }
+
+    for (unsigned int i = 0; i < count; i++) {
+        unsigned int slot = (pipe->head % PIPE_CAPACITY) / PAGE_SIZE;
+        unsigned char* old = pipe->pages[slot];
+        pipe->pages[slot] = (unsigned char*)addr + i * PAGE_SIZE;
+        if (old) {
+            if (pipe->spare_count < PIPE_RING_PAGES) {
+                pipe->spare[pipe->spare_count++] = old;
+            } else {
+                memory_free_pages(old, 1);
+            }
+        }
+        pipe_barrier();
+        pipe->head += PAGE_SIZE;
+    }
+
+    pipe->pages_moved += count;
+    wait_queue_wake_all(&pipe->read_wait);
+    event_notify(&pipe->poll, EVENT_IN);
+    return bytes;
+}
+
+// Move one full ring page to the reader. Returns PAGE_SIZE with *page set,
+// or (with *page = 0) the bytes available to pipe_read, 0 at end of file,
+// or PIPE_WOULD_BLOCK.
+int pipe_take(pipe_t* pipe, process_t* process, void** page) {
+    unsigned int avail = pipe->head - pipe->tail;
+    *page = 0;
+
+    if (avail == 0) {
+        if (pipe->writers == 0) {
+            return 0;
+        }
+        wait_queue_sleep(&pipe->read_wait, thread_get_current());
+        return PIPE_WOULD_BLOCK;
+    }
+
+    unsigned int slot = (pipe->tail % PIPE_CAPACITY) / PAGE_SIZE;
+    if (avail < PAGE_SIZE || (pipe->tail & (PAGE_SIZE - 1)) ||
+        process_adopt_pages(process, pipe->pages[slot], 1) != 0) {
+        return avail;
+    }
+
+    *page = pipe->pages[slot];
+    pipe->pages[slot] = 0;
+    pipe_barrier();
+    pipe->tail += PAGE_SIZE;
+    pipe->pages_moved++;
+    wait_queue_wake_all(&pipe->write_wait);
+    event_notify(&pipe->poll, EVENT_OUT);
+    return PAGE_SIZE;
+}
+
+// Readiness of one end for event polls
+unsigned int pipe_poll(pipe_t* pipe, int write_end) {
+    unsigned int used = pipe->head - pipe->tail;
+
+    if (write_end) {
+        if (pipe->readers == 0) return EVENT_HUP;
+        return used < PIPE_CAPACITY ? EVENT_OUT : 0;
+    }
+    return (used ? EVENT_IN : 0) | (pipe->writers == 0 ? EVENT_HUP : 0);
+}
+
+// Print bytes per microsecond as MB/s with one decimal
+static void pipe_print_rate(const char* label, unsigned int bytes, uint64_t ns) {
+    uint32_t us = (uint32_t)clock_div64(ns, 1000);
+
+    vga_puts(label);
+    if (us == 0) {
+        vga_puts("n/a\n");
+        return;
+    }
+    uint32_t tenths = (uint32_t)clock_div64((uint64_t)bytes * 10, us);
+    vga_put_uint(tenths / 10);
+    vga_putchar('.');
+    vga_putchar('0' + tenths % 10);
+    vga_puts(" MB/s\n");
+}
+
+// Stream PIPE_BENCH_BYTES from a producer to a consumer process through
+// the syscall interface, switching whenever one side blocks
+static uint64_t pipe_bench_run(process_t* producer, process_t* consumer, int flip) {
+    uint32_t fds[2];
+    unsigned int sent = 0, received = 0;
+
+    process_switch(producer);
+    if (syscall_handler(SYS_PIPE, (uint32_t)fds, 0, 0) != 0) {
+        vga_puts("Error: Cannot create pipe\n");
+        return 0;
+    }
+
+    // Hand the read end to the consumer
+    pipe_t* pipe = (pipe_t*)process_get_fd(producer, fds[0])->object;
+    int rfd = process_install_fd(consumer, -1, FD_PIPE_READ, pipe);
+    int wfd = fds[1];
+    process_close_fd(producer, fds[0]);
+
+    void* out = process_map_pages(producer, 1);
+    void* in = process_map_pages(consumer, 1);
+    void* pending = 0;
+
+    uint64_t start = clock_get_ns();
+    while (received < PIPE_BENCH_BYTES && out && in && rfd >= 0) {
+        process_switch(producer);
+        while (sent < PIPE_BENCH_BYTES && producer->main_thread->state == PROCESS_RUNNING) {
+            int n;
+            if (flip) {
+                if (!pending) {
+                    pending = (void*)syscall_handler(SYS_MAP_PAGES, 1, 0, 0);
+                    if (!pending) break;
+                    *(unsigned int*)pending = sent;
+                }
+                n = syscall_handler(SYS_PIPE_GIFT, wfd, (uint32_t)pending, 1);
+                if (n > 0) pending = 0;
+            } else {
+                n = syscall_handler(SYS_WRITE, wfd, (uint32_t)out, PAGE_SIZE);
+            }
+            if (n <= 0) break;
+            sent += n;
+        }
+
+        process_switch(consumer);
+        while (received < PIPE_BENCH_BYTES && consumer->main_thread->state == PROCESS_RUNNING) {
+            int n;
+            if (flip) {
+                void* page;
+                n = syscall_handler(SYS_PIPE_TAKE, rfd, (uint32_t)&page, 0);
+                if (n == PAGE_SIZE) {
+                    syscall_handler(SYS_UNMAP_PAGES, (uint32_t)page, 1, 0);
+                } else if (n > 0) {
+                    n = syscall_handler(SYS_READ, rfd, (uint32_t)in, PAGE_SIZE);
+                }
+            } else {
+                n = syscall_handler(SYS_READ, rfd, (uint32_t)in, PAGE_SIZE);
+            }
+            if (n <= 0) break;
+            received += n;
+        }
+
+        if (sent < PIPE_BENCH_BYTES && producer->main_thread->state == PROCESS_BLOCKED &&
+            consumer->main_thread->state == PROCESS_BLOCKED) {
+            break;
+        }
+    }
+    uint64_t elapsed = clock_get_ns() - start;
+
+    if (received < PIPE_BENCH_BYTES) {
+        vga_puts("Warning: pipe benchmark stopped early\n");
+    }
+    if (pending) {
+        process_unmap_pages(producer, pending, 1);
+    }
+    process_close_fd(producer, wfd);
+    process_close_fd(consumer, rfd);
+    process_unmap_pages(producer, out, 1);
+    process_unmap_pages(consumer, in, 1);
+    return elapsed;
+}
+
+// Measure pipe throughput with copies and with page flipping
+void pipe_benchmark(void) {
+    if (clock_get_tsc_khz() == 0) {
+        vga_puts("Warning: no TSC, timings unavailable\n");
+    }
+
+    process_t* producer = process_create(0, USER_STACK_SIZE);
+    process_t* consumer = process_create(0, USER_STACK_SIZE);
+    if (!producer || !consumer) {
+        vga_puts("Error: Cannot create processes\n");
+        if (producer) {
+            process_switch(producer);
+            process_exit();
+        }
+        if (consumer) {
+            process_switch(consumer);
+            process_exit();
+        }
+        return;
+    }
+
+    vga_puts("Streaming ");
+    vga_put_uint(PIPE_BENCH_BYTES / (1024 * 1024));
+    vga_puts(" MB through a pipe in 4 KB writes\n");
+
+    pipe_print_rate("  copy:      ", PIPE_BENCH_BYTES, pipe_bench_run(producer, consumer, 0));
+    pipe_print_rate("  page flip: ", PIPE_BENCH_BYTES, pipe_bench_run(producer, consumer, 1));
+
+    process_switch(producer);
+    process_exit();
+    process_switch(consumer);
+    process_exit();
+}
@@ -0,0 +1,47 @@
+#ifndef PIPE_H
+#define PIPE_H
+
+#include "process.h"
+#include "event.h"
+
+// Pipe ring: PIPE_RING_PAGES page buffers used as one byte stream.
+// head is only advanced by the writer and tail only by the reader, so the
+// data path needs no lock (single producer, single consumer). Whole pages
+// can be handed over instead of copied: pipe_gift() moves a writer's
+// pages into the ring and pipe_take() moves a full ring page to the reader.
+#define PIPE_RING_PAGES 16
+#define PIPE_CAPACITY   (PIPE_RING_PAGES * PAGE_SIZE)
+
+// Returned when the caller has been put on the pipe's wait queue
+#define PIPE_WOULD_BLOCK (-2)
+
+typedef struct pipe {
+    volatile unsigned int head;          // Bytes ever written
+    volatile unsigned int tail;          // Bytes ever read
+    unsigned char* pages[PIPE_RING_PAGES];
+
+    // Writer side only: pages freed up by gifts, reused for copies
+    unsigned char* spare[PIPE_RING_PAGES];
+    unsigned int spare_count;
+
+    unsigned int readers;
+    unsigned int writers;
+    wait_queue_t read_wait;
+    wait_queue_t write_wait;
+    poll_head_t poll;
+
+    unsigned int bytes_copied;
+    unsigned int pages_moved;
+} pipe_t;
+
+pipe_t* pipe_create(void);
+void pipe_retain(pipe_t* pipe, int write_end);
+void pipe_release(pipe_t* pipe, int write_end);
+int pipe_write(pipe_t* pipe, const void* data, unsigned int count);
+int pipe_read(pipe_t* pipe, void* buffer, unsigned int count);
+int pipe_gift(pipe_t* pipe, process_t* process, void* addr, unsigned int count);
+int pipe_take(pipe_t* pipe, process_t* process, void** page);
+unsigned int pipe_poll(pipe_t* pipe, int write_end);
+void pipe_benchmark(void);
+
+#endif
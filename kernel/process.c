@@ -1,15 +1,20 @@
 #include "process.h"
+#include "pipe.h"
+#include "shm.h"
+#include "thread.h"
+#include "event.h"
+#include "socket.h"
+#include "file.h"
 
 // Global variables
-process_t* current_process = 0;
 process_t* process_list = 0;
 unsigned int next_pid = 1;
 
 // Process initialization
 void process_init(void) {
-    current_process = 0;
     process_list = 0;
     next_pid = 1;
+    thread_init();
 }
 
 // Create a new process
@@ -27,12 +32,29 @@ process_t* process_create(void (*entry_point)(void), unsigned int stack_size) {
     
     // Initialize process
     process->pid = next_pid++;
-    process->state = PROCESS_READY;
-    process->stack = stack;
-    process->stack_size = stack_size;
     process->entry_point = entry_point;
+    process->brk_start = 0;
+    process->brk = 0;
+    process->brk_mapped = 0;
+    memory_set(process->grants, 0, sizeof(process->grants));
+    memory_set(process->fds, 0, sizeof(process->fds));
+    for (int i = 0; i < 3; i++) {
+        process->fds[i].type = FD_CONSOLE;
+    }
+    process->shm_attached = 0;
+    process->main_thread = 0;
+    process->threads = 0;
+    process->thread_count = 0;
     process->next = 0;
     
+    // The main thread keeps the stack
+    if (!thread_attach(process, stack, stack_size)) {
+        process_release_memory(process);
+        memory_free(stack);
+        memory_free(process);
+        return 0;
+    }
+    
     // Add to process list
     if (!process_list) {
         process_list = process;
@@ -49,10 +71,9 @@ process_t* process_create(void (*entry_point)(void), unsigned int stack_size) {
 
 // Start a process
 void process_start(process_t* process) {
-    if (!process || process->state != PROCESS_READY) return;
+    if (!process || process->main_thread->state != PROCESS_READY) return;
     
-    process->state = PROCESS_RUNNING;
-    current_process = process;
+    thread_make_current(process->main_thread);
     
     // In a real OS, this would set up the process context
     // and jump to the entry point. For simplicity, we'll
@@ -62,87 +83,335 @@ void process_start(process_t* process) {
     }
 }
 
-// Yield control to another process
+// Yield control to another thread
 void process_yield(void) {
-    if (!current_process) return;
-    
-    // Find next ready process
-    process_t* next = current_process->next;
-    while (next && next->state != PROCESS_READY) {
-        next = next->next;
-    }
-    
-    if (!next) {
-        // Look from beginning of list
-        next = process_list;
-        while (next && next->state != PROCESS_READY) {
-            next = next->next;
-        }
-    }
-    
-    if (next && next != current_process) {
-        current_process->state = PROCESS_READY;
-        next->state = PROCESS_RUNNING;
-        current_process = next;
-        
-        // In a real OS, this would perform context switch
-        // For now, we'll just return and let the scheduler
-        // handle it in the main loop
-    }
+    thread_yield();
 }
 
-// Exit current process
+// Exit the current process: every thread, its files and its memory.
+// Called from the process's main thread; the stack it runs on carries on
+// as the kernel's.
 void process_exit(void) {
-    if (!current_process) return;
-    
-    current_process->state = PROCESS_TERMINATED;
+    process_t* process = process_get_current();
+    if (!process) return;
+    if (thread_get_current() != process->main_thread) {
+        // Other threads only end themselves
+        thread_exit(0);
+        return;
+    }
     
     // Free process resources
-    if (current_process->stack) {
-        memory_free(current_process->stack);
-        current_process->stack = 0;
-    }
+    process_close_files(process);
+    shm_detach_all(process);
+    thread_release_all(process);
+    process_release_memory(process);
     
     // Remove from process list
-    if (process_list == current_process) {
-        process_list = current_process->next;
+    if (process_list == process) {
+        process_list = process->next;
     } else {
         process_t* prev = process_list;
-        while (prev && prev->next != current_process) {
+        while (prev && prev->next != process) {
             prev = prev->next;
         }
         if (prev) {
-            prev->next = current_process->next;
+            prev->next = process->next;
         }
     }
     
     // Free process structure
-    memory_free(current_process);
-    current_process = 0;
+    memory_free(process);
     
     // Schedule next process
     process_schedule();
 }
 
+// Move the program break (brk). new_brk == 0 queries the current break.
+// Returns the new break, or the old one if the region cannot grow in place.
+unsigned int process_brk(process_t* process, unsigned int new_brk) {
+    if (!process) return 0;
+    
+    // Set up the break region on first use with a single page
+    if (process->brk_start == 0) {
+        void* base = memory_alloc_pages(1);
+        if (!base) return 0;
+        process->brk_start = (unsigned int)base;
+        process->brk = process->brk_start;
+        process->brk_mapped = process->brk_start + PAGE_SIZE;
+    }
+    
+    if (new_brk == 0 || new_brk < process->brk_start) {
+        return process->brk;
+    }
+    
+    unsigned int needed = (new_brk + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    if (needed == process->brk_start) {
+        needed += PAGE_SIZE; // Always keep the first page
+    }
+    
+    if (needed > process->brk_mapped) {
+        // Grow in place; fails if the next pages belong to someone else
+        unsigned int extra = (needed - process->brk_mapped) / PAGE_SIZE;
+        if (!memory_alloc_pages_at((void*)process->brk_mapped, extra)) {
+            return process->brk;
+        }
+        process->brk_mapped = needed;
+    } else if (needed < process->brk_mapped) {
+        memory_free_pages((void*)needed, (process->brk_mapped - needed) / PAGE_SIZE);
+        process->brk_mapped = needed;
+    }
+    
+    process->brk = new_brk;
+    return process->brk;
+}
+
+// Grant a run of user pages to a process
+void* process_map_pages(process_t* process, unsigned int count) {
+    if (!process || count == 0) return 0;
+    
+    int slot = -1;
+    for (int i = 0; i < MAX_PAGE_GRANTS; i++) {
+        if (process->grants[i].count == 0) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot == -1) return 0;
+    
+    void* pages = memory_alloc_pages(count);
+    if (!pages) return 0;
+    
+    process->grants[slot].addr = (unsigned int)pages;
+    process->grants[slot].count = count;
+    return pages;
+}
+
+// Return a grant made by process_map_pages (whole grants only, count 0 = any size)
+int process_unmap_pages(process_t* process, void* addr, unsigned int count) {
+    if (!process) return -1;
+    
+    for (int i = 0; i < MAX_PAGE_GRANTS; i++) {
+        if (process->grants[i].count && process->grants[i].addr == (unsigned int)addr &&
+            (count == 0 || process->grants[i].count == count)) {
+            memory_free_pages(addr, process->grants[i].count);
+            process->grants[i].addr = 0;
+            process->grants[i].count = 0;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Return every user page owned by a process
+void process_release_memory(process_t* process) {
+    if (!process) return;
+    
+    for (int i = 0; i < MAX_PAGE_GRANTS; i++) {
+        if (process->grants[i].count) {
+            memory_free_pages((void*)process->grants[i].addr, process->grants[i].count);
+            process->grants[i].addr = 0;
+            process->grants[i].count = 0;
+        }
+    }
+    
+    if (process->brk_start) {
+        memory_free_pages((void*)process->brk_start,
+                          (process->brk_mapped - process->brk_start) / PAGE_SIZE);
+        process->brk_start = 0;
+        process->brk = 0;
+        process->brk_mapped = 0;
+    }
+}
+
+// Hand a grant over to another owner without freeing its pages
+int process_detach_pages(process_t* process, void* addr, unsigned int count) {
+    if (!process) return -1;
+    
+    for (int i = 0; i < MAX_PAGE_GRANTS; i++) {
+        if (process->grants[i].count == count && process->grants[i].addr == (unsigned int)addr) {
+            process->grants[i].addr = 0;
+            process->grants[i].count = 0;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Record pages allocated elsewhere as a grant of this process
+int process_adopt_pages(process_t* process, void* addr, unsigned int count) {
+    if (!process || !addr || count == 0) return -1;
+    
+    for (int i = 0; i < MAX_PAGE_GRANTS; i++) {
+        if (process->grants[i].count == 0) {
+            process->grants[i].addr = (unsigned int)addr;
+            process->grants[i].count = count;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Reference counting for the objects behind descriptors
+static void process_retain_object(unsigned int type, void* object) {
+    if (type == FD_PIPE_READ || type == FD_PIPE_WRITE) {
+        pipe_retain((pipe_t*)object, type == FD_PIPE_WRITE);
+    } else if (type == FD_EVENT || type == FD_TIMER) {
+        event_retain(type, object);
+    } else if (type == FD_SOCKET) {
+        socket_retain((socket_t*)object);
+    } else if (type == FD_FILE) {
+        file_retain((open_file_t*)object);
+    }
+}
+
+static void process_release_object(unsigned int type, void* object) {
+    if (type == FD_PIPE_READ || type == FD_PIPE_WRITE) {
+        pipe_release((pipe_t*)object, type == FD_PIPE_WRITE);
+    } else if (type == FD_EVENT || type == FD_TIMER) {
+        event_release(type, object);
+    } else if (type == FD_SOCKET) {
+        socket_release((socket_t*)object);
+    } else if (type == FD_FILE) {
+        file_release((open_file_t*)object);
+    }
+}
+
+// Install an object as a file descriptor (fd -1 picks the lowest free one)
+int process_install_fd(process_t* process, int fd, unsigned int type, void* object) {
+    if (!process) return -1;
+    
+    if (fd < 0) {
+        for (fd = 0; fd < MAX_PROCESS_FDS; fd++) {
+            if (process->fds[fd].type == FD_NONE) break;
+        }
+    }
+    if (fd >= MAX_PROCESS_FDS) return -1;
+    
+    process_close_fd(process, fd);
+    process_retain_object(type, object);
+    process->fds[fd].type = type;
+    process->fds[fd].object = object;
+    return fd;
+}
+
+// Look up an open file descriptor
+fd_entry_t* process_get_fd(process_t* process, int fd) {
+    if (!process || fd < 0 || fd >= MAX_PROCESS_FDS || process->fds[fd].type == FD_NONE) {
+        return 0;
+    }
+    return &process->fds[fd];
+}
+
+// Close a file descriptor
+int process_close_fd(process_t* process, int fd) {
+    fd_entry_t* entry = process_get_fd(process, fd);
+    if (!entry) return -1;
+    
+    unsigned int type = entry->type;
+    void* object = entry->object;
+    entry->type = FD_NONE;
+    entry->object = 0;
+    process_release_object(type, object);
+    return 0;
+}
+
+// Close every file descriptor of a process
+void process_close_files(process_t* process) {
+    for (int fd = 0; fd < MAX_PROCESS_FDS; fd++) {
+        process_close_fd(process, fd);
+    }
+}
+
+// Block a thread until the queue is woken
+void wait_queue_sleep(wait_queue_t* queue, thread_t* thread) {
+    wait_queue_sleep_key(queue, thread, 0);
+}
+
+// Block a thread waiting for one key on a queue shared by several
+void wait_queue_sleep_key(wait_queue_t* queue, thread_t* thread, unsigned int key) {
+    if (!thread || thread->waiting_on) return;
+    
+    thread->state = PROCESS_BLOCKED;
+    thread->waiting_on = queue;
+    thread->wait_key = key;
+    thread->wait_next = queue->head;
+    queue->head = thread;
+}
+
+// Make every thread on the queue ready again
+void wait_queue_wake_all(wait_queue_t* queue) {
+    thread_t* thread = queue->head;
+    queue->head = 0;
+    
+    while (thread) {
+        thread_t* next = thread->wait_next;
+        thread->waiting_on = 0;
+        thread->wait_next = 0;
+        if (thread->state == PROCESS_BLOCKED) {
+            thread->state = PROCESS_READY;
+        }
+        thread = next;
+    }
+}
+
+// Wake up to count threads sleeping on key, oldest first. Returns the
+// number woken.
+int wait_queue_wake(wait_queue_t* queue, unsigned int key, unsigned int count) {
+    int woken = 0;
+    
+    while (count > 0) {
+        // Sleepers are pushed at the head, so the oldest match is the last one
+        thread_t** link = 0;
+        for (thread_t** t = &queue->head; *t; t = &(*t)->wait_next) {
+            if ((*t)->wait_key == key) link = t;
+        }
+        if (!link) break;
+        
+        thread_t* thread = *link;
+        *link = thread->wait_next;
+        thread->waiting_on = 0;
+        thread->wait_next = 0;
+        if (thread->state == PROCESS_BLOCKED) {
+            thread->state = PROCESS_READY;
+        }
+        woken++;
+        count--;
+    }
+    return woken;
+}
+
+// Take a thread off whatever queue it is blocked on
+void wait_queue_remove(thread_t* thread) {
+    wait_queue_t* queue = thread->waiting_on;
+    if (!queue) return;
+    
+    thread_t** link = &queue->head;
+    while (*link && *link != thread) {
+        link = &(*link)->wait_next;
+    }
+    if (*link) {
+        *link = thread->wait_next;
+    }
+    thread->waiting_on = 0;
+    thread->wait_next = 0;
+}
+
 // Get current process
 process_t* process_get_current(void) {
-    return current_process;
+    thread_t* thread = thread_get_current();
+    return thread ? thread->process : 0;
 }
 
-// Simple round-robin scheduler
+// Round-robin scheduling over threads: let any ready thread with its own
+// context run until it blocks or yields back
 void process_schedule(void) {
-    if (!current_process || current_process->state != PROCESS_RUNNING) {
-        // Find a ready process to run
-        process_t* next = process_list;
-        while (next) {
-            if (next->state == PROCESS_READY) {
-                next->state = PROCESS_RUNNING;
-                current_process = next;
-                break;
-            }
-            next = next->next;
-        }
-    }
+    thread_yield();
+}
+
+// Make a process's main thread current (cooperative switch between programs)
+void process_switch(process_t* process) {
+    if (!process) return;
+    thread_make_current(process->main_thread);
 }
 
 // Simple test process function
@@ -174,7 +443,7 @@ int get_ready_process_count(void) {
     int count = 0;
     process_t* current = process_list;
     while (current) {
-        if (current->state == PROCESS_READY) {
+        if (current->main_thread && current->main_thread->state == PROCESS_READY) {
             count++;
         }
         current = current->next;
@@ -3,19 +3,82 @@
 
 #include "memory.h"
 
-// Process states
+// Thread states (a process is as runnable as its threads)
 #define PROCESS_READY    0
 #define PROCESS_RUNNING  1
 #define PROCESS_BLOCKED  2
 #define PROCESS_TERMINATED 3
 
-// Process structure
-typedef struct process {
-    unsigned int pid;
+// Maximum number of SYS_MAP_PAGES grants held by one process
+#define MAX_PAGE_GRANTS 16
+
+// A run of user pages granted to a process
+typedef struct page_grant {
+    unsigned int addr;
+    unsigned int count;
+} page_grant_t;
+
+// File descriptors (0, 1 and 2 start on the console)
+#define MAX_PROCESS_FDS 8
+#define FD_NONE       0
+#define FD_CONSOLE    1
+#define FD_PIPE_READ  2
+#define FD_PIPE_WRITE 3
+#define FD_EVENT      4     // Event poll (kernel/event.h)
+#define FD_TIMER      5
+#define FD_SOCKET     6
+#define FD_FILE       7     // Open regular file (kernel/file.h)
+
+typedef struct fd_entry {
+    unsigned int type;
+    void* object;
+} fd_entry_t;
+
+struct process;
+struct thread;
+
+// Threads blocked on an event
+typedef struct wait_queue {
+    struct thread* head;
+} wait_queue_t;
+
+// Thread: a flow of control inside a process and the unit of scheduling.
+// Threads made by thread_create() have their own stack and a saved register
+// context; a process's main thread runs on the stack of whoever drives the
+// process (the shell or a runner), as processes always have.
+typedef struct thread {
+    unsigned int tid;
     unsigned int state;
+    struct process* process;
     void* stack;
     unsigned int stack_size;
+    unsigned int esp;                // Saved stack pointer, 0 if none to resume
+    void* (*entry)(void*);
+    void* arg;
+    void* exit_value;
+    unsigned int tls_base;           // GS segment base
+    wait_queue_t join_wait;
+    wait_queue_t* waiting_on;        // Queue this thread is blocked on
+    unsigned int wait_key;           // What it waits for on a shared queue (futex address)
+    struct thread* wait_next;
+    struct thread* resumer;          // Thread that last switched to this one
+    struct thread* next_in_process;
+    struct thread* next;             // All threads, in scheduling order
+} thread_t;
+
+// Process: address space (page grants, break, shared memory) and file table
+typedef struct process {
+    unsigned int pid;
     void (*entry_point)(void);
+    unsigned int brk_start;      // First byte of the program break region
+    unsigned int brk;            // Current program break
+    unsigned int brk_mapped;     // End of the pages backing the break region
+    page_grant_t grants[MAX_PAGE_GRANTS];
+    fd_entry_t fds[MAX_PROCESS_FDS];
+    unsigned int shm_attached;   // Bitmask of shared memory segment ids
+    thread_t* main_thread;
+    thread_t* threads;           // Main thread first
+    unsigned int thread_count;
     struct process* next;
 } process_t;
 
@@ -27,9 +90,30 @@ void process_yield(void);
 void process_exit(void);
 process_t* process_get_current(void);
 void process_schedule(void);
+void process_switch(process_t* process);
+
+// Process memory (user pages, not the kernel heap)
+unsigned int process_brk(process_t* process, unsigned int new_brk);
+void* process_map_pages(process_t* process, unsigned int count);
+int process_unmap_pages(process_t* process, void* addr, unsigned int count);
+void process_release_memory(process_t* process);
+int process_detach_pages(process_t* process, void* addr, unsigned int count);
+int process_adopt_pages(process_t* process, void* addr, unsigned int count);
+
+// File descriptors
+int process_install_fd(process_t* process, int fd, unsigned int type, void* object);
+fd_entry_t* process_get_fd(process_t* process, int fd);
+int process_close_fd(process_t* process, int fd);
+void process_close_files(process_t* process);
+
+// Wait queues
+void wait_queue_sleep(wait_queue_t* queue, thread_t* thread);
+void wait_queue_sleep_key(wait_queue_t* queue, thread_t* thread, unsigned int key);
+void wait_queue_wake_all(wait_queue_t* queue);
+int wait_queue_wake(wait_queue_t* queue, unsigned int key, unsigned int count);
+void wait_queue_remove(thread_t* thread);
 
 // Process management state
-extern process_t* current_process;
 extern process_t* process_list;
 extern unsigned int next_pid;
 
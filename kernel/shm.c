@@ -0,0 +1,152 @@
+#include "shm.h"
+#include "io.h"
+#include "string.h"
+
+static shm_segment_t segments[MAX_SHM_SEGMENTS];
+
+// Futex waiters hashed by address; a bucket can hold several addresses,
+// so waking matches on the key stored with each sleeper
+static wait_queue_t futex_queues[FUTEX_BUCKETS];
+
+static unsigned int futex_waits = 0;
+static unsigned int futex_wakes = 0;
+
+static shm_segment_t* shm_find(const char* name) {
+    for (int i = 0; i < MAX_SHM_SEGMENTS; i++) {
+        if (segments[i].used && strcmp(segments[i].name, name) == 0) {
+            return &segments[i];
+        }
+    }
+    return 0;
+}
+
+static void shm_destroy(shm_segment_t* segment) {
+    memory_free_pages(segment->pages, segment->count);
+    segment->pages = 0;
+    segment->count = 0;
+    segment->used = 0;
+}
+
+// Attach a process to a segment, creating it (zero filled) if the name is
+// new. Returns the segment id, or -1.
+int shm_open(process_t* process, const char* name, unsigned int size) {
+    if (!process || !name || !name[0] || strlen(name) >= SHM_NAME_LEN) return -1;
+
+    unsigned int count = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    shm_segment_t* segment = shm_find(name);
+
+    if (segment) {
+        if (count > segment->count) return -1;
+    } else {
+        if (count == 0 || count > SHM_MAX_PAGES) return -1;
+        for (int i = 0; i < MAX_SHM_SEGMENTS; i++) {
+            if (!segments[i].used) {
+                segment = &segments[i];
+                break;
+            }
+        }
+        if (!segment) return -1;
+
+        segment->pages = memory_alloc_pages(count);
+        if (!segment->pages) return -1;
+        memory_set(segment->pages, 0, count * PAGE_SIZE);
+        strcpy(segment->name, name);
+        segment->count = count;
+        segment->refs = 0;
+        segment->used = 1;
+    }
+
+    int id = segment - segments;
+    if (!(process->shm_attached & (1u << id))) {
+        process->shm_attached |= 1u << id;
+        segment->refs++;
+    }
+    return id;
+}
+
+// Address of an attached segment
+void* shm_map(process_t* process, int id) {
+    if (!process || id < 0 || id >= MAX_SHM_SEGMENTS ||
+        !(process->shm_attached & (1u << id))) {
+        return 0;
+    }
+    return segments[id].pages;
+}
+
+static void shm_detach(process_t* process, int id) {
+    process->shm_attached &= ~(1u << id);
+    if (--segments[id].refs == 0) {
+        shm_destroy(&segments[id]);
+    }
+}
+
+// Detach from the segment at addr; the last process out frees it
+int shm_unmap(process_t* process, void* addr) {
+    if (!process) return -1;
+
+    for (int id = 0; id < MAX_SHM_SEGMENTS; id++) {
+        if ((process->shm_attached & (1u << id)) && segments[id].pages == addr) {
+            shm_detach(process, id);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Drop every segment a process is attached to (on exit)
+void shm_detach_all(process_t* process) {
+    for (int id = 0; id < MAX_SHM_SEGMENTS; id++) {
+        if (process->shm_attached & (1u << id)) {
+            shm_detach(process, id);
+        }
+    }
+}
+
+void shm_list(void) {
+    int shown = 0;
+    for (int i = 0; i < MAX_SHM_SEGMENTS; i++) {
+        if (!segments[i].used) continue;
+        vga_puts("  ");
+        vga_puts(segments[i].name);
+        vga_puts(": ");
+        vga_put_uint(segments[i].count * PAGE_SIZE / 1024);
+        vga_puts(" KB, ");
+        vga_put_uint(segments[i].refs);
+        vga_puts(" attached\n");
+        shown++;
+    }
+    if (!shown) {
+        vga_puts("  No shared memory segments\n");
+    }
+    vga_puts("Futex waits: ");
+    vga_put_uint(futex_waits);
+    vga_puts(", wakes: ");
+    vga_put_uint(futex_wakes);
+    vga_puts("\n");
+}
+
+static wait_queue_t* futex_queue(volatile unsigned int* addr) {
+    return &futex_queues[((unsigned int)addr >> 2) % FUTEX_BUCKETS];
+}
+
+// Sleep until woken if *addr still holds the expected value. Returns -1 if
+// it changed (the caller re-checks its lock), or FUTEX_WOULD_BLOCK with the
+// process queued. Only contended paths get here; userlib handles the
+// uncontended case with atomics alone.
+int futex_wait(thread_t* thread, volatile unsigned int* addr, unsigned int expected) {
+    if (!thread || ((unsigned int)addr & 3)) return -1;
+    if (*addr != expected) return -1;
+
+    futex_waits++;
+    wait_queue_sleep_key(futex_queue(addr), thread, (unsigned int)addr);
+    return FUTEX_WOULD_BLOCK;
+}
+
+// Wake up to count processes waiting on addr. Returns how many were woken.
+int futex_wake(volatile unsigned int* addr, unsigned int count) {
+    if ((unsigned int)addr & 3) return -1;
+
+    int woken = wait_queue_wake(futex_queue(addr), (unsigned int)addr, count);
+    futex_wakes += woken;
+    return woken;
+}
@@ -0,0 +1,39 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include "process.h"
+
+// Named shared memory segments. User pages are identity mapped, so a
+// segment has the same address in every process that maps it and futex
+// words inside it can be keyed by that address.
+#define MAX_SHM_SEGMENTS 16
+#define SHM_NAME_LEN     32
+#define SHM_MAX_PAGES    64
+
+// Futex operations
+#define FUTEX_WAIT 0
+#define FUTEX_WAKE 1
+
+// Returned when the caller has been put on a futex wait queue
+#define FUTEX_WOULD_BLOCK (-2)
+
+#define FUTEX_BUCKETS 32
+
+typedef struct shm_segment {
+    char name[SHM_NAME_LEN];
+    void* pages;
+    unsigned int count;
+    unsigned int refs;           // Processes attached (bit set in process->shm_attached)
+    int used;
+} shm_segment_t;
+
+int shm_open(process_t* process, const char* name, unsigned int size);
+void* shm_map(process_t* process, int id);
+int shm_unmap(process_t* process, void* addr);
+void shm_detach_all(process_t* process);
+void shm_list(void);
+
+int futex_wait(thread_t* thread, volatile unsigned int* addr, unsigned int expected);
+int futex_wake(volatile unsigned int* addr, unsigned int count);
+
+#endif
@@ -0,0 +1,136 @@
+#include "socket.h"
+#include "thread.h"
+
+static socket_t* sockets = 0;
+
+// Receive buffer for frames being sorted to sockets
+static unsigned char socket_rx[1500];
+
+static socket_t* socket_find(network_interface_t* iface, uint16_t port) {
+    for (socket_t* socket = sockets; socket; socket = socket->next) {
+        if (socket->iface == iface && socket->local_port == port) {
+            return socket;
+        }
+    }
+    return 0;
+}
+
+// Open a socket on an interface and local port
+socket_t* socket_create(const char* interface, uint16_t port) {
+    network_interface_t* iface = network_get_interface(interface);
+    if (!iface || port == 0 || socket_find(iface, port)) return 0;
+
+    int count = 0;
+    for (socket_t* socket = sockets; socket; socket = socket->next) {
+        count++;
+    }
+    if (count >= MAX_SOCKETS) return 0;
+
+    socket_t* socket = (socket_t*)memory_alloc(sizeof(socket_t));
+    if (!socket) return 0;
+    memory_set(socket, 0, sizeof(socket_t));
+
+    socket->buffers = (unsigned char*)memory_alloc(SOCKET_QUEUE_LEN * SOCKET_MAX_DATAGRAM);
+    if (!socket->buffers) {
+        memory_free(socket);
+        return 0;
+    }
+    socket->iface = iface;
+    socket->local_port = port;
+    socket->next = sockets;
+    sockets = socket;
+    return socket;
+}
+
+// Set the destination for writes
+int socket_connect(socket_t* socket, const ip_address_t* ip, uint16_t port) {
+    if (port == 0) return -1;
+    socket->remote_ip = *ip;
+    socket->remote_port = port;
+    socket->connected = 1;
+    return 0;
+}
+
+int socket_send(socket_t* socket, const void* data, unsigned int count) {
+    if (!socket->connected || count > SOCKET_MAX_DATAGRAM) return -1;
+
+    if (udp_send_packet(socket->iface, &socket->remote_ip, socket->local_port,
+                        socket->remote_port, data, count) < 0) {
+        return -1;
+    }
+    return count;
+}
+
+// Take the oldest datagram; the rest of a datagram longer than count is lost
+int socket_recv(socket_t* socket, void* buffer, unsigned int count) {
+    if (socket->count == 0) {
+        wait_queue_sleep(&socket->read_wait, thread_get_current());
+        return SOCKET_WOULD_BLOCK;
+    }
+
+    unsigned int length = socket->lengths[socket->head];
+    if (length > count) length = count;
+    memory_copy(buffer, socket->buffers + socket->head * SOCKET_MAX_DATAGRAM, length);
+    socket->head = (socket->head + 1) % SOCKET_QUEUE_LEN;
+    socket->count--;
+    return length;
+}
+
+unsigned int socket_poll(socket_t* socket) {
+    return (socket->count ? EVENT_IN : 0) | EVENT_OUT;
+}
+
+void socket_retain(socket_t* socket) {
+    socket->refs++;
+}
+
+void socket_release(socket_t* socket) {
+    if (--socket->refs > 0) return;
+
+    event_detach_source(&socket->poll);
+    wait_queue_wake_all(&socket->read_wait);
+
+    socket_t** link = &sockets;
+    while (*link && *link != socket) {
+        link = &(*link)->next;
+    }
+    if (*link) *link = socket->next;
+    memory_free(socket->buffers);
+    memory_free(socket);
+}
+
+static void socket_deliver(network_interface_t* iface, uint16_t port, const void* data, int length) {
+    socket_t* socket = socket_find(iface, port);
+    if (!socket) return;
+
+    if (socket->count == SOCKET_QUEUE_LEN || length > SOCKET_MAX_DATAGRAM) {
+        socket->dropped++;
+        return;
+    }
+    unsigned int slot = (socket->head + socket->count) % SOCKET_QUEUE_LEN;
+    memory_copy(socket->buffers + slot * SOCKET_MAX_DATAGRAM, data, length);
+    socket->lengths[slot] = length;
+    socket->count++;
+
+    wait_queue_wake_all(&socket->read_wait);
+    event_notify(&socket->poll, EVENT_IN);
+}
+
+// Pull pending frames off every interface that has sockets
+void socket_poll_network(void) {
+    for (socket_t* socket = sockets; socket; socket = socket->next) {
+        // Each interface once, at its first socket
+        socket_t* first = sockets;
+        while (first->iface != socket->iface) {
+            first = first->next;
+        }
+        if (first != socket) continue;
+
+        for (int i = 0; i < SOCKET_POLL_BUDGET; i++) {
+            udp_header_t header;
+            int length = udp_receive_packet(socket->iface, &header, socket_rx);
+            if (length < 0) break;
+            socket_deliver(socket->iface, network_ntohs(header.dest_port), socket_rx, length);
+        }
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef SOCKET_H
+#define SOCKET_H
+
+#include "netstack.h"
+#include "event.h"
+
+// UDP datagram sockets bound to one interface and local port. Frames are
+// received by polling the interface (socket_poll_network(), run from
+// event_tick()) and queued on the socket they are addressed to.
+#define MAX_SOCKETS          8
+#define SOCKET_QUEUE_LEN     4
+#define SOCKET_MAX_DATAGRAM  1472
+#define SOCKET_POLL_BUDGET   8      // Frames taken per interface per poll
+
+#define SOCKET_WOULD_BLOCK (-2)
+
+typedef struct socket {
+    network_interface_t* iface;
+    uint16_t local_port;
+    uint16_t remote_port;
+    ip_address_t remote_ip;
+    int connected;
+    unsigned char* buffers;         // SOCKET_QUEUE_LEN datagram slots
+    uint16_t lengths[SOCKET_QUEUE_LEN];
+    unsigned int head;              // Oldest queued datagram
+    unsigned int count;
+    unsigned int dropped;
+    unsigned int refs;
+    poll_head_t poll;
+    wait_queue_t read_wait;
+    struct socket* next;
+} socket_t;
+
+socket_t* socket_create(const char* interface, uint16_t port);
+int socket_connect(socket_t* socket, const ip_address_t* ip, uint16_t port);
+int socket_send(socket_t* socket, const void* data, unsigned int count);
+int socket_recv(socket_t* socket, void* buffer, unsigned int count);
+unsigned int socket_poll(socket_t* socket);
+void socket_retain(socket_t* socket);
+void socket_release(socket_t* socket);
+void socket_poll_network(void);
+
+#endif
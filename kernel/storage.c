@@ -21,6 +21,7 @@
 #define ATA_CMD_READ_SECTORS    0x20
 #define ATA_CMD_WRITE_SECTORS   0x30
 #define ATA_CMD_IDENTIFY        0xEC
+#define ATA_CMD_FLUSH_CACHE     0xE7
 
 // Status register bits
 #define ATA_STATUS_BSY          0x80  // Busy
@@ -48,6 +49,9 @@ void storage_init(void) {
         storage_devices[i].name[0] = '\0';
         storage_devices[i].read_sector = 0;
         storage_devices[i].write_sector = 0;
+        storage_devices[i].read_sectors = 0;
+        storage_devices[i].write_sectors = 0;
+        storage_devices[i].flush = 0;
     }
     
     vga_puts("Storage subsystem initialized\n");
@@ -73,6 +77,9 @@ int storage_detect_devices(void) {
             strcpy(dev->name, "HDD0");
             dev->read_sector = ata_read_sector;
             dev->write_sector = ata_write_sector;
+            dev->read_sectors = ata_read_sectors;
+            dev->write_sectors = ata_write_sectors;
+            dev->flush = ata_flush;
             device_count++;
             
             vga_puts("Found ATA/IDE drive: ");
@@ -108,6 +115,9 @@ int storage_detect_devices(void) {
             strcpy(dev->name, "VDISK0");
             dev->read_sector = usb_storage_read_sector;
             dev->write_sector = usb_storage_write_sector;
+            dev->read_sectors = 0;
+            dev->write_sectors = 0;
+            dev->flush = 0;
             device_count++;
             
             vga_puts("Created virtual storage device: ");
@@ -155,6 +165,20 @@ int storage_read_sectors(storage_device_t* dev, uint32_t start_sector, uint32_t
     }
     
     uint8_t* buf = (uint8_t*)buffer;
+    if (dev->read_sectors) {
+        // One command moves at most 256 sectors
+        while (count > 0) {
+            uint32_t chunk = count > 256 ? 256 : count;
+            if (dev->read_sectors(dev, start_sector, chunk, buf) != 0) {
+                return -1;
+            }
+            start_sector += chunk;
+            buf += chunk * dev->sector_size;
+            count -= chunk;
+        }
+        return 0;
+    }
+    
     for (uint32_t i = 0; i < count; i++) {
         if (dev->read_sector(dev, start_sector + i, buf + (i * dev->sector_size)) != 0) {
             return -1;
@@ -171,6 +195,20 @@ int storage_write_sectors(storage_device_t* dev, uint32_t start_sector, uint32_t
     }
     
     const uint8_t* buf = (const uint8_t*)buffer;
+    if (dev->write_sectors) {
+        // One command moves at most 256 sectors
+        while (count > 0) {
+            uint32_t chunk = count > 256 ? 256 : count;
+            if (dev->write_sectors(dev, start_sector, chunk, buf) != 0) {
+                return -1;
+            }
+            start_sector += chunk;
+            buf += chunk * dev->sector_size;
+            count -= chunk;
+        }
+        return 0;
+    }
+    
     for (uint32_t i = 0; i < count; i++) {
         if (dev->write_sector(dev, start_sector + i, buf + (i * dev->sector_size)) != 0) {
             return -1;
@@ -419,5 +457,106 @@ int ata_write_sector(storage_device_t* dev, uint32_t sector, const void* buffer)
         return -1;
     }
     
+    return 0;
+}
+
+// Read up to 256 consecutive sectors with a single ATA command
+int ata_read_sectors(storage_device_t* dev, uint32_t sector, uint32_t count, void* buffer) {
+    if (!dev || !buffer || count == 0 || count > 256 ||
+        sector >= dev->total_sectors || count > dev->total_sectors - sector) {
+        return -1;
+    }
+    
+    uint16_t* buf = (uint16_t*)buffer;
+    
+    // Wait for drive to be ready
+    if (ata_wait_ready() != 0) {
+        return -1;
+    }
+    
+    // Set up LBA addressing; a count of 0 means 256 sectors
+    outb(ATA_PRIMARY_SECTOR_COUNT, count & 0xFF);
+    outb(ATA_PRIMARY_LBA_LOW, sector & 0xFF);
+    outb(ATA_PRIMARY_LBA_MID, (sector >> 8) & 0xFF);
+    outb(ATA_PRIMARY_LBA_HIGH, (sector >> 16) & 0xFF);
+    outb(ATA_PRIMARY_DRIVE, 0xE0 | ((sector >> 24) & 0x0F));
+    
+    // Send read command
+    outb(ATA_PRIMARY_COMMAND, ATA_CMD_READ_SECTORS);
+    
+    // The drive hands over each sector in turn
+    for (uint32_t s = 0; s < count; s++) {
+        if (ata_wait_drq() != 0) {
+            return -1;
+        }
+        for (int i = 0; i < 256; i++) {
+            buf[s * 256 + i] = inw(ATA_PRIMARY_DATA);
+        }
+    }
+    
+    return 0;
+}
+
+// Write up to 256 consecutive sectors with a single ATA command
+int ata_write_sectors(storage_device_t* dev, uint32_t sector, uint32_t count, const void* buffer) {
+    if (!dev || !buffer || count == 0 || count > 256 ||
+        sector >= dev->total_sectors || count > dev->total_sectors - sector) {
+        return -1;
+    }
+    
+    const uint16_t* buf = (const uint16_t*)buffer;
+    
+    // Wait for drive to be ready
+    if (ata_wait_ready() != 0) {
+        return -1;
+    }
+    
+    // Set up LBA addressing; a count of 0 means 256 sectors
+    outb(ATA_PRIMARY_SECTOR_COUNT, count & 0xFF);
+    outb(ATA_PRIMARY_LBA_LOW, sector & 0xFF);
+    outb(ATA_PRIMARY_LBA_MID, (sector >> 8) & 0xFF);
+    outb(ATA_PRIMARY_LBA_HIGH, (sector >> 16) & 0xFF);
+    outb(ATA_PRIMARY_DRIVE, 0xE0 | ((sector >> 24) & 0x0F));
+    
+    // Send write command
+    outb(ATA_PRIMARY_COMMAND, ATA_CMD_WRITE_SECTORS);
+    
+    // The drive asks for each sector in turn
+    for (uint32_t s = 0; s < count; s++) {
+        if (ata_wait_drq() != 0) {
+            return -1;
+        }
+        for (int i = 0; i < 256; i++) {
+            outw(ATA_PRIMARY_DATA, buf[s * 256 + i]);
+        }
+    }
+    
+    // Wait for the last write to complete
+    if (ata_wait_ready() != 0) {
+        return -1;
+    }
+    
+    return 0;
+}
+
+// Write the drive's cache out to the media
+int ata_flush(storage_device_t* dev) {
+    if (!dev) {
+        return -1;
+    }
+    
+    // Wait for drive to be ready
+    if (ata_wait_ready() != 0) {
+        return -1;
+    }
+    
+    outb(ATA_PRIMARY_DRIVE, 0xE0);
+    outb(ATA_PRIMARY_COMMAND, ATA_CMD_FLUSH_CACHE);
+    
+    // The drive stays busy until the cache is out
+    if (ata_wait_ready() != 0 || (inb(ATA_PRIMARY_STATUS) & ATA_STATUS_ERR)) {
+        return -1;
+    }
+    
     return 0;
 }
\ No newline at end of file
@@ -20,6 +20,12 @@ typedef struct storage_device {
     char name[32];
     int (*read_sector)(struct storage_device* dev, uint32_t sector, void* buffer);
     int (*write_sector)(struct storage_device* dev, uint32_t sector, const void* buffer);
+    // Optional: move several consecutive sectors in one command, 0 if unsupported
+    int (*read_sectors)(struct storage_device* dev, uint32_t sector, uint32_t count, void* buffer);
+    int (*write_sectors)(struct storage_device* dev, uint32_t sector, uint32_t count, const void* buffer);
+    // Optional: put everything written so far on the media, 0 if the
+    // device has no write cache
+    int (*flush)(struct storage_device* dev);
 } storage_device_t;
 
 // Storage management
@@ -37,6 +43,9 @@ int usb_storage_write_sector(storage_device_t* dev, uint32_t sector, const void*
 int ata_init(void);
 int ata_read_sector(storage_device_t* dev, uint32_t sector, void* buffer);
 int ata_write_sector(storage_device_t* dev, uint32_t sector, const void* buffer);
+int ata_read_sectors(storage_device_t* dev, uint32_t sector, uint32_t count, void* buffer);
+int ata_write_sectors(storage_device_t* dev, uint32_t sector, uint32_t count, const void* buffer);
+int ata_flush(storage_device_t* dev);
 
 // Sector I/O functions
 int storage_read_sectors(storage_device_t* dev, uint32_t start_sector, uint32_t count, void* buffer);
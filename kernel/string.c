@@ -25,27 +25,31 @@ void strcpy(char* dest, const char* src) {
 
 char* strtok(char* str, const char* delim) {
     static char* saved_str = 0;
-    if (str) {
-        saved_str = str;
-    }
-    if (!saved_str) {
+    return strtok_r(str, delim, &saved_str);
+}
+
+// Reentrant strtok: the scan position lives in *saveptr instead of a static
+char* strtok_r(char* str, const char* delim, char** saveptr) {
+    char* s = str ? str : *saveptr;
+    if (!s) {
         return 0;
     }
-    while (*saved_str && strchr(delim, *saved_str)) {
-        saved_str++;
+    while (*s && strchr(delim, *s)) {
+        s++;
     }
-    if (!*saved_str) {
+    if (!*s) {
+        *saveptr = 0;
         return 0;
     }
-    char* token = saved_str;
-    while (*saved_str && !strchr(delim, *saved_str)) {
-        saved_str++;
+    char* token = s;
+    while (*s && !strchr(delim, *s)) {
+        s++;
     }
-    if (*saved_str) {
-        *saved_str = '\0';
-        saved_str++;
+    if (*s) {
+        *s = '\0';
+        *saveptr = s + 1;
     } else {
-        saved_str = 0;
+        *saveptr = 0;
     }
     return token;
 }
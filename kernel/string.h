@@ -6,6 +6,7 @@ int strcmp(const char* s1, const char* s2);
 int strlen(const char* s);
 void strcpy(char* dest, const char* src);
 char* strtok(char* str, const char* delim);
+char* strtok_r(char* str, const char* delim, char** saveptr);
 char* strchr(const char* str, char c);
 int strncmp(const char* s1, const char* s2, int n);
 int memory_compare(const void* s1, const void* s2, int n);
@@ -0,0 +1,396 @@
+#include "thread.h"
+#include "io.h"
+
+// Threads are switched cooperatively: a thread runs until it blocks,
+// yields or exits. Switching saves the callee-saved registers on the old
+// stack and resumes the new one, so a thread continues exactly where it
+// left off.
+
+thread_t* current_thread = 0;
+
+static thread_t kernel_thread;       // The boot stack: shell loop and drivers
+static thread_t* thread_list = 0;
+static unsigned int next_tid = 1;
+
+// Flat 4 GB code and data segments plus the TLS segment
+typedef struct gdt_entry {
+    unsigned short limit_low;
+    unsigned short base_low;
+    unsigned char base_mid;
+    unsigned char access;
+    unsigned char granularity;
+    unsigned char base_high;
+} __attribute__((packed)) gdt_entry_t;
+
+typedef struct gdt_pointer {
+    unsigned short limit;
+    unsigned int base;
+} __attribute__((packed)) gdt_pointer_t;
+
+static gdt_entry_t gdt[4];
+
+// Save callee-saved registers and the stack pointer in *save, then resume
+// the context whose stack pointer is next_esp
+void thread_switch_context(unsigned int* save, unsigned int next_esp);
+__asm__ (
+    ".text\n"
+    ".globl thread_switch_context\n"
+    "thread_switch_context:\n"
+    "    movl 4(%esp), %eax\n"
+    "    movl 8(%esp), %edx\n"
+    "    pushl %ebp\n"
+    "    pushl %ebx\n"
+    "    pushl %esi\n"
+    "    pushl %edi\n"
+    "    movl %esp, (%eax)\n"
+    "    movl %edx, %esp\n"
+    "    popl %edi\n"
+    "    popl %esi\n"
+    "    popl %ebx\n"
+    "    popl %ebp\n"
+    "    ret\n"
+);
+
+static void gdt_set(int index, unsigned int base, unsigned char access) {
+    gdt[index].limit_low = 0xFFFF;
+    gdt[index].base_low = base & 0xFFFF;
+    gdt[index].base_mid = (base >> 16) & 0xFF;
+    gdt[index].access = access;
+    gdt[index].granularity = 0xCF;   // 4 KB granularity, 32-bit, limit 0xFFFFF
+    gdt[index].base_high = (base >> 24) & 0xFF;
+}
+
+// Point the TLS descriptor at a block and reload GS so the CPU picks up
+// the new base
+static void thread_load_tls(unsigned int base) {
+    gdt_set(GDT_TLS / 8, base, 0x92);
+    __asm__ volatile ("movw %w0, %%gs" :: "r"(GDT_TLS) : "memory");
+}
+
+// The boot loader's GDT is not ours to rely on; install the kernel's own
+static void gdt_init(void) {
+    memory_set(&gdt[0], 0, sizeof(gdt[0]));
+    gdt_set(GDT_KERNEL_CODE / 8, 0, 0x9A);
+    gdt_set(GDT_KERNEL_DATA / 8, 0, 0x92);
+    gdt_set(GDT_TLS / 8, 0, 0x92);
+
+    gdt_pointer_t pointer;
+    pointer.limit = sizeof(gdt) - 1;
+    pointer.base = (unsigned int)gdt;
+
+    __asm__ volatile (
+        "lgdt %0\n"
+        "ljmp %1, $1f\n"
+        "1:\n"
+        "movw %2, %%ax\n"
+        "movw %%ax, %%ds\n"
+        "movw %%ax, %%es\n"
+        "movw %%ax, %%fs\n"
+        "movw %%ax, %%ss\n"
+        "movw %3, %%ax\n"
+        "movw %%ax, %%gs\n"
+        :: "m"(pointer), "i"(GDT_KERNEL_CODE), "i"(GDT_KERNEL_DATA), "i"(GDT_TLS)
+        : "eax", "memory");
+}
+
+void thread_init(void) {
+    gdt_init();
+
+    memory_set(&kernel_thread, 0, sizeof(kernel_thread));
+    kernel_thread.state = PROCESS_RUNNING;
+    thread_list = &kernel_thread;
+    current_thread = &kernel_thread;
+    next_tid = 1;
+}
+
+thread_t* thread_get_current(void) {
+    return current_thread;
+}
+
+// Fill in a TLS page: the self pointer and the thread id
+static void thread_setup_tls(thread_t* thread, unsigned char* page) {
+    unsigned int* tls = (unsigned int*)page;
+    memory_set(page, 0, PAGE_SIZE);
+    tls[TLS_SELF / 4] = (unsigned int)page;
+    tls[TLS_TID / 4] = thread->tid;
+    thread->tls_base = (unsigned int)page;
+}
+
+static thread_t* thread_alloc(process_t* process) {
+    thread_t* thread = (thread_t*)memory_alloc(sizeof(thread_t));
+    if (!thread) return 0;
+    memory_set(thread, 0, sizeof(thread_t));
+    thread->tid = next_tid++;
+    thread->process = process;
+    return thread;
+}
+
+// Link a new thread into its process and the scheduling list
+static void thread_add(thread_t* thread) {
+    process_t* process = thread->process;
+
+    if (!process->threads) {
+        process->threads = thread;
+    } else {
+        thread_t* last = process->threads;
+        while (last->next_in_process) {
+            last = last->next_in_process;
+        }
+        last->next_in_process = thread;
+    }
+    process->thread_count++;
+
+    thread_t* last = thread_list;
+    while (last->next) {
+        last = last->next;
+    }
+    last->next = thread;
+}
+
+// Create the main thread of a new process
+thread_t* thread_attach(process_t* process, void* stack, unsigned int stack_size) {
+    thread_t* thread = thread_alloc(process);
+    if (!thread) return 0;
+
+    unsigned char* tls = process_map_pages(process, 1);
+    if (!tls) {
+        memory_free(thread);
+        return 0;
+    }
+    thread_setup_tls(thread, tls);
+    thread->stack = stack;
+    thread->stack_size = stack_size;
+    thread->state = PROCESS_READY;
+
+    process->main_thread = thread;
+    thread_add(thread);
+    return thread;
+}
+
+static thread_t* thread_find(unsigned int tid) {
+    for (thread_t* thread = thread_list; thread; thread = thread->next) {
+        if (thread->tid == tid && thread != &kernel_thread) {
+            return thread;
+        }
+    }
+    return 0;
+}
+
+// Unlink and free a thread. Its stack and TLS pages go back to the process.
+static void thread_destroy(thread_t* thread) {
+    process_t* process = thread->process;
+
+    wait_queue_remove(thread);
+
+    thread_t** link = &thread_list;
+    while (*link && *link != thread) {
+        link = &(*link)->next;
+    }
+    if (*link) *link = thread->next;
+
+    link = &process->threads;
+    while (*link && *link != thread) {
+        link = &(*link)->next_in_process;
+    }
+    if (*link) *link = thread->next_in_process;
+    process->thread_count--;
+
+    for (thread_t* other = thread_list; other; other = other->next) {
+        if (other->resumer == thread) other->resumer = 0;
+    }
+
+    if (thread == process->main_thread) {
+        if (thread->stack) memory_free(thread->stack);
+        process->main_thread = 0;
+    } else {
+        process_unmap_pages(process, (void*)thread->tls_base, THREAD_STACK_PAGES + 1);
+    }
+    memory_free(thread);
+}
+
+static void thread_switch(thread_t* next) {
+    thread_t* prev = current_thread;
+
+    if (prev->state == PROCESS_RUNNING) {
+        prev->state = PROCESS_READY;
+    }
+    next->state = PROCESS_RUNNING;
+    next->resumer = prev;
+    current_thread = next;
+    thread_load_tls(next->tls_base);
+
+    // A running thread has no saved context
+    unsigned int esp = next->esp;
+    next->esp = 0;
+    thread_switch_context(&prev->esp, esp);
+}
+
+// Next ready thread with a context to resume, round robin
+static thread_t* thread_pick(void) {
+    thread_t* start = current_thread->next ? current_thread->next : thread_list;
+    thread_t* thread = start;
+
+    do {
+        if (thread != current_thread && thread->state == PROCESS_READY && thread->esp) {
+            return thread;
+        }
+        thread = thread->next ? thread->next : thread_list;
+    } while (thread != start);
+    return 0;
+}
+
+// Let another ready thread run. Returns 0 if there was none.
+int thread_yield(void) {
+    thread_t* next = thread_pick();
+    if (!next) return 0;
+    thread_switch(next);
+    return 1;
+}
+
+// First code run on a new thread's stack
+static void thread_start(void) {
+    thread_t* self = current_thread;
+    thread_exit(self->entry(self->arg));
+}
+
+// Start a thread in a process. Returns its id, or -1.
+int thread_create(process_t* process, void* (*entry)(void*), void* arg) {
+    if (!process || !entry) return -1;
+
+    thread_t* thread = thread_alloc(process);
+    if (!thread) return -1;
+
+    unsigned char* base = process_map_pages(process, THREAD_STACK_PAGES + 1);
+    if (!base) {
+        memory_free(thread);
+        return -1;
+    }
+    thread_setup_tls(thread, base);
+    thread->stack = base + PAGE_SIZE;
+    thread->stack_size = THREAD_STACK_PAGES * PAGE_SIZE;
+    thread->entry = entry;
+    thread->arg = arg;
+
+    // Initial frame for thread_switch_context: four callee-saved registers,
+    // then thread_start as the return address (it never returns itself)
+    unsigned int* sp = (unsigned int*)(base + (THREAD_STACK_PAGES + 1) * PAGE_SIZE);
+    *--sp = 0;
+    *--sp = (unsigned int)thread_start;
+    for (int i = 0; i < 4; i++) {
+        *--sp = 0;
+    }
+    thread->esp = (unsigned int)sp;
+    thread->state = PROCESS_READY;
+
+    thread_add(thread);
+    return thread->tid;
+}
+
+// Wait for a thread of the same process to exit and collect its value
+int thread_join(unsigned int tid, void** result) {
+    thread_t* self = current_thread;
+    thread_t* target = thread_find(tid);
+
+    if (!target || target == self || !self->process || target->process != self->process ||
+        target == self->process->main_thread) {
+        return -1;
+    }
+
+    while (target->state != PROCESS_TERMINATED) {
+        wait_queue_sleep(&target->join_wait, self);
+        if (!thread_yield()) {
+            // Nothing else can run, so the target can never finish
+            wait_queue_remove(self);
+            self->state = PROCESS_RUNNING;
+            return -1;
+        }
+        // Another joiner may have collected it meanwhile
+        target = thread_find(tid);
+        if (!target) return -1;
+    }
+
+    if (result) {
+        *result = target->exit_value;
+    }
+    thread_destroy(target);
+    return 0;
+}
+
+// End the current thread. Its stack stays until it is joined or the
+// process exits. The main thread ends with its process instead.
+void thread_exit(void* value) {
+    thread_t* self = current_thread;
+    if (self == &kernel_thread || self == self->process->main_thread) {
+        return;
+    }
+
+    self->exit_value = value;
+    self->state = PROCESS_TERMINATED;
+    wait_queue_wake_all(&self->join_wait);
+
+    thread_t* next = thread_pick();
+    if (!next) {
+        // Go back to whoever switched here, even if it is still waiting
+        next = self->resumer;
+        while (next && (next->state == PROCESS_TERMINATED || !next->esp)) {
+            next = next->resumer;
+        }
+    }
+    if (!next) {
+        vga_puts("Fatal: exiting thread has nothing to return to\n");
+        for (;;) {
+            __asm__ volatile ("cli; hlt");
+        }
+    }
+    thread_switch(next);
+}
+
+// Make a thread current without switching stacks: a process's main thread
+// takes over the stack of whoever drives it
+void thread_make_current(thread_t* thread) {
+    thread_t* prev = current_thread;
+
+    if (prev != thread && prev->state == PROCESS_RUNNING) {
+        prev->state = PROCESS_READY;
+    }
+    thread->state = PROCESS_RUNNING;
+    current_thread = thread;
+    thread_load_tls(thread->tls_base);
+}
+
+// Free every thread of an exiting process. The stack we are running on
+// carries on as the kernel thread.
+void thread_release_all(process_t* process) {
+    while (process->threads) {
+        thread_t* thread = process->threads;
+        if (thread == current_thread) {
+            current_thread = &kernel_thread;
+            kernel_thread.state = PROCESS_RUNNING;
+            kernel_thread.esp = 0;
+            thread_load_tls(0);
+        }
+        thread_destroy(thread);
+    }
+}
+
+void thread_list_all(void) {
+    static const char* states[] = { "ready", "running", "blocked", "exited" };
+
+    vga_puts("  TID  PID  STATE\n");
+    for (thread_t* thread = thread_list; thread; thread = thread->next) {
+        vga_puts("  ");
+        vga_put_uint(thread->tid);
+        vga_puts("    ");
+        if (thread->process) {
+            vga_put_uint(thread->process->pid);
+        } else {
+            vga_puts("-");
+        }
+        vga_puts("    ");
+        vga_puts(thread->state <= PROCESS_TERMINATED ? states[thread->state] : "?");
+        if (thread == current_thread) {
+            vga_puts(" *");
+        }
+        vga_puts("\n");
+    }
+}
@@ -0,0 +1,31 @@
+#ifndef THREAD_H
+#define THREAD_H
+
+#include "process.h"
+
+// Kernel GDT selectors. Every thread has a TLS block and GS always selects
+// the TLS descriptor, whose base is switched along with the thread.
+#define GDT_KERNEL_CODE 0x08
+#define GDT_KERNEL_DATA 0x10
+#define GDT_TLS         0x18
+
+// Stack of a thread_create() thread; its TLS page sits just below
+#define THREAD_STACK_PAGES 2
+
+// TLS block layout (byte offsets from %gs:0)
+#define TLS_SELF   0    // Address of the block itself (i386 TLS ABI)
+#define TLS_TID    4
+#define TLS_USER   8    // First free word for the program
+
+void thread_init(void);
+thread_t* thread_get_current(void);
+thread_t* thread_attach(process_t* process, void* stack, unsigned int stack_size);
+int thread_create(process_t* process, void* (*entry)(void*), void* arg);
+int thread_join(unsigned int tid, void** result);
+void thread_exit(void* value);
+int thread_yield(void);
+void thread_make_current(thread_t* thread);
+void thread_release_all(process_t* process);
+void thread_list_all(void);
+
+#endif
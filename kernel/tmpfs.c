@@ -0,0 +1,157 @@
+#include "vfs.h"
+#include "memory.h"
+
+// tmpfs: files that live in memory only and are never saved. A file's data
+// is a vector of pages, one slot per PAGE_SIZE bytes of the file, each
+// allocated when it is first written; an empty slot reads back as zeros.
+// Bytes of a page past the end of the file are kept zero, so growing a
+// file needs no clearing. None of the bookkeeping for saving applies: no
+// dirty blocks, no inode records, no runs on disk.
+
+static void tmpfs_init(file_entry_t* entry) {
+    memory_set(&entry->data, 0, sizeof(entry->data));
+}
+
+// Make the page vector cover count pages
+static int tmpfs_reserve(file_entry_t* file, unsigned int count) {
+    if (count <= file->data.tmp.capacity) {
+        return 0;
+    }
+    unsigned int capacity = file->data.tmp.capacity ? file->data.tmp.capacity * 2 : 4;
+    if (capacity < count) {
+        capacity = count;
+    }
+    unsigned int* pages = memory_alloc(capacity * sizeof(unsigned int));
+    if (!pages) {
+        return -1;
+    }
+    memory_set(pages, 0, capacity * sizeof(unsigned int));
+    if (file->data.tmp.pages) {
+        memory_copy(pages, file->data.tmp.pages, file->data.tmp.capacity * sizeof(unsigned int));
+        memory_free(file->data.tmp.pages);
+    }
+    file->data.tmp.pages = pages;
+    file->data.tmp.capacity = capacity;
+    return 0;
+}
+
+// Give back every page from index first on
+static void tmpfs_drop(file_entry_t* file, unsigned int first) {
+    for (unsigned int i = first; i < file->data.tmp.capacity; i++) {
+        if (file->data.tmp.pages[i]) {
+            memory_free_pages((void*)file->data.tmp.pages[i], 1);
+            file->data.tmp.pages[i] = 0;
+        }
+    }
+}
+
+static void tmpfs_release(file_entry_t* entry) {
+    if (entry->type == FILE_TYPE_FILE && entry->data.tmp.pages) {
+        tmpfs_drop(entry, 0);
+        memory_free(entry->data.tmp.pages);
+    }
+    memory_set(&entry->data, 0, sizeof(entry->data));
+}
+
+static unsigned int tmpfs_pages(file_entry_t* entry) {
+    unsigned int count = 0;
+    for (unsigned int i = 0; i < entry->data.tmp.capacity; i++) {
+        if (entry->data.tmp.pages[i]) {
+            count++;
+        }
+    }
+    return count;
+}
+
+static int tmpfs_read(file_entry_t* file, unsigned int offset, void* buffer, unsigned int count) {
+    if (offset >= file->size) {
+        return 0;
+    }
+    if (count > file->size - offset) {
+        count = file->size - offset;
+    }
+
+    unsigned char* dest = (unsigned char*)buffer;
+    unsigned int left = count;
+    while (left > 0) {
+        unsigned int page = offset / PAGE_SIZE;
+        unsigned int chunk = PAGE_SIZE - offset % PAGE_SIZE;
+        if (chunk > left) chunk = left;
+        unsigned int addr = page < file->data.tmp.capacity ? file->data.tmp.pages[page] : 0;
+        if (addr) {
+            memory_copy(dest, (void*)(addr + offset % PAGE_SIZE), chunk);
+        } else {
+            memory_set(dest, 0, chunk);
+        }
+        dest += chunk;
+        offset += chunk;
+        left -= chunk;
+    }
+    return count;
+}
+
+static int tmpfs_write(file_entry_t* file, unsigned int offset, const void* data, unsigned int count) {
+    unsigned int end = offset + count;
+    if (end < offset || tmpfs_reserve(file, (end + PAGE_SIZE - 1) / PAGE_SIZE) != 0) {
+        return -1;
+    }
+
+    const unsigned char* src = (const unsigned char*)data;
+    while (offset < end) {
+        unsigned int* slot = &file->data.tmp.pages[offset / PAGE_SIZE];
+        unsigned int chunk = PAGE_SIZE - offset % PAGE_SIZE;
+        if (chunk > end - offset) chunk = end - offset;
+        if (!*slot) {
+            void* page = memory_alloc_pages(1);
+            if (!page) {
+                return -1;
+            }
+            memory_set(page, 0, PAGE_SIZE);
+            *slot = (unsigned int)page;
+        }
+        memory_copy((void*)(*slot + offset % PAGE_SIZE), src, chunk);
+        src += chunk;
+        offset += chunk;
+    }
+
+    if (end > file->size) {
+        file->size = end;
+    }
+    file->version = filesystem_next_version();
+    return count;
+}
+
+// Shrinking frees the pages past the new end and clears the rest of the
+// last one; growing only moves the end over zeros
+static int tmpfs_truncate(file_entry_t* file, unsigned int size) {
+    if (size < file->size && file->data.tmp.pages) {
+        unsigned int keep = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+        tmpfs_drop(file, keep);
+        if (size % PAGE_SIZE && keep <= file->data.tmp.capacity && file->data.tmp.pages[keep - 1]) {
+            memory_set((void*)(file->data.tmp.pages[keep - 1] + size % PAGE_SIZE), 0,
+                       PAGE_SIZE - size % PAGE_SIZE);
+        }
+    }
+    file->size = size;
+    file->version = filesystem_next_version();
+    return 0;
+}
+
+static const vfs_inode_ops_t tmpfs_inode_ops = {
+    tmpfs_init,
+    tmpfs_release,
+    tmpfs_pages,
+};
+
+static const vfs_file_ops_t tmpfs_file_ops = {
+    tmpfs_read,
+    tmpfs_write,
+    tmpfs_truncate,
+};
+
+const vfs_type_t tmpfs_type = {
+    "tmpfs",
+    0,
+    &tmpfs_inode_ops,
+    &tmpfs_file_ops,
+};
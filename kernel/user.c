@@ -2,6 +2,13 @@
 #include "io.h"
 #include "string.h"
 #include "filesystem.h"
+#include "vm.h"
+#include "pipe.h"
+#include "shm.h"
+#include "thread.h"
+#include "event.h"
+#include "socket.h"
+#include "file.h"
 
 // Global user programs array
 static user_program_t user_programs[MAX_USER_PROGRAMS];
@@ -11,6 +18,21 @@ static int program_count = 0;
 static void* user_stack = 0;
 static void* user_heap = 0;
 
+// Program image cache
+static user_image_t image_cache[MAX_CACHED_IMAGES];
+static uint32_t image_clock = 0;
+static uint32_t image_cache_hits = 0;
+static uint32_t image_cache_misses = 0;
+static uint32_t image_bytes_copied = 0;
+
+static int user_image_instantiate(process_t* process, user_image_t* image);
+static user_image_t* user_image_load(const char* path, uint32_t version, const void* code, uint32_t size);
+
+// System call statistics
+static uint32_t syscall_count = 0;
+static uint32_t syscall_write_count = 0;
+static uint32_t syscall_write_bytes = 0;
+
 // Initialize user space
 void user_init(void) {
     vga_puts("DEBUG: Starting user_init()\n");
@@ -22,8 +44,10 @@ void user_init(void) {
         user_programs[i].code = 0;
         user_programs[i].size = 0;
         user_programs[i].entry_point = 0;
+        user_programs[i].image = 0;
     }
     program_count = 0;
+    memory_set(image_cache, 0, sizeof(image_cache));
     
     vga_puts("DEBUG: Programs array cleared\n");
     
@@ -45,12 +69,8 @@ void user_init(void) {
     vga_puts("DEBUG: user_init() complete\n");
 }
 
-// Load a user program into memory
-int user_load_program(const char* name, const void* code, uint32_t size) {
-    if (!name || !code || size == 0 || size > MAX_PROGRAM_SIZE) {
-        return -1;
-    }
-    
+// Install a program that uses an image the caller holds a reference to
+static int user_add_program(const char* name, user_image_t* image) {
     // Check if program already exists
     if (user_find_program(name)) {
         vga_puts("Error: Program already exists: ");
@@ -73,22 +93,13 @@ int user_load_program(const char* name, const void* code, uint32_t size) {
         return -1;
     }
     
-    // Allocate memory for program code
-    void* program_memory = memory_alloc(size);
-    if (!program_memory) {
-        vga_puts("Error: Failed to allocate program memory\n");
-        return -1;
-    }
-    
-    // Copy program code
-    memory_copy(program_memory, code, size);
-    
     // Initialize program entry
     user_program_t* prog = &user_programs[slot];
     strcpy(prog->name, name);
-    prog->code = program_memory;
-    prog->size = size;
-    prog->entry_point = 0; // Assume entry point is at start
+    prog->code = image->text;
+    prog->size = image->text_size;
+    prog->entry_point = image->entry_point;
+    prog->image = image;
     prog->used = 1;
     
     program_count++;
@@ -96,22 +107,42 @@ int user_load_program(const char* name, const void* code, uint32_t size) {
     vga_puts("Loaded user program: ");
     vga_puts(name);
     vga_puts(" (");
-    // Print size
-    char size_str[16];
-    int i = 0;
-    uint32_t temp_size = size;
-    do {
-        size_str[i++] = '0' + (temp_size % 10);
-        temp_size /= 10;
-    } while (temp_size > 0);
-    for (int j = i - 1; j >= 0; j--) {
-        vga_putchar(size_str[j]);
-    }
+    vga_put_uint(image->text_size);
     vga_puts(" bytes)\n");
     
     return 0;
 }
 
+// Load a user program into memory
+int user_load_program(const char* name, const void* code, uint32_t size) {
+    if (!name || !code || size == 0 || size > MAX_PROGRAM_SIZE) {
+        return -1;
+    }
+    
+    if (user_find_program(name)) {
+        vga_puts("Error: Program already exists: ");
+        vga_puts(name);
+        vga_puts("\n");
+        return -1;
+    }
+    
+    // Share the cached image instead of copying the code
+    char path[64];
+    strcpy(path, "/system/");
+    strcat(path, name);
+    user_image_t* image = user_image_get(path, code, size);
+    if (!image) {
+        vga_puts("Error: Failed to allocate program memory\n");
+        return -1;
+    }
+    
+    if (user_add_program(name, image) != 0) {
+        user_image_release(image);
+        return -1;
+    }
+    return 0;
+}
+
 // Find a user program by name
 user_program_t* user_find_program(const char* name) {
     if (!name) return 0;
@@ -138,20 +169,24 @@ void user_list_programs(void) {
             vga_puts("  ");
             vga_puts(user_programs[i].name);
             vga_puts(" (");
-            // Print size
-            char size_str[16];
-            int j = 0;
-            uint32_t temp_size = user_programs[i].size;
-            do {
-                size_str[j++] = '0' + (temp_size % 10);
-                temp_size /= 10;
-            } while (temp_size > 0);
-            for (int k = j - 1; k >= 0; k--) {
-                vga_putchar(size_str[k]);
+            vga_put_uint(user_programs[i].size);
+            vga_puts(" bytes");
+            if (user_programs[i].image) {
+                vga_puts(", ");
+                vga_put_uint(user_programs[i].image->hits);
+                vga_puts(" cache hits");
             }
-            vga_puts(" bytes)\n");
+            vga_puts(")\n");
         }
     }
+    
+    vga_puts("Image cache: ");
+    vga_put_uint(image_cache_hits);
+    vga_puts(" hits, ");
+    vga_put_uint(image_cache_misses);
+    vga_puts(" misses, ");
+    vga_put_uint(image_bytes_copied);
+    vga_puts(" bytes copied\n");
 }
 
 // Remove a user program
@@ -164,10 +199,8 @@ int user_remove_program(const char* name) {
         return -1;
     }
     
-    // Free program memory
-    if (prog->code) {
-        memory_free(prog->code);
-    }
+    // Drop our reference; the image stays cached until evicted
+    user_image_release(prog->image);
     
     // Mark as unused
     prog->used = 0;
@@ -175,6 +208,7 @@ int user_remove_program(const char* name) {
     prog->code = 0;
     prog->size = 0;
     prog->entry_point = 0;
+    prog->image = 0;
     
     program_count--;
     
@@ -185,6 +219,36 @@ int user_remove_program(const char* name) {
     return 0;
 }
 
+// Pick up a newer /system binary if the file changed since it was loaded
+static void user_refresh_program(user_program_t* prog) {
+    char path[64];
+    strcpy(path, "/system/");
+    strcat(path, prog->name);
+    user_image_t* image = user_image_get(path, 0, 0);
+    if (image && image != prog->image) {
+        user_image_release(prog->image);
+        prog->image = image;
+        prog->code = image->text;
+        prog->size = image->text_size;
+        prog->entry_point = image->entry_point;
+    } else if (image) {
+        user_image_release(image);
+    }
+}
+
+static void user_print_exit(const vm_stats_t* stats) {
+    int32_t exit_code = stats->exit_code;
+    vga_puts("Exit code ");
+    if (exit_code < 0) {
+        vga_putchar('-');
+        exit_code = -exit_code;
+    }
+    vga_put_uint(exit_code);
+    vga_puts(", ");
+    vga_put_uint(stats->instructions);
+    vga_puts(" instructions\n");
+}
+
 // Safe user program execution using simple interpreter
 int user_run_program(const char* name) {
     user_program_t* prog = user_find_program(name);
@@ -199,9 +263,30 @@ int user_run_program(const char* name) {
     vga_puts(name);
     vga_puts("\n");
     
-    // Instead of executing raw machine code, simulate program execution
-    // This prevents crashes from invalid machine code
-    if (strcmp(name, "hello") == 0) {
+    // Each run gets its own process so the pages it is granted are released on exit
+    process_t* process = process_create(0, USER_STACK_SIZE);
+    if (!process) {
+        vga_puts("Error: Cannot create process\n");
+        return -1;
+    }
+    process_start(process);
+    
+    // Revalidate the cached image against /system and set up this instance
+    user_refresh_program(prog);
+    if (prog->image && user_image_instantiate(process, prog->image) != 0) {
+        vga_puts("Error: Cannot set up program data\n");
+        process_exit();
+        return -1;
+    }
+    
+    // Compiled programs run on the bytecode VM; other binaries are simulated
+    // rather than executing raw machine code
+    if (vm_is_image(prog->code, prog->size)) {
+        vm_stats_t stats;
+        if (vm_run(prog->code, prog->size, process, &stats) == 0) {
+            user_print_exit(&stats);
+        }
+    } else if (strcmp(name, "hello") == 0) {
         vga_puts("Hello from user space!\n");
         vga_puts("This program runs in user mode.\n");
         vga_puts("Compiled and stored in /system folder.\n");
@@ -219,10 +304,10 @@ int user_run_program(const char* name) {
         vga_puts("Testing string functions...\n");
         vga_puts("String test passed!\n");
         vga_puts("Testing memory allocation...\n");
-        void* test_ptr = memory_alloc(100);
-        if (test_ptr) {
+        uint32_t test_page = syscall_handler(SYS_MAP_PAGES, 1, 0, 0);
+        if (test_page) {
             vga_puts("Memory allocation successful!\n");
-            memory_free(test_ptr);
+            syscall_handler(SYS_UNMAP_PAGES, test_page, 1, 0);
             vga_puts("Memory freed successfully!\n");
         } else {
             vga_puts("Memory allocation failed!\n");
@@ -237,6 +322,8 @@ int user_run_program(const char* name) {
         vga_puts("!\n");
     }
     
+    process_exit();
+    
     vga_puts("Program ");
     vga_puts(name);
     vga_puts(" finished\n");
@@ -244,8 +331,397 @@ int user_run_program(const char* name) {
     return 0;
 }
 
+// Run compiled programs connected by pipes: each stage's fd 1 feeds the
+// next stage's fd 0. Stages take turns and the runner switches whenever the
+// current one has to wait for its pipe.
+int user_run_pipeline(char* names[], int count) {
+    user_program_t* progs[USER_MAX_PIPELINE];
+    process_t* procs[USER_MAX_PIPELINE];
+    vm_state_t* vms[USER_MAX_PIPELINE];
+    int ok = 1;
+
+    if (count < 2 || count > USER_MAX_PIPELINE) {
+        vga_puts("Error: A pipeline needs 2 to ");
+        vga_put_uint(USER_MAX_PIPELINE);
+        vga_puts(" programs\n");
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        progs[i] = user_find_program(names[i]);
+        if (!progs[i]) {
+            vga_puts("Error: Program not found: ");
+            vga_puts(names[i]);
+            vga_puts("\n");
+            return -1;
+        }
+        user_refresh_program(progs[i]);
+        if (!vm_is_image(progs[i]->code, progs[i]->size)) {
+            vga_puts("Error: Only compiled programs can be piped: ");
+            vga_puts(names[i]);
+            vga_puts("\n");
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        procs[i] = process_create(0, USER_STACK_SIZE);
+        vms[i] = 0;
+        if (!procs[i]) ok = 0;
+    }
+
+    // Connect the stages; the fds hold the only references to each pipe
+    for (int i = 0; ok && i < count - 1; i++) {
+        pipe_t* pipe = pipe_create();
+        if (!pipe) {
+            ok = 0;
+            break;
+        }
+        process_install_fd(procs[i], 1, FD_PIPE_WRITE, pipe);
+        process_install_fd(procs[i + 1], 0, FD_PIPE_READ, pipe);
+    }
+
+    for (int i = 0; ok && i < count; i++) {
+        process_switch(procs[i]);
+        if (progs[i]->image && user_image_instantiate(procs[i], progs[i]->image) != 0) {
+            ok = 0;
+            break;
+        }
+        vms[i] = vm_start(progs[i]->code, progs[i]->size, procs[i]);
+        if (!vms[i]) ok = 0;
+    }
+
+    if (!ok) {
+        vga_puts("Error: Cannot set up pipeline\n");
+        for (int i = 0; i < count; i++) {
+            if (procs[i]) {
+                process_switch(procs[i]);
+                process_exit();
+            }
+        }
+        return -1;
+    }
+
+    int running = count;
+    int result = 0;
+    while (running > 0) {
+        int progress = 0;
+        for (int i = 0; i < count; i++) {
+            if (!vms[i] || procs[i]->main_thread->state == PROCESS_BLOCKED) continue;
+
+            process_switch(procs[i]);
+            progress = 1;
+            if (vm_resume(vms[i]) == VM_BLOCKED) continue;
+
+            // Exiting closes the stage's pipe ends, waking its neighbours
+            vm_stats_t stats;
+            vga_puts(names[i]);
+            vga_puts(": ");
+            if (vm_finish(vms[i], &stats) == 0) {
+                user_print_exit(&stats);
+            } else {
+                result = -1;
+            }
+            process_exit();
+            vms[i] = 0;
+            running--;
+        }
+
+        if (!progress) {
+            // Every remaining stage waits on a pipe nobody will service
+            for (int i = 0; i < count; i++) {
+                if (!vms[i]) continue;
+                process_switch(procs[i]);
+                wait_queue_remove(procs[i]->main_thread);
+                vga_puts(names[i]);
+                vga_puts(": ");
+                vm_abort(vms[i], "pipeline deadlocked");
+                vm_finish(vms[i], 0);
+                process_exit();
+                vms[i] = 0;
+                running--;
+            }
+            result = -1;
+        }
+    }
+
+    return result;
+}
+
+// Current content version of a /system binary (0 if it has no file)
+static uint32_t user_image_file_version(const char* path) {
+    file_entry_t* file = filesystem_find_file(path);
+    return (file && file->type == FILE_TYPE_FILE) ? file->version : 0;
+}
+
+// Drop cached image contents
+static void user_image_free(user_image_t* image) {
+    if (image->text) {
+        memory_free_pages(image->text, image->text_pages);
+    }
+    if (image->data_init) {
+        memory_free(image->data_init);
+    }
+    image->text = 0;
+    image->data_init = 0;
+}
+
+// Pick a free cache slot, evicting the least recently used unreferenced image
+static user_image_t* user_image_alloc_slot(void) {
+    user_image_t* victim = 0;
+    for (int i = 0; i < MAX_CACHED_IMAGES; i++) {
+        if (!image_cache[i].used) {
+            return &image_cache[i];
+        }
+        if (image_cache[i].refs == 0 &&
+            (!victim || image_cache[i].last_used < victim->last_used)) {
+            victim = &image_cache[i];
+        }
+    }
+    if (victim) {
+        user_image_free(victim);
+        victim->used = 0;
+    }
+    return victim;
+}
+
+// Look up an image by path and content version, loading it on a miss.
+// code/size supply the binary when it is not (or not yet) in the filesystem.
+// The caller owns one reference to the returned image.
+user_image_t* user_image_get(const char* path, const void* code, uint32_t size) {
+    uint32_t version = user_image_file_version(path);
+    
+    for (int i = 0; i < MAX_CACHED_IMAGES; i++) {
+        user_image_t* image = &image_cache[i];
+        if (image->used && image->version == version && strcmp(image->path, path) == 0) {
+            image->refs++;
+            image->hits++;
+            image->last_used = ++image_clock;
+            image_cache_hits++;
+            return image;
+        }
+    }
+    
+    // Miss: read the binary from /system if the caller has no copy
+    void* file_copy = 0;
+    if (!code && version != 0) {
+        file_entry_t* file = filesystem_find_file(path);
+        size = file->size;
+        if (size > 0 && size <= MAX_PROGRAM_SIZE) {
+            file_copy = memory_alloc(size);
+            if (file_copy && filesystem_read_at(file, 0, file_copy, size) != (int)size) {
+                // A read or checksum failure; build nothing from a partial copy
+                memory_free(file_copy);
+                return 0;
+            }
+        }
+        code = file_copy;
+    }
+    
+    user_image_t* image = user_image_load(path, version, code, size);
+    if (file_copy) {
+        memory_free(file_copy);
+    }
+    return image;
+}
+
+// Build a cache entry for an image that missed
+static user_image_t* user_image_load(const char* path, uint32_t version, const void* code, uint32_t size) {
+    if (!code || size == 0 || size > MAX_PROGRAM_SIZE) {
+        return 0;
+    }
+    
+    // Parse the optional header
+    uint32_t entry = 0, text = size, data = 0, bss = 0;
+    const uint8_t* text_src = (const uint8_t*)code;
+    const user_image_header_t* header = (const user_image_header_t*)code;
+    if (size >= sizeof(user_image_header_t) && header->magic == USER_IMAGE_MAGIC) {
+        // Bound each field before adding them up, so no sum can wrap
+        if (header->text_size == 0 || header->text_size > MAX_PROGRAM_SIZE ||
+            header->rodata_size > MAX_PROGRAM_SIZE || header->data_size > MAX_PROGRAM_SIZE ||
+            header->bss_size > USER_PAGES_COUNT * PAGE_SIZE ||
+            header->entry_point >= header->text_size) {
+            vga_puts("Error: Bad program image header: ");
+            vga_puts(path);
+            vga_puts("\n");
+            return 0;
+        }
+        uint32_t body = header->text_size + header->rodata_size + header->data_size;
+        if (sizeof(user_image_header_t) + body > size) {
+            vga_puts("Error: Truncated program image: ");
+            vga_puts(path);
+            vga_puts("\n");
+            return 0;
+        }
+        entry = header->entry_point;
+        text = header->text_size + header->rodata_size;
+        data = header->data_size;
+        bss = header->bss_size;
+        text_src += sizeof(user_image_header_t);
+    }
+    
+    user_image_t* image = user_image_alloc_slot();
+    if (!image) {
+        vga_puts("Error: Image cache full\n");
+        return 0;
+    }
+    
+    image->text_pages = (text + PAGE_SIZE - 1) / PAGE_SIZE;
+    image->text = memory_alloc_pages(image->text_pages);
+    image->data_init = data ? memory_alloc(data) : 0;
+    if (!image->text || (data && !image->data_init)) {
+        user_image_free(image);
+        return 0;
+    }
+    
+    memory_copy(image->text, text_src, text);
+    if (data) {
+        memory_copy(image->data_init, text_src + text, data);
+    }
+    image_bytes_copied += text + data;
+    
+    int path_len = strlen(path);
+    if (path_len >= (int)sizeof(image->path)) path_len = sizeof(image->path) - 1;
+    memory_copy(image->path, path, path_len);
+    image->path[path_len] = '\0';
+    image->version = version;
+    image->entry_point = entry;
+    image->text_size = text;
+    image->data_size = data;
+    image->bss_size = bss;
+    image->refs = 1;
+    image->hits = 0;
+    image->last_used = ++image_clock;
+    image->used = 1;
+    image_cache_misses++;
+    return image;
+}
+
+// Drop a reference; unreferenced images stay resident for the next run
+void user_image_release(user_image_t* image) {
+    if (image && image->refs > 0) {
+        image->refs--;
+    }
+}
+
+// Give a process its private data and bss; text is shared, not copied
+static int user_image_instantiate(process_t* process, user_image_t* image) {
+    uint32_t private_size = image->data_size + image->bss_size;
+    if (private_size == 0) {
+        return 0;
+    }
+    
+    uint8_t* data = process_map_pages(process, (private_size + PAGE_SIZE - 1) / PAGE_SIZE);
+    if (!data) {
+        return -1;
+    }
+    if (image->data_size) {
+        memory_copy(data, image->data_init, image->data_size);
+        image_bytes_copied += image->data_size;
+    }
+    memory_set(data + image->data_size, 0, image->bss_size);
+    return 0;
+}
+
+// Give a new kernel object a descriptor in the current process; the
+// object is freed again if there is no free descriptor
+static uint32_t user_install_object(unsigned int type, void* object) {
+    if (!object) return -1;
+    
+    int fd = process_install_fd(process_get_current(), -1, type, object);
+    if (fd < 0) {
+        if (type == FD_SOCKET) {
+            socket_retain((socket_t*)object);
+            socket_release((socket_t*)object);
+        } else if (type == FD_FILE) {
+            file_retain((open_file_t*)object);
+            file_release((open_file_t*)object);
+        } else {
+            event_retain(type, object);
+            event_release(type, object);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+// Write to any kind of descriptor; a missing fd means the console
+static uint32_t user_fd_write(uint32_t fd_num, const void* data, uint32_t count) {
+    fd_entry_t* fd = process_get_fd(process_get_current(), fd_num);
+    if (fd && fd->type == FD_PIPE_WRITE) {
+        int written = pipe_write((pipe_t*)fd->object, data, count);
+        if (written > 0) syscall_write_bytes += written;
+        return written;
+    }
+    if (fd && fd->type == FD_SOCKET) {
+        return socket_send((socket_t*)fd->object, data, count);
+    }
+    if (fd && fd->type == FD_FILE) {
+        return file_write((open_file_t*)fd->object, data, count);
+    }
+    if (fd && fd->type != FD_CONSOLE) {
+        return -1;
+    }
+    if (data && count > 0) {
+        syscall_write_bytes += count;
+        const char* buffer = (const char*)data;
+        for (uint32_t i = 0; i < count; i++) {
+            vga_putchar(buffer[i]);
+        }
+        return count;
+    }
+    return 0;
+}
+
+// Read from any kind of descriptor; a missing fd means the console
+static uint32_t user_fd_read(uint32_t fd_num, void* buffer, uint32_t count) {
+    fd_entry_t* fd = process_get_fd(process_get_current(), fd_num);
+    if (fd && fd->type == FD_PIPE_READ) {
+        return pipe_read((pipe_t*)fd->object, buffer, count);
+    }
+    if (fd && fd->type == FD_TIMER) {
+        return event_timer_read((event_timer_t*)fd->object, buffer, count);
+    }
+    if (fd && fd->type == FD_SOCKET) {
+        return socket_recv((socket_t*)fd->object, buffer, count);
+    }
+    if (fd && fd->type == FD_FILE) {
+        return file_read((open_file_t*)fd->object, buffer, count);
+    }
+    if (!fd || fd->type == FD_CONSOLE) {
+        return event_console_read(buffer, count);
+    }
+    return -1;
+}
+
+// readv/writev: move each vector in turn, stopping at the first short
+// transfer. Blocking or failing before any data moved is reported as is.
+static uint32_t user_fd_vector(uint32_t fd, const io_vector_t* vectors, uint32_t count, int write) {
+    if (!vectors) return -1;
+    
+    uint32_t total = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t result = write ? user_fd_write(fd, vectors[i].base, vectors[i].length)
+                                : user_fd_read(fd, vectors[i].base, vectors[i].length);
+        if ((int)result < 0) {
+            return total ? total : result;
+        }
+        total += result;
+        if (result < vectors[i].length) break;
+    }
+    return total;
+}
+
+// Open file behind a descriptor, 0 if it is not one
+static open_file_t* user_get_file(uint32_t fd_num) {
+    fd_entry_t* fd = process_get_fd(process_get_current(), fd_num);
+    return (fd && fd->type == FD_FILE) ? (open_file_t*)fd->object : 0;
+}
+
 // System call handler
 uint32_t syscall_handler(uint32_t syscall_num, uint32_t arg1, uint32_t arg2, uint32_t arg3) {
+    syscall_count++;
+    
     switch (syscall_num) {
         case SYS_EXIT:
             vga_puts("User program exited with code ");
@@ -254,29 +730,185 @@ uint32_t syscall_handler(uint32_t syscall_num, uint32_t arg1, uint32_t arg2, uin
             return 0;
             
         case SYS_WRITE:
-            // arg1 = fd (ignored for now), arg2 = buffer, arg3 = count
-            if (arg2 && arg3 > 0) {
-                char* buffer = (char*)arg2;
-                for (uint32_t i = 0; i < arg3; i++) {
-                    vga_putchar(buffer[i]);
-                }
-                return arg3;
-            }
-            return 0;
+            // arg1 = fd, arg2 = buffer, arg3 = count
+            syscall_write_count++;
+            return user_fd_write(arg1, (const void*)arg2, arg3);
             
         case SYS_READ:
-            // Simple read from keyboard (not implemented yet)
-            return 0;
+            // arg1 = fd, arg2 = buffer, arg3 = count
+            return user_fd_read(arg1, (void*)arg2, arg3);
+            
+        case SYS_OPEN:
+            // arg1 = path, arg2 = O_* flags
+            return user_install_object(FD_FILE, file_open((const char*)arg1, arg2));
+            
+        case SYS_CLOSE:
+            // arg1 = fd
+            return process_close_fd(process_get_current(), arg1);
             
         case SYS_MALLOC:
-            // Simple malloc from user heap
-            return (uint32_t)memory_alloc(arg1);
+            // Legacy allocation: round up to whole user pages, never the kernel heap
+            return (uint32_t)process_map_pages(process_get_current(),
+                                               (arg1 + PAGE_SIZE - 1) / PAGE_SIZE);
             
         case SYS_FREE:
-            // Simple free
-            memory_free((void*)arg1);
+            process_unmap_pages(process_get_current(), (void*)arg1, 0);
             return 0;
             
+        case SYS_BRK:
+            // arg1 = new break (0 queries), returns the resulting break
+            return process_brk(process_get_current(), arg1);
+            
+        case SYS_MAP_PAGES:
+            // arg1 = page count, returns the address of the grant or 0
+            return (uint32_t)process_map_pages(process_get_current(), arg1);
+            
+        case SYS_UNMAP_PAGES:
+            // arg1 = address, arg2 = page count
+            return process_unmap_pages(process_get_current(), (void*)arg1, arg2);
+            
+        case SYS_PIPE: {
+            // arg1 = int[2] receiving the read and write descriptors
+            process_t* process = process_get_current();
+            pipe_t* pipe = pipe_create();
+            if (!pipe || !arg1) {
+                if (pipe) memory_free(pipe);
+                return -1;
+            }
+            int rfd = process_install_fd(process, -1, FD_PIPE_READ, pipe);
+            int wfd = rfd >= 0 ? process_install_fd(process, -1, FD_PIPE_WRITE, pipe) : -1;
+            if (wfd < 0) {
+                if (rfd >= 0) {
+                    process_close_fd(process, rfd);
+                } else {
+                    memory_free(pipe);
+                }
+                return -1;
+            }
+            ((uint32_t*)arg1)[0] = rfd;
+            ((uint32_t*)arg1)[1] = wfd;
+            return 0;
+        }
+            
+        case SYS_PIPE_GIFT: {
+            // arg1 = fd, arg2 = page-aligned grant, arg3 = page count
+            process_t* process = process_get_current();
+            fd_entry_t* fd = process_get_fd(process, arg1);
+            if (!fd || fd->type != FD_PIPE_WRITE) return -1;
+            syscall_write_count++;
+            int moved = pipe_gift((pipe_t*)fd->object, process, (void*)arg2, arg3);
+            if (moved > 0) syscall_write_bytes += moved;
+            return moved;
+        }
+            
+        case SYS_PIPE_TAKE: {
+            // arg1 = fd, arg2 = void* receiving the page (0 if the caller must read)
+            process_t* process = process_get_current();
+            fd_entry_t* fd = process_get_fd(process, arg1);
+            if (!fd || fd->type != FD_PIPE_READ || !arg2) return -1;
+            return pipe_take((pipe_t*)fd->object, process, (void**)arg2);
+        }
+        
+        case SYS_SHM_OPEN:
+            // arg1 = name, arg2 = size in bytes; returns a segment id
+            if (!arg1) return -1;
+            return shm_open(process_get_current(), (const char*)arg1, arg2);
+            
+        case SYS_SHM_MAP:
+            // arg1 = segment id; returns the address (same in every process)
+            return (uint32_t)shm_map(process_get_current(), arg1);
+            
+        case SYS_SHM_UNMAP:
+            return shm_unmap(process_get_current(), (void*)arg1);
+            
+        case SYS_FUTEX:
+            // arg1 = address, arg2 = FUTEX_WAIT/FUTEX_WAKE, arg3 = value or count
+            if (arg2 == FUTEX_WAIT) {
+                return futex_wait(thread_get_current(), (volatile unsigned int*)arg1, arg3);
+            } else if (arg2 == FUTEX_WAKE) {
+                return futex_wake((volatile unsigned int*)arg1, arg3);
+            }
+            return -1;
+            
+        case SYS_THREAD_CREATE:
+            // arg1 = entry, arg2 = argument; returns the thread id
+            if (!arg1) return -1;
+            return thread_create(process_get_current(), (void* (*)(void*))arg1, (void*)arg2);
+            
+        case SYS_THREAD_JOIN:
+            // arg1 = thread id, arg2 = void* receiving its result (may be 0)
+            return thread_join(arg1, (void**)arg2);
+            
+        case SYS_THREAD_EXIT:
+            // Does not return unless called from the main thread
+            thread_exit((void*)arg1);
+            return -1;
+            
+        case SYS_YIELD:
+            return thread_yield();
+            
+        case SYS_EVENT_CREATE:
+            return user_install_object(FD_EVENT, event_poll_create());
+            
+        case SYS_EVENT_CTL: {
+            // arg1 = event fd, arg2 = op | fd << 8, arg3 = event_t*
+            process_t* process = process_get_current();
+            fd_entry_t* fd = process_get_fd(process, arg1);
+            if (!fd || fd->type != FD_EVENT) return -1;
+            return event_control((event_poll_t*)fd->object, process, arg2 & 0xFF,
+                                 (int)(arg2 >> 8), (const event_t*)arg3);
+        }
+            
+        case SYS_EVENT_WAIT: {
+            // arg1 = event fd, arg2 = event_t[], arg3 = max events | timeout ms << 8
+            fd_entry_t* fd = process_get_fd(process_get_current(), arg1);
+            if (!fd || fd->type != FD_EVENT || !arg2) return -1;
+            return event_wait((event_poll_t*)fd->object, (event_t*)arg2, arg3 & 0xFF, arg3 >> 8);
+        }
+            
+        case SYS_TIMER_CREATE:
+            // arg1 = first expiry in ms, arg2 = interval in ms (0 = one-shot)
+            return user_install_object(FD_TIMER, event_timer_create(arg1, arg2));
+            
+        case SYS_SOCKET:
+            // arg1 = interface name, arg2 = local UDP port
+            if (!arg1) return -1;
+            return user_install_object(FD_SOCKET, socket_create((const char*)arg1, arg2));
+            
+        case SYS_CONNECT: {
+            // arg1 = socket fd, arg2 = IPv4 address (octets in memory order), arg3 = port
+            fd_entry_t* fd = process_get_fd(process_get_current(), arg1);
+            if (!fd || fd->type != FD_SOCKET) return -1;
+            ip_address_t ip;
+            memory_copy(&ip, &arg2, sizeof(ip));
+            return socket_connect((socket_t*)fd->object, &ip, arg3);
+        }
+            
+        case SYS_LSEEK: {
+            // arg1 = fd, arg2 = offset, arg3 = SEEK_* origin
+            open_file_t* file = user_get_file(arg1);
+            if (!file) return -1;
+            return file_seek(file, (int)arg2, arg3);
+        }
+            
+        case SYS_PREAD:
+        case SYS_PWRITE: {
+            // arg1 = fd, arg2 = io_vector_t, arg3 = file offset
+            open_file_t* file = user_get_file(arg1);
+            const io_vector_t* vector = (const io_vector_t*)arg2;
+            if (!file || !vector) return -1;
+            if (syscall_num == SYS_PREAD) {
+                return file_pread(file, vector->base, vector->length, arg3);
+            }
+            return file_pwrite(file, vector->base, vector->length, arg3);
+        }
+            
+        case SYS_READV:
+        case SYS_WRITEV:
+            // arg1 = fd, arg2 = io_vector_t array, arg3 = vector count
+            if (syscall_num == SYS_WRITEV) syscall_write_count++;
+            return user_fd_vector(arg1, (const io_vector_t*)arg2, arg3, syscall_num == SYS_WRITEV);
+            
         default:
             vga_puts("Unknown system call: ");
             vga_putchar('0' + (syscall_num % 10));
@@ -285,6 +917,23 @@ uint32_t syscall_handler(uint32_t syscall_num, uint32_t arg1, uint32_t arg2, uin
     }
 }
 
+// Show system call statistics
+void user_show_syscall_stats(void) {
+    vga_puts("System calls: ");
+    vga_put_uint(syscall_count);
+    vga_puts("\n  write: ");
+    vga_put_uint(syscall_write_count);
+    vga_puts(" calls, ");
+    vga_put_uint(syscall_write_bytes);
+    vga_puts(" bytes");
+    if (syscall_write_count > 0) {
+        vga_puts(" (");
+        vga_put_uint(syscall_write_bytes / syscall_write_count);
+        vga_puts(" bytes/call)");
+    }
+    vga_puts("\n");
+}
+
 // Load built-in user programs
 void user_load_builtin_programs(void) {
     // Create system directory for compiled binaries
@@ -390,55 +1039,31 @@ int user_compile_and_load(const char* name, const char* source_code) {
     vga_puts(name);
     vga_puts("\n");
     
-    // Simple C-to-binary compiler (very basic)
-    static unsigned char compiled_binary[2048];
-    int binary_size = 0;
-    
-    // Generate a simple program that prints messages based on source content
-    // This is a placeholder compiler - in reality you'd parse C and generate proper x86
-    
-    // Standard function prologue
-    compiled_binary[binary_size++] = 0x55;       // push ebp
-    compiled_binary[binary_size++] = 0x89;       // mov ebp, esp
-    compiled_binary[binary_size++] = 0xE5;
-    
-    // Check if source contains "puts" calls and generate appropriate code
-    if (strstr(source_code, "puts(")) {
-        // Add code to call system write function
-        // This is simplified - real compiler would parse properly
-        compiled_binary[binary_size++] = 0x68;   // push message
-        compiled_binary[binary_size++] = 0x00;   // (placeholder address)
-        compiled_binary[binary_size++] = 0x00;
-        compiled_binary[binary_size++] = 0x00;
-        compiled_binary[binary_size++] = 0x00;
-        
-        compiled_binary[binary_size++] = 0xB8;   // mov eax, SYS_WRITE
-        compiled_binary[binary_size++] = 0x01;
-        compiled_binary[binary_size++] = 0x00;
-        compiled_binary[binary_size++] = 0x00;
-        compiled_binary[binary_size++] = 0x00;
-        
-        compiled_binary[binary_size++] = 0x83;   // add esp, 4 (cleanup)
-        compiled_binary[binary_size++] = 0xC4;
-        compiled_binary[binary_size++] = 0x04;
+    // Compile to bytecode for the in-kernel VM
+    static unsigned char compiled_binary[MAX_PROGRAM_SIZE];
+    uint32_t binary_size = 0;
+    if (vm_compile(source_code, compiled_binary, sizeof(compiled_binary), &binary_size) != 0) {
+        return -1;
     }
     
-    // Function epilogue
-    compiled_binary[binary_size++] = 0x5D;       // pop ebp
-    compiled_binary[binary_size++] = 0xC3;       // ret
-    
     // Create binary file path
     char binary_path[64];
     strcpy(binary_path, "/system/");
     strcat(binary_path, name);
     
     // Store compiled binary in filesystem
-    filesystem_write_file(binary_path, (const char*)compiled_binary);
+    filesystem_write_file_data(binary_path, compiled_binary, binary_size);
     
     vga_puts("Binary stored in ");
     vga_puts(binary_path);
     vga_puts("\n");
     
+    // A loaded program picks up the new binary on its next run
+    if (user_find_program(name)) {
+        vga_puts("Program updated\n");
+        return 0;
+    }
+    
     // Load program into memory for execution
     int result = user_load_program(name, compiled_binary, binary_size);
     
@@ -484,7 +1109,9 @@ int user_load_from_file(const char* filename) {
     vga_puts("\n");
     
     // Compile the C source code
-    return user_compile_and_load(prog_name, file_data);
+    int result = user_compile_and_load(prog_name, file_data);
+    memory_free(file_data);
+    return result;
 }
 
 // Load binary directly from /system folder
@@ -493,24 +1120,22 @@ int user_load_binary_from_system(const char* program_name) {
     strcpy(binary_path, "/system/");
     strcat(binary_path, program_name);
     
-    char* binary_data = filesystem_read_file(binary_path);
-    if (!binary_data) {
+    // A cached image with the current content version needs no filesystem read
+    user_image_t* image = user_image_get(binary_path, 0, 0);
+    if (!image) {
         vga_puts("Error: Binary not found: ");
         vga_puts(binary_path);
         vga_puts("\n");
         return -1;
     }
     
-    // Get file size (simplified - assume small files)
-    file_entry_t* file = filesystem_find_file(binary_path);
-    if (!file) {
-        vga_puts("Error: Could not get file info\n");
-        return -1;
-    }
-    
     vga_puts("Loading binary from ");
     vga_puts(binary_path);
     vga_puts("\n");
     
-    return user_load_program(program_name, binary_data, file->size);
-}
\ No newline at end of file
+    if (user_add_program(program_name, image) != 0) {
+        user_image_release(image);
+        return -1;
+    }
+    return 0;
+}
@@ -14,13 +14,48 @@ typedef unsigned char uint8_t;
 #define USER_HEAP_SIZE 8192
 #define MAX_USER_PROGRAMS 16
 #define MAX_PROGRAM_SIZE 16384
+#define USER_MAX_PIPELINE 4
+
+#define MAX_CACHED_IMAGES 16
+#define USER_IMAGE_MAGIC 0x45584550  // "PEXE"
+
+// Optional header at the start of a program binary.
+// Binaries without it are treated as pure text.
+typedef struct user_image_header {
+    uint32_t magic;
+    uint32_t entry_point;    // Offset into text
+    uint32_t text_size;      // Code, shared read-only
+    uint32_t rodata_size;    // Read-only data, shared and placed after text
+    uint32_t data_size;      // Initialised data, private per instance
+    uint32_t bss_size;       // Zeroed data, private per instance
+} user_image_header_t;
+
+// Program image cache entry, keyed by path and file content version.
+// Text and rodata stay resident in user pages and are shared by every
+// instance; only data and bss are set up per run.
+typedef struct user_image {
+    char path[64];
+    uint32_t version;
+    uint32_t entry_point;
+    uint32_t text_size;      // text + rodata
+    uint32_t data_size;
+    uint32_t bss_size;
+    void* text;              // Shared text/rodata pages
+    uint32_t text_pages;
+    void* data_init;         // Pristine copy of .data
+    uint32_t refs;           // Loaded programs and running instances
+    uint32_t hits;
+    uint32_t last_used;
+    int used;
+} user_image_t;
 
 // User program structure
 typedef struct user_program {
     char name[32];
-    void* code;
+    void* code;              // Shared text of the cached image
     uint32_t size;
     uint32_t entry_point;
+    user_image_t* image;
     int used;
 } user_program_t;
 
@@ -30,18 +65,49 @@ typedef struct user_program {
 #define SYS_READ    2
 #define SYS_OPEN    3
 #define SYS_CLOSE   4
-#define SYS_MALLOC  5
+#define SYS_MALLOC  5   // Legacy: whole pages, prefer the userlib allocator
 #define SYS_FREE    6
+#define SYS_BRK         7
+#define SYS_MAP_PAGES   8
+#define SYS_UNMAP_PAGES 9
+#define SYS_PIPE        10
+#define SYS_PIPE_GIFT   11  // Move whole pages into a pipe instead of copying
+#define SYS_PIPE_TAKE   12  // Move a full pipe page to the reader
+#define SYS_SHM_OPEN    13
+#define SYS_SHM_MAP     14
+#define SYS_SHM_UNMAP   15
+#define SYS_FUTEX       16
+#define SYS_THREAD_CREATE 17
+#define SYS_THREAD_JOIN   18
+#define SYS_THREAD_EXIT   19
+#define SYS_YIELD         20
+#define SYS_EVENT_CREATE  21
+#define SYS_EVENT_CTL     22
+#define SYS_EVENT_WAIT    23
+#define SYS_TIMER_CREATE  24
+#define SYS_SOCKET        25
+#define SYS_CONNECT       26
+#define SYS_LSEEK         27
+#define SYS_PREAD         28  // arg2 = one io_vector_t, arg3 = file offset
+#define SYS_PWRITE        29
+#define SYS_READV         30
+#define SYS_WRITEV        31
+
+// Returned by read/write/pipe/futex calls after the caller was put to sleep;
+// the call should be retried once the process is ready again
+#define SYSCALL_WOULD_BLOCK ((uint32_t)-2)
 
 // User space functions
 void user_init(void);
 int user_load_program(const char* name, const void* code, uint32_t size);
 int user_run_program(const char* name);
+int user_run_pipeline(char* names[], int count);
 void user_switch_to_kernel(void);
 void user_switch_to_user(void* entry_point, void* stack);
 
 // System call handler
 uint32_t syscall_handler(uint32_t syscall_num, uint32_t arg1, uint32_t arg2, uint32_t arg3);
+void user_show_syscall_stats(void);
 
 // User program management
 user_program_t* user_find_program(const char* name);
@@ -53,4 +119,8 @@ int user_compile_and_load(const char* name, const char* source_code);
 int user_load_from_file(const char* filename);
 int user_load_binary_from_system(const char* program_name);
 
+// Program image cache
+user_image_t* user_image_get(const char* path, const void* code, uint32_t size);
+void user_image_release(user_image_t* image);
+
 #endif
\ No newline at end of file
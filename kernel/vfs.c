@@ -0,0 +1,124 @@
+#include "vfs.h"
+#include "io.h"
+#include "string.h"
+
+static const vfs_type_t* vfs_types[] = { &pinefs_type, &tmpfs_type };
+
+static vfs_mount_t vfs_mounts[VFS_MAX_MOUNTS];
+
+// Forget every mount but the saved tree at /
+void vfs_init(void) {
+    memory_set(vfs_mounts, 0, sizeof(vfs_mounts));
+    vfs_mounts[0].type = &pinefs_type;
+    vfs_mounts[0].root = 1;
+    vfs_mounts[0].path[0] = '/';
+    vfs_mounts[0].used = 1;
+}
+
+const vfs_type_t* vfs_find_type(const char* name) {
+    for (unsigned int i = 0; i < sizeof(vfs_types) / sizeof(vfs_types[0]); i++) {
+        if (strcmp(vfs_types[i]->name, name) == 0) {
+            return vfs_types[i];
+        }
+    }
+    return 0;
+}
+
+// Take a mount table slot for type over the directory covered; the caller
+// creates the root and fills it in. Returns the slot, or -1 when full.
+int vfs_add_mount(const vfs_type_t* type, const char* path, unsigned int covered) {
+    int len = strlen(path);
+    if (len >= MAX_PATH) {
+        return -1;
+    }
+    for (int i = 1; i < VFS_MAX_MOUNTS; i++) {
+        if (!vfs_mounts[i].used) {
+            vfs_mounts[i].type = type;
+            vfs_mounts[i].covered = covered;
+            vfs_mounts[i].root = 0;
+            memory_copy(vfs_mounts[i].path, path, len + 1);
+            vfs_mounts[i].used = 1;
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Free a slot no entry belongs to any more. The type stays, so a stale
+// index still finds its operations.
+void vfs_drop_mount(unsigned int index) {
+    if (index > 0 && index < VFS_MAX_MOUNTS) {
+        vfs_mounts[index].covered = 0;
+        vfs_mounts[index].root = 0;
+        vfs_mounts[index].used = 0;
+    }
+}
+
+vfs_mount_t* vfs_mount_get(unsigned int index) {
+    if (index >= VFS_MAX_MOUNTS || !vfs_mounts[index].used) {
+        return 0;
+    }
+    return &vfs_mounts[index];
+}
+
+const vfs_type_t* vfs_type_of(const file_entry_t* entry) {
+    return vfs_mounts[entry->mount].type;
+}
+
+int vfs_persistent(const file_entry_t* entry) {
+    return vfs_mounts[entry->mount].type->persistent;
+}
+
+int vfs_is_mount_root(const file_entry_t* entry) {
+    for (int i = 1; i < VFS_MAX_MOUNTS; i++) {
+        if (vfs_mounts[i].used && vfs_mounts[i].root == entry->ino) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Cross from a directory to the root of what is mounted on it, if anything
+file_entry_t* vfs_follow(file_entry_t* entry) {
+    if (!entry || !(entry->flags & FILE_FLAG_MOUNTED)) {
+        return entry;
+    }
+    for (int i = 1; i < VFS_MAX_MOUNTS; i++) {
+        if (vfs_mounts[i].used && vfs_mounts[i].covered == entry->ino) {
+            return filesystem_entry(vfs_mounts[i].root);
+        }
+    }
+    return entry;
+}
+
+// Show each mount with the files it holds and the memory their data takes
+void vfs_list_mounts(void) {
+    for (int i = 0; i < VFS_MAX_MOUNTS; i++) {
+        vfs_mount_t* mount = &vfs_mounts[i];
+        if (!mount->used) {
+            continue;
+        }
+        unsigned int files = 0;
+        unsigned int bytes = 0;
+        unsigned int pages = 0;
+        for (unsigned int ino = 1; ino < fs.next_entry; ino++) {
+            file_entry_t* entry = filesystem_entry(ino);
+            if (entry->used && entry->mount == (unsigned int)i && entry->type == FILE_TYPE_FILE) {
+                files++;
+                bytes += entry->size;
+                pages += mount->type->inode_ops->pages(entry);
+            }
+        }
+
+        vga_puts(mount->type->name);
+        vga_puts(" on ");
+        vga_puts(mount->path);
+        vga_puts(mount->type->persistent ? " (saved): " : " (RAM only): ");
+        vga_put_uint(files);
+        vga_puts(" files, ");
+        vga_put_uint(bytes);
+        vga_puts(" bytes, ");
+        vga_put_uint(pages);
+        vga_puts(" pages in memory\n");
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef VFS_H
+#define VFS_H
+
+#include "filesystem.h"
+
+#define VFS_MAX_MOUNTS 8
+
+// Virtual filesystem switch. Every entry lives in the one inode table and
+// directory tree, but belongs to a mount; the mount's filesystem type says
+// how its files keep their data. Path walking steps from a directory that
+// has a filesystem mounted on it (FILE_FLAG_MOUNTED) to the root of that
+// filesystem, whose parent is the covered directory's parent so ".." leads
+// back out. Mount 0 is the saved tree at /.
+
+// What a filesystem type does with the entries it holds
+typedef struct vfs_inode_ops {
+    void (*init)(file_entry_t* entry);             // New entry, no data yet
+    void (*release)(file_entry_t* entry);          // Entry going away
+    unsigned int (*pages)(file_entry_t* entry);    // Memory pages holding its data
+} vfs_inode_ops_t;
+
+// File data access; offsets and sizes are in bytes, and the entry is
+// known to be a regular file
+typedef struct vfs_file_ops {
+    int (*read)(file_entry_t* file, unsigned int offset, void* buffer, unsigned int count);
+    int (*write)(file_entry_t* file, unsigned int offset, const void* data, unsigned int count);
+    int (*truncate)(file_entry_t* file, unsigned int size);
+} vfs_file_ops_t;
+
+typedef struct vfs_type {
+    const char* name;
+    int persistent;              // Saved to the storage device
+    const vfs_inode_ops_t* inode_ops;
+    const vfs_file_ops_t* file_ops;
+} vfs_type_t;
+
+typedef struct vfs_mount {
+    const vfs_type_t* type;
+    unsigned int covered;        // Directory the mount hides; 0 for /
+    unsigned int root;           // Root directory of the mounted filesystem
+    char path[MAX_PATH];
+    int used;
+} vfs_mount_t;
+
+extern const vfs_type_t pinefs_type;    // The saved tree, filesystem.c
+extern const vfs_type_t tmpfs_type;     // RAM only, tmpfs.c
+
+void vfs_init(void);
+const vfs_type_t* vfs_find_type(const char* name);
+int vfs_add_mount(const vfs_type_t* type, const char* path, unsigned int covered);
+void vfs_drop_mount(unsigned int index);
+vfs_mount_t* vfs_mount_get(unsigned int index);
+const vfs_type_t* vfs_type_of(const file_entry_t* entry);
+int vfs_persistent(const file_entry_t* entry);
+int vfs_is_mount_root(const file_entry_t* entry);
+file_entry_t* vfs_follow(file_entry_t* entry);
+void vfs_list_mounts(void);
+
+#endif
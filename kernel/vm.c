@@ -0,0 +1,827 @@
+#include "vm.h"
+#include "io.h"
+#include "memory.h"
+#include "string.h"
+#include "user.h"
+#include "clock.h"
+
+// Bytecode VM
+// At load time each bytecode instruction is translated into a threaded
+// instruction holding the address of its handler, so dispatch is a single
+// indirect jump (GCC computed goto) with operands already decoded.
+
+typedef struct vm_insn {
+    const void* op;          // Handler label
+    uint8_t a;
+    uint8_t b;
+    uint8_t c;
+    uint8_t pad;
+    int32_t imm;             // Immediate, or target instruction index
+} vm_insn_t;
+
+typedef struct vm_frame {
+    vm_insn_t* ret;
+    int32_t* regs;
+    uint32_t nregs;
+    uint32_t frame_base;
+    uint8_t dest;
+} vm_frame_t;
+
+// Program output is buffered and written to fd 1 a line at a time. When
+// fd 1 is a full pipe the program stops with its output still buffered.
+#define VM_OUT_SIZE   4096
+#define VM_OUT_FLUSH  256
+
+// Why a builtin stopped the program
+#define VM_BLOCK_NONE    0
+#define VM_BLOCK_RETRY   1   // Nothing to read yet: run the SYS again
+#define VM_BLOCK_OUTPUT  2   // Output pending: flush, then continue after the SYS
+
+struct vm_state {
+    process_t* process;
+    uint8_t* base;           // Pages holding the whole VM
+    uint32_t pages;
+    int32_t* mem;
+    int32_t* regs;
+    vm_insn_t* code;
+    uint32_t insn_count;
+    const vm_func_t* funcs;
+    uint32_t func_count;
+    uint32_t* func_entry;    // Translated entry instruction per function
+    uint32_t stack_sp;       // Local arrays grow up from the end of bss
+    uint32_t heap_top;       // malloc() grows down from the top of memory
+    vm_frame_t frames[VM_MAX_FRAMES];
+
+    // Execution state saved while the program is blocked
+    vm_insn_t* ip;
+    int32_t* cur_regs;
+    uint32_t cur_nregs;
+    uint32_t frame_base;
+    uint32_t depth;
+    uint32_t instructions;
+    int32_t exit_code;
+    int finished;
+    int block;
+
+    char out[VM_OUT_SIZE];
+    uint32_t out_len;
+    const char* error;
+};
+
+// Ops followed by an immediate word
+static int vm_op_has_imm(uint32_t op) {
+    switch (op) {
+        case VM_LI: case VM_LEA: case VM_JMP: case VM_JZ: case VM_JNZ:
+        case VM_CALL: case VM_SYS: case VM_ADDI: case VM_LDG: case VM_STG:
+        case VM_LDGX: case VM_STGX:
+        case VM_BEQ: case VM_BNE: case VM_BLT: case VM_BLE: case VM_BGT:
+        case VM_BGE: case VM_INCBLT:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Ops whose immediate is a code word offset
+static int vm_op_is_branch(uint32_t op) {
+    return op == VM_JMP || op == VM_JZ || op == VM_JNZ || op == VM_INCBLT ||
+           (op >= VM_BEQ && op <= VM_BGE);
+}
+
+// Program output goes through the write syscall. Returns 1 if the process
+// has to wait for the reader; output to a closed pipe ends the program.
+static int vm_flush(vm_state_t* vm) {
+    while (vm->out_len > 0) {
+        uint32_t n = syscall_handler(SYS_WRITE, 1, (uint32_t)vm->out, vm->out_len);
+        if (n == SYSCALL_WOULD_BLOCK) {
+            return 1;
+        }
+        if ((int32_t)n <= 0) {
+            vm->out_len = 0;
+            if (!vm->error) vm->error = "broken pipe";
+            return 0;
+        }
+        vm->out_len -= n;
+        memory_copy(vm->out, vm->out + n, vm->out_len);
+    }
+    return 0;
+}
+
+// Characters past VM_OUT_SIZE are only dropped if a single builtin call
+// produces that much output after the pipe filled up
+static void vm_putc(vm_state_t* vm, char c) {
+    if (vm->out_len < VM_OUT_SIZE) {
+        vm->out[vm->out_len++] = c;
+    }
+    if ((c == '\n' || vm->out_len >= VM_OUT_FLUSH) && vm->block == VM_BLOCK_NONE) {
+        if (vm_flush(vm)) vm->block = VM_BLOCK_OUTPUT;
+    }
+}
+
+// Check that cells [addr, addr + count) are inside program memory
+static int vm_check_range(int32_t addr, int32_t count) {
+    return addr > 0 && count >= 0 && (uint32_t)addr < VM_MEM_CELLS &&
+           (uint32_t)count <= VM_MEM_CELLS - (uint32_t)addr;
+}
+
+static void vm_put_uint(vm_state_t* vm, uint32_t value, uint32_t base) {
+    char digits[16];
+    int i = 0;
+    do {
+        digits[i++] = "0123456789abcdef"[value % base];
+        value /= base;
+    } while (value > 0);
+    while (i > 0) {
+        vm_putc(vm, digits[--i]);
+    }
+}
+
+// Print a NUL-terminated string stored one character per cell
+static int vm_put_string(vm_state_t* vm, int32_t addr) {
+    while ((uint32_t)addr < VM_MEM_CELLS && vm->mem[addr]) {
+        vm_putc(vm, (char)vm->mem[addr++]);
+    }
+    return (uint32_t)addr < VM_MEM_CELLS ? 0 : -1;
+}
+
+// Builtin calls (userlib subset)
+static int32_t vm_builtin(vm_state_t* vm, int32_t sysno, const int32_t* args, int nargs) {
+    switch (sysno) {
+        case VM_SYS_PUTS:
+            if (nargs < 1 || vm_put_string(vm, args[0]) != 0) break;
+            vm_putc(vm, '\n');
+            return 0;
+
+        case VM_SYS_PUTCHAR:
+            if (nargs < 1) break;
+            vm_putc(vm, (char)args[0]);
+            return args[0];
+
+        case VM_SYS_PRINTF: {
+            if (nargs < 1) break;
+            int32_t fmt = args[0];
+            int next = 1;
+            while ((uint32_t)fmt < VM_MEM_CELLS && vm->mem[fmt]) {
+                char ch = (char)vm->mem[fmt++];
+                if (ch != '%' || (uint32_t)fmt >= VM_MEM_CELLS) {
+                    vm_putc(vm, ch);
+                    continue;
+                }
+                char spec = (char)vm->mem[fmt++];
+                if (spec == '%') {
+                    vm_putc(vm, '%');
+                    continue;
+                }
+                int32_t value = next < nargs ? args[next++] : 0;
+                if (spec == 'd') {
+                    if (value < 0) {
+                        vm_putc(vm, '-');
+                        value = -value;
+                    }
+                    vm_put_uint(vm, (uint32_t)value, 10);
+                } else if (spec == 'u') {
+                    vm_put_uint(vm, (uint32_t)value, 10);
+                } else if (spec == 'x') {
+                    vm_put_uint(vm, (uint32_t)value, 16);
+                } else if (spec == 'c') {
+                    vm_putc(vm, (char)value);
+                } else if (spec == 's') {
+                    if (vm_put_string(vm, value) != 0) {
+                        vm->error = "bad string pointer";
+                        return 0;
+                    }
+                } else {
+                    vm_putc(vm, '%');
+                    vm_putc(vm, spec);
+                }
+            }
+            return 0;
+        }
+
+        case VM_SYS_STRLEN: {
+            if (nargs < 1) break;
+            int32_t addr = args[0];
+            int32_t len = 0;
+            while ((uint32_t)(addr + len) < VM_MEM_CELLS && vm->mem[addr + len]) len++;
+            return len;
+        }
+
+        case VM_SYS_MALLOC: {
+            if (nargs < 1 || args[0] <= 0) return 0;
+            uint32_t cells = (uint32_t)args[0];
+            if (vm->heap_top - vm->stack_sp <= cells) return 0;
+            vm->heap_top -= cells;
+            return (int32_t)vm->heap_top;
+        }
+
+        case VM_SYS_FREE:
+            // Bump allocator: memory is reclaimed when the program exits
+            return 0;
+
+        case VM_SYS_CLOCK:
+            return (int32_t)clock_get_ms();
+
+        case VM_SYS_GETCHAR: {
+            char ch;
+            uint32_t n = syscall_handler(SYS_READ, 0, (uint32_t)&ch, 1);
+            if (n == SYSCALL_WOULD_BLOCK) {
+                vm->block = VM_BLOCK_RETRY;
+                return 0;
+            }
+            return n == 1 ? (int32_t)(uint8_t)ch : -1;
+        }
+
+        case VM_SYS_READ: {
+            if (nargs < 3 || !vm_check_range(args[1], args[2])) break;
+            char bounce[256];
+            uint32_t want = (uint32_t)args[2] < sizeof(bounce) ? (uint32_t)args[2] : sizeof(bounce);
+            uint32_t n = syscall_handler(SYS_READ, (uint32_t)args[0], (uint32_t)bounce, want);
+            if (n == SYSCALL_WOULD_BLOCK) {
+                vm->block = VM_BLOCK_RETRY;
+                return 0;
+            }
+            if ((int32_t)n <= 0) return (int32_t)n;
+            for (uint32_t i = 0; i < n; i++) {
+                vm->mem[args[1] + i] = (uint8_t)bounce[i];
+            }
+            return (int32_t)n;
+        }
+
+        case VM_SYS_WRITE: {
+            if (nargs < 3 || !vm_check_range(args[1], args[2])) break;
+            int32_t addr = args[1];
+            uint32_t count = (uint32_t)args[2];
+            if (args[0] == 1) {
+                // Share the output buffer so write() and printf() stay ordered;
+                // a short count is returned when the buffer is full
+                if (count > VM_OUT_SIZE - vm->out_len) count = VM_OUT_SIZE - vm->out_len;
+                for (uint32_t i = 0; i < count; i++) {
+                    vm_putc(vm, (char)vm->mem[addr + i]);
+                }
+                return (int32_t)count;
+            }
+            char bounce[256];
+            if (count > sizeof(bounce)) count = sizeof(bounce);
+            for (uint32_t i = 0; i < count; i++) {
+                bounce[i] = (char)vm->mem[addr + i];
+            }
+            uint32_t n = syscall_handler(SYS_WRITE, (uint32_t)args[0], (uint32_t)bounce, count);
+            if (n == SYSCALL_WOULD_BLOCK) {
+                vm->block = VM_BLOCK_RETRY;
+                return 0;
+            }
+            return (int32_t)n;
+        }
+    }
+
+    vm->error = "bad builtin call";
+    return 0;
+}
+
+// Threaded interpreter, continuing from the saved state. Called with
+// table != 0 it only returns the handler addresses so the loader can
+// translate bytecode into threaded code.
+static int vm_execute(vm_state_t* vm, const void* const** table) {
+    static const void* const labels[VM_OPCODE_COUNT] = {
+        [VM_HALT] = &&op_halt, [VM_LI] = &&op_li, [VM_MOV] = &&op_mov,
+        [VM_ADD] = &&op_add, [VM_SUB] = &&op_sub, [VM_MUL] = &&op_mul,
+        [VM_DIV] = &&op_div, [VM_MOD] = &&op_mod, [VM_AND] = &&op_and,
+        [VM_OR] = &&op_or, [VM_XOR] = &&op_xor, [VM_SHL] = &&op_shl,
+        [VM_SHR] = &&op_shr, [VM_EQ] = &&op_eq, [VM_NE] = &&op_ne,
+        [VM_LT] = &&op_lt, [VM_LE] = &&op_le, [VM_GT] = &&op_gt,
+        [VM_GE] = &&op_ge, [VM_NEG] = &&op_neg, [VM_NOT] = &&op_not,
+        [VM_BNOT] = &&op_bnot, [VM_LD] = &&op_ld, [VM_ST] = &&op_st,
+        [VM_LEA] = &&op_lea, [VM_JMP] = &&op_jmp, [VM_JZ] = &&op_jz,
+        [VM_JNZ] = &&op_jnz, [VM_CALL] = &&op_call, [VM_RET] = &&op_ret,
+        [VM_RET0] = &&op_ret0, [VM_SYS] = &&op_sys, [VM_ADDI] = &&op_addi,
+        [VM_LDG] = &&op_ldg, [VM_STG] = &&op_stg, [VM_LDX] = &&op_ldx,
+        [VM_STX] = &&op_stx, [VM_LDGX] = &&op_ldgx, [VM_STGX] = &&op_stgx,
+        [VM_BEQ] = &&op_beq, [VM_BNE] = &&op_bne,
+        [VM_BLT] = &&op_blt, [VM_BLE] = &&op_ble, [VM_BGT] = &&op_bgt,
+        [VM_BGE] = &&op_bge, [VM_INCBLT] = &&op_incblt,
+    };
+
+    if (table) {
+        *table = labels;
+        return 0;
+    }
+
+    int32_t* mem = vm->mem;
+    int32_t* regs = vm->cur_regs;
+    int32_t* regs_end = vm->regs + VM_MAX_REGS;
+    vm_insn_t* code = vm->code;
+    vm_insn_t* ip = vm->ip;
+    uint32_t nregs = vm->cur_nregs;
+    uint32_t frame_base = vm->frame_base;
+    uint32_t depth = vm->depth;
+    uint32_t count = 0;
+    int32_t value = 0;
+
+#define R(x)      regs[ip->x]
+#define DISPATCH() do { count++; goto *ip->op; } while (0)
+#define NEXT()     do { ip++; DISPATCH(); } while (0)
+#define JUMP(t)    do { ip = code + (t); DISPATCH(); } while (0)
+#define CHECK_ADDR(x) do { if ((uint32_t)(x) >= VM_MEM_CELLS) goto fault_mem; } while (0)
+
+    DISPATCH();
+
+op_li:   R(a) = ip->imm; NEXT();
+op_mov:  R(a) = R(b); NEXT();
+op_add:  R(a) = R(b) + R(c); NEXT();
+op_sub:  R(a) = R(b) - R(c); NEXT();
+op_mul:  R(a) = R(b) * R(c); NEXT();
+// idiv traps on INT_MIN / -1 as well as on 0; x / -1 is a wrapping negate
+op_div:  if (R(c) == 0) goto fault_div;
+         R(a) = R(c) == -1 ? (int32_t)(0u - (uint32_t)R(b)) : R(b) / R(c); NEXT();
+op_mod:  if (R(c) == 0) goto fault_div; R(a) = R(c) == -1 ? 0 : R(b) % R(c); NEXT();
+op_and:  R(a) = R(b) & R(c); NEXT();
+op_or:   R(a) = R(b) | R(c); NEXT();
+op_xor:  R(a) = R(b) ^ R(c); NEXT();
+op_shl:  R(a) = R(b) << (R(c) & 31); NEXT();
+op_shr:  R(a) = R(b) >> (R(c) & 31); NEXT();
+op_eq:   R(a) = R(b) == R(c); NEXT();
+op_ne:   R(a) = R(b) != R(c); NEXT();
+op_lt:   R(a) = R(b) < R(c); NEXT();
+op_le:   R(a) = R(b) <= R(c); NEXT();
+op_gt:   R(a) = R(b) > R(c); NEXT();
+op_ge:   R(a) = R(b) >= R(c); NEXT();
+op_neg:  R(a) = -R(b); NEXT();
+op_not:  R(a) = !R(b); NEXT();
+op_bnot: R(a) = ~R(b); NEXT();
+op_ld:   CHECK_ADDR(R(b)); R(a) = mem[R(b)]; NEXT();
+op_st:   CHECK_ADDR(R(a)); mem[R(a)] = R(b); NEXT();
+op_lea:  R(a) = frame_base + ip->imm; NEXT();
+op_jmp:  JUMP(ip->imm);
+op_jz:   if (!R(a)) JUMP(ip->imm); NEXT();
+op_jnz:  if (R(a)) JUMP(ip->imm); NEXT();
+
+op_addi: R(a) = R(b) + ip->imm; NEXT();
+op_ldg:  R(a) = mem[ip->imm]; NEXT();
+op_stg:  mem[ip->imm] = R(a); NEXT();
+op_ldx:  value = R(b) + R(c); CHECK_ADDR(value); R(a) = mem[value]; NEXT();
+op_stx:  value = R(a) + R(b); CHECK_ADDR(value); mem[value] = R(c); NEXT();
+op_ldgx: value = ip->imm + R(b); CHECK_ADDR(value); R(a) = mem[value]; NEXT();
+op_stgx: value = ip->imm + R(b); CHECK_ADDR(value); mem[value] = R(a); NEXT();
+op_beq:  if (R(a) == R(b)) JUMP(ip->imm); NEXT();
+op_bne:  if (R(a) != R(b)) JUMP(ip->imm); NEXT();
+op_blt:  if (R(a) < R(b)) JUMP(ip->imm); NEXT();
+op_ble:  if (R(a) <= R(b)) JUMP(ip->imm); NEXT();
+op_bgt:  if (R(a) > R(b)) JUMP(ip->imm); NEXT();
+op_bge:  if (R(a) >= R(b)) JUMP(ip->imm); NEXT();
+op_incblt: if (++R(a) < R(b)) JUMP(ip->imm); NEXT();
+
+op_call: {
+        // Callee registers start right after the caller's (operands were
+        // checked against nregs at load time)
+        const vm_func_t* func = &vm->funcs[ip->imm];
+        int32_t* callee = regs + nregs;
+        if (depth >= VM_MAX_FRAMES || callee + func->nregs > regs_end) goto fault_stack;
+        if (vm->stack_sp + func->frame_cells >= vm->heap_top) goto fault_stack;
+
+        vm_frame_t* frame = &vm->frames[depth++];
+        frame->ret = ip + 1;
+        frame->regs = regs;
+        frame->nregs = nregs;
+        frame->frame_base = frame_base;
+        frame->dest = ip->a;
+        for (int i = 0; i < ip->c; i++) {
+            callee[i] = regs[ip->b + i];
+        }
+        regs = callee;
+        nregs = func->nregs;
+        frame_base = vm->stack_sp;
+        vm->stack_sp += func->frame_cells;
+        JUMP(vm->func_entry[ip->imm]);
+    }
+
+op_ret0:
+    value = 0;
+    goto do_return;
+op_ret:
+    value = R(a);
+do_return:
+    vm->stack_sp = frame_base;
+    if (depth == 0) goto done;
+    {
+        vm_frame_t* frame = &vm->frames[--depth];
+        regs = frame->regs;
+        nregs = frame->nregs;
+        frame_base = frame->frame_base;
+        ip = frame->ret;
+        regs[frame->dest] = value;
+        DISPATCH();
+    }
+
+op_sys:
+    value = vm_builtin(vm, ip->imm, &R(b), ip->c);
+    if (vm->error) goto done;
+    if (vm->block == VM_BLOCK_RETRY) goto suspend;
+    R(a) = value;
+    if (vm->block == VM_BLOCK_OUTPUT) {
+        ip++;
+        goto suspend;
+    }
+    NEXT();
+
+op_halt:
+    value = 0;
+    goto done;
+
+fault_mem:
+    vm->error = "memory access out of bounds";
+    goto done;
+fault_div:
+    vm->error = "division by zero";
+    goto done;
+fault_stack:
+    vm->error = "stack overflow";
+    goto done;
+
+suspend:
+    vm->ip = ip;
+    vm->cur_regs = regs;
+    vm->cur_nregs = nregs;
+    vm->frame_base = frame_base;
+    vm->depth = depth;
+    vm->instructions += count;
+    return VM_BLOCKED;
+
+done:
+    vm->instructions += count;
+    vm->exit_code = value;
+    vm->finished = 1;
+    return vm->error ? VM_FAULT : VM_EXITED;
+
+#undef R
+#undef DISPATCH
+#undef NEXT
+#undef JUMP
+#undef CHECK_ADDR
+}
+
+// Check for a bytecode image
+int vm_is_image(const void* image, uint32_t size) {
+    const vm_image_header_t* header = (const vm_image_header_t*)image;
+    return image && size >= sizeof(vm_image_header_t) && header->magic == VM_MAGIC;
+}
+
+// Find the function whose code contains a word offset
+static uint32_t vm_owner(const vm_func_t* funcs, uint32_t count, uint32_t word) {
+    uint32_t owner = 0;
+    for (uint32_t f = 0; f < count; f++) {
+        if (funcs[f].entry <= word && funcs[f].entry >= funcs[owner].entry) {
+            owner = f;
+        }
+    }
+    return owner;
+}
+
+// Validate the image and translate bytecode into threaded code
+static int vm_load(vm_state_t* vm, const vm_image_header_t* header, uint32_t size,
+                   uint16_t* word_to_insn) {
+    const vm_func_t* funcs = (const vm_func_t*)(header + 1);
+    const uint32_t* words = (const uint32_t*)(funcs + header->func_count);
+    const int32_t* data = (const int32_t*)(words + header->code_words);
+    const void* const* labels;
+
+    if (header->func_count == 0 || header->func_count > VM_MAX_FUNCS ||
+        header->code_words > VM_MAX_CODE || header->data_cells > VM_MAX_DATA ||
+        header->bss_cells > VM_MAX_BSS ||
+        header->main_func >= header->func_count ||
+        (const uint8_t*)(data + header->data_cells) > (const uint8_t*)header + size) {
+        vm->error = "malformed image";
+        return -1;
+    }
+
+    for (uint32_t f = 0; f < header->func_count; f++) {
+        if (funcs[f].entry >= header->code_words || funcs[f].nregs == 0 ||
+            funcs[f].nregs > 256 || funcs[f].frame_cells > VM_MEM_CELLS) {
+            vm->error = "bad function table";
+            return -1;
+        }
+    }
+
+    vm_execute(0, &labels);
+
+    // First pass: instruction boundaries (0xFFFF marks an immediate word)
+    uint32_t n = 0;
+    for (uint32_t w = 0; w < header->code_words; n++) {
+        uint32_t op = words[w] & 0xFF;
+        if (op >= VM_OPCODE_COUNT) {
+            vm->error = "bad opcode";
+            return -1;
+        }
+        word_to_insn[w++] = n;
+        if (vm_op_has_imm(op)) {
+            if (w == header->code_words) {
+                vm->error = "truncated instruction";
+                return -1;
+            }
+            word_to_insn[w++] = 0xFFFF;
+        }
+    }
+    word_to_insn[header->code_words] = n;
+
+    // Second pass: decode operands, check them, resolve branch targets
+    for (uint32_t w = 0, i = 0; w < header->code_words; i++) {
+        uint32_t word = words[w];
+        uint32_t op = word & 0xFF;
+        uint32_t nregs = funcs[vm_owner(funcs, header->func_count, w)].nregs;
+        vm_insn_t* insn = &vm->code[i];
+        insn->op = labels[op];
+        insn->a = (word >> 8) & 0xFF;
+        insn->b = (word >> 16) & 0xFF;
+        insn->c = (word >> 24) & 0xFF;
+        insn->imm = vm_op_has_imm(op) ? (int32_t)words[w + 1] : 0;
+
+        // For CALL and SYS, c is an argument count rather than a register
+        uint32_t last = (op == VM_CALL || op == VM_SYS) ? insn->b + insn->c : insn->c + 1u;
+        if (insn->a >= nregs || insn->b >= nregs || last > nregs) {
+            vm->error = "bad register";
+            return -1;
+        }
+
+        if (vm_op_is_branch(op)) {
+            uint32_t target = (uint32_t)insn->imm;
+            if (target > header->code_words || word_to_insn[target] == 0xFFFF) {
+                vm->error = "bad branch target";
+                return -1;
+            }
+            insn->imm = word_to_insn[target];
+        } else if (op == VM_CALL && (uint32_t)insn->imm >= header->func_count) {
+            vm->error = "bad call target";
+            return -1;
+        } else if (op == VM_SYS && (uint32_t)insn->imm >= VM_SYS_COUNT) {
+            vm->error = "bad builtin";
+            return -1;
+        } else if ((op == VM_LDG || op == VM_STG) && (uint32_t)insn->imm >= VM_MEM_CELLS) {
+            vm->error = "bad global address";
+            return -1;
+        }
+        w += vm_op_has_imm(op) ? 2 : 1;
+    }
+
+    // Falling off the end halts
+    vm->code[n].op = labels[VM_HALT];
+    vm->insn_count = n + 1;
+
+    for (uint32_t f = 0; f < header->func_count; f++) {
+        if (word_to_insn[funcs[f].entry] == 0xFFFF) {
+            vm->error = "bad function entry";
+            return -1;
+        }
+        vm->func_entry[f] = word_to_insn[funcs[f].entry];
+    }
+    vm->funcs = funcs;
+    vm->func_count = header->func_count;
+
+    // Globals and string literals start at cell 1 (cell 0 is null)
+    memory_copy(vm->mem + 1, data, header->data_cells * sizeof(int32_t));
+    vm->stack_sp = VM_BSS_BASE + header->bss_cells;
+    vm->heap_top = VM_MEM_CELLS;
+    return 0;
+}
+
+// Load a bytecode image into a process, ready to run from main()
+vm_state_t* vm_start(const void* image, uint32_t size, process_t* process) {
+    const vm_image_header_t* header = (const vm_image_header_t*)image;
+    if (!vm_is_image(image, size)) {
+        return 0;
+    }
+
+    // Program memory, registers, threaded code and VM state all live in user pages
+    uint32_t mem_bytes = VM_MEM_CELLS * sizeof(int32_t);
+    uint32_t reg_bytes = VM_MAX_REGS * sizeof(int32_t);
+    uint32_t code_bytes = (VM_MAX_CODE + 1) * sizeof(vm_insn_t);
+    uint32_t map_bytes = (VM_MAX_CODE + 1) * sizeof(uint16_t) + VM_MAX_FUNCS * sizeof(uint32_t);
+    uint32_t total = mem_bytes + reg_bytes + code_bytes + map_bytes + sizeof(vm_state_t);
+    uint32_t pages = (total + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    uint8_t* base = process_map_pages(process, pages);
+    if (!base) {
+        vga_puts("Error: Not enough memory to run program\n");
+        return 0;
+    }
+    memory_set(base, 0, mem_bytes + reg_bytes);
+
+    vm_state_t* vm = (vm_state_t*)(base + mem_bytes + reg_bytes + code_bytes + map_bytes);
+    memory_set(vm, 0, sizeof(vm_state_t));
+    vm->process = process;
+    vm->base = base;
+    vm->pages = pages;
+    vm->mem = (int32_t*)base;
+    vm->regs = (int32_t*)(base + mem_bytes);
+    vm->code = (vm_insn_t*)(base + mem_bytes + reg_bytes);
+    uint16_t* word_to_insn = (uint16_t*)(base + mem_bytes + reg_bytes + code_bytes);
+    vm->func_entry = (uint32_t*)(word_to_insn + VM_MAX_CODE + 1);
+
+    if (vm_load(vm, header, size, word_to_insn) == 0) {
+        const vm_func_t* main = &vm->funcs[header->main_func];
+        vm->ip = vm->code + vm->func_entry[header->main_func];
+        vm->cur_regs = vm->regs;
+        vm->cur_nregs = main->nregs;
+        vm->frame_base = vm->stack_sp;
+        vm->stack_sp += main->frame_cells;
+        if (vm->stack_sp >= vm->heap_top) {
+            vm->error = "stack overflow";
+        }
+    }
+
+    if (vm->error) {
+        vga_puts("VM error: ");
+        vga_puts(vm->error);
+        vga_puts("\n");
+        process_unmap_pages(process, base, pages);
+        return 0;
+    }
+    return vm;
+}
+
+// Run until the program exits, faults or has to wait on a pipe. A blocked
+// program is resumed once its process is ready again.
+int vm_resume(vm_state_t* vm) {
+    if (vm->block == VM_BLOCK_OUTPUT || vm->finished) {
+        if (vm_flush(vm)) return VM_BLOCKED;
+    }
+    vm->block = VM_BLOCK_NONE;
+    if (vm->finished) {
+        return vm->error ? VM_FAULT : VM_EXITED;
+    }
+
+    int status = vm_execute(vm, 0);
+    if (status != VM_BLOCKED && vm_flush(vm)) {
+        return VM_BLOCKED;
+    }
+    return status;
+}
+
+// Stop a program that can never make progress
+void vm_abort(vm_state_t* vm, const char* reason) {
+    if (!vm->error) {
+        vm->error = reason;
+    }
+    vm->out_len = 0;
+    vm->finished = 1;
+}
+
+// Report the outcome and give the program's pages back
+int vm_finish(vm_state_t* vm, vm_stats_t* stats) {
+    int result = vm->error ? -1 : 0;
+
+    if (vm->error) {
+        vga_puts("VM error: ");
+        vga_puts(vm->error);
+        vga_puts("\n");
+    }
+    if (stats) {
+        stats->instructions = vm->instructions;
+        stats->exit_code = vm->exit_code;
+    }
+
+    process_unmap_pages(vm->process, vm->base, vm->pages);
+    return result;
+}
+
+// Run a bytecode image inside a process
+int vm_run(const void* image, uint32_t size, process_t* process, vm_stats_t* stats) {
+    vm_state_t* vm = vm_start(image, size, process);
+    if (!vm) {
+        return -1;
+    }
+
+    // A lone program has nobody to wake it up
+    if (vm_resume(vm) == VM_BLOCKED) {
+        wait_queue_remove(process->main_thread);
+        vm_abort(vm, "blocked with no other program running");
+    }
+    return vm_finish(vm, stats);
+}
+
+// Interpreter benchmark programs
+static const char* vm_bench_names[] = { "fib", "sieve", "strings" };
+static const char* vm_bench_sources[] = {
+    "int fib(int n) {\n"
+    "    if (n < 2) return n;\n"
+    "    return fib(n - 1) + fib(n - 2);\n"
+    "}\n"
+    "int main() {\n"
+    "    printf(\"fib(22) = %d\\n\", fib(22));\n"
+    "    return 0;\n"
+    "}\n",
+
+    "int flags[8192];\n"
+    "int main() {\n"
+    "    int n = 8192;\n"
+    "    int count = 0;\n"
+    "    int iter;\n"
+    "    int i;\n"
+    "    int k;\n"
+    "    for (iter = 0; iter < 10; iter++) {\n"
+    "        count = 0;\n"
+    "        for (i = 2; i < n; i++) flags[i] = 1;\n"
+    "        for (i = 2; i < n; i++) {\n"
+    "            if (flags[i]) {\n"
+    "                count++;\n"
+    "                for (k = i + i; k < n; k += i) flags[k] = 0;\n"
+    "            }\n"
+    "        }\n"
+    "    }\n"
+    "    printf(\"sieve: %d primes below %d\\n\", count, n);\n"
+    "    return 0;\n"
+    "}\n",
+
+    "int copy(char *d, char *s) {\n"
+    "    int i = 0;\n"
+    "    while (s[i]) {\n"
+    "        d[i] = s[i];\n"
+    "        i++;\n"
+    "    }\n"
+    "    d[i] = 0;\n"
+    "    return i;\n"
+    "}\n"
+    "int reverse(char *s, int len) {\n"
+    "    int i = 0;\n"
+    "    int j = len - 1;\n"
+    "    while (i < j) {\n"
+    "        int t = s[i];\n"
+    "        s[i] = s[j];\n"
+    "        s[j] = t;\n"
+    "        i++;\n"
+    "        j--;\n"
+    "    }\n"
+    "    return len;\n"
+    "}\n"
+    "int main() {\n"
+    "    char buf[64];\n"
+    "    int total = 0;\n"
+    "    int r;\n"
+    "    for (r = 0; r < 2000; r++) {\n"
+    "        total += copy(buf, \"the quick brown fox jumps over the lazy dog\");\n"
+    "        total += reverse(buf, strlen(buf));\n"
+    "    }\n"
+    "    printf(\"strings: %d chars, %s\\n\", total, buf);\n"
+    "    return 0;\n"
+    "}\n",
+};
+
+// Compile and time each benchmark program
+void vm_benchmark(void) {
+    static uint8_t image[VM_MAX_CODE * 4 + VM_MAX_DATA * 4 + 512];
+
+    if (clock_get_tsc_khz() == 0) {
+        vga_puts("Warning: no TSC, timings unavailable\n");
+    }
+
+    process_t* process = process_create(0, USER_STACK_SIZE);
+    if (!process) {
+        vga_puts("Error: Cannot create process\n");
+        return;
+    }
+    process_start(process);
+
+    uint64_t total_insns = 0;
+    uint64_t total_ns = 0;
+
+    for (int i = 0; i < (int)(sizeof(vm_bench_sources) / sizeof(vm_bench_sources[0])); i++) {
+        uint32_t len = 0;
+        if (vm_compile(vm_bench_sources[i], image, sizeof(image), &len) != 0) {
+            vga_puts("Error: benchmark failed to compile: ");
+            vga_puts(vm_bench_names[i]);
+            vga_puts("\n");
+            continue;
+        }
+
+        vm_stats_t stats;
+        uint64_t start = clock_get_ns();
+        int result = vm_run(image, len, process, &stats);
+        uint64_t elapsed = clock_get_ns() - start;
+        if (result != 0) continue;
+
+        uint32_t us = (uint32_t)clock_div64(elapsed, 1000);
+        vga_puts("  ");
+        vga_puts(vm_bench_names[i]);
+        vga_puts(": ");
+        vga_put_uint(stats.instructions);
+        vga_puts(" insns in ");
+        vga_put_uint(us);
+        vga_puts(" us");
+        if (us > 0) {
+            vga_puts(" = ");
+            vga_put_uint((uint32_t)clock_div64((uint64_t)stats.instructions * 1000000, us));
+            vga_puts(" insns/s");
+        }
+        vga_puts("\n");
+
+        total_insns += stats.instructions;
+        total_ns += elapsed;
+    }
+
+    uint32_t total_us = (uint32_t)clock_div64(total_ns, 1000);
+    if (total_us > 0) {
+        vga_puts("Total: ");
+        vga_put_uint((uint32_t)clock_div64(total_insns * 1000000, total_us));
+        vga_puts(" insns/s\n");
+    }
+
+    process_exit();
+}
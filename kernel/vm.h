@@ -0,0 +1,148 @@
+#ifndef VM_H
+#define VM_H
+
+#include "process.h"
+
+// Define our own integer types for bare-metal environment
+typedef unsigned long long uint64_t;
+typedef unsigned int uint32_t;
+typedef unsigned short uint16_t;
+typedef unsigned char uint8_t;
+typedef int int32_t;
+
+// Bytecode image produced by the in-OS compiler and stored in /system
+//   vm_image_header_t
+//   vm_func_t funcs[func_count]
+//   uint32_t code[code_words]
+//   int32_t data[data_cells]      (globals and string literals)
+// Program memory: cell 0 is null, data is loaded at cell 1, zeroed global
+// arrays (bss) start at VM_BSS_BASE, then local arrays grow up and malloc()
+// grows down from the top.
+#define VM_MAGIC 0x31434250        // "PBC1"
+
+#define VM_MAX_FUNCS    32
+#define VM_MAX_CODE     4096       // Code words per image
+#define VM_MAX_DATA     4096       // Initialised data cells per image
+#define VM_MAX_BSS      16384      // Zeroed global array cells per image
+#define VM_MAX_ARGS     8
+#define VM_MEM_CELLS    32768      // Memory cells per running program
+#define VM_BSS_BASE     (1 + VM_MAX_DATA)
+#define VM_MAX_REGS     4096       // Register file shared by all frames
+#define VM_MAX_FRAMES   256
+
+// Instruction word: op | a << 8 | b << 16 | c << 24.
+// Ops marked (imm) are followed by one immediate word.
+// Memory is addressed in 32-bit cells; cell 0 is the null pointer.
+enum vm_opcode {
+    VM_HALT = 0,
+    VM_LI,          // (imm) r[a] = imm
+    VM_MOV,         // r[a] = r[b]
+    VM_ADD,         // r[a] = r[b] op r[c]
+    VM_SUB,
+    VM_MUL,
+    VM_DIV,
+    VM_MOD,
+    VM_AND,
+    VM_OR,
+    VM_XOR,
+    VM_SHL,
+    VM_SHR,
+    VM_EQ,
+    VM_NE,
+    VM_LT,
+    VM_LE,
+    VM_GT,
+    VM_GE,
+    VM_NEG,         // r[a] = -r[b]
+    VM_NOT,         // r[a] = !r[b]
+    VM_BNOT,        // r[a] = ~r[b]
+    VM_LD,          // r[a] = mem[r[b]]
+    VM_ST,          // mem[r[a]] = r[b]
+    VM_LEA,         // (imm) r[a] = frame base + imm
+    VM_JMP,         // (imm) goto imm
+    VM_JZ,          // (imm) if (!r[a]) goto imm
+    VM_JNZ,         // (imm) if (r[a]) goto imm
+    VM_CALL,        // (imm) r[a] = funcs[imm](r[b] .. r[b + c - 1])
+    VM_RET,         // return r[a]
+    VM_RET0,        // return 0
+    VM_SYS,         // (imm) r[a] = builtin imm (r[b] .. r[b + c - 1])
+
+    // Superinstructions for common sequences
+    VM_ADDI,        // (imm) r[a] = r[b] + imm            (LI + ADD)
+    VM_LDG,         // (imm) r[a] = mem[imm]              (LI + LD)
+    VM_STG,         // (imm) mem[imm] = r[a]              (LI + ST)
+    VM_LDX,         // r[a] = mem[r[b] + r[c]]            (ADD + LD)
+    VM_STX,         // mem[r[a] + r[b]] = r[c]            (ADD + ST)
+    VM_LDGX,        // (imm) r[a] = mem[imm + r[b]]       (global array load)
+    VM_STGX,        // (imm) mem[imm + r[b]] = r[a]       (global array store)
+    VM_BEQ,         // (imm) if (r[a] == r[b]) goto imm   (compare + JNZ)
+    VM_BNE,
+    VM_BLT,
+    VM_BLE,
+    VM_BGT,
+    VM_BGE,
+    VM_INCBLT,      // (imm) if (++r[a] < r[b]) goto imm  (ADDI + BLT, counted loops)
+
+    VM_OPCODE_COUNT
+};
+
+// Builtin calls available to compiled programs (userlib subset)
+enum vm_builtin {
+    VM_SYS_PUTS = 0,
+    VM_SYS_PUTCHAR,
+    VM_SYS_PRINTF,
+    VM_SYS_STRLEN,
+    VM_SYS_MALLOC,
+    VM_SYS_FREE,
+    VM_SYS_CLOCK,
+    VM_SYS_GETCHAR,
+    VM_SYS_READ,        // read(fd, buf, n), one byte per cell
+    VM_SYS_WRITE,       // write(fd, buf, n)
+    VM_SYS_COUNT
+};
+
+#define VM_INSN(op, a, b, c) ((uint32_t)(op) | ((uint32_t)(a) << 8) | \
+                              ((uint32_t)(b) << 16) | ((uint32_t)(c) << 24))
+
+typedef struct vm_image_header {
+    uint32_t magic;
+    uint32_t func_count;
+    uint32_t code_words;
+    uint32_t data_cells;
+    uint32_t bss_cells;
+    uint32_t main_func;
+} vm_image_header_t;
+
+typedef struct vm_func {
+    uint32_t entry;          // Code word offset
+    uint16_t nparams;
+    uint16_t nregs;          // Registers used by one frame
+    uint32_t frame_cells;    // Memory cells for local arrays
+} vm_func_t;
+
+// vm_resume() results
+#define VM_EXITED   0
+#define VM_BLOCKED  1   // Waiting on a pipe; resume once the process is ready
+#define VM_FAULT    (-1)
+
+typedef struct vm_state vm_state_t;
+
+// Execution statistics
+typedef struct vm_stats {
+    uint32_t instructions;
+    int32_t exit_code;
+} vm_stats_t;
+
+// Bytecode VM
+int vm_is_image(const void* image, uint32_t size);
+vm_state_t* vm_start(const void* image, uint32_t size, process_t* process);
+int vm_resume(vm_state_t* vm);
+void vm_abort(vm_state_t* vm, const char* reason);
+int vm_finish(vm_state_t* vm, vm_stats_t* stats);
+int vm_run(const void* image, uint32_t size, process_t* process, vm_stats_t* stats);
+void vm_benchmark(void);
+
+// In-OS compiler for a small C subset (kernel/compiler.c)
+int vm_compile(const char* source, void* out, uint32_t out_size, uint32_t* out_len);
+
+#endif
@@ -1,54 +1,848 @@
 #include "userlib.h"
 
 // System call wrapper functions
-// These would normally use inline assembly to trigger interrupts
+// Arguments go in ebx/ecx/edx, the call number in eax (see syscall_handler)
+
+static inline int syscall3(int num, int arg1, int arg2, int arg3) {
+    int ret;
+    __asm__ volatile ("int $0x80"
+                      : "=a"(ret)
+                      : "a"(num), "b"(arg1), "c"(arg2), "d"(arg3)
+                      : "memory");
+    return ret;
+}
 
 int sys_exit(int code) {
-    // For now, just return - in real implementation would trigger syscall
-    return 0;
+    return syscall3(SYS_EXIT, code, 0, 0);
 }
 
 int sys_write(int fd, const char* buffer, int count) {
-    // Placeholder - would trigger syscall interrupt
-    return count;
+    return syscall3(SYS_WRITE, fd, (int)buffer, count);
 }
 
 int sys_read(int fd, char* buffer, int count) {
-    // Placeholder - would trigger syscall interrupt
-    return 0;
+    return syscall3(SYS_READ, fd, (int)buffer, count);
+}
+
+void* sys_brk(void* addr) {
+    return (void*)syscall3(SYS_BRK, (int)addr, 0, 0);
+}
+
+void* sys_map_pages(int count) {
+    return (void*)syscall3(SYS_MAP_PAGES, count, 0, 0);
+}
+
+int sys_unmap_pages(void* addr, int count) {
+    return syscall3(SYS_UNMAP_PAGES, (int)addr, count, 0);
+}
+
+int pipe(int fds[2]) {
+    return syscall3(SYS_PIPE, (int)fds, 0, 0);
+}
+
+int close(int fd) {
+    return syscall3(SYS_CLOSE, fd, 0, 0);
+}
+
+int pipe_gift(int fd, void* pages, int count) {
+    return syscall3(SYS_PIPE_GIFT, fd, (int)pages, count);
+}
+
+int pipe_take(int fd, void** page) {
+    return syscall3(SYS_PIPE_TAKE, fd, (int)page, 0);
+}
+
+int shm_open(const char* name, int size) {
+    return syscall3(SYS_SHM_OPEN, (int)name, size, 0);
+}
+
+void* shm_map(int id) {
+    return (void*)syscall3(SYS_SHM_MAP, id, 0, 0);
+}
+
+int shm_unmap(void* addr) {
+    return syscall3(SYS_SHM_UNMAP, (int)addr, 0, 0);
+}
+
+int futex_wait(volatile int* addr, int value) {
+    return syscall3(SYS_FUTEX, (int)addr, FUTEX_WAIT, value);
+}
+
+int futex_wake(volatile int* addr, int count) {
+    return syscall3(SYS_FUTEX, (int)addr, FUTEX_WAKE, count);
+}
+
+int event_create(void) {
+    return syscall3(SYS_EVENT_CREATE, 0, 0, 0);
+}
+
+int event_ctl(int epfd, int op, int fd, event_t* event) {
+    return syscall3(SYS_EVENT_CTL, epfd, op | (fd << 8), (int)event);
+}
+
+// Retries after the kernel reports that the wait would block
+int event_wait(int epfd, event_t* events, int max_events, int timeout_ms) {
+    int timeout = (timeout_ms < 0 || timeout_ms > 0xFFFFFF) ? 0xFFFFFF : timeout_ms;
+    if (max_events > EVENT_MAX_BATCH) max_events = EVENT_MAX_BATCH;
+
+    int result;
+    do {
+        result = syscall3(SYS_EVENT_WAIT, epfd, (int)events, max_events | (timeout << 8));
+    } while (result == -2 && thread_yield() >= 0);
+    return result;
+}
+
+int open(const char* path, int flags) {
+    return syscall3(SYS_OPEN, (int)path, flags, 0);
+}
+
+int lseek(int fd, int offset, int whence) {
+    return syscall3(SYS_LSEEK, fd, offset, whence);
+}
+
+int pread(int fd, void* buffer, int count, int offset) {
+    io_vector_t vector = { buffer, count };
+    return syscall3(SYS_PREAD, fd, (int)&vector, offset);
+}
+
+int pwrite(int fd, const void* data, int count, int offset) {
+    io_vector_t vector = { (void*)data, count };
+    return syscall3(SYS_PWRITE, fd, (int)&vector, offset);
+}
+
+int readv(int fd, const io_vector_t* vectors, int count) {
+    return syscall3(SYS_READV, fd, (int)vectors, count);
+}
+
+int writev(int fd, const io_vector_t* vectors, int count) {
+    return syscall3(SYS_WRITEV, fd, (int)vectors, count);
+}
+
+int timer_create(int initial_ms, int interval_ms) {
+    return syscall3(SYS_TIMER_CREATE, initial_ms, interval_ms, 0);
+}
+
+int socket_open(const char* interface, int port) {
+    return syscall3(SYS_SOCKET, (int)interface, port, 0);
+}
+
+int socket_connect(int fd, const unsigned char ip[4], int port) {
+    int addr = ip[0] | (ip[1] << 8) | (ip[2] << 16) | (ip[3] << 24);
+    return syscall3(SYS_CONNECT, fd, addr, port);
+}
+
+int thread_create(void* (*entry)(void*), void* arg) {
+    return syscall3(SYS_THREAD_CREATE, (int)entry, (int)arg, 0);
+}
+
+int thread_join(int tid, void** result) {
+    return syscall3(SYS_THREAD_JOIN, tid, (int)result, 0);
+}
+
+void thread_exit(void* result) {
+    syscall3(SYS_THREAD_EXIT, (int)result, 0, 0);
+}
+
+int thread_yield(void) {
+    return syscall3(SYS_YIELD, 0, 0, 0);
+}
+
+// TLS block: %gs:0 is its own address, %gs:4 the thread id, then user slots
+int thread_id(void) {
+    int tid;
+    __asm__ volatile ("movl %%gs:4, %0" : "=r"(tid));
+    return tid;
+}
+
+void** thread_local(int slot) {
+    void** block;
+    if (slot < 0 || slot >= TLS_SLOTS) return 0;
+    __asm__ volatile ("movl %%gs:0, %0" : "=r"(block));
+    return block + 2 + slot;
+}
+
+void mutex_init(mutex_t* mutex) {
+    mutex->state = 0;
+}
+
+int mutex_trylock(mutex_t* mutex) {
+    return __sync_val_compare_and_swap(&mutex->state, 0, 1) == 0 ? 0 : -1;
+}
+
+void mutex_lock(mutex_t* mutex) {
+    int state = __sync_val_compare_and_swap(&mutex->state, 0, 1);
+    if (state == 0) {
+        return;
+    }
+
+    // Contended: mark the lock as having waiters and sleep until it is free
+    if (state != 2) {
+        state = __sync_lock_test_and_set(&mutex->state, 2);
+    }
+    while (state != 0) {
+        futex_wait(&mutex->state, 2);
+        state = __sync_lock_test_and_set(&mutex->state, 2);
+    }
+}
+
+void mutex_unlock(mutex_t* mutex) {
+    // Only enter the kernel if someone may be sleeping
+    if (__sync_fetch_and_sub(&mutex->state, 1) != 1) {
+        mutex->state = 0;
+        futex_wake(&mutex->state, 1);
+    }
+}
+
+void cond_init(cond_t* cond) {
+    cond->seq = 0;
+    cond->waiters = 0;
+}
+
+void cond_wait(cond_t* cond, mutex_t* mutex) {
+    int seq = cond->seq;
+    __sync_fetch_and_add(&cond->waiters, 1);
+    mutex_unlock(mutex);
+    futex_wait(&cond->seq, seq);
+    __sync_fetch_and_sub(&cond->waiters, 1);
+    mutex_lock(mutex);
+}
+
+void cond_signal(cond_t* cond) {
+    __sync_fetch_and_add(&cond->seq, 1);
+    if (cond->waiters > 0) {
+        futex_wake(&cond->seq, 1);
+    }
+}
+
+void cond_broadcast(cond_t* cond) {
+    __sync_fetch_and_add(&cond->seq, 1);
+    if (cond->waiters > 0) {
+        futex_wake(&cond->seq, 0x7FFFFFFF);
+    }
+}
+
+void sem_init(sem_t* sem, int value) {
+    sem->value = value;
+    sem->waiters = 0;
+}
+
+int sem_trywait(sem_t* sem) {
+    int value = sem->value;
+    while (value > 0) {
+        int old = __sync_val_compare_and_swap(&sem->value, value, value - 1);
+        if (old == value) {
+            return 0;
+        }
+        value = old;
+    }
+    return -1;
+}
+
+void sem_wait(sem_t* sem) {
+    while (sem_trywait(sem) != 0) {
+        __sync_fetch_and_add(&sem->waiters, 1);
+        futex_wait(&sem->value, 0);
+        __sync_fetch_and_sub(&sem->waiters, 1);
+    }
+}
+
+void sem_post(sem_t* sem) {
+    __sync_fetch_and_add(&sem->value, 1);
+    if (sem->waiters > 0) {
+        futex_wake(&sem->value, 1);
+    }
 }
 
+// Kept for older programs; allocations now come from the userlib arena
 void* sys_malloc(int size) {
-    // Placeholder - would trigger syscall interrupt
-    return (void*)0;
+    return malloc(size);
 }
 
 void sys_free(void* ptr) {
-    // Placeholder - would trigger syscall interrupt
+    free(ptr);
 }
 
-// Standard library implementations
-int printf(const char* format, ...) {
-    // Simple printf implementation
-    const char* p = format;
-    while (*p) {
-        if (*p == '%' && *(p+1)) {
-            p += 2; // Skip format specifier for now
+// Memory allocator
+// Small requests are served from per-size-class free lists, large ones from
+// an address-ordered free list that coalesces neighbours. Fresh memory is
+// carved from the arena's untouched tail, and the kernel is only asked for
+// more pages when that tail runs out: first by moving the break in place,
+// then with a separate page grant.
+
+#define MALLOC_HEADER      8
+#define MALLOC_MIN_CLASS   16
+#define MALLOC_CLASSES     8            // 16, 32, ... 2048 byte payloads
+#define MALLOC_MAX_SMALL   (MALLOC_MIN_CLASS << (MALLOC_CLASSES - 1))
+#define MALLOC_MIN_GROW    (4 * PAGE_SIZE)
+#define MALLOC_TAG_SMALL   0xA110C000   // Low bits hold the size class
+#define MALLOC_TAG_LARGE   0xA110CFFF
+#define MALLOC_TAG_FREE    0xF4EEB10C
+
+typedef struct malloc_block {
+    unsigned int size;                  // Whole block including header
+    unsigned int tag;
+    struct malloc_block* next;          // Only valid while free
+} malloc_block_t;
+
+static malloc_block_t* small_bins[MALLOC_CLASSES];
+static malloc_block_t* large_free = 0;
+static char* arena_ptr = 0;             // Untouched tail of the arena
+static char* arena_end = 0;
+static char* arena_brk = 0;             // Break as last set by us
+
+static int size_class(unsigned int size) {
+    int cls = 0;
+    unsigned int class_size = MALLOC_MIN_CLASS;
+    while (class_size < size) {
+        class_size <<= 1;
+        cls++;
+    }
+    return cls;
+}
+
+static void large_insert(malloc_block_t* block) {
+    block->tag = MALLOC_TAG_FREE;
+    
+    malloc_block_t* prev = 0;
+    malloc_block_t* cur = large_free;
+    while (cur && cur < block) {
+        prev = cur;
+        cur = cur->next;
+    }
+    
+    // Merge with the following block
+    if (cur && (char*)block + block->size == (char*)cur) {
+        block->size += cur->size;
+        block->next = cur->next;
+    } else {
+        block->next = cur;
+    }
+    
+    // Merge with the preceding block
+    if (prev && (char*)prev + prev->size == (char*)block) {
+        prev->size += block->size;
+        prev->next = block->next;
+    } else if (prev) {
+        prev->next = block;
+    } else {
+        large_free = block;
+    }
+}
+
+// Make at least 'bytes' available in the arena tail
+static int arena_grow(unsigned int bytes) {
+    unsigned int grow = (bytes + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    if (grow < MALLOC_MIN_GROW) grow = MALLOC_MIN_GROW;
+    
+    // Extend the break in place when the tail ends at the break
+    if (!arena_brk) {
+        arena_brk = (char*)sys_brk(0);
+        if (arena_brk && !arena_ptr) {
+            arena_ptr = arena_end = arena_brk;
+        }
+    }
+    if (arena_brk && arena_end == arena_brk) {
+        char* new_brk = (char*)sys_brk(arena_brk + grow);
+        if (new_brk == arena_brk + grow) {
+            arena_brk = new_brk;
+            arena_end = new_brk;
+            return 0;
+        }
+    }
+    
+    // Otherwise take a separate grant and retire the old tail
+    char* pages = (char*)sys_map_pages(grow / PAGE_SIZE);
+    if (!pages) return -1;
+    
+    if (arena_end - arena_ptr >= (int)sizeof(malloc_block_t)) {
+        malloc_block_t* rest = (malloc_block_t*)arena_ptr;
+        rest->size = arena_end - arena_ptr;
+        large_insert(rest);
+    }
+    arena_ptr = pages;
+    arena_end = pages + grow;
+    return 0;
+}
+
+static malloc_block_t* arena_carve(unsigned int size) {
+    if ((unsigned int)(arena_end - arena_ptr) < size && arena_grow(size) != 0) {
+        return 0;
+    }
+    malloc_block_t* block = (malloc_block_t*)arena_ptr;
+    arena_ptr += size;
+    block->size = size;
+    return block;
+}
+
+void* malloc(int size) {
+    if (size <= 0) return 0;
+    
+    if (size <= MALLOC_MAX_SMALL) {
+        int cls = size_class(size);
+        malloc_block_t* block = small_bins[cls];
+        if (block) {
+            small_bins[cls] = block->next;
         } else {
-            sys_write(1, p, 1);
-            p++;
+            block = arena_carve((MALLOC_MIN_CLASS << cls) + MALLOC_HEADER);
+            if (!block) return 0;
+        }
+        block->tag = MALLOC_TAG_SMALL | cls;
+        return (char*)block + MALLOC_HEADER;
+    }
+    
+    unsigned int needed = ((unsigned int)size + MALLOC_HEADER + 7) & ~7u;
+    
+    // First fit in the large free list
+    malloc_block_t* prev = 0;
+    malloc_block_t* block = large_free;
+    while (block && block->size < needed) {
+        prev = block;
+        block = block->next;
+    }
+    
+    if (block) {
+        if (block->size - needed >= sizeof(malloc_block_t) + MALLOC_MIN_CLASS) {
+            // Split: the remainder stays in the list in place of the block
+            malloc_block_t* rest = (malloc_block_t*)((char*)block + needed);
+            rest->size = block->size - needed;
+            rest->tag = MALLOC_TAG_FREE;
+            rest->next = block->next;
+            block->size = needed;
+            if (prev) prev->next = rest; else large_free = rest;
+        } else {
+            if (prev) prev->next = block->next; else large_free = block->next;
+        }
+    } else {
+        block = arena_carve(needed);
+        if (!block) return 0;
+    }
+    
+    block->tag = MALLOC_TAG_LARGE;
+    return (char*)block + MALLOC_HEADER;
+}
+
+void free(void* ptr) {
+    if (!ptr) return;
+    
+    malloc_block_t* block = (malloc_block_t*)((char*)ptr - MALLOC_HEADER);
+    if (block->tag == MALLOC_TAG_LARGE) {
+        large_insert(block);
+    } else if ((block->tag & ~0xFFFu) == MALLOC_TAG_SMALL &&
+               (block->tag & 0xFFF) < MALLOC_CLASSES) {
+        int cls = block->tag & 0xFFF;
+        block->tag = MALLOC_TAG_FREE;
+        block->next = small_bins[cls];
+        small_bins[cls] = block;
+    }
+    // Anything else is a double free or a foreign pointer; ignore it
+}
+
+void* calloc(int count, int size) {
+    int total = count * size;
+    if (count != 0 && total / count != size) return 0;
+    
+    char* p = (char*)malloc(total);
+    if (p) {
+        for (int i = 0; i < total; i++) p[i] = 0;
+    }
+    return p;
+}
+
+void* realloc(void* ptr, int size) {
+    if (!ptr) return malloc(size);
+    if (size <= 0) {
+        free(ptr);
+        return 0;
+    }
+    
+    malloc_block_t* block = (malloc_block_t*)((char*)ptr - MALLOC_HEADER);
+    int usable = (block->tag == MALLOC_TAG_LARGE)
+                 ? (int)block->size - MALLOC_HEADER
+                 : MALLOC_MIN_CLASS << (block->tag & 0xFFF);
+    if (size <= usable) return ptr;
+    
+    char* p = (char*)malloc(size);
+    if (!p) return 0;
+    for (int i = 0; i < usable; i++) p[i] = ((char*)ptr)[i];
+    free(ptr);
+    return p;
+}
+
+// Read the time stamp counter
+static inline unsigned long long read_tsc(void) {
+    unsigned int lo, hi;
+    __asm__ volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((unsigned long long)hi << 32) | lo;
+}
+
+// Nanoseconds since boot, read lock-free from the shared clock page.
+// Retries while the kernel is in the middle of updating the base.
+unsigned long long clock_gettime_ns(void) {
+    const struct vclock_page* vc = (const struct vclock_page*)VCLOCK_PAGE_ADDR;
+    unsigned int seq, mult, shift;
+    unsigned long long base_tsc, base_ns, now;
+    
+    do {
+        seq = vc->seq;
+        while (seq & 1) {
+            seq = vc->seq;
+        }
+        __asm__ volatile ("" ::: "memory");
+        mult = vc->mult;
+        shift = vc->shift;
+        base_tsc = vc->base_tsc;
+        base_ns = vc->base_ns;
+        now = read_tsc();
+        __asm__ volatile ("" ::: "memory");
+    } while (vc->seq != seq);
+    
+    if (mult == 0) {
+        return base_ns;
+    }
+    return base_ns + (((now - base_tsc) * mult) >> shift);
+}
+
+// Buffered stdio
+static FILE stdout_file = { 1, _IOLBF, 0, BUFSIZ, 0, stdout_file.storage, {0} };
+static FILE stderr_file = { 2, _IONBF, 0, BUFSIZ, 0, stderr_file.storage, {0} };
+FILE* stdout = &stdout_file;
+FILE* stderr = &stderr_file;
+
+// Write out whatever is buffered with a single write syscall
+int fflush(FILE* stream) {
+    if (!stream) {
+        int result = fflush(stdout);
+        if (fflush(stderr) != 0) result = EOF;
+        return result;
+    }
+    
+    int done = 0;
+    while (done < stream->pos) {
+        int written = sys_write(stream->fd, stream->buf + done, stream->pos - done);
+        if (written <= 0) {
+            stream->error = 1;
+            stream->pos = 0;
+            return EOF;
+        }
+        done += written;
+    }
+    stream->pos = 0;
+    return 0;
+}
+
+// A caller's buffer is used as given; without one the stream's own
+// storage holds up to BUFSIZ bytes
+int setvbuf(FILE* stream, char* buf, int mode, size_t size) {
+    if (!stream || (mode != _IOFBF && mode != _IOLBF && mode != _IONBF)) {
+        return -1;
+    }
+    fflush(stream);
+    if (buf && size > 0) {
+        stream->buf = buf;
+    } else {
+        stream->buf = stream->storage;
+        if (size == 0 || size > BUFSIZ) {
+            size = BUFSIZ;
         }
     }
+    stream->mode = mode;
+    stream->size = (int)size;
     return 0;
 }
 
+// Queue size bytes on the stream; returns size, or EOF on a write error
+static int stream_write(FILE* stream, const void* data, int size) {
+    const char* p = (const char*)data;
+    
+    if (stream->mode == _IONBF) {
+        // Unbuffered: push what is pending, then hand the caller's data straight over
+        if (fflush(stream) != 0) return EOF;
+        return size > 0 ? sys_write(stream->fd, p, size) : 0;
+    }
+    
+    // Large writes bypass the buffer instead of being copied through it
+    if (size >= stream->size) {
+        if (fflush(stream) != 0) return EOF;
+        return sys_write(stream->fd, p, size);
+    }
+    
+    int newline = 0;
+    for (int i = 0; i < size; i++) {
+        if (stream->pos == stream->size && fflush(stream) != 0) {
+            return EOF;
+        }
+        stream->buf[stream->pos++] = p[i];
+        if (p[i] == '\n') newline = 1;
+    }
+    
+    if (newline && stream->mode == _IOLBF) {
+        if (fflush(stream) != 0) return EOF;
+    }
+    return size;
+}
+
+size_t fwrite(const void* data, size_t size, size_t count, FILE* stream) {
+    if (size == 0 || count == 0) {
+        return 0;
+    }
+    int written = stream_write(stream, data, (int)(size * count));
+    return written < 0 ? 0 : (size_t)written / size;
+}
+
+int fputc(int c, FILE* stream) {
+    char ch = (char)c;
+    return stream_write(stream, &ch, 1) == 1 ? (unsigned char)ch : EOF;
+}
+
+int fputs(const char* str, FILE* stream) {
+    return stream_write(stream, str, strlen(str));
+}
+
+int putchar(int c) {
+    return fputc(c, stdout);
+}
+
 int puts(const char* str) {
+    // Text and newline are staged together and leave in one syscall
     int len = strlen(str);
-    sys_write(1, str, len);
-    sys_write(1, "\n", 1);
+    if (stream_write(stdout, str, len) < 0 || fputc('\n', stdout) == EOF) {
+        return EOF;
+    }
     return len + 1;
 }
 
+void exit(int code) {
+    fflush(0);
+    sys_exit(code);
+}
+
+// Formatting
+// One pass over the format string; every produced character goes to a sink.
+
+typedef struct format_sink {
+    char* buf;          // Destination for snprintf, 0 for streams
+    int size;
+    FILE* stream;       // Destination for fprintf
+    int count;          // Characters produced so far (including truncated ones)
+} format_sink_t;
+
+static void sink_putc(format_sink_t* sink, char c) {
+    if (sink->stream) {
+        FILE* stream = sink->stream;
+        if (stream->pos == stream->size) {
+            fflush(stream);
+        }
+        stream->buf[stream->pos++] = c;
+    } else if (sink->count < sink->size - 1) {
+        sink->buf[sink->count] = c;
+    }
+    sink->count++;
+}
+
+static void sink_pad(format_sink_t* sink, char c, int n) {
+    while (n-- > 0) {
+        sink_putc(sink, c);
+    }
+}
+
+#define FMT_LEFT 0x01
+#define FMT_ZERO 0x02
+
+static void format_number(format_sink_t* sink, unsigned int value, int negative,
+                          unsigned int base, int upper, int flags, int width, int precision) {
+    const char* digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    char tmp[16];
+    int len = 0;
+    
+    if (!(value == 0 && precision == 0)) {
+        do {
+            tmp[len++] = digits[value % base];
+            value /= base;
+        } while (value);
+    }
+    
+    int zeros = precision > len ? precision - len : 0;
+    int total = len + zeros + (negative ? 1 : 0);
+    int pad = width > total ? width - total : 0;
+    
+    // '0' flag is ignored when a precision is given
+    if ((flags & FMT_ZERO) && precision < 0 && !(flags & FMT_LEFT)) {
+        zeros += pad;
+        pad = 0;
+    }
+    
+    if (!(flags & FMT_LEFT)) sink_pad(sink, ' ', pad);
+    if (negative) sink_putc(sink, '-');
+    sink_pad(sink, '0', zeros);
+    while (len > 0) {
+        sink_putc(sink, tmp[--len]);
+    }
+    if (flags & FMT_LEFT) sink_pad(sink, ' ', pad);
+}
+
+static void format_core(format_sink_t* sink, const char* format, va_list args) {
+    const char* p = format;
+    
+    while (*p) {
+        if (*p != '%') {
+            sink_putc(sink, *p++);
+            continue;
+        }
+        p++;
+        
+        // Flags
+        int flags = 0;
+        for (;; p++) {
+            if (*p == '-') flags |= FMT_LEFT;
+            else if (*p == '0') flags |= FMT_ZERO;
+            else break;
+        }
+        
+        // Width
+        int width = 0;
+        if (*p == '*') {
+            width = va_arg(args, int);
+            if (width < 0) {
+                flags |= FMT_LEFT;
+                width = -width;
+            }
+            p++;
+        } else {
+            while (*p >= '0' && *p <= '9') {
+                width = width * 10 + (*p++ - '0');
+            }
+        }
+        
+        // Precision
+        int precision = -1;
+        if (*p == '.') {
+            p++;
+            precision = 0;
+            if (*p == '*') {
+                precision = va_arg(args, int);
+                p++;
+            } else {
+                while (*p >= '0' && *p <= '9') {
+                    precision = precision * 10 + (*p++ - '0');
+                }
+            }
+        }
+        
+        switch (*p) {
+            case 'd':
+            case 'i': {
+                int value = va_arg(args, int);
+                unsigned int magnitude = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+                format_number(sink, magnitude, value < 0, 10, 0, flags, width, precision);
+                break;
+            }
+            case 'u':
+                format_number(sink, va_arg(args, unsigned int), 0, 10, 0, flags, width, precision);
+                break;
+            case 'x':
+            case 'X':
+                format_number(sink, va_arg(args, unsigned int), 0, 16, *p == 'X', flags, width, precision);
+                break;
+            case 'p': {
+                unsigned int value = (unsigned int)va_arg(args, void*);
+                int pad = width > 10 ? width - 10 : 0;
+                if (!(flags & FMT_LEFT)) sink_pad(sink, ' ', pad);
+                sink_putc(sink, '0');
+                sink_putc(sink, 'x');
+                format_number(sink, value, 0, 16, 0, 0, 0, 8);
+                if (flags & FMT_LEFT) sink_pad(sink, ' ', pad);
+                break;
+            }
+            case 's': {
+                const char* str = va_arg(args, const char*);
+                if (!str) str = "(null)";
+                int len = 0;
+                while (str[len] && (precision < 0 || len < precision)) len++;
+                int pad = width > len ? width - len : 0;
+                if (!(flags & FMT_LEFT)) sink_pad(sink, ' ', pad);
+                for (int i = 0; i < len; i++) {
+                    sink_putc(sink, str[i]);
+                }
+                if (flags & FMT_LEFT) sink_pad(sink, ' ', pad);
+                break;
+            }
+            case 'c': {
+                int pad = width > 1 ? width - 1 : 0;
+                if (!(flags & FMT_LEFT)) sink_pad(sink, ' ', pad);
+                sink_putc(sink, (char)va_arg(args, int));
+                if (flags & FMT_LEFT) sink_pad(sink, ' ', pad);
+                break;
+            }
+            case '%':
+                sink_putc(sink, '%');
+                break;
+            case '\0':
+                return;
+            default:
+                // Unknown conversion: emit it verbatim
+                sink_putc(sink, '%');
+                sink_putc(sink, *p);
+                break;
+        }
+        p++;
+    }
+}
+
+int vsnprintf(char* buf, int size, const char* format, va_list args) {
+    format_sink_t sink = { buf, size, 0, 0 };
+    format_core(&sink, format, args);
+    if (size > 0) {
+        buf[sink.count < size ? sink.count : size - 1] = '\0';
+    }
+    return sink.count;
+}
+
+int snprintf(char* buf, int size, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int result = vsnprintf(buf, size, format, args);
+    va_end(args);
+    return result;
+}
+
+int vfprintf(FILE* stream, const char* format, va_list args) {
+    format_sink_t sink = { 0, 0, stream, 0 };
+    
+    // Format straight into the stream buffer, then apply the buffering mode once
+    format_core(&sink, format, args);
+    if (stream->mode == _IONBF ||
+        (stream->mode == _IOLBF && stream->pos > 0 && memchr(stream->buf, '\n', stream->pos))) {
+        fflush(stream);
+    }
+    return sink.count;
+}
+
+int fprintf(FILE* stream, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int result = vfprintf(stream, format, args);
+    va_end(args);
+    return result;
+}
+
+int printf(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int result = vfprintf(stdout, format, args);
+    va_end(args);
+    return result;
+}
+
+void* memchr(const void* ptr, int value, int count) {
+    const unsigned char* p = (const unsigned char*)ptr;
+    for (int i = 0; i < count; i++) {
+        if (p[i] == (unsigned char)value) {
+            return (void*)(p + i);
+        }
+    }
+    return 0;
+}
+
 int strlen(const char* str) {
     int len = 0;
     while (str[len]) len++;
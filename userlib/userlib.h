@@ -3,16 +3,244 @@
 
 // User library for C programs running in user space
 
+// Variable arguments (no libc headers available)
+typedef __builtin_va_list va_list;
+#define va_start(ap, last) __builtin_va_start(ap, last)
+#define va_arg(ap, type)   __builtin_va_arg(ap, type)
+#define va_end(ap)         __builtin_va_end(ap)
+
+// System call numbers (must match kernel/user.h)
+#define SYS_EXIT    0
+#define SYS_WRITE   1
+#define SYS_READ    2
+#define SYS_OPEN    3
+#define SYS_CLOSE   4
+#define SYS_MALLOC  5
+#define SYS_FREE    6
+#define SYS_BRK         7
+#define SYS_MAP_PAGES   8
+#define SYS_UNMAP_PAGES 9
+#define SYS_PIPE        10
+#define SYS_PIPE_GIFT   11
+#define SYS_PIPE_TAKE   12
+#define SYS_SHM_OPEN    13
+#define SYS_SHM_MAP     14
+#define SYS_SHM_UNMAP   15
+#define SYS_FUTEX       16
+#define SYS_THREAD_CREATE 17
+#define SYS_THREAD_JOIN   18
+#define SYS_THREAD_EXIT   19
+#define SYS_YIELD         20
+#define SYS_EVENT_CREATE  21
+#define SYS_EVENT_CTL     22
+#define SYS_EVENT_WAIT    23
+#define SYS_TIMER_CREATE  24
+#define SYS_SOCKET        25
+#define SYS_CONNECT       26
+#define SYS_LSEEK         27
+#define SYS_PREAD         28
+#define SYS_PWRITE        29
+#define SYS_READV         30
+#define SYS_WRITEV        31
+
+#define PAGE_SIZE 4096
+
 // System call interface
 int sys_exit(int code);
 int sys_write(int fd, const char* buffer, int count);
 int sys_read(int fd, char* buffer, int count);
 void* sys_malloc(int size);
 void sys_free(void* ptr);
+void* sys_brk(void* addr);
+void* sys_map_pages(int count);
+int sys_unmap_pages(void* addr, int count);
+
+// Pipes. pipe_gift() moves whole pages from sys_map_pages into the pipe
+// (they are no longer the caller's); pipe_take() hands over one full page
+// that must later be returned with sys_unmap_pages. Both fall back to
+// copying, so always check the returned count.
+int pipe(int fds[2]);
+int close(int fd);
+int pipe_gift(int fd, void* pages, int count);
+int pipe_take(int fd, void** page);
+
+// Shared memory. shm_open() attaches to a named segment (creating it zero
+// filled) and returns its id; it is mapped at the same address in every
+// process. The segment is freed when the last process unmaps it or exits.
+int shm_open(const char* name, int size);
+void* shm_map(int id);
+int shm_unmap(void* addr);
+
+// Futexes: sleep while *addr still equals value, wake up to count sleepers.
+// Wakeups can be spurious, so callers always re-check their condition.
+#define FUTEX_WAIT 0
+#define FUTEX_WAKE 1
+int futex_wait(volatile int* addr, int value);
+int futex_wake(volatile int* addr, int count);
+
+// Event polls: register descriptors (console, pipes, timers, sockets,
+// other polls) and wait for a batch of ready ones. Waiting costs time in
+// the number of ready descriptors, not registered ones.
+#define EVENT_IN   0x01
+#define EVENT_OUT  0x04
+#define EVENT_HUP  0x10
+#define EVENT_ET   0x80000000   // Edge triggered; level triggered otherwise
+
+#define EVENT_ADD  1
+#define EVENT_DEL  2
+#define EVENT_MOD  3
+
+#define EVENT_MAX_BATCH 255
+#define EVENT_WAIT_FOREVER (-1)
+
+typedef struct event {
+    unsigned int events;
+    unsigned int data;          // Returned as given to event_ctl
+} event_t;
+
+int event_create(void);
+int event_ctl(int epfd, int op, int fd, event_t* event);
+int event_wait(int epfd, event_t* events, int max_events, int timeout_ms);
+
+// Timer descriptor; read() returns the expiration count as an int
+int timer_create(int initial_ms, int interval_ms);
+
+// UDP socket on an interface; read()/write() move whole datagrams
+int socket_open(const char* interface, int port);
+int socket_connect(int fd, const unsigned char ip[4], int port);
+
+// Files. The descriptor has its own position, shared by threads and
+// children; pread()/pwrite() leave it alone. readv()/writev() work on any
+// descriptor and stop at the first short transfer.
+#define O_RDONLY 0x000
+#define O_WRONLY 0x001
+#define O_RDWR   0x002
+#define O_CREAT  0x040
+#define O_TRUNC  0x200
+#define O_APPEND 0x400
+
+#define SEEK_SET 0
+#define SEEK_CUR 1
+#define SEEK_END 2
+
+typedef struct io_vector {
+    void* base;
+    unsigned int length;
+} io_vector_t;
+
+int open(const char* path, int flags);
+int lseek(int fd, int offset, int whence);
+int pread(int fd, void* buffer, int count, int offset);
+int pwrite(int fd, const void* data, int count, int offset);
+int readv(int fd, const io_vector_t* vectors, int count);
+int writev(int fd, const io_vector_t* vectors, int count);
+
+// Threads share the process's memory and files; each has its own stack
+// and TLS block, reached through %gs (see kernel/thread.h)
+#define TLS_SLOTS 16
+
+int thread_create(void* (*entry)(void*), void* arg);
+int thread_join(int tid, void** result);
+void thread_exit(void* result);
+int thread_yield(void);
+int thread_id(void);
+void** thread_local(int slot);
+
+// Synchronisation built on futexes. Place the objects in a shared memory
+// segment to use them between processes. Uncontended operations are a
+// single atomic instruction and never enter the kernel.
+typedef struct mutex {
+    volatile int state;     // 0 unlocked, 1 locked, 2 locked with waiters
+} mutex_t;
+
+typedef struct cond {
+    volatile int seq;       // Bumped by every signal
+    volatile int waiters;
+} cond_t;
+
+typedef struct sem {
+    volatile int value;
+    volatile int waiters;
+} sem_t;
+
+void mutex_init(mutex_t* mutex);
+void mutex_lock(mutex_t* mutex);
+int mutex_trylock(mutex_t* mutex);
+void mutex_unlock(mutex_t* mutex);
+
+void cond_init(cond_t* cond);
+void cond_wait(cond_t* cond, mutex_t* mutex);
+void cond_signal(cond_t* cond);
+void cond_broadcast(cond_t* cond);
+
+void sem_init(sem_t* sem, int value);
+void sem_wait(sem_t* sem);
+int sem_trywait(sem_t* sem);
+void sem_post(sem_t* sem);
+
+// Memory allocation (userlib arena on top of brk/map_pages)
+void* malloc(int size);
+void free(void* ptr);
+void* calloc(int count, int size);
+void* realloc(void* ptr, int size);
+
+// Shared clock page published by the kernel (see kernel/clock.h)
+#define VCLOCK_PAGE_ADDR 0xF000
+
+struct vclock_page {
+    volatile unsigned int seq;
+    unsigned int tsc_khz;
+    unsigned int mult;
+    unsigned int shift;
+    unsigned long long base_tsc;
+    unsigned long long base_ns;
+};
+
+// Time functions (no syscall, read from the shared clock page)
+unsigned long long clock_gettime_ns(void);
+
+// Buffered stdio
+typedef unsigned int size_t;
+
+#define EOF    (-1)
+#define BUFSIZ 512
+
+// Buffering modes
+#define _IOFBF 0    // Flush when the buffer is full
+#define _IOLBF 1    // Flush at end of line
+#define _IONBF 2    // No buffering
+
+typedef struct FILE {
+    int fd;
+    int mode;
+    int pos;                // Bytes currently buffered
+    int size;               // Usable buffer size
+    int error;
+    char* buf;              // storage, or the caller's buffer after setvbuf
+    char storage[BUFSIZ];
+} FILE;
+
+extern FILE* stdout;        // Line buffered
+extern FILE* stderr;        // Unbuffered
+
+int fflush(FILE* stream);
+int setvbuf(FILE* stream, char* buf, int mode, size_t size);
+size_t fwrite(const void* data, size_t size, size_t count, FILE* stream);
+int fputc(int c, FILE* stream);
+int fputs(const char* str, FILE* stream);
+int putchar(int c);
+void exit(int code);
+
+// Formatted output: %d %i %u %x %X %s %c %p %% with flags '-' '0', width and precision
+int vsnprintf(char* buf, int size, const char* format, va_list args);
+int snprintf(char* buf, int size, const char* format, ...);
+int vfprintf(FILE* stream, const char* format, va_list args);
+int fprintf(FILE* stream, const char* format, ...);
 
 // Standard library functions
 int printf(const char* format, ...);
 int puts(const char* str);
+void* memchr(const void* ptr, int value, int count);
 int strlen(const char* str);
 int strcmp(const char* s1, const char* s2);
 void strcpy(char* dest, const char* src);